@@ -0,0 +1,79 @@
+#include <csl.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+size_t MSG_SIZE = 128;
+size_t TOTAL_SIZE = 64;
+int MAX_THREADS = 32;
+std::string filename = "append_bench.txt";
+
+/**
+ * Multi-threaded append to a single NCL file. For each thread count, the file is truncated and TOTAL_SIZE MB is
+ * appended with write() evenly split across the threads.
+ *
+ * Usage:
+ * ./append_bench [msg_size] [total_size_mb] [max_threads] [filename]
+ */
+int main(int argc, char *argv[]) {
+    if (argc > 1) MSG_SIZE = std::stoul(argv[1]);
+    if (argc > 2) TOTAL_SIZE = std::stoul(argv[2]);
+    if (argc > 3) MAX_THREADS = std::stoi(argv[3]);
+    if (argc > 4) filename = argv[4];
+    TOTAL_SIZE *= 1048576;
+
+    std::cout << "msg size: " << MSG_SIZE << "B\ntotal size: " << TOTAL_SIZE << "\nfilename: " << filename << std::endl;
+    std::cout << "threads\tops\tthroughput(MB/s)\tops/s\tavg latency(us)" << std::endl;
+    for (int n = 1; n <= MAX_THREADS; n *= 2) {
+        int fd = open(filename.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CSL, 0644);
+        if (fd < 0) {
+            std::cerr << "open file failed: " << errno << std::endl;
+            return 1;
+        }
+
+        size_t ops_per_thread = TOTAL_SIZE / MSG_SIZE / n;
+        std::atomic<bool> go(false);
+        std::atomic<long> total_lat(0);
+        std::vector<std::thread> ths;
+        for (int t = 0; t < n; t++) {
+            ths.emplace_back([&]() {
+                char *buf = new char[MSG_SIZE];
+                memset(buf, 42, MSG_SIZE);
+                while (!go.load())
+                    ;
+                long lat = 0;
+                for (size_t i = 0; i < ops_per_thread; i++) {
+                    auto start = std::chrono::high_resolution_clock::now();
+                    if (write(fd, buf, MSG_SIZE) != MSG_SIZE) {
+                        std::cerr << "write error\n";
+                        exit(1);
+                    }
+                    auto end = std::chrono::high_resolution_clock::now();
+                    lat += std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count();
+                }
+                total_lat += lat;
+                delete[] buf;
+            });
+        }
+        auto start = std::chrono::high_resolution_clock::now();
+        go.store(true);
+        for (auto &th : ths) th.join();
+        auto end = std::chrono::high_resolution_clock::now();
+
+        size_t ops = ops_per_thread * n;
+        auto elapse = std::chrono::duration_cast<std::chrono::microseconds>(end - start).count();
+        std::cout << n << "\t" << ops << "\t" << static_cast<double>(ops) * MSG_SIZE / elapse << "\t"
+                  << static_cast<double>(ops) * 1e6 / elapse << "\t" << total_lat.load() / 1000.0 / ops << std::endl;
+
+        close(fd);
+        unlink(filename.c_str());
+    }
+    return 0;
+}
@@ -0,0 +1,51 @@
+#include <chrono>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "client_pool.h"
+#include "csl_config.h"
+
+size_t MSG_SIZE = 4096;
+int FILES = 200;
+std::string filename = "churn_bench";
+
+/**
+ * Open and close latency under file churn. Each round opens a file of buf_size bytes from the client pool, appends
+ * MSG_SIZE bytes and closes it, for buf_size from MR_SIZE up to 64 times MR_SIZE. Closing zeroes only what was written
+ * and the servers zero recycled segments in the background, so the latencies shouldn't grow with buf_size.
+ *
+ * Usage:
+ * ./churn_bench [msg_size] [files] [filename]
+ */
+int main(int argc, char *argv[]) {
+    if (argc > 1) MSG_SIZE = std::stoul(argv[1]);
+    if (argc > 2) FILES = std::stoi(argv[2]);
+    if (argc > 3) filename = argv[3];
+
+    CSLClientPool pool;
+    std::vector<char> buf(MSG_SIZE, 42);
+
+    std::cout << "buf size(MB)\tfiles\tavg open(us)\tavg close(us)" << std::endl;
+    for (size_t buf_size = MR_SIZE; buf_size <= 64 * MR_SIZE; buf_size *= 4) {
+        long open_us = 0, close_us = 0;
+        for (int i = 0; i < FILES; i++) {
+            std::string name = filename + "_" + std::to_string(i);
+            auto start = std::chrono::high_resolution_clock::now();
+            auto cli = pool.GetClient(buf_size, name.c_str());
+            auto opened = std::chrono::high_resolution_clock::now();
+            if (cli->Append(buf.data(), MSG_SIZE) != static_cast<ssize_t>(MSG_SIZE)) {
+                std::cerr << "append error" << std::endl;
+                return 1;
+            }
+            auto written = std::chrono::high_resolution_clock::now();
+            pool.RecycleClient(cli->GetId());
+            auto end = std::chrono::high_resolution_clock::now();
+            open_us += std::chrono::duration_cast<std::chrono::microseconds>(opened - start).count();
+            close_us += std::chrono::duration_cast<std::chrono::microseconds>(end - written).count();
+        }
+        std::cout << buf_size / 1048576 << "\t" << FILES << "\t" << static_cast<double>(open_us) / FILES << "\t"
+                  << static_cast<double>(close_us) / FILES << std::endl;
+    }
+    return 0;
+}
@@ -14,8 +14,15 @@ using namespace std;
 CSLClientPool::CSLClientPool(string mgr_hosts) : global_id(0), mgr_hosts(mgr_hosts) {
     context = new infinity::core::Context(infinity::core::Configuration::DEFAULT_IB_DEVICE,
                                           infinity::core::Configuration::DEFAULT_IB_PHY_PORT);
+#ifdef SHARED_QP
+    qp_pool = make_shared<NCLQpPool>(context, PORT, SHARED_QPS_PER_PEER);
+#else
     qp_pool = make_shared<NCLQpPool>(context, PORT);
+#endif
     mr_pool = make_shared<NCLMrPool>(context);
+#ifdef POLLER_THREAD
+    qp_pool->GetDispatcher()->Start(POLLER_CPU);
+#endif
 }
 
 void CSLClientPool::RecycleClient(uint32_t client_id) {
@@ -65,8 +72,14 @@ shared_ptr<CSLClient> CSLClientPool::GetClient(size_t buf_size, const char *file
     if (idle_clients.empty()) {
         cli_id = global_id++;
         cli = busy_clients
+#ifdef ERASURE_CODE
+                  .insert(make_pair(cli_id, make_shared<CSLClient>(qp_pool, mr_pool, mgr_hosts, buf_size, cli_id,
+                                                                   filename, EC_DATA_SHARDS + EC_PARITY_SHARDS,
+                                                                   try_recover, EC_PARITY_SHARDS)))
+#else
                   .insert(make_pair(cli_id, make_shared<CSLClient>(qp_pool, mr_pool, mgr_hosts, buf_size, cli_id,
                                                                    filename, DEFAULT_REP_FACTOR, try_recover)))
+#endif
                   .first->second;
     } else {
         auto it = idle_clients.begin();
@@ -52,6 +52,11 @@ class CSLClientPool {
     shared_ptr<CSLClient> GetClient(size_t buf_size, const char *filename, bool try_recover=false);
 
     void RecycleClient(uint32_t client_id);
+
+    /**
+     * Drop the registrations of application memory in [addr, addr + len), which is about to be unmapped or freed
+     */
+    void InvalidateUserMemory(const void *addr, size_t len) { mr_pool->GetUserMrCache()->Invalidate(addr, len); }
     int GetIdleCliCnt() { return idle_clients.size(); }
     int GetBusyCliCnt() { return busy_clients.size(); }
 };
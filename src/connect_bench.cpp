@@ -0,0 +1,54 @@
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "client_pool.h"
+#include "csl_config.h"
+
+int FILES = 1000;
+std::string filename = "connect_bench";
+
+/**
+ * Latency of opening new files while more and more files stay open, which is dominated by the servers setting up the
+ * MRs of each file. Run it against servers built with and without SERVER_ARENA: with the arena a new file is carved
+ * out of memory registered at startup instead of registering its own MRs.
+ *
+ * Usage:
+ * ./connect_bench [files] [filename]
+ */
+int main(int argc, char *argv[]) {
+    if (argc > 1) FILES = std::stoi(argv[1]);
+    if (argc > 2) filename = argv[2];
+
+    CSLClientPool pool;
+    std::vector<std::shared_ptr<CSLClient>> clients;
+    std::vector<double> lat;
+
+    std::cout << "open files\tp50(us)\tp99(us)\tmax(us)" << std::endl;
+    auto report = [&]() {
+        std::vector<double> sorted(lat);
+        std::sort(sorted.begin(), sorted.end());
+        std::cout << clients.size() << "\t" << sorted[sorted.size() / 2] << "\t" << sorted[sorted.size() * 99 / 100]
+                  << "\t" << sorted.back() << std::endl;
+        lat.clear();
+    };
+    for (int i = 0; i < FILES; i++) {
+        std::string name = filename + "_" + std::to_string(i);
+        auto start = std::chrono::high_resolution_clock::now();
+        clients.push_back(pool.GetClient(MR_SIZE, name.c_str()));
+        auto end = std::chrono::high_resolution_clock::now();
+        lat.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count() / 1000.0);
+        if (lat.size() == 100 || i == FILES - 1) report();
+    }
+
+    auto start = std::chrono::high_resolution_clock::now();
+    for (auto &c : clients) pool.RecycleClient(c->GetId());
+    auto end = std::chrono::high_resolution_clock::now();
+    std::cout << "avg close(us)\t"
+              << std::chrono::duration_cast<std::chrono::microseconds>(end - start).count() / (double)FILES
+              << std::endl;
+    return 0;
+}
@@ -12,19 +12,27 @@
 #include "csl.h"
 
 #include <dlfcn.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <malloc.h>
 #include <stdarg.h>
 #include <stdio.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/uio.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <map>
 #include <mutex>
 #include <string>
 #include <unordered_map>
+#include <vector>
 
 #include "client_pool.h"
 #include "csl_config.h"
+#include "fd_table.h"
+#include "iov_util.h"
 #include "syscall_type.h"
 
 // #define CSL_DEBUG
@@ -32,6 +40,12 @@
 #define RECOVER_FROM_REMOTE 1
 
 #define __NEED_RECOVER_DATA(flags) (((flags)&O_TRUNC) == 0)
+#ifdef WRITE_BACK
+// files opened with O_DSYNC/O_SYNC keep waiting for a quorum on every write
+#define __IS_WRITE_BACK(flags) (((flags)&O_DSYNC) == 0)
+#else
+#define __IS_WRITE_BACK(flags) 0
+#endif
 
 static original_open_t original_open = reinterpret_cast<original_open_t>(dlsym(RTLD_NEXT, "open"));
 static original_open_t original_open64 = reinterpret_cast<original_open_t>(dlsym(RTLD_NEXT, "open64"));
@@ -41,10 +55,17 @@ static original_write_t original_write = reinterpret_cast<original_write_t>(dlsy
 static original_pwrite_t original_pwrite = reinterpret_cast<original_pwrite_t>(dlsym(RTLD_NEXT, "pwrite"));
 static original_pwrite_t original_pwrite64 = reinterpret_cast<original_pwrite_t>(dlsym(RTLD_NEXT, "pwrite64"));
 static original_pwritev_t original_pwritev = reinterpret_cast<original_pwritev_t>(dlsym(RTLD_NEXT, "pwritev"));
+static original_pwritev_t original_pwritev64 = reinterpret_cast<original_pwritev_t>(dlsym(RTLD_NEXT, "pwritev64"));
+static original_pwritev2_t original_pwritev2 = reinterpret_cast<original_pwritev2_t>(dlsym(RTLD_NEXT, "pwritev2"));
+static original_writev_t original_writev = reinterpret_cast<original_writev_t>(dlsym(RTLD_NEXT, "writev"));
 static original_close_t original_close = reinterpret_cast<original_close_t>(dlsym(RTLD_NEXT, "close"));
 static original_read_t original_read = reinterpret_cast<original_read_t>(dlsym(RTLD_NEXT, "read"));
 static original_pread_t original_pread = reinterpret_cast<original_pread_t>(dlsym(RTLD_NEXT, "pread"));
 static original_pread_t original_pread64 = reinterpret_cast<original_pread_t>(dlsym(RTLD_NEXT, "pread64"));
+static original_readv_t original_readv = reinterpret_cast<original_readv_t>(dlsym(RTLD_NEXT, "readv"));
+static original_preadv_t original_preadv = reinterpret_cast<original_preadv_t>(dlsym(RTLD_NEXT, "preadv"));
+static original_preadv_t original_preadv64 = reinterpret_cast<original_preadv_t>(dlsym(RTLD_NEXT, "preadv64"));
+static original_preadv2_t original_preadv2 = reinterpret_cast<original_preadv2_t>(dlsym(RTLD_NEXT, "preadv2"));
 static original_unlink_t original_unlink = reinterpret_cast<original_unlink_t>(dlsym(RTLD_NEXT, "unlink"));
 static original_lseek_t original_lseek = reinterpret_cast<original_lseek_t>(dlsym(RTLD_NEXT, "lseek"));
 static original_ftruncate_t original_ftruncate = reinterpret_cast<original_ftruncate_t>(dlsym(RTLD_NEXT, "ftruncate"));
@@ -56,6 +77,28 @@ static original_fread_t original_fread = reinterpret_cast<original_fread_t>(dlsy
 static original_fread_t original_fread_unlocked =
     reinterpret_cast<original_fread_t>(dlsym(RTLD_NEXT, "fread_unlocked"));
 static original_feof_t original_feof = reinterpret_cast<original_feof_t>(dlsym(RTLD_NEXT, "feof"));
+static original_fwrite_t original_fwrite = reinterpret_cast<original_fwrite_t>(dlsym(RTLD_NEXT, "fwrite"));
+static original_fwrite_t original_fwrite_unlocked =
+    reinterpret_cast<original_fwrite_t>(dlsym(RTLD_NEXT, "fwrite_unlocked"));
+static original_fputs_t original_fputs = reinterpret_cast<original_fputs_t>(dlsym(RTLD_NEXT, "fputs"));
+static original_fputs_t original_fputs_unlocked =
+    reinterpret_cast<original_fputs_t>(dlsym(RTLD_NEXT, "fputs_unlocked"));
+static original_fputc_t original_fputc = reinterpret_cast<original_fputc_t>(dlsym(RTLD_NEXT, "fputc"));
+static original_fputc_t original_putc = reinterpret_cast<original_fputc_t>(dlsym(RTLD_NEXT, "putc"));
+static original_fputc_t original_fputc_unlocked =
+    reinterpret_cast<original_fputc_t>(dlsym(RTLD_NEXT, "fputc_unlocked"));
+static original_fputc_t original_putc_unlocked =
+    reinterpret_cast<original_fputc_t>(dlsym(RTLD_NEXT, "putc_unlocked"));
+static original_vfprintf_t original_vfprintf = reinterpret_cast<original_vfprintf_t>(dlsym(RTLD_NEXT, "vfprintf"));
+static original_vfprintf_chk_t original_vfprintf_chk =
+    reinterpret_cast<original_vfprintf_chk_t>(dlsym(RTLD_NEXT, "__vfprintf_chk"));
+static original_fflush_t original_fflush = reinterpret_cast<original_fflush_t>(dlsym(RTLD_NEXT, "fflush"));
+static original_setvbuf_t original_setvbuf = reinterpret_cast<original_setvbuf_t>(dlsym(RTLD_NEXT, "setvbuf"));
+static original_setbuf_t original_setbuf = reinterpret_cast<original_setbuf_t>(dlsym(RTLD_NEXT, "setbuf"));
+static original_setbuffer_t original_setbuffer =
+    reinterpret_cast<original_setbuffer_t>(dlsym(RTLD_NEXT, "setbuffer"));
+static original_setlinebuf_t original_setlinebuf =
+    reinterpret_cast<original_setlinebuf_t>(dlsym(RTLD_NEXT, "setlinebuf"));
 static original_fclose_t original_fclose = reinterpret_cast<original_fclose_t>(dlsym(RTLD_NEXT, "fclose"));
 static original_fopen_t original_fopen = reinterpret_cast<original_fopen_t>(dlsym(RTLD_NEXT, "fopen"));
 static original_fopen_t original_fopen64 = reinterpret_cast<original_fopen_t>(dlsym(RTLD_NEXT, "fopen64"));
@@ -64,10 +107,51 @@ static original_ftell_t original_ftello64 = reinterpret_cast<original_ftell_t>(d
 static original_fgets_t original_fgets = reinterpret_cast<original_fgets_t>(dlsym(RTLD_NEXT, "fgets"));
 static original_fstat64_t original_fstat64 = reinterpret_cast<original_fstat64_t>(dlsym(RTLD_NEXT, "__fxstat64"));
 static original_stat64_t original_stat64 = reinterpret_cast<original_stat64_t>(dlsym(RTLD_NEXT, "__xstat64"));
+static original_mmap_t original_mmap = reinterpret_cast<original_mmap_t>(dlsym(RTLD_NEXT, "mmap"));
+static original_mmap_t original_mmap64 = reinterpret_cast<original_mmap_t>(dlsym(RTLD_NEXT, "mmap64"));
+static original_msync_t original_msync = reinterpret_cast<original_msync_t>(dlsym(RTLD_NEXT, "msync"));
+static original_munmap_t original_munmap = reinterpret_cast<original_munmap_t>(dlsym(RTLD_NEXT, "munmap"));
+static original_mremap_t original_mremap = reinterpret_cast<original_mremap_t>(dlsym(RTLD_NEXT, "mremap"));
+static original_free_t original_free = nullptr;  // resolved on first use, dlsym itself may free
+static original_realloc_t original_realloc = nullptr;
+// glibc's own entry points, used while dlsym is resolving the ones above, malloc isn't interposed so they own the heap
+extern "C" void __libc_free(void *ptr);
+extern "C" void *__libc_realloc(void *ptr, size_t size);
 
-static std::unordered_map<int, shared_ptr<CSLClient> > csl_fd_cli;
+/*
+ * csl_fd_cli is probed by every interposed call, so it is lock-free: a non-NCL fd costs a single relaxed load and a NCL
+ * fd is looked up inside a CliGuard. csl_lock only protects csl_path_cli, which is touched on open/unlink/stat.
+ */
+static FdTable<CSLClient> csl_fd_cli;
 static std::unordered_map<std::string, shared_ptr<CSLClient> > csl_path_cli;
 static std::mutex csl_lock;
+
+/*
+ * The replication mode is a property of the client, which all fds of a file share. While a file is open, it can only be
+ * opened again in the same mode. Protected by csl_lock.
+ */
+struct CslOpenFds {
+    int n = 0;
+    bool write_back;
+};
+static std::unordered_map<const CSLClient *, CslOpenFds> csl_open_fds;
+using CliGuard = FdTable<CSLClient>::ReadGuard;
+
+/*
+ * Shared mappings of NCL files by start address. A mapping holds its client, it stays valid after the fd is closed.
+ * csl_n_mmaps lets msync skip the lock when no NCL file is mapped, csl_any_mapped does the same for munmap, which must
+ * also keep any range of a log that was ever mapped away from the real munmap.
+ */
+struct CslMapping {
+    shared_ptr<CSLClient> cli;
+    size_t len;
+    int refs = 0;  // shared mappings of the same offset of a file return the same address
+};
+static std::map<uintptr_t, CslMapping> csl_mmaps;
+static std::vector<std::weak_ptr<CSLClient>> csl_mapped_clis;  // clients ever mapped, their logs are never unmapped
+static std::mutex csl_mmap_lock;
+static std::atomic<size_t> csl_n_mmaps(0);
+static std::atomic<bool> csl_any_mapped(false);
 static CSLClientPool pool;
 
 /*
@@ -78,30 +162,57 @@ static CSLClientPool pool;
  * hash map (since it's uninitialized) and there is no need to check the hash map as there is no NCL logs opened at that
  * time. Instead, we directly use the original implementation of those glibc functions.
  */
+static int flushStreams();
+
 static struct InitializeIndicator {
     bool initialized;
-    InitializeIndicator() { initialized = true; }
+    InitializeIndicator() {
+        initialized = true;
+        // the buffered data of streams the application didn't close is replicated on exit, before the clients go away
+        atexit([] { flushStreams(); });
+    }
 } init_d;
 
-void getClient(const char *pathname, int flags, int fd) {
+/*
+ * @return false if the file is open in the other replication mode, fd is then left alone
+ */
+bool getClient(const char *pathname, int flags, int fd) {
     if (__IS_COMP_SIDE_LOG(flags)) {
 #ifdef CSL_DEBUG
         printf("get client for fd %d, pathname %s\n", fd, pathname);
 #endif
         std::shared_ptr<CSLClient> csl_client;
-        if (csl_path_cli.find(pathname) != csl_path_cli.end()) {
-            csl_client = csl_path_cli[pathname];
-        } else {
+        csl_lock.lock();
+        auto it = csl_path_cli.find(pathname);
+        if (it != csl_path_cli.end()) csl_client = it->second;
+        csl_lock.unlock();
+
+        if (!csl_client) {
+            // csl_lock is not held here since creating a client may call into the stubs (e.g. stat)
             csl_client = pool.GetClient(MR_SIZE, pathname, __NEED_RECOVER_DATA(flags) && RECOVER_FROM_REMOTE);
 #if RECYCLE_ON_DELETE
+            std::lock_guard<std::mutex> lock(csl_lock);
             csl_path_cli.insert(make_pair(pathname, csl_client));
 #endif
         }
-
+        bool write_back = __IS_WRITE_BACK(flags);
         if (fd >= 0) {
             std::lock_guard<std::mutex> lock(csl_lock);
-            csl_fd_cli.insert(make_pair(fd, csl_client));
+            auto &open_fds = csl_open_fds[csl_client.get()];
+            if (open_fds.n > 0 && open_fds.write_back != write_back) {
+                fprintf(stderr, "%s is already open in %s mode\n", pathname,
+                        open_fds.write_back ? "write-back" : "write-through");
+                return false;
+            }
+            open_fds.write_back = write_back;
+            if (!csl_fd_cli.Insert(fd, csl_client)) {
+                fprintf(stderr, "fd %d exceeds NCL fd table capacity %zu, %s is not replicated\n", fd,
+                        csl_fd_cli.Capacity(), pathname);
+            } else {
+                open_fds.n++;
+            }
         }
+        if (fd >= 0) csl_client->SetWriteBack(write_back);
 #if RECOVER_FROM_REMOTE
 #else
         if (__NEED_RECOVER_DATA(flags)) {
@@ -110,6 +221,16 @@ void getClient(const char *pathname, int flags, int fd) {
         }
 #endif
     }
+    return true;
+}
+
+/*
+ * Forget an fd of cli that was closed
+ */
+static void putClient(const CSLClient *cli) {
+    std::lock_guard<std::mutex> lock(csl_lock);
+    auto it = csl_open_fds.find(cli);
+    if (it != csl_open_fds.end() && --it->second.n == 0) csl_open_fds.erase(it);
 }
 
 int open(const char *pathname, int flags, ...) {
@@ -127,7 +248,11 @@ int open(const char *pathname, int flags, ...) {
         fd = original_open(pathname, flags);
     }
 
-    if (fd >= 0) getClient(pathname, flags, fd);
+    if (fd >= 0 && !getClient(pathname, flags, fd)) {
+        original_close(fd);
+        errno = EINVAL;
+        return -1;
+    }
 
 #ifdef CSL_DEBUG
     printf("open path %s, flag 0x%x, mode 0%o\n", pathname, flags, mode);
@@ -150,7 +275,11 @@ int open64(const char *pathname, int flags, ...) {
         fd = original_open64(pathname, flags);
     }
 
-    if (fd >= 0) getClient(pathname, flags, fd);
+    if (fd >= 0 && !getClient(pathname, flags, fd)) {
+        original_close(fd);
+        errno = EINVAL;
+        return -1;
+    }
 
 #ifdef CSL_DEBUG
     printf("open64 path %s, flag 0x%x, mode 0%o\n", pathname, flags, mode);
@@ -173,7 +302,11 @@ int openat(int dirfd, const char *pathname, int flags, ...) {
         fd = original_openat(dirfd, pathname, flags);
     }
 
-    if (fd >= 0) getClient(pathname, flags, fd);
+    if (fd >= 0 && !getClient(pathname, flags, fd)) {
+        original_close(fd);
+        errno = EINVAL;
+        return -1;
+    }
 
 #ifdef CSL_DEBUG
     printf("openat dir %d path %s, flag 0x%x, mode 0%o\n", dirfd, pathname, flags, mode);
@@ -196,7 +329,11 @@ int openat64(int dirfd, const char *pathname, int flags, ...) {
         fd = original_openat64(dirfd, pathname, flags);
     }
 
-    if (fd >= 0) getClient(pathname, flags, fd);
+    if (fd >= 0 && !getClient(pathname, flags, fd)) {
+        original_close(fd);
+        errno = EINVAL;
+        return -1;
+    }
 
 #ifdef CSL_DEBUG
     printf("openat64 dir %d path %s, flag 0x%x, mode 0%o\n", dirfd, pathname, flags, mode);
@@ -205,35 +342,31 @@ int openat64(int dirfd, const char *pathname, int flags, ...) {
 }
 
 ssize_t write(int fd, const void *buf, size_t count) {
-    csl_lock.lock();
-    auto it = csl_fd_cli.find(fd);
-    if (it != csl_fd_cli.end()) {
-        auto cli = it->second;
-        csl_lock.unlock();
+    if (csl_fd_cli.Contains(fd)) {
+        CliGuard guard;
+        CSLClient *cli = csl_fd_cli.Get(fd);
+        if (cli) {
 #ifdef CSL_DEBUG
-        printf("compute side log write, fd: %d\n", fd);
+            printf("compute side log write, fd: %d\n", fd);
 #endif
-        return cli->Append(buf, count);
-    } else {
-        csl_lock.unlock();
-        return original_write(fd, buf, count);
+            return cli->Append(buf, count);
+        }
     }
+    return original_write(fd, buf, count);
 }
 
 ssize_t pwrite_internal(int fd, const void *buf, size_t count, off_t offset, original_pwrite_t pwrite_impl) {
-    csl_lock.lock();
-    auto it = csl_fd_cli.find(fd);
-    if (it != csl_fd_cli.end()) {
-        auto cli = it->second;
-        csl_lock.unlock();
+    if (csl_fd_cli.Contains(fd)) {
+        CliGuard guard;
+        CSLClient *cli = csl_fd_cli.Get(fd);
+        if (cli) {
 #ifdef CSL_DEBUG
-        printf("compute side log pwrite, fd: %d, size %ld, pos %ld\n", fd, count, offset);
+            printf("compute side log pwrite, fd: %d, size %ld, pos %ld\n", fd, count, offset);
 #endif
-        return cli->WritePos(buf, count, offset);
-    } else {
-        csl_lock.unlock();
-        return pwrite_impl(fd, buf, count, offset);
+            return cli->WritePos(buf, count, offset);
+        }
     }
+    return pwrite_impl(fd, buf, count, offset);
 }
 
 ssize_t pwrite(int fd, const void *buf, size_t count, off_t offset) {
@@ -244,55 +377,106 @@ ssize_t pwrite64(int fd, const void *buf, size_t count, off_t offset) {
     return pwrite_internal(fd, buf, count, offset, original_pwrite64);
 }
 
+ssize_t writev(int fd, const struct iovec *iov, int iovcnt) {
+    if (csl_fd_cli.Contains(fd)) {
+        CliGuard guard;
+        CSLClient *cli = csl_fd_cli.Get(fd);
+        if (cli) {
+#ifdef CSL_DEBUG
+            printf("compute side log writev, fd: %d, iovcnt %d\n", fd, iovcnt);
+#endif
+            return cli->AppendVec(iov, iovcnt);
+        }
+    }
+    return original_writev(fd, iov, iovcnt);
+}
+
+ssize_t pwritev_internal(int fd, const struct iovec *iov, int iovcnt, off_t offset, original_pwritev_t pwritev_impl) {
+    if (csl_fd_cli.Contains(fd)) {
+        CliGuard guard;
+        CSLClient *cli = csl_fd_cli.Get(fd);
+        if (cli) {
+#ifdef CSL_DEBUG
+            printf("compute side log pwritev, fd: %d, iovcnt %d, pos %ld\n", fd, iovcnt, offset);
+#endif
+            return cli->WritePosVec(iov, iovcnt, offset);
+        }
+    }
+    return pwritev_impl(fd, iov, iovcnt, offset);
+}
+
+ssize_t pwritev(int fd, const struct iovec *iov, int iovcnt, off_t offset) {
+    return pwritev_internal(fd, iov, iovcnt, offset, original_pwritev);
+}
+
+ssize_t pwritev64(int fd, const struct iovec *iov, int iovcnt, off_t offset) {
+    return pwritev_internal(fd, iov, iovcnt, offset, original_pwritev64);
+}
+
+ssize_t pwritev2(int fd, const struct iovec *iov, int iovcnt, off_t offset, int flags) {
+    if (csl_fd_cli.Contains(fd)) {
+        CliGuard guard;
+        CSLClient *cli = csl_fd_cli.Get(fd);
+        if (cli) {
+#ifdef CSL_DEBUG
+            printf("compute side log pwritev2, fd: %d, iovcnt %d, pos %ld, flags 0x%x\n", fd, iovcnt, offset, flags);
+#endif
+            if (!rwfFlagsSupported(flags, NCL_RWF_WRITE_FLAGS)) return -1;
+            ssize_t ret;
+            if (flags & RWF_APPEND)
+                ret = cli->WritePosVec(iov, iovcnt, cli->GetFileSize());
+            else if (offset == -1)
+                ret = cli->AppendVec(iov, iovcnt);  // use and update the current file offset
+            else
+                ret = cli->WritePosVec(iov, iovcnt, offset);
+            if (ret >= 0 && (flags & (RWF_DSYNC | RWF_SYNC))) cli->Sync();
+            return ret;
+        }
+    }
+    return original_pwritev2(fd, iov, iovcnt, offset, flags);
+}
+
 int close(int fd) {
-    csl_lock.lock();
-    auto it = csl_fd_cli.find(fd);
-    if (it != csl_fd_cli.end()) {
-        csl_lock.unlock();
+    if (csl_fd_cli.Contains(fd)) {
+        auto cli = csl_fd_cli.Erase(fd);
+        if (cli) putClient(cli.get());
 #if RECYCLE_ON_DELETE
 #else
-        pool.RecycleClient(it->second->GetId());
+        if (cli) pool.RecycleClient(cli->GetId());
 #endif
 #ifdef CSL_DEBUG
         printf("compute side log close, fd %d\n", fd);
 #endif
-        csl_lock.lock();
-        csl_fd_cli.erase(it);
     }
-    csl_lock.unlock();
     return original_close(fd);
 }
 
 ssize_t read(int fd, void *buf, size_t count) {
-    csl_lock.lock();
-    auto it = csl_fd_cli.find(fd);
-    if (it != csl_fd_cli.end()) {
-        auto cli = it->second;
-        csl_lock.unlock();
+    if (csl_fd_cli.Contains(fd)) {
+        CliGuard guard;
+        CSLClient *cli = csl_fd_cli.Get(fd);
+        if (cli) {
 #ifdef CSL_DEBUG
-        printf("compute side log read, fd: %d\n", fd);
+            printf("compute side log read, fd: %d\n", fd);
 #endif
-        return cli->Read(buf, count);
-    } else {
-        csl_lock.unlock();
-        return original_read(fd, buf, count);
+            return cli->Read(buf, count);
+        }
     }
+    return original_read(fd, buf, count);
 }
 
 ssize_t pread_internal(int fd, void *buf, size_t count, off_t offset, original_pread_t pread_impl) {
-    csl_lock.lock();
-    auto it = csl_fd_cli.find(fd);
-    if (it != csl_fd_cli.end()) {
-        auto cli = it->second;
-        csl_lock.unlock();
+    if (csl_fd_cli.Contains(fd)) {
+        CliGuard guard;
+        CSLClient *cli = csl_fd_cli.Get(fd);
+        if (cli) {
 #ifdef CSL_DEBUG
-        printf("compute side log pread, fd: %d, pos %ld\n", fd, offset);
+            printf("compute side log pread, fd: %d, pos %ld\n", fd, offset);
 #endif
-        return cli->ReadPos(buf, count, offset);
-    } else {
-        csl_lock.unlock();
-        return pread_impl(fd, buf, count, offset);
+            return cli->ReadPos(buf, count, offset);
+        }
     }
+    return pread_impl(fd, buf, count, offset);
 }
 
 ssize_t pread(int fd, void *buf, size_t count, off_t offset) {
@@ -303,8 +487,60 @@ ssize_t pread64(int fd, void *buf, size_t count, off_t offset) {
     return pread_internal(fd, buf, count, offset, original_pread64);
 }
 
+ssize_t readv(int fd, const struct iovec *iov, int iovcnt) {
+    if (csl_fd_cli.Contains(fd)) {
+        CliGuard guard;
+        CSLClient *cli = csl_fd_cli.Get(fd);
+        if (cli) {
+#ifdef CSL_DEBUG
+            printf("compute side log readv, fd: %d, iovcnt %d\n", fd, iovcnt);
+#endif
+            return cli->ReadVec(iov, iovcnt);
+        }
+    }
+    return original_readv(fd, iov, iovcnt);
+}
+
+ssize_t preadv_internal(int fd, const struct iovec *iov, int iovcnt, off_t offset, original_preadv_t preadv_impl) {
+    if (csl_fd_cli.Contains(fd)) {
+        CliGuard guard;
+        CSLClient *cli = csl_fd_cli.Get(fd);
+        if (cli) {
+#ifdef CSL_DEBUG
+            printf("compute side log preadv, fd: %d, iovcnt %d, pos %ld\n", fd, iovcnt, offset);
+#endif
+            return cli->ReadPosVec(iov, iovcnt, offset);
+        }
+    }
+    return preadv_impl(fd, iov, iovcnt, offset);
+}
+
+ssize_t preadv(int fd, const struct iovec *iov, int iovcnt, off_t offset) {
+    return preadv_internal(fd, iov, iovcnt, offset, original_preadv);
+}
+
+ssize_t preadv64(int fd, const struct iovec *iov, int iovcnt, off_t offset) {
+    return preadv_internal(fd, iov, iovcnt, offset, original_preadv64);
+}
+
+ssize_t preadv2(int fd, const struct iovec *iov, int iovcnt, off_t offset, int flags) {
+    if (csl_fd_cli.Contains(fd)) {
+        CliGuard guard;
+        CSLClient *cli = csl_fd_cli.Get(fd);
+        if (cli) {
+#ifdef CSL_DEBUG
+            printf("compute side log preadv2, fd: %d, iovcnt %d, pos %ld, flags 0x%x\n", fd, iovcnt, offset, flags);
+#endif
+            if (!rwfFlagsSupported(flags, NCL_RWF_READ_FLAGS)) return -1;
+            return offset == -1 ? cli->ReadVec(iov, iovcnt) : cli->ReadPosVec(iov, iovcnt, offset);
+        }
+    }
+    return original_preadv2(fd, iov, iovcnt, offset, flags);
+}
+
 int unlink(const char *pathname) {
 #if RECYCLE_ON_DELETE
+    csl_lock.lock();
     auto it = csl_path_cli.find(pathname);
     if (it != csl_path_cli.end()) {
         pool.RecycleClient(it->second->GetId());
@@ -313,71 +549,65 @@ int unlink(const char *pathname) {
         printf("compute side log unlink, %s\n", pathname);
 #endif
     }
+    csl_lock.unlock();
 #endif
     return original_unlink(pathname);
 }
 
 off_t lseek(int fd, off_t offset, int whence) {
-    csl_lock.lock();
-    auto it = csl_fd_cli.find(fd);
-    if (it != csl_fd_cli.end()) {
-        auto cli = it->second;
-        csl_lock.unlock();
-        return cli->Seek(offset, whence);
-    } else {
-        csl_lock.unlock();
-        return original_lseek(fd, offset, whence);
+    if (csl_fd_cli.Contains(fd)) {
+        CliGuard guard;
+        CSLClient *cli = csl_fd_cli.Get(fd);
+        if (cli) {
+            return cli->Seek(offset, whence);
+        }
     }
+    return original_lseek(fd, offset, whence);
 }
 
 int fseek(FILE *stream, long offset, int whence) {
     int fd = fileno(stream);
 
-    csl_lock.lock();
-    auto it = csl_fd_cli.find(fd);
-    if (it != csl_fd_cli.end()) {
-        auto cli = it->second;
-        csl_lock.unlock();
+    if (csl_fd_cli.Contains(fd)) {
+        CliGuard guard;
+        CSLClient *cli = csl_fd_cli.Get(fd);
+        if (cli) {
 #ifdef CSL_DEBUG
-        printf("compute side log fseek, fd %d, offset %ld, whence %d\n", fd, offset, whence);
+            printf("compute side log fseek, fd %d, offset %ld, whence %d\n", fd, offset, whence);
 #endif
-        return cli->Seek(offset, whence);
-    } else {
-        csl_lock.unlock();
-        return original_fseek(stream, offset, whence);
+            cli->Flush();
+            return cli->Seek(offset, whence);
+        }
     }
+    return original_fseek(stream, offset, whence);
 }
 
 off_t ftello64(FILE *stream) {
     int fd = fileno(stream);
 
-    csl_lock.lock();
-    auto it = csl_fd_cli.find(fd);
-    if (it != csl_fd_cli.end()) {
-        auto cli = it->second;
-        csl_lock.unlock();
-        size_t pos = cli->GetOffset();
+    if (csl_fd_cli.Contains(fd)) {
+        CliGuard guard;
+        CSLClient *cli = csl_fd_cli.Get(fd);
+        if (cli) {
+            size_t pos = cli->GetOffset();
 #ifdef CSL_DEBUG
-        printf("compute side log ftello64, fd %d, pos %ld\n", fd, pos);
+            printf("compute side log ftello64, fd %d, pos %ld\n", fd, pos);
 #endif
-        return pos;
-    } else {
-        csl_lock.unlock();
-        return original_ftello64(stream);
+            return pos;
+        }
     }
+    return original_ftello64(stream);
 }
 
 int ftruncate_internal(int fd, off_t length, original_ftruncate_t ftruncate_impl) {
-    csl_lock.lock();
-    auto it = csl_fd_cli.find(fd);
-    if (it != csl_fd_cli.end()) {
-        auto cli = it->second;
-        csl_lock.unlock();
-        return cli->Truncate(length);
-    } else {
-        csl_lock.unlock();
-        return ftruncate_impl(fd, length);
+    if (csl_fd_cli.Contains(fd)) {
+        CliGuard guard;
+        CSLClient *cli = csl_fd_cli.Get(fd);
+        if (cli) {
+            return cli->Truncate(length);
+        }
     }
+    return ftruncate_impl(fd, length);
 }
 
 int ftruncate(int fd, off_t length) { return ftruncate_internal(fd, length, original_ftruncate); }
@@ -385,35 +615,198 @@ int ftruncate(int fd, off_t length) { return ftruncate_internal(fd, length, orig
 int ftruncate64(int fd, off_t length) { return ftruncate_internal(fd, length, original_ftruncate64); }
 
 int sync_internal(int fd, original_fsync_t sync_impl) {
-    if (csl_fd_cli.find(fd) == csl_fd_cli.end())
-        return sync_impl(fd);
-    else
-        return 0;  // fsync/fdatasync is a no-op for NCL
+    if (csl_fd_cli.Contains(fd)) {
+        CliGuard guard;
+        CSLClient *cli = csl_fd_cli.Get(fd);
+        if (cli) return cli->Sync();  // returns immediately unless the file is in write-back mode
+    }
+    return sync_impl(fd);
 }
 
 int fsync(int fd) { return sync_internal(fd, original_fsync); }
 
 int fdatasync(int fd) { return sync_internal(fd, original_fdatasync); }
 
+void *mmap_internal(void *addr, size_t length, int prot, int flags, int fd, off_t offset, original_mmap_t mmap_impl) {
+    if (csl_fd_cli.Contains(fd)) {
+        auto cli = csl_fd_cli.GetShared(fd);
+        if (cli) {
+            void *ret = cli->Map(length, prot, flags, offset);
+#ifdef CSL_DEBUG
+            printf("compute side log mmap, fd: %d, length: %ld, offset: %ld, ret: %p\n", fd, length, offset, ret);
+#endif
+            if (ret != MAP_FAILED && (flags & MAP_TYPE) != MAP_PRIVATE) {
+                std::lock_guard<std::mutex> lock(csl_mmap_lock);
+                CslMapping &m = csl_mmaps[reinterpret_cast<uintptr_t>(ret)];
+                m.cli = cli;
+                m.len = m.refs++ == 0 ? length : std::max(m.len, length);
+                csl_n_mmaps = csl_mmaps.size();
+                bool known = false;
+                for (auto &w : csl_mapped_clis) known |= w.lock() == cli;
+                if (!known) {
+                    csl_mapped_clis.erase(std::remove_if(csl_mapped_clis.begin(), csl_mapped_clis.end(),
+                                                         [](const std::weak_ptr<CSLClient> &w) { return w.expired(); }),
+                                          csl_mapped_clis.end());
+                    csl_mapped_clis.push_back(cli);
+                    csl_any_mapped = true;
+                }
+            }
+            return ret;
+        }
+    }
+    return mmap_impl(addr, length, prot, flags, fd, offset);
+}
+
+void *mmap(void *addr, size_t length, int prot, int flags, int fd, off_t offset) {
+    if (original_mmap == nullptr) original_mmap = reinterpret_cast<original_mmap_t>(dlsym(RTLD_NEXT, "mmap"));
+    return mmap_internal(addr, length, prot, flags, fd, offset, original_mmap);
+}
+
+void *mmap64(void *addr, size_t length, int prot, int flags, int fd, off_t offset) {
+    if (original_mmap64 == nullptr) original_mmap64 = reinterpret_cast<original_mmap_t>(dlsym(RTLD_NEXT, "mmap64"));
+    return mmap_internal(addr, length, prot, flags, fd, offset, original_mmap64);
+}
+
+/**
+ * Find the NCL mapping containing addr
+ *
+ * @return iterator to the mapping, csl_mmaps.end() if not found. Must hold csl_mmap_lock
+ */
+static std::map<uintptr_t, CslMapping>::iterator findMapping(void *addr) {
+    uintptr_t a = reinterpret_cast<uintptr_t>(addr);
+    auto it = csl_mmaps.upper_bound(a);
+    if (it == csl_mmaps.begin()) return csl_mmaps.end();
+    --it;
+    return a < it->first + it->second.len ? it : csl_mmaps.end();
+}
+
+int msync(void *addr, size_t length, int flags) {
+    if (csl_n_mmaps.load() > 0) {
+        shared_ptr<CSLClient> cli;
+        {
+            std::lock_guard<std::mutex> lock(csl_mmap_lock);
+            auto it = findMapping(addr);
+            if (it != csl_mmaps.end()) cli = it->second.cli;
+        }
+        if (cli) {
+#ifdef CSL_DEBUG
+            printf("compute side log msync, addr: %p, length: %ld\n", addr, length);
+#endif
+            return cli->MapSync(addr, length, flags);
+        }
+    }
+    return original_msync(addr, length, flags);
+}
+
+int munmap(void *addr, size_t length) {
+    if (original_munmap == nullptr) original_munmap = reinterpret_cast<original_munmap_t>(dlsym(RTLD_NEXT, "munmap"));
+
+    if (csl_any_mapped.load()) {
+        shared_ptr<CSLClient> cli;
+        bool whole = false, in_log = false;
+        {
+            std::lock_guard<std::mutex> lock(csl_mmap_lock);
+            auto it = findMapping(addr);
+            if (it != csl_mmaps.end()) {
+                cli = it->second.cli;
+                // releases one of the mappings at this address, whichever length it was mapped with
+                whole = it->first == reinterpret_cast<uintptr_t>(addr);
+                if (whole && --it->second.refs == 0) csl_mmaps.erase(it);
+                csl_n_mmaps = csl_mmaps.size();
+            } else {
+                for (auto &w : csl_mapped_clis) {
+                    auto c = w.lock();
+                    in_log |= c && c->InLog(addr, length);
+                }
+            }
+        }
+        if (cli) {
+#ifdef CSL_DEBUG
+            printf("compute side log munmap, addr: %p, length: %ld\n", addr, length);
+#endif
+            // the MR itself is never unmapped, a partial munmap only syncs the range
+            return whole ? cli->Unmap(addr, length) : cli->MapSync(addr, length, MS_SYNC);
+        }
+        if (in_log) return 0;  // e.g. unmapped twice, the log stays registered
+    }
+    if (init_d.initialized && UserMrCache::AnyPinned()) pool.InvalidateUserMemory(addr, length);
+    return original_munmap(addr, length);
+}
+
+void *mremap(void *old_address, size_t old_size, size_t new_size, int flags, ...) {
+    if (original_mremap == nullptr) original_mremap = reinterpret_cast<original_mremap_t>(dlsym(RTLD_NEXT, "mremap"));
+    void *new_address = nullptr;
+    if (flags & MREMAP_FIXED) {
+        va_list args;
+        va_start(args, flags);
+        new_address = va_arg(args, void *);
+        va_end(args);
+    }
+
+    if (csl_any_mapped.load()) {
+        bool mapped;
+        {
+            std::lock_guard<std::mutex> lock(csl_mmap_lock);
+            mapped = findMapping(old_address) != csl_mmaps.end();
+        }
+        if (mapped) {  // the log MR can't move or shrink under its registration
+            errno = EINVAL;
+            return MAP_FAILED;
+        }
+    }
+    // the old pages may move or go back to the kernel, the registrations of the new range are dropped as well
+    if (init_d.initialized && UserMrCache::AnyPinned()) {
+        pool.InvalidateUserMemory(old_address, old_size);
+        if (new_address) pool.InvalidateUserMemory(new_address, new_size);
+    }
+    return flags & MREMAP_FIXED ? original_mremap(old_address, old_size, new_size, flags, new_address)
+                                : original_mremap(old_address, old_size, new_size, flags);
+}
+
+/*
+ * Application buffers registered for zero-copy writes must be deregistered before their pages go back to the kernel.
+ * glibc unmaps large chunks in free() and realloc() with its internal munmap, which the hook above doesn't see. Both
+ * only take a lock when a registration exists.
+ */
+static bool resolveAllocator() {
+    static thread_local bool resolving = false;
+    if (resolving) return false;
+    resolving = true;
+    if (original_free == nullptr) original_free = reinterpret_cast<original_free_t>(dlsym(RTLD_NEXT, "free"));
+    if (original_realloc == nullptr)
+        original_realloc = reinterpret_cast<original_realloc_t>(dlsym(RTLD_NEXT, "realloc"));
+    resolving = false;
+    return true;
+}
+
+void free(void *ptr) noexcept {
+    if (original_free == nullptr && !resolveAllocator()) return __libc_free(ptr);  // dlsym frees while resolving
+    if (ptr && init_d.initialized && UserMrCache::AnyPinned()) pool.InvalidateUserMemory(ptr, malloc_usable_size(ptr));
+    original_free(ptr);
+}
+
+void *realloc(void *ptr, size_t size) noexcept {
+    if (original_realloc == nullptr && !resolveAllocator()) return __libc_realloc(ptr, size);
+    if (ptr && init_d.initialized && UserMrCache::AnyPinned()) pool.InvalidateUserMemory(ptr, malloc_usable_size(ptr));
+    return original_realloc(ptr, size);
+}
+
 size_t fread_internal(void *ptr, size_t size, size_t nmemb, FILE *stream, original_fread_t fread_impl) {
     int fd = fileno(stream);
     size_t count = size * nmemb;
 
-    csl_lock.lock();
-    auto it = csl_fd_cli.find(fd);
-    if (it != csl_fd_cli.end()) {
-        auto cli = it->second;
-        csl_lock.unlock();
-
-        int ret = cli->Read(ptr, count);
+    if (csl_fd_cli.Contains(fd)) {
+        CliGuard guard;
+        CSLClient *cli = csl_fd_cli.Get(fd);
+        if (cli) {
+            int ret = cli->Read(ptr, count);
 #ifdef CSL_DEBUG
-        printf("compute side log fread, fd: %d, ret: %d\n", fd, ret);
+            printf("compute side log fread, fd: %d, ret: %d\n", fd, ret);
 #endif
-        return ret;
-    } else {
-        csl_lock.unlock();
-        return fread_impl(ptr, size, nmemb, stream);
+            return ret;
+        }
     }
+    return fread_impl(ptr, size, nmemb, stream);
 }
 
 size_t fread(void *ptr, size_t size, size_t nmemb, FILE *stream) {
@@ -427,36 +820,31 @@ size_t fread_unlocked(void *ptr, size_t size, size_t nmemb, FILE *stream) {
 char *fgets(char *s, int size, FILE *stream) {
     int fd = fileno(stream);
 
-    csl_lock.lock();
-    auto it = csl_fd_cli.find(fd);
-    if (it != csl_fd_cli.end()) {
-        auto cli = it->second;
-        csl_lock.unlock();
+    if (csl_fd_cli.Contains(fd)) {
+        CliGuard guard;
+        CSLClient *cli = csl_fd_cli.Get(fd);
+        if (cli) {
 #ifdef CSL_DEBUG
-        printf("compute side log fgets, fd: %d\n", fd);
+            printf("compute side log fgets, fd: %d\n", fd);
 #endif
-        return cli->GetLine(s, size);
-    } else {
-        csl_lock.unlock();
-        return original_fgets(s, size, stream);
+            return cli->GetLine(s, size);
+        }
     }
+    return original_fgets(s, size, stream);
 }
 
 int feof(FILE *stream) {
     int fd = fileno(stream);
 
-    csl_lock.lock();
-    auto it = csl_fd_cli.find(fd);
-    if (it != csl_fd_cli.end()) {
-        auto cli = it->second;
-        csl_lock.unlock();
-
-        int ret = cli->Eof();
-        return ret;
-    } else {
-        csl_lock.unlock();
-        return original_feof(stream);
+    if (csl_fd_cli.Contains(fd)) {
+        CliGuard guard;
+        CSLClient *cli = csl_fd_cli.Get(fd);
+        if (cli) {
+            int ret = cli->Eof();
+            return ret;
+        }
     }
+    return original_feof(stream);
 }
 
 FILE *fopen_internal(const char *pathname, const char *mode, original_fopen_t fopen_impl) {
@@ -469,7 +857,11 @@ FILE *fopen_internal(const char *pathname, const char *mode, original_fopen_t fo
 #ifdef CSL_DEBUG
             printf("compute side log fopen, fd %d, path %s, mode %s\n", fd, pathname, mode);
 #endif
-            getClient(pathname, O_CSL, fd);
+            if (!getClient(pathname, O_CSL, fd)) {
+                original_fclose(fp);
+                errno = EINVAL;
+                return nullptr;
+            }
         }
     }
 
@@ -498,24 +890,256 @@ int fclose(FILE *stream) {
         return original_fclose(stream);
     }
 
-    csl_lock.lock();
-    auto it = csl_fd_cli.find(fd);
-    if (it != csl_fd_cli.end()) {
-        csl_lock.unlock();
+    if (csl_fd_cli.Contains(fd)) {
+        auto cli = csl_fd_cli.Erase(fd);
+        if (cli) {
+            cli->Flush();
+            putClient(cli.get());
+        }
 #if RECYCLE_ON_DELETE
 #else
-        pool.RecycleClient(it->second->GetId());
+        if (cli) pool.RecycleClient(cli->GetId());
 #endif
 #ifdef CSL_DEBUG
         printf("compute side log fclose, fd %d\n", fd);
 #endif
-        csl_lock.lock();
-        csl_fd_cli.erase(it);
     }
-    csl_lock.unlock();
     return original_fclose(stream);
 }
 
+size_t fwrite_internal(const void *ptr, size_t size, size_t nmemb, FILE *stream, original_fwrite_t fwrite_impl) {
+    int fd = fileno(stream);
+
+    if (csl_fd_cli.Contains(fd)) {
+        CliGuard guard;
+        CSLClient *cli = csl_fd_cli.Get(fd);
+        if (cli) {
+            if (size == 0 || nmemb == 0) return 0;
+            size_t ret = cli->BufferedAppend(ptr, size * nmemb) / size;
+#ifdef CSL_DEBUG
+            printf("compute side log fwrite, fd: %d, ret: %ld\n", fd, ret);
+#endif
+            return ret;
+        }
+    }
+    return fwrite_impl(ptr, size, nmemb, stream);
+}
+
+size_t fwrite(const void *ptr, size_t size, size_t nmemb, FILE *stream) {
+    return fwrite_internal(ptr, size, nmemb, stream, original_fwrite);
+}
+
+size_t fwrite_unlocked(const void *ptr, size_t size, size_t nmemb, FILE *stream) {
+    return fwrite_internal(ptr, size, nmemb, stream, original_fwrite_unlocked);
+}
+
+int fputs_internal(const char *s, FILE *stream, original_fputs_t fputs_impl) {
+    int fd = fileno(stream);
+
+    if (csl_fd_cli.Contains(fd)) {
+        CliGuard guard;
+        CSLClient *cli = csl_fd_cli.Get(fd);
+        if (cli) {
+            size_t len = strlen(s);
+            return cli->BufferedAppend(s, len) == len ? 1 : EOF;
+        }
+    }
+    return fputs_impl(s, stream);
+}
+
+int fputs(const char *s, FILE *stream) { return fputs_internal(s, stream, original_fputs); }
+
+int fputs_unlocked(const char *s, FILE *stream) { return fputs_internal(s, stream, original_fputs_unlocked); }
+
+int fputc_internal(int c, FILE *stream, original_fputc_t fputc_impl) {
+    int fd = fileno(stream);
+
+    if (csl_fd_cli.Contains(fd)) {
+        CliGuard guard;
+        CSLClient *cli = csl_fd_cli.Get(fd);
+        if (cli) {
+            unsigned char ch = static_cast<unsigned char>(c);
+            return cli->BufferedAppend(&ch, 1) == 1 ? ch : EOF;
+        }
+    }
+    return fputc_impl(c, stream);
+}
+
+int fputc(int c, FILE *stream) { return fputc_internal(c, stream, original_fputc); }
+
+int putc(int c, FILE *stream) { return fputc_internal(c, stream, original_putc); }
+
+int fputc_unlocked(int c, FILE *stream) { return fputc_internal(c, stream, original_fputc_unlocked); }
+
+int putc_unlocked(int c, FILE *stream) { return fputc_internal(c, stream, original_putc_unlocked); }
+
+/**
+ * Format into a stack buffer (or a heap buffer if it doesn't fit) and append the result to the NCL stream
+ *
+ * @return number of bytes appended, fewer than formatted if the log is full, or -1 with errno set
+ */
+static int ncl_vfprintf(CSLClient *cli, const char *format, va_list ap) {
+    char stack_buf[1024];
+    va_list ap_copy;
+    va_copy(ap_copy, ap);
+    int len = vsnprintf(stack_buf, sizeof(stack_buf), format, ap);
+    size_t appended = 0;
+    if (len >= 0 && static_cast<size_t>(len) < sizeof(stack_buf)) {
+        appended = cli->BufferedAppend(stack_buf, len);
+    } else if (len >= 0) {
+        char *heap_buf = reinterpret_cast<char *>(malloc(len + 1));
+        if (!heap_buf) {
+            va_end(ap_copy);
+            errno = ENOMEM;
+            return -1;
+        }
+        vsnprintf(heap_buf, len + 1, format, ap_copy);
+        appended = cli->BufferedAppend(heap_buf, len);
+        free(heap_buf);
+    }
+    va_end(ap_copy);
+    if (len <= 0) return len;
+    return appended > 0 ? static_cast<int>(appended) : -1;  // errno is set by the failed append
+}
+
+int vfprintf(FILE *stream, const char *format, va_list ap) {
+    int fd = fileno(stream);
+
+    if (csl_fd_cli.Contains(fd)) {
+        CliGuard guard;
+        CSLClient *cli = csl_fd_cli.Get(fd);
+        if (cli) return ncl_vfprintf(cli, format, ap);
+    }
+    return original_vfprintf(stream, format, ap);
+}
+
+int fprintf(FILE *stream, const char *format, ...) {
+    va_list ap;
+    va_start(ap, format);
+    int ret = vfprintf(stream, format, ap);
+    va_end(ap);
+    return ret;
+}
+
+// fortified variants called by programs built with _FORTIFY_SOURCE
+int __vfprintf_chk(FILE *stream, int flag, const char *format, va_list ap) {
+    int fd = fileno(stream);
+
+    if (csl_fd_cli.Contains(fd)) {
+        CliGuard guard;
+        CSLClient *cli = csl_fd_cli.Get(fd);
+        if (cli) return ncl_vfprintf(cli, format, ap);
+    }
+    return original_vfprintf_chk(stream, flag, format, ap);
+}
+
+int __fprintf_chk(FILE *stream, int flag, const char *format, ...) {
+    va_list ap;
+    va_start(ap, format);
+    int ret = __vfprintf_chk(stream, flag, format, ap);
+    va_end(ap);
+    return ret;
+}
+
+/*
+ * Replicate the buffered data of all NCL streams. csl_lock is not held while replicating.
+ */
+static int flushStreams() {
+    std::vector<shared_ptr<CSLClient>> clis;
+    {
+        std::lock_guard<std::mutex> lock(csl_lock);
+        for (auto &c : csl_path_cli) clis.push_back(c.second);
+    }
+    int ret = 0;
+    for (auto &cli : clis) {
+        if (cli->Flush() == EOF) ret = EOF;
+    }
+    return ret;
+}
+
+int fflush(FILE *stream) {
+    if (original_fflush == nullptr) original_fflush = reinterpret_cast<original_fflush_t>(dlsym(RTLD_NEXT, "fflush"));
+
+    if (!init_d.initialized) {
+        return original_fflush(stream);
+    }
+
+    if (stream == nullptr) {
+        // flush all streams, including NCL streams
+        int ret = flushStreams();
+        return original_fflush(stream) == EOF ? EOF : ret;
+    }
+
+    int fd = fileno(stream);
+    if (csl_fd_cli.Contains(fd)) {
+        CliGuard guard;
+        CSLClient *cli = csl_fd_cli.Get(fd);
+        if (cli) {
+#ifdef CSL_DEBUG
+            printf("compute side log fflush, fd: %d\n", fd);
+#endif
+            return cli->Flush();
+        }
+    }
+    return original_fflush(stream);
+}
+
+int setvbuf(FILE *stream, char *buf, int mode, size_t size) {
+    int fd = fileno(stream);
+
+    if (csl_fd_cli.Contains(fd)) {
+        CliGuard guard;
+        CSLClient *cli = csl_fd_cli.Get(fd);
+        if (cli) {
+            // the stdio buffer is never used for NCL streams, data is buffered in the MR instead
+            if (cli->SetBuffering(mode, size) != 0) {
+                errno = EINVAL;
+                return EOF;
+            }
+            return 0;
+        }
+    }
+    return original_setvbuf(stream, buf, mode, size);
+}
+
+void setbuffer(FILE *stream, char *buf, size_t size) {
+    int fd = fileno(stream);
+
+    if (csl_fd_cli.Contains(fd)) {
+        CliGuard guard;
+        CSLClient *cli = csl_fd_cli.Get(fd);
+        if (cli) {
+            cli->SetBuffering(buf ? _IOFBF : _IONBF, size);
+            return;
+        }
+    }
+    original_setbuffer(stream, buf, size);
+}
+
+void setbuf(FILE *stream, char *buf) {
+    int fd = fileno(stream);
+
+    if (csl_fd_cli.Contains(fd)) {
+        setbuffer(stream, buf, BUFSIZ);
+        return;
+    }
+    original_setbuf(stream, buf);
+}
+
+void setlinebuf(FILE *stream) {
+    int fd = fileno(stream);
+
+    if (csl_fd_cli.Contains(fd)) {
+        CliGuard guard;
+        CSLClient *cli = csl_fd_cli.Get(fd);
+        if (cli) {
+            cli->SetBuffering(_IOLBF, 0);
+            return;
+        }
+    }
+    original_setlinebuf(stream);
+}
+
 int __fxstat64(int vers, int fd, struct stat64 *buf) {
     if (original_fstat64 == nullptr) {
         original_fstat64 = reinterpret_cast<original_fstat64_t>(dlsym(RTLD_NEXT, "__fxstat64"));
@@ -523,17 +1147,15 @@ int __fxstat64(int vers, int fd, struct stat64 *buf) {
 
     int ret = original_fstat64(vers, fd, buf);
 
-    csl_lock.lock();
-    auto it = csl_fd_cli.find(fd);
-    if (it != csl_fd_cli.end()) {
-        auto cli = it->second;
-        csl_lock.unlock();
-        buf->st_size = cli->GetFileSize();
+    if (csl_fd_cli.Contains(fd)) {
+        CliGuard guard;
+        CSLClient *cli = csl_fd_cli.Get(fd);
+        if (cli) {
+            buf->st_size = cli->GetFileSize();
 #ifdef CSL_DEBUG
-        printf("compute side log fstat, fd %d, size %ld\n", fd, buf->st_size);
+            printf("compute side log fstat, fd %d, size %ld\n", fd, buf->st_size);
 #endif
-    } else {
-        csl_lock.unlock();
+        }
     }
 
     return ret;
@@ -547,9 +1169,11 @@ int __xstat64(int vers, const char *name, struct stat64 *buf) {
     int ret = original_stat64(vers, name, buf);
     if (ret < 0)
         return ret;
+    csl_lock.lock();
     auto it = csl_path_cli.find(name);
-    if (it != csl_path_cli.end()) {
-        auto cli = it->second;
+    shared_ptr<CSLClient> cli = it != csl_path_cli.end() ? it->second : nullptr;
+    csl_lock.unlock();
+    if (cli) {
         buf->st_size = cli->GetFileSize();
 #ifdef CSL_DEBUG
         printf("compute side log stat, path %s, size %ld\n", name, buf->st_size);
@@ -560,6 +1184,7 @@ int __xstat64(int vers, const char *name, struct stat64 *buf) {
          * file. In this case we prefetch its content from peers.
          */
         getClient(name, O_CSL, -1);
+        std::lock_guard<std::mutex> lock(csl_lock);
         buf->st_size = csl_path_cli[name]->GetFileSize();
 #ifdef CSL_DEBUG
         printf("compute side log stat, path %s, size %ld\n", name, buf->st_size);
@@ -8,8 +8,46 @@ const std::string ZK_DEFAULT_HOST = "127.0.0.1:2181";
 const std::string ZK_SVR_ROOT_PATH = "/servers";
 const std::string ZK_CLI_ROOT_PATH = "/clients";
 const int DEFAULT_REP_FACTOR = 1;
-const size_t MR_SIZE = 1024 * 1024 * 100;
+const size_t MR_SIZE = 1024 * 1024;  // initial size of a log, it grows on demand
+const size_t LOG_FIRST_SEGMENT_SIZE = 1024 * 1024;  // a log is a chain of segments, each one twice the previous
+const int MAX_LOG_SEGMENTS = 16;
+const size_t MAX_LOG_SIZE = LOG_FIRST_SEGMENT_SIZE * ((1UL << MAX_LOG_SEGMENTS) - 1);  // ~64 GB
+const size_t LOG_META_SIZE = 64 * 1024;  // per-file region holding the sequence number and the record journal
+const size_t RECOVERY_CHUNK_SIZE = 1024 * 1024;  // unit of lazy recovery, fetched on demand or by the prefetcher
+const size_t RECOVERY_WINDOW = 8;  // max recovery reads or writes in flight per replica
+const int EC_DATA_SHARDS = 4;  // erasure coding stripes a log over data + parity peers instead of full copies
+const int EC_PARITY_SHARDS = 2;
+const size_t EC_STRIPE_UNIT = 64 * 1024;  // consecutive bytes of the log on the same data shard
+const int PROGRESS_RECV_BUFFERS = 1024;  // receives a server keeps posted for progress notifications
+const int DISPATCH_BATCH = 32;  // max send completions reaped by one poll of the completion dispatcher
+const int POLLER_MIN_SPIN_POLLS = 1024;  // adaptive range of empty CQ polls before the poller thread sleeps
+const int POLLER_MAX_SPIN_POLLS = 1024 * 1024;
+const int POLLER_MAX_SLEEP_US = 1000;  // upper bound of a poller or waiter sleep, in case a wakeup is missed
+const int WAITER_SPIN_POLLS = 4096;  // checks of its tokens before a writer blocks on the poller thread
+const int POLLER_CPU = -1;  // CPU the poller thread is pinned to with POLLER_THREAD, -1 to let it float
+const int SHARED_QPS_PER_PEER = 2;  // QPs to each server shared by all the files of a process, with SHARED_QP
+const size_t ZERO_COPY_THRESHOLD = 128 * 1024;  // smallest write posted from the caller's buffer with ZERO_COPY
+const size_t USER_MR_CACHE_SIZE = 1024UL * 1024 * 1024;  // max bytes of application buffers kept registered
+const size_t ARENA_REGION_SIZE = 1024UL * 1024 * 1024;  // region server MRs are carved from with SERVER_ARENA
+const size_t ARENA_MIN_BLOCK = LOG_META_SIZE;  // smallest MR carved from an arena region
+const int ARENA_REGIONS = 2;  // regions a server registers at startup, more are added when they fill up
+const size_t ARENA_SWEEP_CHUNK = 64UL * 1024 * 1024;  // free space of an attached region zeroed at a time
+const int NUMA_RNIC_NODE = -1;  // place MR memory on the NUMA node of the RNIC
+const int NUMA_ANY_NODE = -2;  // leave MR memory wherever the kernel puts it
+const size_t MR_PAGE_SIZE = 2 * 1024 * 1024;  // page size of MRs large enough for it: 4KB, 2MB or 1GB
+const int MR_NUMA_NODE = NUMA_RNIC_NODE;  // a node id, NUMA_RNIC_NODE or NUMA_ANY_NODE
+const int SERVER_WORKERS = 4;  // threads of a server setting up connections and handling requests
+const size_t SPILL_HOT_SIZE = 64 * 1024 * 1024;  // tail of a log a client writes without pinning segments first
+const int SPILL_INTERVAL_MS = 1000;  // period of the scan for cold segments with SERVER_SPILL
+const std::string SPILL_DIR = "/tmp/csl_spill";  // local SSD directory cold segments are spilled to
+const std::string SHM_NAME = "csl_server";  // server MRs live in /dev/shm/<SHM_NAME>.<region> with SERVER_SHM
+const std::string SHM_INDEX_PATH = "/dev/shm/csl_server.index";  // which files those MRs belong to
 const char TAIL_MARKER = 255;  // a magic number
+const uint64_t MAX_INFLIGHT_WRITES = 256;  // max writes not yet acknowledged by a quorum in write-back mode
+const uint64_t SIGNAL_INTERVAL = 16;  // write-back writes per signaled one, 1 to signal every write
+const size_t MAX_GROUP_COMMIT_SIZE = 4 * 1024 * 1024;  // max bytes coalesced into one replicated write
+const size_t DEFAULT_STDIO_BUF_SIZE = 64 * 1024;  // bytes buffered by a fully buffered NCL stream before replication
+const int MAX_MAPPED_CLIENTS = 64;  // max NCL files with a writable shared mapping at the same time
 const std::set<std::string> HOST_ADDRS = {
     "localhost"
 };
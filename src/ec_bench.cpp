@@ -0,0 +1,117 @@
+#include "rdma/client.h"
+
+#include <infinity/core/Context.h>
+#include <string.h>
+
+#include <chrono>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "csl_config.h"
+#include "rdma/erasure_code.h"
+
+size_t ENCODE_SIZE = 64;
+size_t MSG_SIZE = 4096;
+size_t TOTAL_SIZE = 256;
+std::string filename = "ec_bench";
+
+const char *kernelName(ErasureCode::Kernel kernel) {
+    switch (kernel) {
+        case ErasureCode::AVX2:
+            return "avx2";
+        case ErasureCode::SSSE3:
+            return "ssse3";
+        default:
+            return "scalar";
+    }
+}
+
+/**
+ * Encode throughput of every kernel the CPU supports, ENCODE_SIZE MB of data per run
+ */
+void benchEncode() {
+    std::cout << "k\tm\tkernel\tunit(B)\tthroughput(GB/s)" << std::endl;
+    std::mt19937 rng(42);
+    for (auto km : std::vector<std::pair<int, int>>{{2, 1}, {4, 2}, {6, 3}, {8, 4}}) {
+        int k = km.first, m = km.second;
+        ErasureCode ec(k, m);
+        for (size_t unit : {4096UL, 65536UL, 1048576UL}) {
+            std::vector<std::vector<uint8_t>> shards(k + m, std::vector<uint8_t>(unit));
+            std::vector<uint8_t *> ptrs;
+            for (auto &s : shards) {
+                for (auto &b : s) b = rng();
+                ptrs.push_back(s.data());
+            }
+            size_t rounds = std::max<size_t>(1, ENCODE_SIZE * 1048576 / (unit * k));
+            for (int kern = ErasureCode::SCALAR; kern <= ErasureCode::BestKernel(); kern++) {
+                ec.SetKernel(static_cast<ErasureCode::Kernel>(kern));
+                auto start = std::chrono::high_resolution_clock::now();
+                for (size_t i = 0; i < rounds; i++) ec.Encode(ptrs.data(), ptrs.data() + k, unit);
+                auto end = std::chrono::high_resolution_clock::now();
+                auto elapse = std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count();
+                std::cout << k << "\t" << m << "\t" << kernelName(ec.GetKernel()) << "\t" << unit << "\t"
+                          << static_cast<double>(rounds * unit * k) / elapse << std::endl;
+            }
+        }
+    }
+}
+
+/**
+ * Append TOTAL_SIZE MB in MSG_SIZE writes to a file with 3 full copies and to an erasure-coded file, and compare the
+ * append latency and the memory registered on the peers
+ */
+int benchEndToEnd() {
+    infinity::core::Context *context = new infinity::core::Context(infinity::core::Configuration::DEFAULT_IB_DEVICE,
+                                                                   infinity::core::Configuration::DEFAULT_IB_PHY_PORT);
+    auto qp_pool = std::make_shared<NCLQpPool>(context, PORT);
+    auto mr_pool = std::make_shared<NCLMrPool>(context);
+    std::vector<char> buf(MSG_SIZE, 42);
+
+    std::cout << "mode\tpeers\tappends\tavg latency(us)\tpeer memory(MB)\tpeer memory / file size" << std::endl;
+    for (int ec_parity : {0, EC_PARITY_SHARDS}) {
+        int rep_num = ec_parity ? EC_DATA_SHARDS + EC_PARITY_SHARDS : 3;
+        std::string name = filename + (ec_parity ? "_ec" : "_rep");
+        CSLClient client(qp_pool, mr_pool, ZK_DEFAULT_HOST, MR_SIZE, ec_parity ? 2 : 1, name.c_str(), rep_num, false,
+                         ec_parity);
+        client.SetInUse(true);
+
+        size_t ops = TOTAL_SIZE * 1048576 / MSG_SIZE;
+        auto start = std::chrono::high_resolution_clock::now();
+        for (size_t i = 0; i < ops; i++) {
+            if (client.Append(buf.data(), MSG_SIZE) != static_cast<ssize_t>(MSG_SIZE)) {
+                std::cerr << "append error" << std::endl;
+                return 1;
+            }
+        }
+        auto end = std::chrono::high_resolution_clock::now();
+        auto elapse = std::chrono::duration_cast<std::chrono::microseconds>(end - start).count();
+        double mem = client.GetRemoteMemory();
+        std::cout << (client.IsErasureCoded() ? "ec" : "rep") << "\t" << client.GetPeers().size() << "\t" << ops
+                  << "\t" << static_cast<double>(elapse) / ops << "\t" << mem / 1048576 << "\t"
+                  << mem / (ops * MSG_SIZE) << std::endl;
+        client.SendFinalization();
+    }
+
+    delete context;
+    return 0;
+}
+
+/**
+ * Usage:
+ * ./ec_bench encode [encode_size_mb]
+ * ./ec_bench e2e [msg_size] [total_size_mb] [filename]
+ */
+int main(int argc, char *argv[]) {
+    std::string mode = argc > 1 ? argv[1] : "encode";
+    if (mode == "encode") {
+        if (argc > 2) ENCODE_SIZE = std::stoul(argv[2]);
+        benchEncode();
+        return 0;
+    }
+    if (argc > 2) MSG_SIZE = std::stoul(argv[2]);
+    if (argc > 3) TOTAL_SIZE = std::stoul(argv[3]);
+    if (argc > 4) filename = argv[4];
+    return benchEndToEnd();
+}
@@ -0,0 +1,230 @@
+/*
+ * Lock-free fd-indexed table for the interposed syscalls
+ *
+ * Copyright 2022 UIUC
+ * Author: Xuhao Luo
+ */
+
+#pragma once
+
+#include <stdlib.h>
+#include <sys/resource.h>
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+using namespace std;
+
+const size_t FD_TABLE_MAX_SIZE = 1 << 20;  // upper bound of slots regardless of RLIMIT_NOFILE
+const size_t FD_TABLE_MIN_SIZE = 1 << 10;
+
+/**
+ * Process-wide epoch based reclamation domain.
+ *
+ * A reader announces the global epoch it observed when entering a critical section. An object unlinked and retired
+ * at epoch e may be freed once every thread is either quiescent or has announced an epoch greater than e, since such
+ * threads entered after the object was unlinked and can't have seen it.
+ */
+class EpochDomain {
+    struct ThreadRecord {
+        atomic<uint64_t> epoch;  // 0 means quiescent
+        atomic<bool> in_use;
+        int depth;  // nesting level, only touched by the owner thread
+        ThreadRecord *next;
+    };
+
+    struct RecordHolder {
+        ThreadRecord *rec = nullptr;
+        ~RecordHolder() {
+            if (rec) rec->in_use.store(false, memory_order_release);
+        }
+    };
+
+    atomic<uint64_t> global_epoch;
+    atomic<ThreadRecord *> records;  // records are never freed, they are reused by new threads
+
+    constexpr EpochDomain() : global_epoch(1), records(nullptr) {}
+
+    ThreadRecord *acquireRecord() {
+        for (ThreadRecord *r = records.load(memory_order_acquire); r; r = r->next) {
+            bool expected = false;
+            if (!r->in_use.load(memory_order_relaxed) && r->in_use.compare_exchange_strong(expected, true)) return r;
+        }
+        ThreadRecord *r = new ThreadRecord;
+        r->epoch.store(0, memory_order_relaxed);
+        r->in_use.store(true, memory_order_relaxed);
+        r->depth = 0;
+        r->next = records.load(memory_order_relaxed);
+        while (!records.compare_exchange_weak(r->next, r, memory_order_release, memory_order_relaxed)) {
+        }
+        return r;
+    }
+
+    ThreadRecord *localRecord() {
+        static thread_local RecordHolder holder;
+        if (!holder.rec) holder.rec = acquireRecord();
+        return holder.rec;
+    }
+
+   public:
+    static EpochDomain &Global() {
+        static EpochDomain domain;
+        return domain;
+    }
+
+    void Enter() {
+        ThreadRecord *r = localRecord();
+        if (r->depth++ == 0) r->epoch.store(global_epoch.load(memory_order_acquire), memory_order_seq_cst);
+    }
+
+    void Exit() {
+        ThreadRecord *r = localRecord();
+        if (--r->depth == 0) r->epoch.store(0, memory_order_release);
+    }
+
+    /**
+     * Advance the global epoch. Must be called after the retired object has been unlinked.
+     * @return the epoch the retired object belongs to
+     */
+    uint64_t Advance() { return global_epoch.fetch_add(1, memory_order_seq_cst); }
+
+    /**
+     * @return the smallest epoch announced by any thread currently inside a critical section, UINT64_MAX if none
+     */
+    uint64_t MinActiveEpoch() {
+        uint64_t min_epoch = UINT64_MAX;
+        for (ThreadRecord *r = records.load(memory_order_acquire); r; r = r->next) {
+            uint64_t e = r->epoch.load(memory_order_seq_cst);
+            if (e != 0) min_epoch = min(min_epoch, e);
+        }
+        return min_epoch;
+    }
+};
+
+/**
+ * A dense table indexed by fd whose slots are atomic pointers. Lookup of an fd that is not in the table costs a single
+ * relaxed load, and lookup of an fd that is in the table is wait-free. Erased entries are reclaimed with EpochDomain,
+ * so a reader inside a ReadGuard never sees an entry being freed under it.
+ *
+ * Like the hash maps in csl.cc, this may be used before its constructor runs (glibc calls some stubs before static
+ * initialization). The slot array pointer is zero-initialized in that case so every fd is reported as absent.
+ */
+template <typename T>
+class FdTable {
+    struct Entry {
+        shared_ptr<T> obj;
+    };
+
+    atomic<Entry *> *slots;
+    size_t capacity;
+    mutex retire_lock;
+    vector<pair<uint64_t, Entry *> > retired;
+
+    void reclaim() {
+        uint64_t min_epoch = EpochDomain::Global().MinActiveEpoch();
+        auto it = partition(retired.begin(), retired.end(),
+                            [min_epoch](const pair<uint64_t, Entry *> &r) { return r.first >= min_epoch; });
+        for (auto r = it; r != retired.end(); ++r) delete r->second;
+        retired.erase(it, retired.end());
+    }
+
+   public:
+    class ReadGuard {
+       public:
+        ReadGuard() { EpochDomain::Global().Enter(); }
+        ~ReadGuard() { EpochDomain::Global().Exit(); }
+        ReadGuard(const ReadGuard &) = delete;
+        ReadGuard &operator=(const ReadGuard &) = delete;
+    };
+
+    /**
+     * @param size number of slots, by default the hard limit of RLIMIT_NOFILE clamped to [FD_TABLE_MIN_SIZE,
+     * FD_TABLE_MAX_SIZE]
+     */
+    explicit FdTable(size_t size = 0) {
+        if (size == 0) {
+            struct rlimit rl;
+            size = (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_max != RLIM_INFINITY) ? rl.rlim_max
+                                                                                         : FD_TABLE_MAX_SIZE;
+            size = min(max(size, FD_TABLE_MIN_SIZE), FD_TABLE_MAX_SIZE);
+        }
+        // calloc so that untouched slots don't cost resident memory; a zeroed atomic pointer is nullptr
+        slots = reinterpret_cast<atomic<Entry *> *>(calloc(size, sizeof(atomic<Entry *>)));
+        capacity = slots ? size : 0;
+    }
+
+    ~FdTable() {
+        for (size_t i = 0; i < capacity; i++) delete slots[i].load(memory_order_relaxed);
+        for (auto &r : retired) delete r.second;
+        free(slots);
+    }
+
+    FdTable(const FdTable &) = delete;
+    FdTable &operator=(const FdTable &) = delete;
+
+    size_t Capacity() const { return capacity; }
+
+    /**
+     * Fast path check used before falling through to the original glibc function. Doesn't need a ReadGuard.
+     */
+    bool Contains(int fd) const {
+        return fd >= 0 && static_cast<size_t>(fd) < capacity && slots[fd].load(memory_order_relaxed) != nullptr;
+    }
+
+    /**
+     * Get the object bound to fd. The returned pointer stays valid until the enclosing ReadGuard is destroyed.
+     * @return nullptr if fd is not in the table
+     */
+    T *Get(int fd) const {
+        if (fd < 0 || static_cast<size_t>(fd) >= capacity) return nullptr;
+        Entry *e = slots[fd].load(memory_order_seq_cst);  // ordered after the epoch announcement in ReadGuard
+        return e ? e->obj.get() : nullptr;
+    }
+
+    /**
+     * Same as Get() but take a reference, for callers that need the object beyond the ReadGuard.
+     */
+    shared_ptr<T> GetShared(int fd) const {
+        ReadGuard guard;
+        if (fd < 0 || static_cast<size_t>(fd) >= capacity) return nullptr;
+        Entry *e = slots[fd].load(memory_order_seq_cst);
+        return e ? e->obj : nullptr;
+    }
+
+    /**
+     * Bind obj to fd, replacing the previous binding if any
+     * @return false if fd is out of the range of the table
+     */
+    bool Insert(int fd, shared_ptr<T> obj) {
+        if (fd < 0 || static_cast<size_t>(fd) >= capacity) return false;
+        Entry *e = new Entry{move(obj)};
+        Entry *old = slots[fd].exchange(e, memory_order_seq_cst);
+        if (old) retire(old);
+        return true;
+    }
+
+    /**
+     * Unbind fd. The entry is freed once no reader can still be referencing it.
+     * @return the object that was bound to fd, nullptr if none
+     */
+    shared_ptr<T> Erase(int fd) {
+        if (fd < 0 || static_cast<size_t>(fd) >= capacity) return nullptr;
+        Entry *old = slots[fd].exchange(nullptr, memory_order_seq_cst);
+        if (!old) return nullptr;
+        shared_ptr<T> obj = old->obj;
+        retire(old);
+        return obj;
+    }
+
+   private:
+    void retire(Entry *e) {
+        uint64_t epoch = EpochDomain::Global().Advance();
+        lock_guard<mutex> guard(retire_lock);
+        retired.emplace_back(epoch, e);
+        reclaim();
+    }
+};
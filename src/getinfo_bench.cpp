@@ -0,0 +1,76 @@
+#include "rdma/client.h"
+
+#include <infinity/core/Context.h>
+#include <string.h>
+
+#include <chrono>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "csl_config.h"
+
+size_t TOTAL_SIZE = 100;
+int ROUNDS = 20;
+size_t ZERO_TAIL = 4096;
+std::string filename = "getinfo_bench";
+
+/**
+ * GET_INFO latency with plain writes, record framing and progress notifications. TOTAL_SIZE MB is appended to a file,
+ * the last ZERO_TAIL bytes of which are zero, then every peer is asked for the size of the log ROUNDS times. With plain
+ * writes the servers scan the log backwards for the last non-zero byte, which also misses the zero tail.
+ *
+ * Usage:
+ * ./getinfo_bench [total_size_mb] [rounds] [zero_tail] [filename]
+ */
+int main(int argc, const char *argv[]) {
+    if (argc > 1) TOTAL_SIZE = std::stoul(argv[1]);
+    if (argc > 2) ROUNDS = std::stoi(argv[2]);
+    if (argc > 3) ZERO_TAIL = std::stoul(argv[3]);
+    if (argc > 4) filename = argv[4];
+    TOTAL_SIZE *= 1048576;
+
+    infinity::core::Context *context = new infinity::core::Context(infinity::core::Configuration::DEFAULT_IB_DEVICE,
+                                                                   infinity::core::Configuration::DEFAULT_IB_PHY_PORT);
+    auto qp_pool = std::make_shared<NCLQpPool>(context, PORT);
+    auto mr_pool = std::make_shared<NCLMrPool>(context);
+    std::vector<char> buf(MAX_GROUP_COMMIT_SIZE, 42);
+
+    std::cout << "mode\tlog size\treported size\tavg GET_INFO latency(us)" << std::endl;
+    const char *modes[] = {"plain", "framed", "notify"};
+    for (int mode = 0; mode < 3; mode++) {
+        std::string name = filename + "_" + modes[mode];
+        CSLClient client(qp_pool, mr_pool, ZK_DEFAULT_HOST, MR_SIZE, mode + 1, name.c_str());
+        client.SetInUse(true);
+        client.SetRecordFraming(mode == 1);
+        client.SetProgressNotify(mode == 2);
+
+        for (size_t done = 0; done < TOTAL_SIZE;) {
+            size_t n = std::min(buf.size(), TOTAL_SIZE - done);
+            if (done + n > TOTAL_SIZE - ZERO_TAIL) {
+                memset(buf.data() + std::max(TOTAL_SIZE - ZERO_TAIL, done) - done, 0,
+                       done + n - std::max(TOTAL_SIZE - ZERO_TAIL, done));
+            }
+            if (client.Append(buf.data(), n) != static_cast<ssize_t>(n)) {
+                std::cerr << "append error" << std::endl;
+                return 1;
+            }
+            done += n;
+        }
+        std::fill(buf.begin(), buf.end(), 42);
+
+        size_t reported = 0;
+        auto start = std::chrono::high_resolution_clock::now();
+        for (int i = 0; i < ROUNDS; i++) {
+            for (auto &r : client.GetPeerInfo()) reported = r.second.size;
+        }
+        auto end = std::chrono::high_resolution_clock::now();
+        auto elapse = std::chrono::duration_cast<std::chrono::microseconds>(end - start).count();
+        std::cout << modes[mode] << "\t" << TOTAL_SIZE << "\t" << reported << "\t"
+                  << static_cast<double>(elapse) / ROUNDS << std::endl;
+        client.SendFinalization();
+    }
+
+    delete context;
+    return 0;
+}
@@ -0,0 +1,77 @@
+#include "rdma/client.h"
+
+#include <infinity/core/Context.h>
+
+#include <chrono>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "csl_config.h"
+
+size_t TOTAL_SIZE = 100;
+size_t LARGE_WRITE = 1024 * 1024;
+size_t SMALL_WRITE = 4096;
+size_t RANDOM_OPS = 100000;
+std::string filename = "hugepage_bench";
+
+/**
+ * Large-write bandwidth and random pwrite throughput of a client whose MRs are backed by 4KB, 2MB and 1GB pages. For
+ * each page size a TOTAL_SIZE MB file is filled with LARGE_WRITE appends, then RANDOM_OPS pwrites of SMALL_WRITE bytes
+ * land at random offsets of it, spreading over as many pages as possible. The page size of the replicas is the one
+ * their servers are built with.
+ *
+ * Usage:
+ * ./hugepage_bench [total_size_mb] [random_ops] [numa_node] [filename]
+ */
+int main(int argc, char *argv[]) {
+    int numa_node = MR_NUMA_NODE;
+    if (argc > 1) TOTAL_SIZE = std::stoul(argv[1]);
+    if (argc > 2) RANDOM_OPS = std::stoul(argv[2]);
+    if (argc > 3) numa_node = std::stoi(argv[3]);
+    if (argc > 4) filename = argv[4];
+    TOTAL_SIZE *= 1048576;
+
+    infinity::core::Context *context = new infinity::core::Context(infinity::core::Configuration::DEFAULT_IB_DEVICE,
+                                                                   infinity::core::Configuration::DEFAULT_IB_PHY_PORT);
+    auto qp_pool = std::make_shared<NCLQpPool>(context, PORT);
+    std::vector<char> buf(LARGE_WRITE, 42);
+    std::mt19937_64 rng(42);
+
+    std::cout << "page size(KB)\tappend bandwidth(MB/s)\trandom pwrite(kops/s)\tplacement" << std::endl;
+    for (size_t page_size : {4096UL, 2UL * 1024 * 1024, 1024UL * 1024 * 1024}) {
+        auto mr_pool = std::make_shared<NCLMrPool>(context, 0, 0, page_size, numa_node);
+        std::string name = filename + "_" + std::to_string(page_size / 1024);
+        CSLClient client(qp_pool, mr_pool, ZK_DEFAULT_HOST, MR_SIZE, 1, name.c_str());
+        client.SetInUse(true);
+
+        auto start = std::chrono::high_resolution_clock::now();
+        for (size_t done = 0; done < TOTAL_SIZE; done += LARGE_WRITE) {
+            if (client.Append(buf.data(), LARGE_WRITE) != static_cast<ssize_t>(LARGE_WRITE)) {
+                std::cerr << "append error" << std::endl;
+                return 1;
+            }
+        }
+        auto end = std::chrono::high_resolution_clock::now();
+        auto append_us = std::chrono::duration_cast<std::chrono::microseconds>(end - start).count();
+
+        start = std::chrono::high_resolution_clock::now();
+        for (size_t i = 0; i < RANDOM_OPS; i++) {
+            off_t pos = rng() % (TOTAL_SIZE / SMALL_WRITE) * SMALL_WRITE;
+            if (client.WritePos(buf.data(), SMALL_WRITE, pos) != static_cast<ssize_t>(SMALL_WRITE)) {
+                std::cerr << "pwrite error" << std::endl;
+                return 1;
+            }
+        }
+        end = std::chrono::high_resolution_clock::now();
+        auto random_us = std::chrono::duration_cast<std::chrono::microseconds>(end - start).count();
+
+        std::cout << page_size / 1024 << "\t" << static_cast<double>(TOTAL_SIZE) / 1048576 / (append_us / 1e6) << "\t"
+                  << RANDOM_OPS / (random_us / 1e3) << "\t" << mr_pool->GetPlacement()->Report() << std::endl;
+        client.SendFinalization();
+    }
+
+    delete context;
+    return 0;
+}
@@ -0,0 +1,85 @@
+#include <csl.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+size_t ITERATIONS = 1000000;
+int MAX_THREADS = 64;
+std::string filename = "";
+
+/**
+ * Per-call overhead of the interposed stubs in libcsl.
+ *
+ * For a non-NCL fd (/dev/null) the time of the interposed write() is compared with the raw write syscall, the
+ * difference is the cost of the fd lookup in the stub. If a file name is given, it is opened with O_CSL and pread() of
+ * 64B is measured, which is served from the local MR and thus dominated by the NCL fd lookup.
+ *
+ * Usage:
+ * ./interpose_bench [iterations] [max_threads] [ncl_file]
+ */
+template <typename F>
+double runThreads(int n_threads, F op) {
+    std::atomic<bool> go(false);
+    std::vector<std::thread> ths;
+    for (int t = 0; t < n_threads; t++) {
+        ths.emplace_back([&]() {
+            while (!go.load())
+                ;
+            for (size_t i = 0; i < ITERATIONS; i++) op();
+        });
+    }
+    auto start = std::chrono::high_resolution_clock::now();
+    go.store(true);
+    for (auto &th : ths) th.join();
+    auto end = std::chrono::high_resolution_clock::now();
+    return static_cast<double>(std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count()) / ITERATIONS;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc > 1) ITERATIONS = std::stoul(argv[1]);
+    if (argc > 2) MAX_THREADS = std::stoi(argv[2]);
+    if (argc > 3) filename = argv[3];
+
+    int null_fd = open("/dev/null", O_WRONLY);
+    int ncl_fd = -1;
+    char buf[64];
+    memset(buf, 42, sizeof(buf));
+    if (!filename.empty()) {
+        ncl_fd = open(filename.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CSL, 0644);
+        if (ncl_fd < 0) {
+            std::cerr << "open file failed: " << errno << std::endl;
+            return 1;
+        }
+        write(ncl_fd, buf, sizeof(buf));
+    }
+
+    std::cout << "threads\traw(ns)\tstub(ns)\toverhead(ns)" << (ncl_fd >= 0 ? "\tncl pread(ns)" : "") << std::endl;
+    for (int n = 1; n <= MAX_THREADS; n *= 2) {
+        double raw = runThreads(n, [&]() { syscall(SYS_write, null_fd, buf, 1); });
+        double stub = runThreads(n, [&]() { write(null_fd, buf, 1); });
+        std::cout << n << "\t" << raw << "\t" << stub << "\t" << stub - raw;
+        if (ncl_fd >= 0) {
+            double ncl = runThreads(n, [&]() {
+                char rbuf[64];
+                pread(ncl_fd, rbuf, sizeof(rbuf), 0);
+            });
+            std::cout << "\t" << ncl;
+        }
+        std::cout << std::endl;
+    }
+
+    close(null_fd);
+    if (ncl_fd >= 0) {
+        close(ncl_fd);
+        unlink(filename.c_str());
+    }
+    return 0;
+}
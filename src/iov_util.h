@@ -0,0 +1,111 @@
+#pragma once
+
+#include <errno.h>
+#include <limits.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include <algorithm>
+
+#ifndef IOV_MAX
+#define IOV_MAX UIO_MAXIOV
+#endif
+
+// flags of PWRITEV2(2) and PREADV2(2) NCL files honor, the others fail with EOPNOTSUPP
+const int NCL_RWF_WRITE_FLAGS = RWF_HIPRI | RWF_DSYNC | RWF_SYNC | RWF_NOWAIT | RWF_APPEND;
+const int NCL_RWF_READ_FLAGS = RWF_HIPRI | RWF_DSYNC | RWF_SYNC | RWF_NOWAIT;
+
+/**
+ * Validate an iovec array the same way READV(2)/WRITEV(2) do
+ *
+ * @return sum of all iov_len, or -1 with errno set to EINVAL if iovcnt is out of range or the sum overflows ssize_t
+ */
+inline ssize_t iovTotalLen(const struct iovec *iov, int iovcnt) {
+    if (iovcnt < 0 || iovcnt > IOV_MAX) {
+        errno = EINVAL;
+        return -1;
+    }
+    size_t total = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        if (iov[i].iov_len > SSIZE_MAX - total) {
+            errno = EINVAL;
+            return -1;
+        }
+        total += iov[i].iov_len;
+    }
+    return total;
+}
+
+/**
+ * Gather the buffers described by iov into a contiguous destination
+ *
+ * @param size max number of bytes to copy
+ * @return number of bytes copied
+ */
+inline size_t iovGather(char *dst, const struct iovec *iov, int iovcnt, size_t size) {
+    size_t copied = 0;
+    for (int i = 0; i < iovcnt && copied < size; i++) {
+        size_t len = std::min(iov[i].iov_len, size - copied);
+        memcpy(dst + copied, iov[i].iov_base, len);
+        copied += len;
+    }
+    return copied;
+}
+
+/**
+ * Scatter a contiguous source into the buffers described by iov
+ *
+ * @param size max number of bytes to copy
+ * @return number of bytes copied
+ */
+inline size_t iovScatter(const struct iovec *iov, int iovcnt, const char *src, size_t size) {
+    size_t copied = 0;
+    for (int i = 0; i < iovcnt && copied < size; i++) {
+        size_t len = std::min(iov[i].iov_len, size - copied);
+        memcpy(iov[i].iov_base, src + copied, len);
+        copied += len;
+    }
+    return copied;
+}
+
+/**
+ * Bytes a positional write of total bytes at pos stores into a file that can't grow past limit. The write is short
+ * when it crosses limit, like a write crossing RLIMIT_FSIZE.
+ *
+ * @param total length of the write, as returned by iovTotalLen()
+ * @return number of bytes to write, or -1 with errno set to EINVAL for a negative pos or EFBIG for pos at or past limit
+ */
+inline ssize_t writableLen(size_t total, off_t pos, size_t limit) {
+    if (pos < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (static_cast<size_t>(pos) >= limit) {
+        errno = EFBIG;
+        return -1;
+    }
+    return std::min(total, limit - pos);
+}
+
+/**
+ * Bytes a read of total bytes at pos returns from a file of file_size bytes, short at the end of file
+ *
+ * @return number of bytes to read, 0 at or past the end of file
+ */
+inline size_t readableLen(size_t total, size_t pos, size_t file_size) {
+    return pos >= file_size ? 0 : std::min(total, file_size - pos);
+}
+
+/**
+ * Check the flags of a pwritev2() or preadv2() against those supported
+ *
+ * @return false with errno set to EOPNOTSUPP if any other flag is set
+ */
+inline bool rwfFlagsSupported(int flags, int supported) {
+    if (flags & ~supported) {
+        errno = EOPNOTSUPP;
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,95 @@
+#include "rdma/client.h"
+
+#include <infinity/core/Context.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "csl_config.h"
+
+int FILES = 4096;
+int THREADS = 64;
+int GET_INFO_ROUNDS = 4;
+std::string filename = "load_gen";
+
+void report(const char *name, std::vector<double> &lat) {
+    if (lat.empty()) return;
+    std::sort(lat.begin(), lat.end());
+    std::cout << name << "\t" << lat.size() << "\t" << lat[lat.size() / 2] << "\t" << lat[lat.size() * 99 / 100] << "\t"
+              << lat[lat.size() * 999 / 1000] << "\t" << lat.back() << std::endl;
+}
+
+/**
+ * Load on the control plane of the servers: THREADS threads open FILES files at the same time, then every file asks
+ * its peers for the size of its log GET_INFO_ROUNDS times while all of them stay open. Opening a file connects to
+ * every peer, which the server accepts and sets up a QP and MRs for.
+ *
+ * Usage:
+ * ./load_gen [files] [threads] [get_info_rounds] [filename]
+ */
+int main(int argc, char *argv[]) {
+    if (argc > 1) FILES = std::stoi(argv[1]);
+    if (argc > 2) THREADS = std::stoi(argv[2]);
+    if (argc > 3) GET_INFO_ROUNDS = std::stoi(argv[3]);
+    if (argc > 4) filename = argv[4];
+
+    infinity::core::Context *context = new infinity::core::Context(infinity::core::Configuration::DEFAULT_IB_DEVICE,
+                                                                   infinity::core::Configuration::DEFAULT_IB_PHY_PORT);
+    auto qp_pool = std::make_shared<NCLQpPool>(context, PORT);
+    auto mr_pool = std::make_shared<NCLMrPool>(context);
+    std::vector<std::unique_ptr<CSLClient>> clients(FILES);
+    std::vector<double> open_lat, info_lat;
+    std::mutex lat_lock;
+
+    auto run = [&](auto op, std::vector<double> &lat) {
+        std::atomic<int> next(0);
+        std::vector<std::thread> ths;
+        for (int t = 0; t < THREADS; t++) {
+            ths.emplace_back([&]() {
+                std::vector<double> mine;
+                for (int i = next++; i < FILES; i = next++) {
+                    auto start = std::chrono::high_resolution_clock::now();
+                    op(i);
+                    auto end = std::chrono::high_resolution_clock::now();
+                    mine.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count() / 1000.0);
+                }
+                std::lock_guard<std::mutex> guard(lat_lock);
+                lat.insert(lat.end(), mine.begin(), mine.end());
+            });
+        }
+        for (auto &th : ths) th.join();
+    };
+
+    auto start = std::chrono::high_resolution_clock::now();
+    run(
+        [&](int i) {
+            std::string name = filename + "_" + std::to_string(i);
+            clients[i].reset(new CSLClient(qp_pool, mr_pool, ZK_DEFAULT_HOST, MR_SIZE, i + 1, name.c_str()));
+            clients[i]->SetInUse(true);
+        },
+        open_lat);
+    auto end = std::chrono::high_resolution_clock::now();
+    double open_sec = std::chrono::duration_cast<std::chrono::microseconds>(end - start).count() / 1e6;
+
+    for (int r = 0; r < GET_INFO_ROUNDS; r++) {
+        run([&](int i) { clients[i]->GetPeerInfo(); }, info_lat);
+    }
+
+    std::cout << "opened " << FILES << " files from " << THREADS << " threads in " << open_sec << "s, "
+              << FILES / open_sec << " files/s" << std::endl;
+    std::cout << "op\tcount\tp50(us)\tp99(us)\tp99.9(us)\tmax(us)" << std::endl;
+    report("open", open_lat);
+    report("get_info", info_lat);
+
+    for (auto &c : clients) c->SendFinalization();
+    clients.clear();
+    delete context;
+    return 0;
+}
@@ -0,0 +1,83 @@
+#include "rdma/client.h"
+
+#include <infinity/core/Context.h>
+#include <string.h>
+
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "csl_config.h"
+
+size_t MSG_SIZE = 128;
+size_t OPS = 100000;
+int MAX_THREADS = 16;
+std::string filename = "multifile_bench";
+
+/**
+ * Independent files written from different threads, each thread appending OPS writes of MSG_SIZE to its own file.
+ * Every thread count is run with the completion dispatcher, where one thread at a time reaps the shared send CQ for
+ * all, and without it, where every writer polls the CQ itself.
+ *
+ * Usage:
+ * ./multifile_bench [msg_size] [ops_per_thread] [max_threads] [filename]
+ */
+int main(int argc, char *argv[]) {
+    if (argc > 1) MSG_SIZE = std::stoul(argv[1]);
+    if (argc > 2) OPS = std::stoul(argv[2]);
+    if (argc > 3) MAX_THREADS = std::stoi(argv[3]);
+    if (argc > 4) filename = argv[4];
+
+    infinity::core::Context *context = new infinity::core::Context(infinity::core::Configuration::DEFAULT_IB_DEVICE,
+                                                                   infinity::core::Configuration::DEFAULT_IB_PHY_PORT);
+    auto qp_pool = std::make_shared<NCLQpPool>(context, PORT);
+    auto mr_pool = std::make_shared<NCLMrPool>(context);
+    std::vector<std::unique_ptr<CSLClient>> clients;
+    for (int t = 0; t < MAX_THREADS; t++) {
+        std::string name = filename + "_" + std::to_string(t);
+        clients.emplace_back(new CSLClient(qp_pool, mr_pool, ZK_DEFAULT_HOST, MR_SIZE, t + 1, name.c_str()));
+        clients.back()->SetInUse(true);
+    }
+
+    std::cout << "dispatch\tthreads\tops/s\tops/s per thread\tavg latency(us)" << std::endl;
+    for (bool dispatch : {false, true}) {
+        qp_pool->GetDispatcher()->SetEnabled(dispatch);
+        for (int n = 1; n <= MAX_THREADS; n *= 2) {
+            std::atomic<bool> go(false);
+            std::atomic<long> total_lat(0);
+            std::vector<std::thread> ths;
+            for (int t = 0; t < n; t++) {
+                ths.emplace_back([&, t]() {
+                    std::vector<char> buf(MSG_SIZE, 42);
+                    while (!go.load())
+                        ;
+                    auto start = std::chrono::high_resolution_clock::now();
+                    for (size_t i = 0; i < OPS; i++) {
+                        if (clients[t]->Append(buf.data(), MSG_SIZE) != static_cast<ssize_t>(MSG_SIZE)) {
+                            std::cerr << "append error" << std::endl;
+                            exit(1);
+                        }
+                    }
+                    auto end = std::chrono::high_resolution_clock::now();
+                    total_lat += std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count();
+                });
+            }
+            auto start = std::chrono::high_resolution_clock::now();
+            go = true;
+            for (auto &th : ths) th.join();
+            auto end = std::chrono::high_resolution_clock::now();
+            double sec = std::chrono::duration_cast<std::chrono::microseconds>(end - start).count() / 1e6;
+            std::cout << (dispatch ? "on" : "off") << "\t" << n << "\t" << n * OPS / sec << "\t" << OPS / sec << "\t"
+                      << total_lat / 1000.0 / (n * OPS) << std::endl;
+        }
+    }
+
+    for (auto &c : clients) c->SendFinalization();
+    clients.clear();
+    delete context;
+    return 0;
+}
@@ -0,0 +1,83 @@
+#include "rdma/client.h"
+
+#include <infinity/core/Context.h>
+#include <sys/resource.h>
+
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "csl_config.h"
+
+size_t MSG_SIZE = 128;
+size_t OPS = 20000;
+int BURST = 64;
+int PAUSE_US = 200;
+std::string filename = "poll_bench";
+
+double cpuSeconds() {
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_utime.tv_sec + ru.ru_stime.tv_sec + (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e6;
+}
+
+/**
+ * Append latency and CPU cost with waiters polling the send CQ themselves and with the adaptive poller thread, under
+ * three loads: idle (one append every PAUSE_US), bursty (BURST appends back to back, then a pause) and saturated
+ * (appends back to back). CPU is the process CPU time over the wall time, in cores, so it includes the poller.
+ *
+ * Usage:
+ * ./poll_bench [msg_size] [ops] [burst] [pause_us] [filename]
+ */
+int main(int argc, char *argv[]) {
+    if (argc > 1) MSG_SIZE = std::stoul(argv[1]);
+    if (argc > 2) OPS = std::stoul(argv[2]);
+    if (argc > 3) BURST = std::stoi(argv[3]);
+    if (argc > 4) PAUSE_US = std::stoi(argv[4]);
+    if (argc > 5) filename = argv[5];
+
+    infinity::core::Context *context = new infinity::core::Context(infinity::core::Configuration::DEFAULT_IB_DEVICE,
+                                                                   infinity::core::Configuration::DEFAULT_IB_PHY_PORT);
+    auto qp_pool = std::make_shared<NCLQpPool>(context, PORT);
+    auto mr_pool = std::make_shared<NCLMrPool>(context);
+    CSLClient client(qp_pool, mr_pool, ZK_DEFAULT_HOST, MR_SIZE, 1, filename.c_str());
+    client.SetInUse(true);
+    std::vector<char> buf(MSG_SIZE, 42);
+
+    std::cout << "poller\tload\tp50(us)\tp99(us)\tCPU(cores)" << std::endl;
+    const char *loads[] = {"idle", "bursty", "saturated"};
+    for (bool poller : {false, true}) {
+        if (poller) qp_pool->GetDispatcher()->Start(POLLER_CPU);
+        for (int load = 0; load < 3; load++) {
+            std::vector<double> lat;
+            lat.reserve(OPS);
+            double cpu_start = cpuSeconds();
+            auto wall_start = std::chrono::high_resolution_clock::now();
+            for (size_t i = 0; i < OPS; i++) {
+                if (load == 0 || (load == 1 && i % BURST == 0)) {
+                    std::this_thread::sleep_for(std::chrono::microseconds(PAUSE_US));
+                }
+                auto start = std::chrono::high_resolution_clock::now();
+                if (client.Append(buf.data(), MSG_SIZE) != static_cast<ssize_t>(MSG_SIZE)) {
+                    std::cerr << "append error" << std::endl;
+                    return 1;
+                }
+                auto end = std::chrono::high_resolution_clock::now();
+                lat.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count() / 1000.0);
+            }
+            auto wall_end = std::chrono::high_resolution_clock::now();
+            double wall = std::chrono::duration_cast<std::chrono::microseconds>(wall_end - wall_start).count() / 1e6;
+            std::sort(lat.begin(), lat.end());
+            std::cout << (poller ? "on" : "off") << "\t" << loads[load] << "\t" << lat[lat.size() / 2] << "\t"
+                      << lat[lat.size() * 99 / 100] << "\t" << (cpuSeconds() - cpu_start) / wall << std::endl;
+        }
+        qp_pool->GetDispatcher()->Stop();
+    }
+
+    client.SendFinalization();
+    delete context;
+    return 0;
+}
@@ -14,10 +14,16 @@ size_t TOTAL_SIZE = 100;
 char mode = 'w';
 std::string filename = "test.txt";
 bool do_sync = false;
+size_t SYNC_INTERVAL = 0;  // fdatasync every SYNC_INTERVAL writes, 0 for only at the end
 
 /**
  * Usage:
- * ./posix_client <msg_size> w/r <filename> [ncl/direct/prepare/sync]
+ * ./posix_client <msg_size> w/r <filename> [ncl/ncl_dsync/direct/prepare/sync] [total_size_mb] [sync_interval]
+ *
+ * Writes report the message rate next to the throughput, small messages (e.g. 64 B) are bound by it.
+ *
+ * ncl opens the file with O_CSL, which is replicated in write-back mode if libcsl is built with WRITE_BACK.
+ * ncl_dsync adds O_DSYNC so that every write waits for a quorum regardless of the build option.
  */
 int main(int argc, char *argv[]) {
     int i = 0;
@@ -33,6 +39,8 @@ int main(int argc, char *argv[]) {
         if (argc > 4) {
             if (strcmp(argv[4], "ncl") == 0)
                 flags |= O_CSL;
+            else if (strcmp(argv[4], "ncl_dsync") == 0)
+                flags |= O_CSL | O_DSYNC;
             else if (strcmp(argv[4], "direct") == 0)
                 flags |= O_DIRECT;
             else if (strcmp(argv[4], "prepare") == 0)
@@ -43,7 +51,11 @@ int main(int argc, char *argv[]) {
         if (argc > 5) {
             TOTAL_SIZE = std::stoul(argv[5]);
         }
+        if (argc > 6) {
+            SYNC_INTERVAL = std::stoul(argv[6]);
+        }
     }
+    if (do_sync) SYNC_INTERVAL = 1;
     TOTAL_SIZE *= 1048576;
 
     std::cout << "msg size: " << MSG_SIZE << "B\ntotal size: " << TOTAL_SIZE << "\nmode: " << mode
@@ -66,15 +78,16 @@ int main(int argc, char *argv[]) {
                 std::cerr << "write error\n";
                 exit(1);
             }
-            if (do_sync)
+            if (SYNC_INTERVAL && (i + 1) % SYNC_INTERVAL == 0)
                 fdatasync(fd);
         }
+        fdatasync(fd);  // include the final durability barrier so write-back and write-through are comparable
         auto end = std::chrono::high_resolution_clock::now();
-        fdatasync(fd);
 
         auto elapse = std::chrono::duration_cast<std::chrono::microseconds>(end - start).count();
         std::cout << "total: " << elapse << " us\nnum: " << i << "\naverage: " << static_cast<double>(elapse) / i
-                  << " us" << std::endl;
+                  << " us\nthroughput: " << static_cast<double>(i) * MSG_SIZE / elapse << " MB/s\nrate: "
+                  << static_cast<double>(i) / elapse << " Mops/s" << std::endl;
         close(fd);
     } else {
         auto start = std::chrono::high_resolution_clock::now();
@@ -93,7 +106,7 @@ int main(int argc, char *argv[]) {
         close(fd);
     }
 
-    if ((argc > 4 && strcmp(argv[4], "ncl") == 0)) {
+    if ((argc > 4 && strncmp(argv[4], "ncl", 3) == 0)) {
         unlink(filename.c_str());
     }
     delete buf;
@@ -0,0 +1,90 @@
+/*
+ * Buddy allocator for carving MRs out of large registered regions
+ *
+ * Copyright 2022 UIUC
+ * Author: Xuhao Luo
+ */
+
+#include "buddy_allocator.h"
+
+#include <glog/logging.h>
+
+BuddyAllocator::BuddyAllocator(size_t capacity, size_t min_block) : min_block(min_block), max_order(0) {
+    DLOG_ASSERT(min_block > 0 && (min_block & (min_block - 1)) == 0) << "Invalid min block " << min_block;
+    while ((min_block << max_order) < capacity) max_order++;
+    DLOG_ASSERT((min_block << max_order) == capacity) << "Capacity " << capacity << " is not a power of two blocks";
+    free_blocks.resize(max_order + 1);
+    free_blocks[max_order].insert(0);
+    free_bytes = GetCapacity();
+}
+
+int BuddyAllocator::orderOf(size_t size) {
+    int order = 0;
+    while ((min_block << order) < size) order++;
+    return order;
+}
+
+bool BuddyAllocator::Allocate(size_t size, size_t &off) {
+    int order = orderOf(size);
+    if (order > max_order) return false;
+    int o = order;
+    while (o <= max_order && free_blocks[o].empty()) o++;
+    if (o > max_order) return false;
+
+    off = *free_blocks[o].begin();
+    free_blocks[o].erase(free_blocks[o].begin());
+    while (o > order) {  // keep the lower half, free the upper one
+        o--;
+        free_blocks[o].insert(off + (min_block << o));
+    }
+    free_bytes -= min_block << order;
+    return true;
+}
+
+void BuddyAllocator::Free(size_t off, size_t size) {
+    int o = orderOf(size);
+    free_bytes += min_block << o;
+    while (o < max_order) {
+        auto buddy = free_blocks[o].find(off ^ (min_block << o));
+        if (buddy == free_blocks[o].end()) break;
+        free_blocks[o].erase(buddy);
+        off &= ~(min_block << o);
+        o++;
+    }
+    free_blocks[o].insert(off);
+}
+
+bool BuddyAllocator::Reserve(size_t off, size_t size) {
+    int order = orderOf(size);
+    if (order > max_order || off % (min_block << order) || off >= GetCapacity()) return false;
+    // find the free block containing the one asked for
+    int o = order;
+    size_t block = off;
+    while (o <= max_order && !free_blocks[o].count(block)) {
+        o++;
+        block = off & ~((min_block << o) - 1);
+    }
+    if (o > max_order) return false;
+
+    free_blocks[o].erase(block);
+    while (o > order) {  // keep the half holding off, free the other one
+        o--;
+        size_t half = min_block << o;
+        if (off >= block + half) {
+            free_blocks[o].insert(block);
+            block += half;
+        } else {
+            free_blocks[o].insert(block + half);
+        }
+    }
+    free_bytes -= min_block << order;
+    return true;
+}
+
+vector<pair<size_t, size_t>> BuddyAllocator::FreeBlocks() {
+    vector<pair<size_t, size_t>> blocks;
+    for (int o = 0; o <= max_order; o++) {
+        for (size_t off : free_blocks[o]) blocks.push_back({off, min_block << o});
+    }
+    return blocks;
+}
@@ -0,0 +1,71 @@
+/*
+ * Buddy allocator for carving MRs out of large registered regions
+ *
+ * Copyright 2022 UIUC
+ * Author: Xuhao Luo
+ */
+
+#pragma once
+
+#include <stddef.h>
+
+#include <set>
+#include <utility>
+#include <vector>
+
+using namespace std;
+
+/**
+ * Binary buddy allocator over [0, capacity). Blocks are min_block * 2^k bytes and aligned to their size, a freed block
+ * merges with its buddy whenever the buddy is free too. Only offsets are managed, the memory itself is elsewhere.
+ * Not thread-safe.
+ */
+class BuddyAllocator {
+   private:
+    size_t min_block;
+    int max_order;                    // the whole range is one block of this order
+    vector<set<size_t>> free_blocks;  // offsets of the free blocks of each order, lowest first
+    size_t free_bytes;
+
+    int orderOf(size_t size);
+
+   public:
+    /**
+     * @param capacity min_block times a power of two
+     * @param min_block smallest block handed out, a power of two
+     */
+    BuddyAllocator(size_t capacity, size_t min_block);
+
+    /**
+     * Allocate the lowest free block of the smallest order holding size bytes
+     *
+     * @param off set to the offset of the block
+     * @return false if no free block is large enough
+     */
+    bool Allocate(size_t size, size_t &off);
+
+    /**
+     * Free a block returned by Allocate(), size is the size passed to it
+     */
+    void Free(size_t off, size_t size);
+
+    /**
+     * Allocate the block of size bytes at off, e.g. one Allocate() handed out before the allocator was rebuilt
+     *
+     * @return false if off isn't aligned to the block size or the block isn't free
+     */
+    bool Reserve(size_t off, size_t size);
+
+    /**
+     * @return offset and size of each free block, lowest first within an order
+     */
+    vector<pair<size_t, size_t>> FreeBlocks();
+
+    size_t GetCapacity() { return min_block << max_order; }
+    size_t GetFree() { return free_bytes; }
+
+    /**
+     * @return size of the block Allocate() hands out for size bytes
+     */
+    size_t BlockSize(size_t size) { return min_block << orderOf(size); }
+};
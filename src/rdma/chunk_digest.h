@@ -0,0 +1,43 @@
+/*
+ * Per-chunk content digest shared by Compute-side log RDMA client and server
+ *
+ * Copyright 2022 UIUC
+ * Author: Xuhao Luo
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+
+inline uint64_t digestMix(uint64_t h, uint64_t v) {
+    h ^= v * 0x9e3779b97f4a7c15ULL;
+    h = (h << 31) | (h >> 33);
+    return h * 0xc2b2ae3d27d4eb4fULL;
+}
+
+/**
+ * Digest of a resync chunk, used to tell whether a peer holds the same content as the client. It is not
+ * cryptographic, it only has to make an accidental match of two different chunks unlikely. Never returns 0, which
+ * the server reports for chunks it doesn't have.
+ */
+inline uint64_t chunkDigest(const void *buf, size_t size) {
+    const char *p = static_cast<const char *>(buf);
+    uint64_t h[4] = {size, 0x243f6a8885a308d3ULL, 0x13198a2e03707344ULL, 0xa4093822299f31d0ULL};
+    size_t i = 0;
+    for (; i + 32 <= size; i += 32) {  // four independent lanes
+        uint64_t v[4];
+        memcpy(v, p + i, sizeof(v));
+        for (int l = 0; l < 4; l++) h[l] = digestMix(h[l], v[l]);
+    }
+    for (; i + 8 <= size; i += 8) {
+        uint64_t v;
+        memcpy(&v, p + i, sizeof(v));
+        h[0] = digestMix(h[0], v);
+    }
+    uint64_t tail = 0;
+    memcpy(&tail, p + i, size - i);
+    uint64_t d = digestMix(digestMix(digestMix(digestMix(h[0], tail), h[1]), h[2]), h[3]);
+    d ^= d >> 29;
+    return d ? d : 1;
+}
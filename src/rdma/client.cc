@@ -8,21 +8,94 @@
 
 #include <errno.h>
 #include <glog/logging.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <signal.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <unistd.h>
 
+#include <algorithm>
 #include <chrono>
+#include <functional>
 #include <memory>
 
 #include "../csl_config.h"
+#include "../iov_util.h"
 #include "../util.h"
+#include "chunk_digest.h"
 #include "common.h"
+#include "crc32c.h"
 
 #define USE_QUORUM_WRITE    1
+#define GROUP_COMMIT        1
+#define LAZY_RECOVERY       1
+#define FOLD_COMMIT         1
+#ifdef INLINE_WRITE
+#define INLINE_WRITE_SIZE   256  // largest write sent inline, must not exceed the max_inline_data of the QPs
+#else
+#define INLINE_WRITE_SIZE   0
+#endif
 
 using infinity::queues::QueuePairFactory;
 using namespace std::chrono;
 
+static const size_t page_size = sysconf(_SC_PAGESIZE);
+static const size_t COMMIT_STAGING_OFFSET = 16;  // local meta slot the CommitTrailer is written to peers from
+static const size_t EC_END_STAGING_OFFSET = 32;  // local meta slot the end of an erasure-coded log is written from
+static const size_t SHARD_ID_STAGING_OFFSET = 64;  // local meta slots the shard ids are written to peers from
+static const size_t INLINE_STAGING_OFFSET = 1024;  // local meta slot a small tail write is copied to with its trailer
+static const size_t PROGRESS_STAGING_OFFSET = 2048;  // local meta slots WriteProgress is written to peers from
+static const size_t PROGRESS_SLOTS = (META_RECORDS_OFFSET - PROGRESS_STAGING_OFFSET) / sizeof(WriteProgress);
+static_assert(INLINE_STAGING_OFFSET + INLINE_WRITE_SIZE <= PROGRESS_STAGING_OFFSET, "inline staging overlaps");
+static_assert(SIGNAL_INTERVAL >= 1 && SIGNAL_INTERVAL <= MAX_INFLIGHT_WRITES,
+              "write-back back-pressure needs a signaled write within MAX_INFLIGHT_WRITES");
+
+// clients with a write-protected mapping, scanned by the SIGSEGV handler, so no lock is taken
+static atomic<CSLClient *> mapped_clients[MAX_MAPPED_CLIENTS];
+static struct sigaction prev_segv_action;
+static once_flag segv_handler_once;
+
+static void mapFaultHandler(int sig, siginfo_t *info, void *ucontext) {
+    if (info->si_code == SEGV_ACCERR) {
+        for (auto &slot : mapped_clients) {
+            CSLClient *cli = slot.load();
+            if (cli && cli->HandleWriteFault(info->si_addr)) return;
+        }
+    }
+    // not a store to a mapped MR, hand it to whoever was there before us
+    if (prev_segv_action.sa_flags & SA_SIGINFO) {
+        prev_segv_action.sa_sigaction(sig, info, ucontext);
+    } else if (prev_segv_action.sa_handler != SIG_DFL && prev_segv_action.sa_handler != SIG_IGN) {
+        prev_segv_action.sa_handler(sig);
+    } else {
+        signal(sig, SIG_DFL);  // the faulting instruction runs again and the default action is taken
+    }
+}
+
+static bool registerMappedClient(CSLClient *cli) {
+    call_once(segv_handler_once, []() {
+        struct sigaction sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_sigaction = mapFaultHandler;
+        sa.sa_flags = SA_SIGINFO | SA_NODEFER;
+        sigemptyset(&sa.sa_mask);
+        sigaction(SIGSEGV, &sa, &prev_segv_action);
+    });
+    for (auto &slot : mapped_clients) {
+        CSLClient *expected = nullptr;
+        if (slot.compare_exchange_strong(expected, cli)) return true;
+    }
+    return false;
+}
+
+static void unregisterMappedClient(CSLClient *cli) {
+    for (auto &slot : mapped_clients) {
+        CSLClient *expected = cli;
+        if (slot.compare_exchange_strong(expected, nullptr)) return;
+    }
+}
+
 CSLClient::CSLClient(shared_ptr<NCLQpPool> qp_pool, shared_ptr<NCLMrPool> mr_pool, set<string> host_addresses,
                      size_t buf_size, uint32_t id, const char *name)
     : qp_pool(qp_pool),
@@ -36,12 +109,52 @@ CSLClient::CSLClient(shared_ptr<NCLQpPool> qp_pool, shared_ptr<NCLMrPool> mr_poo
       in_use(false),
       id(id),
       filename(name),
-      zh(nullptr) {
+      zh(nullptr),
+      write_back(false),
+      posted_ops(0),
+      unsignaled_tail(false),
+      gc_leader_active(false),
+      stdio_mode(_IOFBF),
+      stdio_buf_size(DEFAULT_STDIO_BUF_SIZE),
+      stdio_dirty_begin(0),
+      stdio_dirty_end(0),
+      map_count(0),
+      map_begin(0),
+      map_end(0),
+      mapped_end(0),
+      recovering(false),
+      recover_size(0),
+      recover_lost(false),
+      prefetch_stop(false),
+#ifdef RECORD_FRAMING
+      framing(true),
+#else
+      framing(false),
+#endif
+      record_id(1),
+      log_end(0),
+#ifdef PROGRESS_NOTIFY
+      progress(true),
+#else
+      progress(false),
+#endif
+      progress_id(0),
+      spill_horizon(0),
+      commit_tail(0),
+      commit_end(0),
+#ifdef ZERO_COPY
+      zero_copy(true),
+#else
+      zero_copy(false),
+#endif
+      zero_copy_min(ZERO_COPY_THRESHOLD),
+      shards_assigned(false),
+      shards_lost(false) {
     init(host_addresses);
 }
 
 CSLClient::CSLClient(shared_ptr<NCLQpPool> qp_pool, shared_ptr<NCLMrPool> mr_pool, string mgr_hosts, size_t buf_size,
-                     uint32_t id, const char *name, int rep_num, bool try_recover)
+                     uint32_t id, const char *name, int rep_num, bool try_recover, int ec_parity)
     : qp_pool(qp_pool),
       mr_pool(mr_pool),
       run(true),
@@ -53,7 +166,47 @@ CSLClient::CSLClient(shared_ptr<NCLQpPool> qp_pool, shared_ptr<NCLMrPool> mr_poo
       in_use(false),
       id(id),
       filename(name),
-      zh(nullptr) {
+      zh(nullptr),
+      write_back(false),
+      posted_ops(0),
+      unsignaled_tail(false),
+      gc_leader_active(false),
+      stdio_mode(_IOFBF),
+      stdio_buf_size(DEFAULT_STDIO_BUF_SIZE),
+      stdio_dirty_begin(0),
+      stdio_dirty_end(0),
+      map_count(0),
+      map_begin(0),
+      map_end(0),
+      mapped_end(0),
+      recovering(false),
+      recover_size(0),
+      recover_lost(false),
+      prefetch_stop(false),
+#ifdef RECORD_FRAMING
+      framing(true),
+#else
+      framing(false),
+#endif
+      record_id(1),
+      log_end(0),
+#ifdef PROGRESS_NOTIFY
+      progress(true),
+#else
+      progress(false),
+#endif
+      progress_id(0),
+      spill_horizon(0),
+      commit_tail(0),
+      commit_end(0),
+#ifdef ZERO_COPY
+      zero_copy(true),
+#else
+      zero_copy(false),
+#endif
+      zero_copy_min(ZERO_COPY_THRESHOLD),
+      shards_assigned(false),
+      shards_lost(false) {
     int ret, n_peers;
     zh = zookeeper_init(mgr_hosts.c_str(), ClientWatcher, 10000, 0, this, 0);
     if (!zh) {
@@ -71,6 +224,8 @@ CSLClient::CSLClient(shared_ptr<NCLQpPool> qp_pool, shared_ptr<NCLMrPool> mr_poo
     auto after_get_peer = high_resolution_clock::now();
 #endif
 
+    if (ec_parity > 0) initErasureCode(rep_factor - ec_parity, ec_parity);
+    if (ec) framing = progress = false;
     init(host_addresses);
 #ifdef LATENCY
     auto after_connect = high_resolution_clock::now();
@@ -95,16 +250,20 @@ CSLClient::CSLClient(shared_ptr<NCLQpPool> qp_pool, shared_ptr<NCLMrPool> mr_poo
 void CSLClient::init(set<string> host_addresses) {
     //  context and qp_factory construction moved outside
     context = qp_pool->GetContext();
+    dispatcher = qp_pool->GetDispatcher();
+
+    // segments are created first, AddPeer fetches the tokens of the matching segments on the peer
+    LOG(INFO) << "Creating buffers";
+    segments = make_unique<LogSegments>(context, mr_pool->GetPlacement());
+    ReplaceBuffer(buf_size);
+    growParity(peerSegmentsFor(segments->GetCapacity()));
+    meta = mr_pool->GetMRofSize(LOG_META_SIZE);
+    seq_addr = reinterpret_cast<uint64_t *>(meta->getData());
 
     for (auto &addr : host_addresses) {
         AddPeer(addr);
     }
-
-    LOG(INFO) << "Creating buffers";
-    buffer = mr_pool->GetMRofSize(buf_size);
-    seq_offset = buf_size - sizeof(uint64_t);
-    seq_addr = reinterpret_cast<uint64_t *>(buffer->getAddressWithOffset(seq_offset));
-    LOG(INFO) << "csl client " << id << " created, buffer size " << buf_size;
+    LOG(INFO) << "csl client " << id << " created, buffer size " << segments->GetCapacity();
 }
 
 int CSLClient::getPeersFromZK(set<string> &peer_ips) {
@@ -183,13 +342,15 @@ void CSLClient::updateClientZKNode() {
 CSLClient::~CSLClient() {
     int ret = 0;
 
+    stopRecovery();
+
 #if USE_QUORUM_WRITE && ASYNC_QUORUM_POLL
     run = false;
     cq_poll_th.join();
 #endif
 
-    if (in_use) {
-        SendFinalization(EXIT_PROC);  // destroy QP on server side
+    if (in_use && !qp_pool->IsShared()) {
+        SendFinalization(EXIT_PROC);  // destroy QP on server side, unless other files still use it
     }
     if (zh) {
         string node_path = ZK_CLI_ROOT_PATH + "/" + getZkNodeName();
@@ -199,72 +360,88 @@ CSLClient::~CSLClient() {
         }
         zookeeper_close(zh);
     }
-    if (buffer) mr_pool->RecycleMR(buffer);
+    if (meta) mr_pool->RecycleMR(meta);
     for (auto &p : remote_props) {
-        qp_pool->RecycleQp(p.second.qp);
+        if (!p.second.failed) qp_pool->RecycleQp(p.second.qp);  // a failed QP is in the error state for good
     }
 }
 
 void CSLClient::ReadSync(uint64_t local_off, uint64_t remote_off, uint32_t size) {
+    if (ec) return;  // a peer only holds a shard, and the local copy is always complete
     RequestToken request_token(context);
     RemoteConData &prop = remote_props.begin()->second;
-    prop.qp->read(buffer.get(), local_off, prop.remote_buffer_token, remote_off, size, &request_token);
-    request_token.waitUntilCompleted();
+    uint32_t held = 0;
+    pinSegments(prop, remote_off, size, held);
+    postRead(prop, local_off, remote_off, size, &request_token);
+    dispatcher->WaitUntilCompleted(&request_token);
+    unpinSegments(prop, held);
 }
 
-void CSLClient::WriteSync(uint64_t local_off, uint64_t remote_off, uint32_t size) {
+bool CSLClient::WriteSync(uint64_t local_off, uint64_t remote_off, uint32_t size) {
     vector<shared_ptr<CombinedRequestToken> > combined_req_tokens;
-    uint64_t local_offs[2] = {local_off, seq_offset};
-    uint64_t remote_offs[2] = {remote_off, seq_offset};
-    uint32_t sizes[2] = {size, sizeof(uint64_t)};
+    SeqWrite record = framing    ? frameRecord(local_off, size)
+                      : progress ? stageProgress(advanceEnd(local_off, size))
+                                 : SeqWrite();
+    auto held = pinPeers(remote_off, size);
 
     for (auto &p : remote_props) {
-        auto token = make_shared<CombinedRequestToken>(context, p.first);
+        auto token = make_shared<CombinedRequestToken>(context, dispatcher, p.first);
         combined_req_tokens.emplace_back(token);
-        RequestToken *tokens[2] = {&token->data_token_, &token->seq_token_};
-        p.second.qp->writeTwoPlace(buffer.get(), local_offs, p.second.remote_buffer_token, remote_offs, sizes, tokens);
+        postWrite(p.second, local_off, remote_off, size, token.get(), record);
     }
 
+    uint n = 0;
     for (auto token : combined_req_tokens) {
         token->WaitUntilBothCompleted();
+        auto it = held.find(token->peer_);
+        if (it != held.end()) unpinSegments(remote_props.at(token->peer_), it->second);
+        if (token->BothSucceeded()) {
+            n++;
+        } else {
+            LOG(ERROR) << "Write to peer " << token->peer_ << " of " << filename << " failed";
+            remote_props.at(token->peer_).failed = true;
+            qp_pool->DropPeer(token->peer_);
+        }
     }
+    return n > rep_factor / 2;
 }
 
-void CSLClient::WriteQuorum(uint64_t local_off, uint64_t remote_off, uint32_t size) {
+bool CSLClient::WriteQuorum(uint64_t local_off, uint64_t remote_off, uint32_t size) {
     // todo: allow this to fail, application will handle the write() fail
+    auto held = pinPeers(remote_off, size);  // the RPC doesn't hold up other writes
     lock_guard<mutex> guard(recover_lock);
+    releasePins();
 
     vector<shared_ptr<CombinedRequestToken> > request_tokens;
-    uint64_t local_offs[2] = {local_off, seq_offset};
-    uint64_t remote_offs[2] = {remote_off, seq_offset};
-    uint32_t sizes[2] = {size, sizeof(uint64_t)};
-    
+    uint64_t op = ++posted_ops;
+    uint64_t stale = 0;
+    uint32_t stale_len = 0;
+    SeqWrite record = framing    ? frameRecord(local_off, size)
+                      : progress ? stageProgress(advanceEnd(local_off, size))
+                                 : foldCommit(local_off, size, stale, stale_len);
+
     for (auto &p : remote_props) {
-        auto token = make_shared<CombinedRequestToken>(context, p.first);
+        auto token = make_shared<CombinedRequestToken>(context, dispatcher, p.first, op);
         request_tokens.emplace_back(token);
         {
 #if ASYNC_QUORUM_POLL
             lock_guard<mutex> lk(poll_lock);
 #endif
-            p.second.op_queue.push(token);
+            p.second.op_queue.push_back(token);
+        }
+        if (stale_len > 0) {
+            postData(p.second, segments.get(), stale, stale + remote_off - local_off, stale_len, nullptr);
         }
-        RequestToken *tokens[2] = {&token->data_token_, &token->seq_token_};
-        p.second.qp->writeTwoPlace(buffer.get(), local_offs, p.second.remote_buffer_token, remote_offs, sizes, tokens);
+        postWrite(p.second, local_off, remote_off, size, token.get(), record);
+        // released once the peer completes the write, which may be after the quorum
+        if (held[p.first]) p.second.held_pins.emplace_back(op, held[p.first]);
     }
 
-    do {
+    dispatcher->WaitFor([&] {
 #if ASYNC_QUORUM_POLL
 #else
         // todo: what if one rep fail-slow? (queue will build up)
-        for (auto &p : remote_props) {
-            auto &op_q = p.second.op_queue;
-            if (op_q.empty())
-                continue;
-            if (op_q.front()->CheckIfBothCompleted()) {  // will poll CQ once if not completed
-                op_q.front()->SetAllPrevCompleted();
-                op_q.pop();
-            }
-        }
+        pollOpQueues();
 #endif
         /**
          * todo:
@@ -272,7 +449,9 @@ void CSLClient::WriteQuorum(uint64_t local_off, uint64_t remote_off, uint32_t si
          * Now we have 3 peers alive, so L278 won't be triggerred but it's still polling for requests to 1,2, which will
          * never succeed.
          */
-    } while (!quorumCompleted(request_tokens));
+        return quorumCompleted(request_tokens) || !quorumAlive();
+    });
+    return quorumCompleted(request_tokens);
 }
 
 bool CSLClient::quorumCompleted(vector<shared_ptr<CombinedRequestToken>> &tokens) {
@@ -292,80 +471,696 @@ bool CSLClient::quorumCompleted(vector<shared_ptr<CombinedRequestToken>> &tokens
     return false;
 }
 
-void CSLClient::CQPollingFunc() {
-    LOG(INFO) << "CQ Polling Thread running";
-    while (run) {
-        for (auto &p : remote_props) {
-            auto &op_q = p.second.op_queue;
-            if (op_q.empty())
-                continue;
-            {
+void CSLClient::pollOpQueues() {
+    for (auto &p : remote_props) {
+        auto &op_q = p.second.op_queue;
+        if (op_q.empty())
+            continue;
+        {
 #if ASYNC_QUORUM_POLL
-                lock_guard<mutex> lk(poll_lock);
+            lock_guard<mutex> lk(poll_lock);
 #endif
-                if (op_q.front()->CheckIfBothCompleted()) {  // will poll CQ once if not completed
+            // an unsignaled write is done once a later signaled write to the same peer is, the QP executes in order
+            auto it = find_if(op_q.begin(), op_q.end(), [](const shared_ptr<CombinedRequestToken> &t) {
+                return t->signaled_;
+            });
+            if (p.second.failed) continue;
+            if (it != op_q.end() && (*it)->CheckIfBothCompleted()) {  // will poll CQ once if not completed
+                if (!(*it)->BothSucceeded()) {
+                    // the QP is in the error state, the writes after this one are flushed as well
+                    LOG(ERROR) << "Write " << (*it)->op_ << " to peer " << p.first << " of " << filename << " failed";
+                    p.second.failed = true;
+                    qp_pool->DropPeer(p.first);  // other files may share the QP, new ones must not get it
+                    continue;
+                }
+                p.second.completed_ops = (*it)->op_;
+                for (auto end = next(it); op_q.begin() != end;) {
                     op_q.front()->SetAllPrevCompleted();
-                    op_q.pop();
+                    op_q.pop_front();
                 }
             }
         }
     }
-    LOG(INFO) << "CQ Polling Thread exit";
 }
 
-ssize_t CSLClient::Append(const void *buf, size_t size) {
-    size = min(size, buffer->getSizeInBytes() - buf_offset);
-    size_t cur_off = buf_offset.fetch_add(size);
-    file_size = max(file_size, buf_offset.load());
-    memcpy((char *)buffer->getAddress() + cur_off, buf, size);
+uint64_t CSLClient::quorumCompletedOps() {
+    // same as quorumCompleted(), no enough peers to gather a quorum, don't block the caller
+    if (peers.size() <= rep_factor / 2) return posted_ops;
+
+    vector<uint64_t> completed;
+    for (auto &p : remote_props) {
+        completed.push_back(p.second.failed           ? 0
+                            : p.second.op_queue.empty() ? posted_ops
+                                                        : p.second.completed_ops);
+    }
+    // the (rep_factor / 2 + 1)-th largest is acknowledged by a quorum
+    uint q = rep_factor / 2;
+    if (completed.size() <= q) return 0;
+    nth_element(completed.begin(), completed.begin() + q, completed.end(), greater<uint64_t>());
+    return completed[q];
+}
+
+bool CSLClient::quorumAlive() {
+    uint alive = count_if(remote_props.begin(), remote_props.end(),
+                          [](const pair<const string, RemoteConData> &p) { return !p.second.failed; });
+    return alive > rep_factor / 2;
+}
+
+bool CSLClient::writeZeroCopy(const void *buf, uint64_t off, uint32_t size, bool &failed) {
+    uint64_t from_off;
+    failed = false;
+    if (!waitPeersSynced()) {
+        errno = EIO;
+        failed = true;
+        return false;
+    }
+    shared_ptr<Buffer> from = mr_pool->GetUserMrCache()->Get(buf, size, from_off);
+    if (!from) return false;
+
+    auto held = pinPeers(off, size);
     *seq_addr = seq.fetch_add(1);
+    lock_guard<mutex> guard(recover_lock);
+    vector<shared_ptr<CombinedRequestToken>> tokens;
+    uint64_t op = ++posted_ops;
+    uint32_t len = size;  // foldCommit() may widen the write over a stale trailer, with bytes already in the local MR
+    uint64_t stale = 0;
+    uint32_t stale_len = 0;
+    SeqWrite record = progress ? stageProgress(advanceEnd(off, size)) : foldCommit(off, len, stale, stale_len);
+
+    for (auto &p : remote_props) {
+        auto token = make_shared<CombinedRequestToken>(context, dispatcher, p.first, op);
+        tokens.emplace_back(token);
+        {
+#if ASYNC_QUORUM_POLL
+            lock_guard<mutex> lk(poll_lock);
+#endif
+            p.second.op_queue.push_back(token);
+        }
+        if (stale_len > 0) postData(p.second, segments.get(), stale, stale, stale_len, nullptr);
+        if (len > size) postData(p.second, segments.get(), off + size, off + size, len - size, nullptr);
+        postWrite(p.second, segments.get(), off, off, size, token.get(), record, from.get(), from_off);
+    }
+    memcpy(segments->GetBase() + off, buf, size);  // overlaps with the transfer
+
+    dispatcher->WaitFor([&] {
+#if ASYNC_QUORUM_POLL
+#else
+        pollOpQueues();
+#endif
+        for (auto &t : tokens) {
+            if (!t->CheckIfBothCompleted()) return false;
+        }
+        return true;
+    });
+    for (auto &h : held) {
+        auto it = remote_props.find(h.first);
+        if (it != remote_props.end()) unpinSegments(it->second, h.second);
+    }
+    // pollOpQueues() marks the peers that failed
+    auto n = count_if(tokens.begin(), tokens.end(), [](const shared_ptr<CombinedRequestToken> &t) {
+        return t->BothSucceeded();
+    });
+    if (n > rep_factor / 2) return true;
+    LOG(ERROR) << "Zero-copy write of " << filename << " reached " << n << " peers, below a quorum";
+    errno = EIO;
+    failed = true;
+    return false;
+}
+
+void CSLClient::WriteAsync(uint64_t local_off, uint64_t remote_off, uint32_t size) {
+    if (ec) {
+        replicateErasureCoded(local_off, size);  // parity needs the shards in order, no write-back
+        return;
+    }
+    auto held = pinPeers(remote_off, size);
+    lock_guard<mutex> guard(recover_lock);
+    releasePins();
+
+    uint64_t op = ++posted_ops;
+    bool signaled = op % SIGNAL_INTERVAL == 0;
+    unsignaled_tail = !signaled;
+    uint64_t stale = 0;
+    uint32_t stale_len = 0;
+    SeqWrite record = framing    ? frameRecord(local_off, size)
+                      : progress ? stageProgress(advanceEnd(local_off, size))
+                                 : foldCommit(local_off, size, stale, stale_len);
+
+    for (auto &p : remote_props) {
+        auto token = make_shared<CombinedRequestToken>(context, dispatcher, p.first, op, signaled);
+        {
+#if ASYNC_QUORUM_POLL
+            lock_guard<mutex> lk(poll_lock);
+#endif
+            p.second.op_queue.push_back(token);
+        }
+        if (stale_len > 0) {
+            postData(p.second, segments.get(), stale, stale + remote_off - local_off, stale_len, nullptr);
+        }
+        postWrite(p.second, local_off, remote_off, size, signaled ? token.get() : nullptr, record);
+        if (held[p.first]) p.second.held_pins.emplace_back(op, held[p.first]);
+    }
+
+    // back-pressure: bound the number of writes that may be lost if the client crashes before fsync
+    dispatcher->WaitFor([&] {
+#if ASYNC_QUORUM_POLL
+#else
+        pollOpQueues();
+#endif
+        return posted_ops - quorumCompletedOps() <= MAX_INFLIGHT_WRITES || !quorumAlive();
+    });
+}
+
+void CSLClient::signalTail() {
+    if (!unsignaled_tail) return;
+    unsignaled_tail = false;
+    infinity::queues::OperationFlags flags;
+    uint64_t op = ++posted_ops;
+    for (auto &p : remote_props) {
+        auto token = make_shared<CombinedRequestToken>(context, dispatcher, p.first, op);
+        {
+#if ASYNC_QUORUM_POLL
+            lock_guard<mutex> lk(poll_lock);
+#endif
+            p.second.op_queue.push_back(token);
+        }
+        token->data_token_.setCompleted(true);
+        p.second.qp->write(meta.get(), META_SEQ_OFFSET, &p.second.remote_meta, META_SEQ_OFFSET, sizeof(uint64_t),
+                           flags, &token->seq_token_);
+    }
+    dispatcher->Kick();
+}
+
+int CSLClient::Sync() {
+    lock_guard<mutex> guard(recover_lock);
+
+    signalTail();
+    uint64_t target = posted_ops;
+    dispatcher->WaitFor([&] {
+#if ASYNC_QUORUM_POLL
+#else
+        pollOpQueues();
+#endif
+        return quorumCompletedOps() >= target || !quorumAlive();
+    });
+    releasePins();
+    if (!quorumAlive() || peers.size() <= rep_factor / 2) {
+        LOG(ERROR) << "Writes to " << filename << " can't be acknowledged by a quorum of peers";
+        errno = EIO;
+        return -1;
+    }
+    return 0;
+}
+
+void CSLClient::SetWriteBack(bool enable) {
+    if (ec && enable) {
+        LOG(WARNING) << "write-back is not supported for erasure-coded logs, " << filename << " stays write-through";
+        return;
+    }
+    if (write_back && !enable) Sync();  // writes issued in write-back mode must be durable before switching
+    write_back = enable;
+}
+
+bool CSLClient::replicate(uint64_t off, uint32_t size) {
+    if (!waitPeersSynced()) {
+        errno = EIO;
+        return false;
+    }
+    if (ec) {
+        if (replicateErasureCoded(off, size)) return true;
+        errno = EIO;
+        return false;
+    }
+    if (write_back) {
+        WriteAsync(off, off, size);
+        if (quorumAlive()) return true;
+        errno = EIO;
+        return false;
+    }
 #if USE_QUORUM_WRITE
-    WriteQuorum(cur_off, cur_off, size);
+    if (WriteQuorum(off, off, size)) return true;
 #else
-    WriteSync(cur_off, cur_off, size);
+    if (WriteSync(off, off, size)) return true;
 #endif
+    errno = EIO;
+    return false;
+}
+
+void CSLClient::initErasureCode(int k, int m) {
+    if (k < 1) {
+        LOG(ERROR) << "Erasure coding with " << m << " parity shards needs more than " << m
+                   << " peers, fall back to replication";
+        return;
+    }
+    ec = make_unique<ErasureCode>(k, m);
+    for (int q = 0; q < m; q++) parity.emplace_back(new LogSegments(qp_pool->GetContext(), mr_pool->GetPlacement()));
+    shard_peers.assign(k + m, "");
+    LOG(INFO) << "Erasure coding with " << k << " data shards and " << m << " parity shards";
+}
+
+bool CSLClient::replicateErasureCoded(uint64_t off, uint64_t size) {
+    lock_guard<mutex> guard(recover_lock);  // also keeps the parity updates of a row in order
+    if (shards_lost) return false;
+    if (!shards_assigned) assignShards();
+
+    const int k = ec->GetDataShards(), m = ec->GetParityShards();
+    int reachable = count_if(shard_peers.begin(), shard_peers.end(),
+                             [&](const string &peer) { return remote_props.count(peer) > 0; });
+    if (reachable < k + 1) {
+        LOG(ERROR) << "Only " << reachable << " shards of " << filename << " are reachable, a write needs "
+                   << k + 1;
+        return false;
+    }
+    const size_t row = ecRowSize();
+    char *base = segments->GetBase();
+    vector<const uint8_t *> data(k);
+    vector<uint8_t *> par(m);
+    vector<shared_ptr<CombinedRequestToken>> tokens;
+    vector<uint32_t> held(k + m);
+    auto post = [&](int shard, LogSegments *src, uint64_t local_off, uint64_t remote_off, uint64_t len) {
+        auto it = remote_props.find(shard_peers[shard]);
+        if (it == remote_props.end()) return;  // lost, rebuilt when a replacement joins, at most m - 1 of them
+        auto token = make_shared<CombinedRequestToken>(context, dispatcher, it->first);
+        pinSegments(it->second, remote_off, len, held[shard]);
+        postWrite(it->second, src, local_off, remote_off, len, token.get());
+        tokens.push_back(token);
+    };
+
+    uint64_t end = off + size;
+    do {  // an empty write still updates the sequence number
+        size_t r = off / row, j = off % row / EC_STRIPE_UNIT, within = off % EC_STRIPE_UNIT;
+        size_t len = min(end - off, EC_STRIPE_UNIT - within);
+        size_t shard_off = r * EC_STRIPE_UNIT + within;
+        post(j, segments.get(), off, shard_off, len);
+
+        for (int i = 0; i < k; i++) {
+            data[i] = reinterpret_cast<uint8_t *>(base + r * row + i * EC_STRIPE_UNIT + within);
+        }
+        for (int q = 0; q < m; q++) par[q] = reinterpret_cast<uint8_t *>(parity[q]->GetBase() + shard_off);
+        ec->Encode(data.data(), par.data(), len);
+        for (int q = 0; q < m; q++) post(k + q, parity[q].get(), shard_off, shard_off, len);
+        off += len;
+    } while (off < end);
+    for (auto &peer : shard_peers) {
+        auto it = remote_props.find(peer);
+        if (it == remote_props.end()) continue;
+        auto token = make_shared<CombinedRequestToken>(context, dispatcher, peer);
+        token->data_token_.setCompleted(true);
+        postEcEnd(it->second, &token->seq_token_);
+        tokens.push_back(token);
+    }
+
+    for (auto &t : tokens) t->WaitUntilBothCompleted();
+    for (int s = 0; s < k + m; s++) {
+        auto it = remote_props.find(shard_peers[s]);
+        if (it != remote_props.end()) unpinSegments(it->second, held[s]);
+    }
+    return true;
+}
+
+void CSLClient::postEcEnd(RemoteConData &p, RequestToken *token) {
+    // the slot is reused by the next write, which waits for this one under recover_lock
+    *reinterpret_cast<uint64_t *>(reinterpret_cast<char *>(meta->getData()) + EC_END_STAGING_OFFSET) = file_size;
+    infinity::queues::OperationFlags flags;
+    p.qp->write(meta.get(), EC_END_STAGING_OFFSET, &p.remote_meta, META_EC_END_OFFSET, sizeof(uint64_t), flags, token);
+    dispatcher->Kick();
+}
+
+void CSLClient::assignShards() {
+    for (auto &p : peers) {
+        if (shardOf(p) >= 0) continue;
+        auto free_shard = find(shard_peers.begin(), shard_peers.end(), "");
+        if (free_shard == shard_peers.end()) break;
+        *free_shard = p;
+    }
+    for (size_t j = 0; j < shard_peers.size(); j++) {
+        if (!shard_peers[j].empty()) writeShardId(shard_peers[j], j);
+    }
+    shards_assigned = true;
+}
+
+void CSLClient::writeShardId(const string &peer, int shard) {
+    auto it = remote_props.find(peer);
+    if (it == remote_props.end()) return;
+    size_t slot = SHARD_ID_STAGING_OFFSET + shard * sizeof(uint64_t);
+    *reinterpret_cast<uint64_t *>(reinterpret_cast<char *>(meta->getData()) + slot) = shard + 1;
+    RequestToken token(context);
+    infinity::queues::OperationFlags flags;
+    it->second.qp->write(meta.get(), slot, &it->second.remote_meta, META_SHARD_OFFSET, sizeof(uint64_t), flags,
+                         &token);
+    dispatcher->WaitUntilCompleted(&token);
+}
+
+int CSLClient::shardOf(const string &peer) {
+    auto it = find(shard_peers.begin(), shard_peers.end(), peer);
+    return it == shard_peers.end() ? -1 : it - shard_peers.begin();
+}
+
+void CSLClient::pushShard(const string &peer, int shard) {
+    auto &p = remote_props.at(peer);
+    const int k = ec->GetDataShards();
+    const size_t row = ecRowSize();
+    size_t shard_size = shardEnd(file_size);
+    deque<shared_ptr<CombinedRequestToken>> inflight;
+    uint32_t held = 0;
+    auto post = [&](LogSegments *src, uint64_t local_off, uint64_t remote_off, uint64_t len) {
+        if (inflight.size() >= RECOVERY_WINDOW) {
+            inflight.front()->WaitUntilBothCompleted();
+            inflight.pop_front();
+        }
+        auto token = make_shared<CombinedRequestToken>(context, dispatcher, peer);
+        pinSegments(p, remote_off, len, held);
+        postWrite(p, src, local_off, remote_off, len, token.get());
+        inflight.push_back(token);
+    };
+
+    if (shard_size == 0) {
+        post(segments.get(), 0, 0, 0);  // sequence number only
+    } else if (shard < k) {
+        for (size_t r = 0; r * EC_STRIPE_UNIT < shard_size; r++) {
+            post(segments.get(), r * row + shard * EC_STRIPE_UNIT, r * EC_STRIPE_UNIT, EC_STRIPE_UNIT);
+        }
+    } else {
+        // a parity shard is contiguous in its local copy
+        for (size_t off = 0; off < shard_size; off += RECOVERY_CHUNK_SIZE) {
+            post(parity[shard - k].get(), off, off, min(RECOVERY_CHUNK_SIZE, shard_size - off));
+        }
+    }
+    for (auto &t : inflight) t->WaitUntilBothCompleted();
+    unpinSegments(p, held);
+    RequestToken end_token(context);
+    postEcEnd(p, &end_token);
+    dispatcher->WaitUntilCompleted(&end_token);
+    writeShardId(peer, shard);
+}
+
+bool CSLClient::readShard(int shard, size_t rows) {
+    const int k = ec->GetDataShards();
+    const size_t row = ecRowSize();
+    auto &p = remote_props.at(shard_peers[shard]);
+    deque<unique_ptr<RequestToken>> inflight;
+    bool ok = true;
+    uint32_t held = 0;
+    pinSegments(p, 0, rows * EC_STRIPE_UNIT, held);
+    for (size_t r = 0; r < rows; r++) {
+        if (inflight.size() >= RECOVERY_WINDOW) {
+            dispatcher->WaitUntilCompleted(inflight.front().get());
+            ok &= inflight.front()->wasSuccessful();
+            inflight.pop_front();
+        }
+        inflight.emplace_back(new RequestToken(context));
+        if (shard < k) {
+            postRead(p, segments.get(), r * row + shard * EC_STRIPE_UNIT, r * EC_STRIPE_UNIT, EC_STRIPE_UNIT,
+                     inflight.back().get());
+        } else {
+            postRead(p, parity[shard - k].get(), r * EC_STRIPE_UNIT, r * EC_STRIPE_UNIT, EC_STRIPE_UNIT,
+                     inflight.back().get());
+        }
+    }
+    for (auto &t : inflight) {
+        dispatcher->WaitUntilCompleted(t.get());
+        ok &= t->wasSuccessful();
+    }
+    unpinSegments(p, held);
+    return ok;
+}
+
+bool CSLClient::recoverErasureCoded() {
+    auto start = high_resolution_clock::now();
+    const int k = ec->GetDataShards(), m = ec->GetParityShards();
+    const size_t row = ecRowSize();
+    size_t shard_size = 0, log_end = 0;
+    uint64_t min_seq = UINT64_MAX;
+
+    shard_peers.assign(k + m, "");
+    for (auto &r : GetPeerInfo()) {
+        int shard = static_cast<int>(r.second.shard) - 1;
+        if (shard < 0 || shard >= k + m || !shard_peers[shard].empty()) continue;
+        shard_peers[shard] = r.first;
+        shard_size = max(shard_size, r.second.size);
+        if (r.second.seq != 0 && r.second.seq < min_seq) {  // the same state getRecoverSrcPeers() picks
+            min_seq = r.second.seq;
+            log_end = r.second.log_end;
+        }
+    }
+
+    vector<int> srcs;  // the first k surviving shards that were read, data shards are preferred as they need no decoding
+    vector<bool> failed(k + m);
+    size_t rows = (shard_size + EC_STRIPE_UNIT - 1) / EC_STRIPE_UNIT;
+    bool grown = rows > 0 && growTo(rows * row);
+    while (true) {
+        vector<int> fresh;
+        for (int s = 0, n = 0; s < k + m && n < k; s++) {
+            if (shard_peers[s].empty() || failed[s]) continue;
+            n++;
+            if (find(srcs.begin(), srcs.end(), s) == srcs.end()) fresh.push_back(s);
+        }
+        if (shard_size > 0 && srcs.size() + fresh.size() < static_cast<size_t>(k)) {
+            // pushing shards rebuilt from nothing would overwrite what survives
+            LOG(ERROR) << "Only " << srcs.size() + fresh.size() << " shards of " << filename << " survive, " << k
+                       << " are needed";
+            shards_lost = true;
+            return false;
+        }
+        if (!grown || fresh.empty()) {
+            srcs.insert(srcs.end(), fresh.begin(), fresh.end());
+            break;
+        }
+        for (int s : fresh) {
+            if (readShard(s, rows)) {
+                srcs.push_back(s);
+            } else {
+                LOG(WARNING) << "Failed to read shard " << s << " of " << filename << " from " << shard_peers[s]
+                             << ", it is rebuilt from the others";
+                failed[s] = true;
+                shard_peers[s] = "";  // the peer takes it over again below
+            }
+        }
+    }
+    if (grown) {
+        // decode lost data shards and rebuild the local copy of the parity shards that weren't read
+        vector<uint8_t *> shards(k + m);
+        unique_ptr<bool[]> present(new bool[k + m]);
+        for (int s = 0; s < k + m; s++) present[s] = find(srcs.begin(), srcs.end(), s) != srcs.end();
+        for (size_t r = 0; r < rows; r++) {
+            for (int i = 0; i < k; i++) {
+                shards[i] = reinterpret_cast<uint8_t *>(segments->GetBase() + r * row + i * EC_STRIPE_UNIT);
+            }
+            for (int q = 0; q < m; q++) {
+                shards[k + q] = reinterpret_cast<uint8_t *>(parity[q]->GetBase() + r * EC_STRIPE_UNIT);
+            }
+            ec->Reconstruct(shards.data(), present.get(), EC_STRIPE_UNIT);
+        }
+        segments->MarkWritten(0, rows * row);
+        file_size = min(log_end, rows * row);
+    }
+
+    // peers that don't hold a shard take over the lost ones
+    for (auto &p : peers) {
+        if (shardOf(p) >= 0) continue;
+        auto lost = find(shard_peers.begin(), shard_peers.end(), "");
+        if (lost == shard_peers.end()) break;
+        *lost = p;
+        pushShard(p, lost - shard_peers.begin());
+    }
+    shards_assigned = true;
+    LOG(INFO) << "recovered " << file_size << "B for " << filename << " from " << srcs.size() << " shards in "
+              << duration_cast<microseconds>(high_resolution_clock::now() - start).count() << "us";
+    return true;
+}
+
+size_t CSLClient::GetRemoteMemory() {
+    size_t total = 0;
+    for (auto &p : remote_props) total += LOG_META_SIZE + segmentBegin(p.second.n_segments);
+    return total;
+}
+
+void CSLClient::CQPollingFunc() {
+    LOG(INFO) << "CQ Polling Thread running";
+    while (run) {
+        pollOpQueues();
+    }
+    LOG(INFO) << "CQ Polling Thread exit";
+}
+
+ssize_t CSLClient::Append(const void *buf, size_t size) {
+    struct iovec iov = {const_cast<void *>(buf), size};
+    return AppendVec(&iov, 1);
+}
+
+ssize_t CSLClient::AppendVec(const struct iovec *iov, int iovcnt) {
+    ssize_t total = iovTotalLen(iov, iovcnt);
+    if (total < 0) return -1;
+#if USE_QUORUM_WRITE && GROUP_COMMIT
+    // write-back doesn't wait for quorum, a zero-copy write gains nothing from being batched
+    if (!write_back && !useZeroCopy(iovcnt, total)) return appendGroupCommit(iov, iovcnt, total);
+#endif
+    size_t cur_off;
+    ssize_t size = reserveAppend(total, cur_off);
+    if (size < 0) return -1;
+    file_size = max(file_size, buf_offset.load());
+    // the prefetcher must not overwrite new data with the recovered one
+    if (!ensureRecovered(cur_off, size)) {
+        errno = EIO;
+        return -1;
+    }
+    bool failed = false;
+    if (useZeroCopy(iovcnt, size) && writeZeroCopy(iov[0].iov_base, cur_off, size, failed)) return size;
+    if (failed) return -1;
+    iovGather(segments->GetBase() + cur_off, iov, iovcnt, size);
+    *seq_addr = seq.fetch_add(1);
+    if (!replicate(cur_off, size)) return -1;
+    return size;
+}
+
+ssize_t CSLClient::appendGroupCommit(const struct iovec *iov, int iovcnt, size_t size) {
+    if (size == 0) return 0;
+
+    GroupCommitEntry entry = {0, false, false, false};
+    size_t cur_off;
+    {
+        // reserve under gc_lock so that the leader never sees a gap that no one is going to fill
+        lock_guard<mutex> guard(gc_lock);
+        ssize_t ret = reserveAppend(size, cur_off);
+        if (ret < 0) return -1;
+        size = ret;
+        entry.end = cur_off + size;
+        gc_pending.emplace(cur_off, &entry);
+    }
+    file_size = max(file_size, buf_offset.load());
+    // the prefetcher must not overwrite new data with the recovered one
+    bool recovered = ensureRecovered(cur_off, size);
+    if (recovered) iovGather(segments->GetBase() + cur_off, iov, iovcnt, size);
+
+    unique_lock<mutex> lk(gc_lock);
+    entry.failed = !recovered;
+    entry.filled = true;
+    while (!entry.committed) {
+        if (gc_leader_active || !gc_pending.begin()->second->filled) {
+            gc_cv.wait(lk);
+            continue;
+        }
+        if (gc_pending.begin()->second->failed) {
+            // the range of the lowest entry couldn't be recovered, it is left out and the next one leads
+            gc_pending.begin()->second->committed = true;
+            gc_pending.erase(gc_pending.begin());
+            gc_cv.notify_all();
+            continue;
+        }
+
+        // become the leader, take the contiguous filled run starting from the lowest pending offset
+        vector<GroupCommitEntry *> batch;
+        size_t start = gc_pending.begin()->first, end = start;
+        auto it = gc_pending.begin();
+        while (it != gc_pending.end() && it->first == end && it->second->filled && !it->second->failed &&
+               (batch.empty() || it->second->end - start <= MAX_GROUP_COMMIT_SIZE)) {
+            end = it->second->end;
+            batch.push_back(it->second);
+            it = gc_pending.erase(it);
+        }
+        gc_leader_active = true;
+        lk.unlock();
+
+        *seq_addr = seq.fetch_add(1);
+        bool ok = replicate(start, end - start);
+
+        lk.lock();
+        for (auto e : batch) {
+            e->committed = true;
+            e->failed = !ok;
+        }
+        gc_leader_active = false;
+        gc_cv.notify_all();
+    }
+    if (entry.failed) {
+        errno = EIO;
+        return -1;
+    }
     return size;
 }
 
 ssize_t CSLClient::WritePos(const void *buf, size_t size, off_t pos) {
-    size = min(size, buffer->getSizeInBytes() - pos);
+    struct iovec iov = {const_cast<void *>(buf), size};
+    return WritePosVec(&iov, 1, pos);
+}
+
+ssize_t CSLClient::WritePosVec(const struct iovec *iov, int iovcnt, off_t pos) {
+    ssize_t total = iovTotalLen(iov, iovcnt);
+    if (total < 0) return -1;
+    ssize_t writable = writableLen(total, pos, MAX_LOG_SIZE);
+    if (writable < 0) return -1;
+    size_t size = writable;
+    if (!growTo(pos + size)) {
+        errno = ENOSPC;
+        return -1;
+    }
     file_size = max(pos + size, file_size);
-    memcpy((char *)buffer->getAddress() + pos, buf, size);
+    if (!ensureRecovered(pos, size)) {
+        errno = EIO;
+        return -1;
+    }
+    bool failed = false;
+    if (useZeroCopy(iovcnt, size) && writeZeroCopy(iov[0].iov_base, pos, size, failed)) return size;
+    if (failed) return -1;
+    iovGather(segments->GetBase() + pos, iov, iovcnt, size);
     *seq_addr = seq.fetch_add(1);
-#if USE_QUORUM_WRITE
-    WriteQuorum(pos, pos, size);
-#else
-    WriteSync(pos, pos, size);
-#endif
+    if (!replicate(pos, size)) return -1;
     return size;
 }
 
 ssize_t CSLClient::Read(void *buf, size_t size) {
-    size = min(size, file_size - buf_offset);
+    struct iovec iov = {buf, size};
+    return ReadVec(&iov, 1);
+}
+
+ssize_t CSLClient::ReadVec(const struct iovec *iov, int iovcnt) {
+    ssize_t total = iovTotalLen(iov, iovcnt);
+    if (total < 0) return -1;
+    size_t size = readableLen(total, buf_offset, file_size);
+    if (size == 0) return 0;
     size_t cur_off = buf_offset.fetch_add(size);
+    if (!ensureRecovered(cur_off, size)) {
+        errno = EIO;
+        return -1;
+    }
 #ifdef FORCE_REMOTE_READ
     ReadSync(cur_off, cur_off, size);
 #endif
-    memcpy(buf, (char *)buffer->getAddress() + cur_off, size);
+    iovScatter(iov, iovcnt, segments->GetBase() + cur_off, size);
     return size;
 }
 
 ssize_t CSLClient::ReadPos(void *buf, size_t size, off_t pos) {
-    size = min(size, file_size - pos);
+    struct iovec iov = {buf, size};
+    return ReadPosVec(&iov, 1, pos);
+}
+
+ssize_t CSLClient::ReadPosVec(const struct iovec *iov, int iovcnt, off_t pos) {
+    ssize_t total = iovTotalLen(iov, iovcnt);
+    if (total < 0) return -1;
+    if (pos < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    size_t size = readableLen(total, pos, file_size);
+    if (size == 0) return 0;
+    if (!ensureRecovered(pos, size)) {
+        errno = EIO;
+        return -1;
+    }
 #ifdef FORCE_REMOTE_READ
     ReadSync(pos, pos, size);
 #endif
-    memcpy(buf, (char *)buffer->getAddress() + pos, size);
+    iovScatter(iov, iovcnt, segments->GetBase() + pos, size);
     return size;
 }
 
 off_t CSLClient::Seek(off_t offset, int whence) {
     switch (whence) {
         case SEEK_SET:
-            buf_offset.store(min((size_t)offset, buffer->getSizeInBytes() - 1));
+            buf_offset.store(min((size_t)offset, MAX_LOG_SIZE - 1));
             break;
         case SEEK_CUR:
-            buf_offset.store(min((size_t)(offset + buf_offset), buffer->getSizeInBytes() - 1));
+            buf_offset.store(min((size_t)(offset + buf_offset), MAX_LOG_SIZE - 1));
             break;
         case SEEK_END:
             buf_offset.store(file_size);
@@ -380,7 +1175,19 @@ int CSLClient::Truncate(off_t length) {
     file_size = length;
     LOG(INFO) << "current size " << buf_offset << " truncate to " << length;
     if (length < buf_offset) {
-        memset((char*)buffer->getData() + length, 0, buf_offset.exchange(length) - length);
+        size_t end = min(buf_offset.exchange(length), segments->GetCapacity());  // beyond capacity was never written
+        if (static_cast<size_t>(length) < end) {
+            if (!ensureRecovered(length, end - length)) {
+                errno = EIO;
+                return -1;
+            }
+            memset(segments->GetBase() + length, 0, end - length);
+        }
+    }
+    if ((framing || progress) && static_cast<size_t>(length) <= segments->GetCapacity()) {
+        log_end.store(length);  // an empty framed or notifying write tells the peers where the log ends now
+        *seq_addr = seq.fetch_add(1);
+        if (!replicate(length, 0)) return -1;
     }
     return 0;
     
@@ -390,8 +1197,12 @@ char *CSLClient::GetLine(char *s, int size) {
     if (Eof())
         return nullptr;
 
-    char *p = reinterpret_cast<char *>(buffer->getAddress() + buf_offset);
+    char *p = segments->GetBase() + buf_offset;
     size_t cur_off = buf_offset.load();
+    if (!ensureRecovered(cur_off, size)) {
+        errno = EIO;
+        return nullptr;
+    }
     int len = 0;
     while (len < size - 1) {
         ++len;
@@ -407,11 +1218,231 @@ char *CSLClient::GetLine(char *s, int size) {
     return s;
 }
 
+size_t CSLClient::BufferedAppend(const void *buf, size_t size) {
+    lock_guard<mutex> guard(stdio_lock);
+
+    if (stdio_dirty_end != stdio_dirty_begin && stdio_dirty_end != buf_offset) {
+        // the offset was moved since the last buffered write, flush the old range to keep it contiguous
+        *seq_addr = seq.fetch_add(1);
+        if (!replicate(stdio_dirty_begin, stdio_dirty_end - stdio_dirty_begin)) return 0;
+        stdio_dirty_begin = stdio_dirty_end = buf_offset;
+    }
+
+    size_t cur_off;
+    ssize_t ret = reserveAppend(size, cur_off);
+    if (ret < 0) return 0;
+    size = ret;
+    file_size = max(file_size, buf_offset.load());
+    if (!ensureRecovered(cur_off, size)) {
+        errno = EIO;
+        return 0;
+    }
+    memcpy(segments->GetBase() + cur_off, buf, size);
+    if (stdio_dirty_begin == stdio_dirty_end) stdio_dirty_begin = cur_off;
+    stdio_dirty_end = cur_off + size;
+
+    bool flush = stdio_mode == _IONBF || stdio_dirty_end - stdio_dirty_begin >= stdio_buf_size ||
+                 (stdio_mode == _IOLBF && memchr(buf, '\n', size) != nullptr);
+    if (flush) {
+        *seq_addr = seq.fetch_add(1);
+        if (!replicate(stdio_dirty_begin, stdio_dirty_end - stdio_dirty_begin)) return 0;  // stays dirty
+        stdio_dirty_begin = stdio_dirty_end;
+    }
+    return size;
+}
+
+int CSLClient::Flush() {
+    lock_guard<mutex> guard(stdio_lock);
+    if (stdio_dirty_begin == stdio_dirty_end) return 0;
+
+    *seq_addr = seq.fetch_add(1);
+    if (!replicate(stdio_dirty_begin, stdio_dirty_end - stdio_dirty_begin)) return EOF;
+    stdio_dirty_begin = stdio_dirty_end;
+    return 0;
+}
+
+int CSLClient::SetBuffering(int mode, size_t size) {
+    if (mode != _IOFBF && mode != _IOLBF && mode != _IONBF) return -1;
+    Flush();
+    lock_guard<mutex> guard(stdio_lock);
+    stdio_mode = mode;
+    if (size > 0) stdio_buf_size = size;
+    return 0;
+}
+
+void *CSLClient::Map(size_t len, int prot, int flags, off_t offset) {
+    if (len == 0 || offset < 0 || offset % page_size != 0) {
+        errno = EINVAL;
+        return MAP_FAILED;
+    }
+    if (static_cast<size_t>(offset) + len > MAX_LOG_SIZE) {
+        errno = ENXIO;
+        return MAP_FAILED;
+    }
+    if (!growTo(offset + len)) {
+        errno = ENOMEM;
+        return MAP_FAILED;
+    }
+    if (!ensureRecovered(offset, len)) {
+        errno = EIO;
+        return MAP_FAILED;
+    }
+    char *base = segments->GetBase();
+
+    if ((flags & MAP_TYPE) == MAP_PRIVATE) {
+        // copy-on-write semantic, stores must not reach the log
+        void *addr = mmap(nullptr, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (addr == MAP_FAILED) return MAP_FAILED;
+        memcpy(addr, base + offset, len);
+        mprotect(addr, len, prot);
+        return addr;
+    }
+    if (flags & MAP_FIXED) {  // the MR can't be moved
+        errno = EINVAL;
+        return MAP_FAILED;
+    }
+
+    lock_guard<mutex> guard(map_lock);
+    if (prot & PROT_WRITE) {
+        if (!dirty_pages) {
+            size_t n_pages = (MAX_LOG_SIZE + page_size - 1) / page_size;
+            dirty_pages.reset(new atomic<uint64_t>[(n_pages + 63) / 64]());
+        }
+        uintptr_t begin = reinterpret_cast<uintptr_t>(base + offset);
+        uintptr_t end = begin + (len + page_size - 1) / page_size * page_size;
+        if (map_begin == map_end) {
+            if (!registerMappedClient(this)) {
+                LOG(ERROR) << "too many NCL files mapped, at most " << MAX_MAPPED_CLIENTS;
+                errno = ENOMEM;
+                return MAP_FAILED;
+            }
+            map_begin = begin;
+            map_end = end;
+        } else {
+            map_begin = min(map_begin.load(), begin);
+            map_end = max(map_end.load(), end);
+        }
+        // already dirty pages keep their bit, the next store only sets it again
+        mprotect(reinterpret_cast<void *>(begin), end - begin, PROT_READ);
+        mapped_end = max(mapped_end, offset + len);
+    }
+    map_count++;
+    return base + offset;
+}
+
+bool CSLClient::HandleWriteFault(void *addr) {
+    uintptr_t a = reinterpret_cast<uintptr_t>(addr);
+    if (a < map_begin.load() || a >= map_end.load()) return false;
+    uintptr_t base = reinterpret_cast<uintptr_t>(segments->GetBase());
+    size_t page = (a - base) / page_size;
+    dirty_pages[page / 64].fetch_or(1ULL << (page % 64));
+    mprotect(reinterpret_cast<void *>(base + page * page_size), page_size, PROT_READ | PROT_WRITE);
+    return true;
+}
+
+vector<pair<size_t, size_t>> CSLClient::collectDirtyPages(size_t first_page, size_t last_page) {
+    char *base = segments->GetBase();
+    vector<pair<size_t, size_t>> runs;
+    for (size_t p = first_page; p < last_page; p++) {
+        uint64_t bit = 1ULL << (p % 64);
+        // clear the bit before write-protecting, a store in between is still covered by the replication below
+        if (!(dirty_pages[p / 64].fetch_and(~bit) & bit)) continue;
+        if (!runs.empty() && runs.back().first + runs.back().second == p) {
+            runs.back().second++;
+        } else {
+            runs.emplace_back(p, 1);
+        }
+    }
+    for (auto &r : runs) mprotect(base + r.first * page_size, r.second * page_size, PROT_READ);
+    return runs;
+}
+
+int CSLClient::MapSync(void *addr, size_t len, int flags) {
+    lock_guard<mutex> guard(map_lock);
+    if (!dirty_pages || map_begin == map_end) return 0;
+
+    uintptr_t base = reinterpret_cast<uintptr_t>(segments->GetBase());
+    uintptr_t begin = max(reinterpret_cast<uintptr_t>(addr), map_begin.load());
+    uintptr_t end = min(reinterpret_cast<uintptr_t>(addr) + len, map_end.load());
+    if (begin >= end) return 0;
+    auto runs = collectDirtyPages((begin - base) / page_size, (end - base + page_size - 1) / page_size);
+    if (runs.empty()) return 0;
+    if (!waitPeersSynced()) {
+        errno = EIO;
+        return -1;
+    }
+
+    // post all runs back to back and wait once
+    *seq_addr = seq.fetch_add(1);
+    for (auto &r : runs) {
+        size_t off = r.first * page_size;
+        size_t size = min(r.second * page_size, segments->GetCapacity() - off);
+        file_size = max(file_size, min(off + size, mapped_end));  // stores past the end of file extend it
+        while (size > 0) {
+            uint32_t chunk = min(size, static_cast<size_t>(1UL << 30));
+            WriteAsync(off, off, chunk);
+            off += chunk;
+            size -= chunk;
+        }
+    }
+    if (!(flags & MS_ASYNC)) Sync();
+    return 0;
+}
+
+int CSLClient::Unmap(void *addr, size_t len) {
+    MapSync(addr, len, MS_SYNC);
+    lock_guard<mutex> guard(map_lock);
+    if (map_count > 0 && --map_count == 0) dropMappings();
+    return 0;
+}
+
+void CSLClient::dropMappings() {
+    if (map_begin != map_end) {
+        unregisterMappedClient(this);
+        mprotect(reinterpret_cast<void *>(map_begin.load()), map_end - map_begin, PROT_READ | PROT_WRITE);
+        // the bitmap stays, only its bits are cleared
+        uintptr_t base = reinterpret_cast<uintptr_t>(segments->GetBase());
+        size_t first_page = (map_begin - base) / page_size, last_page = (map_end - base + page_size - 1) / page_size;
+        for (size_t w = first_page / 64; w * 64 < last_page && dirty_pages; w++) dirty_pages[w].store(0);
+    }
+    map_begin = map_end = 0;
+    mapped_end = 0;
+    map_count = 0;
+}
+
 void CSLClient::Reset() {
-    memset((void *)buffer->getAddress(), 0, buf_size);
-    double usage = buf_offset.load() / 1024.0 / 1024.0;
+    stopRecovery();
+    Flush();
+    // bytes that may be non-zero, here and on the peers. Writes are marked when posted, mapped pages aren't
+    size_t used = max({file_size, buf_offset.load(), segments->GetHighWater(), commit_end});
+    {
+        lock_guard<mutex> guard(map_lock);
+        if (map_count > 0) LOG(WARNING) << filename << " is still mapped on reset, dirty pages are discarded";
+        if (map_begin != map_end) used = max<size_t>(used, map_end - reinterpret_cast<uintptr_t>(segments->GetBase()));
+        dropMappings();
+    }
+    Sync();  // in-flight writes still read from the buffer
+    write_back = false;
+    double usage = segments->GetCapacity() / 1024.0 / 1024.0;
+    segments->Shrink(segmentsFor(buf_size));  // release the memory of grown segments, the peers do on CLOSE_FILE
+    segments->Zero(used);
+    for (auto &ps : parity) {
+        ps->Shrink(1);
+        ps->Zero();
+    }
+    shards_assigned = shards_lost = false;
+    log_end.store(0);
+    spill_horizon.store(0);
+    commit_tail = commit_end = 0;
+    {
+        lock_guard<mutex> guard(digest_lock);
+        chunk_digests.clear();
+    }
     buf_offset.store(0);
-    SendFinalization(CLOSE_FILE);
+    stdio_mode = _IOFBF;
+    stdio_buf_size = DEFAULT_STDIO_BUF_SIZE;
+    stdio_dirty_begin = stdio_dirty_end = 0;
+    SendFinalization(CLOSE_FILE, used + sizeof(CommitTrailer));  // the trailer past the end of a folded tail write
     SetInUse(false);
     filename.clear();
     LOG(INFO) << "csl client " << id << " recycled, MR usage: " << usage << "MB";
@@ -430,12 +1461,21 @@ bool CSLClient::AddPeer(const string &host_addr) {
     fi.epoch = duration_cast<microseconds>(system_clock::now().time_since_epoch()).count();
     const string file_identifier = getFileIdentifier();
     strcpy(fi.file_id, file_identifier.c_str());
-    prop.qp = qp_pool->GetQpTo(host_addr, &fi);
+    LogRegionTokens tokens;
+    prop.qp = qp_pool->GetQpTo(host_addr, &fi, &tokens);
     prop.socket = prop.qp->getRemoteSocket();
+    prop.channel = qp_pool->GetChannelLock(prop.qp.get());
     LOG(INFO) << host_addr << " connected";
-    prop.remote_buffer_token = static_cast<infinity::memory::RegionToken *>(prop.qp->getUserData());
-    remote_props[host_addr] = prop;
-    peers.insert(host_addr);
+    prop.remote_meta = tokens.meta;
+    prop.remote_segments[0] = tokens.first_segment;
+    prop.file_handle = tokens.file_handle;
+    {
+        // the peer must have every segment the log has grown to before taking writes
+        lock_guard<mutex> guard(grow_lock);
+        if (!growPeer(prop, peerSegmentsFor(segments->GetCapacity()))) return false;
+        remote_props[host_addr] = prop;
+        peers.insert(host_addr);
+    }
 
     string peer_path = ZK_SVR_ROOT_PATH + "/" + host_addr;
     struct Stat stat;
@@ -450,25 +1490,34 @@ bool CSLClient::AddPeer(const string &host_addr) {
 
 system_clock::time_point after_get_peer;
 
+bool CSLClient::dropPeer(const string &addr) {
+    auto it = remote_props.find(addr);
+    if (it == remote_props.end()) {
+        LOG(ERROR) << "Peer " << addr << " not connected.";
+        return false;
+    }
+
+    // not recycled, the peer failed or refused the file, files opened later connect again
+    qp_pool->DropPeer(addr);
+    {
+        lock_guard<mutex> lk(recovery_lock);  // the lazy recovery looks its sources up under it
+        remote_props.erase(it);
+    }
+    peers.erase(addr);
+    if (ec) {
+        int shard = shardOf(addr);
+        if (shard >= 0) shard_peers[shard].clear();
+    }
+    LOG(INFO) << "Client " << id << " removes peer " << addr;
+    return true;
+}
+
 string CSLClient::replacePeer(string &old_addr) {
     string new_addr;
     struct String_vector peerv;
     int ret, i;
 
-    if (!old_addr.empty()) {
-        // remove old peer
-        auto it = remote_props.find(old_addr);
-        if (it == remote_props.end()) {
-            LOG(ERROR) << "Peer " << old_addr << " not connected.";
-            return "";
-        }
-
-        // qp_pool->RecycleQp(it->second.qp);
-        // drop qp and not recycle since it's disconnected ? can we recycle it?
-        remote_props.erase(it);
-        peers.erase(old_addr);
-        LOG(INFO) << "Client " << id << " removes peer " << old_addr;
-    }
+    if (!old_addr.empty() && !dropPeer(old_addr)) return "";
 
     // find a new peer from ZK
     ret = zoo_get_children(zh, ZK_SVR_ROOT_PATH.c_str(), 0, &peerv);
@@ -480,13 +1529,14 @@ string CSLClient::replacePeer(string &old_addr) {
         return "";
     }
 
+    // a peer that flapped and registered again comes first, it likely still holds the file, then the servers that
+    // aren't peers yet
+    vector<string> candidates;
     for (i = 0; i < peerv.count; i++) {
-        if (peers.find(peerv.data[i]) == peers.end()) {
-            new_addr = peerv.data[i];  // find a new peer different from current peers
-            break;
-        }
+        if (old_addr == peerv.data[i]) candidates.insert(candidates.begin(), peerv.data[i]);
+        else if (peers.find(peerv.data[i]) == peers.end()) candidates.push_back(peerv.data[i]);
     }
-    if (i >= peerv.count) {
+    if (candidates.empty()) {
         LOG(ERROR) << "Failed to find new peers";
         return "";
     }
@@ -495,24 +1545,31 @@ string CSLClient::replacePeer(string &old_addr) {
     after_get_peer = high_resolution_clock::now();
 #endif
 
-    if (AddPeer(new_addr)) {
+    for (auto &addr : candidates) {
+        if (!AddPeer(addr)) {
+            LOG(WARNING) << "Failed to add " << addr << " in place of " << old_addr;
+            continue;
+        }
+        new_addr = addr;
+        if (ec) {
+            // the new peer takes over a lost shard
+            auto lost = find(shard_peers.begin(), shard_peers.end(), "");
+            if (lost != shard_peers.end()) *lost = new_addr;
+        }
         LOG(INFO) << "Replaced old peer " << old_addr << " with new peer " << new_addr;
         return new_addr;
-    } else {
-        return "";
     }
+    return "";
 }
 
 bool CSLClient::recoverPeer(const string &new_peer) {
-    auto token = make_shared<CombinedRequestToken>(context, new_peer);
-    auto &p = remote_props[new_peer];
-
-    uint64_t local_offs[2] = {0, seq_offset};
-    uint64_t remote_offs[2] = {0, seq_offset};
-    uint32_t sizes[2] = {static_cast<uint32_t>(file_size), sizeof(uint64_t)};  // todo: if size > max_uint32, need multiple writes
-    RequestToken *tokens[2] = {&token->data_token_, &token->seq_token_};
-    p.qp->writeTwoPlace(buffer.get(), local_offs, p.remote_buffer_token, remote_offs, sizes, tokens);
-    token->WaitUntilBothCompleted();
+    if (!ensureRecovered(0, file_size)) return false;  // the local copy is the source
+    if (ec) {
+        int shard = shardOf(new_peer);
+        if (shard >= 0) pushShard(new_peer, shard);
+        return shard >= 0;
+    }
+    pushChunked({new_peer}, file_size);
     return true;
 }
 
@@ -537,22 +1594,7 @@ bool CSLClient::recoverPeers(const vector<string> &sync_addrs) {
     */
 
     // write to the tmp MR
-    vector<shared_ptr<CombinedRequestToken> > tokens;
-    uint64_t local_offs[2] = {0, seq_offset};
-    uint64_t remote_offs[2] = {0, seq_offset};
-    uint32_t sizes[2] = {static_cast<uint32_t>(file_size), sizeof(uint64_t)};  // todo: if size > max_uint32, need multiple writes
-
-    for (auto &a : sync_addrs) {
-        auto &p = remote_props[a];
-        auto token = make_shared<CombinedRequestToken>(context, a);
-        tokens.emplace_back(token);
-        RequestToken *tokens[2] = {&token->data_token_, &token->seq_token_};
-        p.qp->writeTwoPlace(buffer.get(), local_offs, p.remote_buffer_token, remote_offs, sizes, tokens);
-    }
-
-    for (auto token : tokens) {
-        token->WaitUntilBothCompleted();
-    }
+    pushChunked(sync_addrs, file_size);
 
     /*
     // ask peer to do an atomic switch from old MR to new MR
@@ -566,11 +1608,121 @@ bool CSLClient::recoverPeers(const vector<string> &sync_addrs) {
     return true;
 }
 
-tuple<string, size_t> CSLClient::getRecoverSrcPeer() {
+uint64_t CSLClient::localDigest(size_t c, size_t size) {
+    size_t off = c * RECOVERY_CHUNK_SIZE;
+    size_t len = min(RECOVERY_CHUNK_SIZE, size - off);
+    uint64_t version = segments->GetVersion(c);  // read before hashing, a racing write makes the entry stale
+    if (chunk_digests.size() <= c) chunk_digests.resize(c + 1);
+    auto &d = chunk_digests[c];
+    if (d.digest == 0 || d.version != version || d.len != len) {
+        d = {version, len, chunkDigest(segments->GetBase() + off, len)};
+    }
+    return d.digest;
+}
+
+vector<size_t> CSLClient::staleChunks(const string &peer, size_t size) {
+    size_t n_chunks = (size + RECOVERY_CHUNK_SIZE - 1) / RECOVERY_CHUNK_SIZE;
+    vector<uint64_t> remote(n_chunks);
+    ClientReq req;
+    req.type = GET_DIGESTS;
+    req.fi.size = size;
+    const string file_identifier = getFileIdentifier();
+    strcpy(req.fi.file_id, file_identifier.c_str());
+    ssize_t ret;
+    {
+        auto &p = remote_props.at(peer);
+        lock_guard<mutex> guard(*p.channel);
+        send(p.socket, &req, sizeof(req), 0);
+        ret = recv(p.socket, remote.data(), n_chunks * sizeof(uint64_t), MSG_WAITALL);
+    }
+    vector<size_t> stale;
+    if (ret != static_cast<ssize_t>(n_chunks * sizeof(uint64_t))) {
+        LOG(ERROR) << "Failed to get chunk digests from " << peer << ", resync the whole file";
+        remote.assign(n_chunks, 0);
+    }
+    for (size_t c = 0; c < n_chunks; c++) {
+        if (remote[c] == 0 || remote[c] != localDigest(c, size)) stale.push_back(c);
+    }
+    return stale;
+}
+
+void CSLClient::pushChunked(const vector<string> &dsts, size_t size) {
+    lock_guard<mutex> guard(digest_lock);
+    vector<vector<size_t>> stale;
+    size_t max_stale = 0, total_stale = 0;
+    for (auto &d : dsts) {
+        stale.push_back(staleChunks(d, size));
+        max_stale = max(max_stale, stale.back().size());
+        total_stale += stale.back().size();
+    }
+    LOG(INFO) << "resync " << total_stale << " of " << (size + RECOVERY_CHUNK_SIZE - 1) / RECOVERY_CHUNK_SIZE * dsts.size()
+              << " chunks to " << dsts.size() << " peers";
+
+    vector<deque<shared_ptr<CombinedRequestToken>>> inflight(dsts.size());
+    vector<uint32_t> held(dsts.size());
+    for (size_t k = 0; k < max(max_stale, static_cast<size_t>(1)); k++) {  // seq is sent even if nothing is stale
+        for (size_t i = 0; i < dsts.size(); i++) {
+            if (k > 0 && k >= stale[i].size()) continue;
+            size_t off = stale[i].empty() ? 0 : stale[i][k] * RECOVERY_CHUNK_SIZE;
+            size_t len = stale[i].empty() ? 0 : min(RECOVERY_CHUNK_SIZE, size - off);
+            auto &q = inflight[i];
+            if (q.size() >= RECOVERY_WINDOW) {
+                q.front()->WaitUntilBothCompleted();
+                q.pop_front();
+            }
+            auto token = make_shared<CombinedRequestToken>(context, dispatcher, dsts[i]);
+            // the progress goes with the last chunk, which completes after the others on the same QP
+            SeqWrite record = framing                                 ? frameRecord(off, len)
+                              : progress && k + 1 >= stale[i].size() ? stageProgress(size)
+                                                                      : SeqWrite();
+            pinSegments(remote_props.at(dsts[i]), off, len, held[i]);
+            postWrite(remote_props.at(dsts[i]), off, off, len, token.get(), record);
+            q.push_back(token);
+        }
+    }
+    for (auto &q : inflight) {
+        for (auto &t : q) t->WaitUntilBothCompleted();
+    }
+    for (size_t i = 0; i < dsts.size(); i++) unpinSegments(remote_props.at(dsts[i]), held[i]);
+}
+
+void CSLClient::RecoverStriped(const vector<string> &srcs, size_t size, size_t chunk_size) {
+    vector<deque<unique_ptr<RequestToken>>> inflight(srcs.size());
+    vector<uint32_t> held(srcs.size());
+    size_t n_chunks = (size + chunk_size - 1) / chunk_size;
+    for (size_t c = 0; c < n_chunks; c++) {
+        // chunk c is read from replica c % n, each replica keeps up to RECOVERY_WINDOW reads in flight
+        auto &q = inflight[c % srcs.size()];
+        if (q.size() >= RECOVERY_WINDOW) {
+            dispatcher->WaitUntilCompleted(q.front().get());  // completions of a QP come in order
+            q.pop_front();
+        }
+        size_t off = c * chunk_size;
+        q.emplace_back(new RequestToken(context));
+        auto &p = remote_props.at(srcs[c % srcs.size()]);
+        pinSegments(p, off, min(chunk_size, size - off), held[c % srcs.size()]);
+        postRead(p, off, off, min(chunk_size, size - off), q.back().get());
+    }
+    for (auto &q : inflight) {
+        for (auto &t : q) dispatcher->WaitUntilCompleted(t.get());
+    }
+    for (size_t i = 0; i < srcs.size(); i++) unpinSegments(remote_props.at(srcs[i]), held[i]);
+}
+
+vector<unique_lock<mutex>> CSLClient::lockChannels() {
+    vector<mutex *> locks;
+    for (auto &p : remote_props) locks.push_back(p.second.channel.get());
+    sort(locks.begin(), locks.end());
+    locks.erase(unique(locks.begin(), locks.end()), locks.end());
+    vector<unique_lock<mutex>> guards;
+    for (auto l : locks) guards.emplace_back(*l);
+    return guards;
+}
+
+unordered_map<string, ServerResp> CSLClient::GetPeerInfo() {
     const string file_id = getFileIdentifier();
-    uint64_t min_seq = UINT64_MAX;
-    size_t recover_size;
-    string ip_recover_src;
+    unordered_map<string, ServerResp> resps;
+    auto guards = lockChannels();
     for (auto &p : remote_props) {
         struct ClientReq getinfo_req;
         getinfo_req.type = GET_INFO;
@@ -580,38 +1732,63 @@ tuple<string, size_t> CSLClient::getRecoverSrcPeer() {
     }
 
     for (auto &p : remote_props) {
-        struct ServerResp getinfo_resp;
-        recv(p.second.socket, &getinfo_resp, sizeof(getinfo_resp), 0);
-        if (getinfo_resp.seq != 0 && getinfo_resp.seq < min_seq) {
-            min_seq = getinfo_resp.seq;
-            recover_size = getinfo_resp.size;
-            ip_recover_src = p.first;
+        struct ServerResp getinfo_resp = {};
+        recv(p.second.socket, &getinfo_resp, sizeof(getinfo_resp), MSG_WAITALL);
+        raiseHorizon(getinfo_resp.size);  // e.g. a recovering client, the peer may have spilled what it holds
+        resps[p.first] = getinfo_resp;
+    }
+    return resps;
+}
+
+tuple<vector<string>, size_t> CSLClient::getRecoverSrcPeers() {
+    uint64_t min_seq = UINT64_MAX;
+    size_t recover_size;
+    vector<string> srcs;
+    unordered_map<string, ServerResp> resps = GetPeerInfo();
+    for (auto &r : resps) {
+        if (r.second.seq != 0 && r.second.seq < min_seq) {
+            min_seq = r.second.seq;
+            recover_size = r.second.size;
         }
     }
-    if (min_seq == UINT64_MAX)
-        recover_size = 0;  // none server has replication for this file 
-    return make_tuple(ip_recover_src, recover_size);
+    if (min_seq == UINT64_MAX) {
+        recover_size = 0;  // none server has replication for this file
+    } else {
+        // every replica in the same state can serve a stripe of the recovery
+        for (auto &r : resps) {
+            if (r.second.seq == min_seq && r.second.size == recover_size) srcs.push_back(r.first);
+        }
+    }
+    return make_tuple(srcs, recover_size);
 }
 
-void CSLClient::recoverFromSrc(string &recover_src, size_t size) {
-    auto &p = remote_props[recover_src];
-    auto token = make_shared<RequestToken>(context);
-    p.qp->read(buffer.get(), p.remote_buffer_token, size, token.get());  // todo: if size > max_uint32, need multiple writes
-    token->waitUntilCompleted();
+void CSLClient::recoverFromSrcs(const vector<string> &srcs, size_t size) {
+    if (!growTo(size)) {
+        LOG(ERROR) << "Failed to grow log to " << size << "B for recovery";
+        return;
+    }
+    RecoverStriped(srcs, size, RECOVERY_CHUNK_SIZE);
     file_size = size;
     // no need to recover seq number, just let it start from 0
 }
 
-void CSLClient::syncPeerAfterRecover(const string &skip_peer) {
+void CSLClient::syncPeerAfterRecover(const vector<string> &skip_peers) {
     vector<string> peers_to_sync;
     for (auto &p : peers) {
-        if (p.compare(skip_peer) == 0) continue;
+        if (find(skip_peers.begin(), skip_peers.end(), p) != skip_peers.end()) continue;
         peers_to_sync.push_back(p);
     }
 
     recoverPeers(peers_to_sync);
 }
 
+bool CSLClient::waitPeersSynced() {
+    if (!recovering.load(memory_order_acquire)) return true;
+    unique_lock<mutex> lk(recovery_lock);
+    recovery_cv.wait(lk, [this] { return !recovering.load(memory_order_acquire) || recover_lost; });
+    return !recovering.load(memory_order_acquire);
+}
+
 void CSLClient::watchForPeerJoin() {
     int ret = zoo_get_children(zh, ZK_SVR_ROOT_PATH.c_str(), 1, nullptr);
     if (ret) {
@@ -619,22 +1796,309 @@ void CSLClient::watchForPeerJoin() {
     }
 }
 
-void CSLClient::SendFinalization(int type) {
+void CSLClient::SendFinalization(int type, size_t used) {
     if (!in_use) return;
     ClientReq req;
+    req.fi.size = used;
     const string file_identifier = getFileIdentifier();
     strcpy(req.fi.file_id, file_identifier.c_str());
     req.type = type;
 
     for (auto &p : remote_props) {
+        lock_guard<mutex> guard(*p.second.channel);
         send(p.second.socket, &req, sizeof(req), 0);
     }
 }
 
 void CSLClient::ReplaceBuffer(size_t size) {
-    if (size <= buffer->getSizeInBytes()) return;
-    mr_pool->RecycleMR(buffer);
-    buffer = mr_pool->GetMRofSize(size);
+    size = min(size, MAX_LOG_SIZE);
+    while (segments->GetCapacity() < size) {
+        if (!segments->AddSegment()) return;
+    }
+}
+
+bool CSLClient::growTo(size_t end) {
+    if (end > MAX_LOG_SIZE) return false;
+    if (ec) end = min((end + ecRowSize() - 1) / ecRowSize() * ecRowSize(), MAX_LOG_SIZE);  // parity reads whole rows
+    if (end <= segments->GetCapacity()) return true;
+
+    lock_guard<mutex> guard(grow_lock);
+    while (segments->GetCapacity() < end) {
+        // peers first, a write to the new segment may be posted as soon as it's added locally
+        int n = peerSegmentsFor(segmentBegin(segments->GetCount() + 1));
+        for (auto &p : remote_props) {
+            if (!growPeer(p.second, n)) return false;
+        }
+        if (!growParity(n) || !segments->AddSegment()) return false;
+        LOG(INFO) << filename << " grows to " << segments->GetCapacity() / 1024.0 / 1024.0 << "MB";
+    }
+    return true;
+}
+
+bool CSLClient::fetchRemoteSegment(RemoteConData &p, int i, bool pin) {
+    ClientReq req;
+    req.type = pin ? PIN_SEGMENT : ADD_SEGMENT;
+    req.segment = i;
+    req.fi.size = segmentSize(i);
+    const string file_identifier = getFileIdentifier();
+    strcpy(req.fi.file_id, file_identifier.c_str());
+    {
+        lock_guard<mutex> guard(*p.channel);
+        if (pin && (p.pinned >> i & 1)) {
+            p.pin_refs[i]++;
+            return true;
+        }
+        send(p.socket, &req, sizeof(req), 0);
+        RegionToken token;  // a refusal has size 0, the token in use is kept
+        int ret = recv(p.socket, &token, sizeof(RegionToken), MSG_WAITALL);
+        if (ret != sizeof(RegionToken) || token.getSizeInBytes() < segmentSize(i)) {
+            LOG(ERROR) << "Failed to " << (pin ? "pin" : "add") << " segment " << i << " on peer "
+                       << p.qp->getRemoteAddr();
+            return false;
+        }
+        p.remote_segments[i] = token;
+        p.pinned = pin ? p.pinned | 1U << i : p.pinned & ~(1U << i);
+        if (pin) p.pin_refs[i]++;
+    }
+    p.n_segments = max(p.n_segments, i + 1);
+    return true;
+}
+
+void CSLClient::pinSegments(RemoteConData &p, uint64_t remote_off, uint64_t size, uint32_t &held) {
+    uint64_t horizon = spill_horizon.load(memory_order_relaxed);
+    // the first segment is never spilled, and segments past a hot one are hot too
+    for (int i = max(segmentOf(remote_off), 1); i < p.n_segments && segmentBegin(i) < remote_off + size &&
+                                                segmentBegin(i + 1) + SPILL_HOT_SIZE <= horizon;
+         i++) {
+        if (held >> i & 1) continue;
+        // a refused pin leaves the token in use, the access fails if the segment was spilled
+        if (fetchRemoteSegment(p, i, true)) held |= 1U << i;
+    }
+}
+
+unordered_map<string, uint32_t> CSLClient::pinPeers(uint64_t remote_off, uint64_t size) {
+    unordered_map<string, uint32_t> held;
+    int first = segmentOf(remote_off);
+    if (first == 0 || segmentBegin(first + 1) + SPILL_HOT_SIZE > spill_horizon.load(memory_order_relaxed)) return held;
+    for (auto &p : remote_props) pinSegments(p.second, remote_off, size, held[p.first]);
+    return held;
+}
+
+void CSLClient::unpinSegments(RemoteConData &p, uint32_t held) {
+    if (held == 0) return;
+    ClientReq req;
+    req.type = UNPIN_SEGMENT;
+    req.fi.size = 0;
+    const string file_identifier = getFileIdentifier();
+    strcpy(req.fi.file_id, file_identifier.c_str());
+    lock_guard<mutex> guard(*p.channel);
+    for (int i = 1; i < MAX_LOG_SEGMENTS; i++) {
+        // refs are reset when the file is opened again
+        if (!(held >> i & 1) || p.pin_refs[i] == 0 || --p.pin_refs[i] > 0 || !(p.pinned >> i & 1)) continue;
+        req.segment = i;
+        send(p.socket, &req, sizeof(req), 0);
+        p.pinned &= ~(1U << i);
+    }
+}
+
+void CSLClient::releasePins() {
+    for (auto &p : remote_props) {
+        auto &held = p.second.held_pins;
+        // a failed peer completes nothing more, the pins go with the file
+        while (!held.empty() && (p.second.failed || held.front().first <= p.second.completed_ops)) {
+            unpinSegments(p.second, held.front().second);
+            held.pop_front();
+        }
+    }
+}
+
+int CSLClient::peerSegmentsFor(size_t capacity) {
+    // with erasure coding a peer only holds one shard, about 1/k of the log
+    return segmentsFor(ec ? shardEnd(capacity) : capacity);
+}
+
+bool CSLClient::growPeer(RemoteConData &p, int n) {
+    while (p.n_segments < n) {
+        if (!fetchRemoteSegment(p, p.n_segments)) return false;
+    }
+    return true;
+}
+
+bool CSLClient::growParity(int n) {
+    for (auto &ps : parity) {
+        while (ps->GetCount() < n) {
+            if (!ps->AddSegment()) return false;
+        }
+    }
+    return true;
+}
+
+ssize_t CSLClient::reserveAppend(size_t size, size_t &off) {
+    size = min(size, MAX_LOG_SIZE - min(buf_offset.load(), MAX_LOG_SIZE));
+    off = buf_offset.fetch_add(size);
+    if (off >= MAX_LOG_SIZE && size == 0) {
+        errno = EFBIG;
+        return -1;
+    }
+    if (!growTo(off + size)) {
+        errno = ENOSPC;
+        return -1;
+    }
+    return size;
+}
+
+void CSLClient::postWrite(RemoteConData &p, LogSegments *src, uint64_t local_off, uint64_t remote_off, uint64_t size,
+                          CombinedRequestToken *token, SeqWrite record, Buffer *from, uint64_t from_off) {
+    infinity::queues::OperationFlags flags;
+    flags.inlined = INLINE_WRITE_SIZE > 0;  // the sequence number and records are small
+    RequestToken *data_token = token ? &token->data_token_ : nullptr, *seq_token = token ? &token->seq_token_ : nullptr;
+    src->MarkWritten(local_off, size);
+    if (record.kind == SeqWrite::COMMIT_TRAILER && !from && size + sizeof(CommitTrailer) <= INLINE_WRITE_SIZE) {
+        // staged with its trailer so that the whole write is one inline work request, the staging slot can be reused
+        // as soon as the post returns
+        char *staging = reinterpret_cast<char *>(meta->getData()) + INLINE_STAGING_OFFSET;
+        memcpy(staging, src->GetBase() + local_off, size);
+        memcpy(staging + size, reinterpret_cast<char *>(meta->getData()) + COMMIT_STAGING_OFFSET, sizeof(CommitTrailer));
+        int rs = segmentOf(remote_off);
+        p.qp->write(meta.get(), INLINE_STAGING_OFFSET, remoteSegment(p, rs), remote_off - segmentBegin(rs),
+                    size + sizeof(CommitTrailer), flags, data_token);
+        if (seq_token) seq_token->setCompleted(true);
+        dispatcher->Kick();
+        return;
+    }
+    if (record.kind == SeqWrite::COMMIT_TRAILER) {
+        // foldCommit() checked [data | trailer] fits one segment, the sequence number needs no work request of its own
+        int ls = segmentOf(local_off), rs = segmentOf(remote_off);
+        infinity::memory::Buffer *buffers[2] = {from ? from : src->GetSegment(ls), meta.get()};
+        uint32_t sizes[2] = {static_cast<uint32_t>(size), sizeof(CommitTrailer)};
+        uint64_t offsets[2] = {from ? from_off : local_off - segmentBegin(ls), COMMIT_STAGING_OFFSET};
+        int skip = size == 0 ? 1 : 0;  // an empty write only moves the trailer
+        p.qp->multiWrite(buffers + skip, sizes + skip, offsets + skip, 2 - skip, remoteSegment(p, rs),
+                         remote_off - segmentBegin(rs), data_token);
+        if (seq_token) seq_token->setCompleted(true);
+        dispatcher->Kick();
+        return;
+    }
+    // the commit write completes after the data on the same QP, and with an error if the data failed, so it is the
+    // only signaled work request
+    postData(p, src, local_off, remote_off, size, nullptr, from, from_off);
+    if (data_token) data_token->setCompleted(true);
+    if (record.kind == SeqWrite::LOG_RECORD) {
+        uint64_t slot = META_RECORDS_OFFSET + record.slot * sizeof(LogRecord);
+        p.qp->write(meta.get(), slot, &p.remote_meta, slot, sizeof(LogRecord), flags, seq_token);
+    } else if (record.kind == SeqWrite::PROGRESS) {
+        uint64_t slot = PROGRESS_STAGING_OFFSET + record.slot * sizeof(WriteProgress);
+        p.qp->writeWithImmediate(meta.get(), slot, &p.remote_meta, META_PROGRESS_OFFSET, sizeof(WriteProgress),
+                                 p.file_handle, flags, seq_token);
+    } else {
+        p.qp->write(meta.get(), META_SEQ_OFFSET, &p.remote_meta, META_SEQ_OFFSET, sizeof(uint64_t), flags,
+                    seq_token);
+    }
+    dispatcher->Kick();
+}
+
+void CSLClient::postData(RemoteConData &p, LogSegments *src, uint64_t local_off, uint64_t remote_off, uint64_t size,
+                         RequestToken *token, Buffer *from, uint64_t from_off) {
+    infinity::queues::OperationFlags flags;
+    while (true) {
+        int ls = segmentOf(local_off), rs = segmentOf(remote_off);
+        // a registered application buffer is contiguous, only the remote side splits
+        uint64_t len = min({size, from ? size : segmentBegin(ls + 1) - local_off, segmentBegin(rs + 1) - remote_off,
+                            static_cast<uint64_t>(UINT32_MAX)});
+        bool last = len == size;
+        flags.inlined = !from && len <= INLINE_WRITE_SIZE;
+        if (from) {
+            p.qp->write(from, from_off, remoteSegment(p, rs), remote_off - segmentBegin(rs), len, flags,
+                        last ? token : nullptr);
+        } else {
+            p.qp->write(src->GetSegment(ls), local_off - segmentBegin(ls), remoteSegment(p, rs),
+                        remote_off - segmentBegin(rs), len, flags, last ? token : nullptr);
+        }
+        if (last) break;
+        local_off += len;
+        remote_off += len;
+        from_off += len;
+        size -= len;
+    }
+}
+
+uint64_t CSLClient::advanceEnd(uint64_t off, uint64_t size) {
+    uint64_t end = log_end.load();
+    while (end < off + size && !log_end.compare_exchange_weak(end, off + size))
+        ;
+    return max(end, off + size);
+}
+
+CSLClient::SeqWrite CSLClient::frameRecord(uint64_t off, uint64_t size) {
+    uint64_t id = record_id.fetch_add(1);
+    int slot = id % LOG_RECORD_SLOTS;
+    auto rec = reinterpret_cast<LogRecord *>(reinterpret_cast<char *>(meta->getData()) + META_RECORDS_OFFSET) + slot;
+    rec->id = id;
+    rec->seq = *seq_addr;
+    rec->offset = off;
+    rec->length = size;
+    rec->end = advanceEnd(off, size);
+    raiseHorizon(rec->end);
+    rec->data_crc = crc32c(segments->GetBase() + off, size);
+    rec->crc = crc32c(rec, offsetof(LogRecord, crc));
+    return {SeqWrite::LOG_RECORD, slot};
+}
+
+CSLClient::SeqWrite CSLClient::stageProgress(uint64_t end) {
+    // a slot is reused PROGRESS_SLOTS writes later, long after its write was posted
+    uint64_t id = progress_id.fetch_add(1);
+    int slot = id % PROGRESS_SLOTS;
+    auto staged = reinterpret_cast<WriteProgress *>(reinterpret_cast<char *>(meta->getData()) +
+                                                    PROGRESS_STAGING_OFFSET) + slot;
+    staged->version = id + 1;
+    staged->seq = *seq_addr;
+    staged->end = end;
+    staged->version_end = id + 1;
+    raiseHorizon(end);
+    return {SeqWrite::PROGRESS, slot};
+}
+
+CSLClient::SeqWrite CSLClient::foldCommit(uint64_t off, uint32_t &size, uint64_t &stale, uint32_t &stale_len) {
+    stale = commit_tail;
+    stale_len = 0;
+#if FOLD_COMMIT
+    if (ec || off + size < commit_tail) return SeqWrite();
+    stale_len = staleTrailerBelow(commit_tail, commit_end, off);
+    commit_tail = off + size;
+    uint64_t end = off + size + sizeof(CommitTrailer);
+    if (end <= segmentBegin(segmentOf(off) + 1) && end <= segments->GetCapacity() && end - off <= UINT32_MAX) {
+        auto trailer = reinterpret_cast<CommitTrailer *>(reinterpret_cast<char *>(meta->getData()) +
+                                                         COMMIT_STAGING_OFFSET);
+        trailer->seq = *seq_addr;
+        trailer->magic = COMMIT_MAGIC;
+        commit_end = end;
+        return {SeqWrite::COMMIT_TRAILER, 0};
+    }
+    // the peers would otherwise find the old trailer after the new end of the log
+    uint64_t stale_end = min<uint64_t>(commit_end, segments->GetCapacity());
+    if (stale_end > off + size && stale_end - off <= UINT32_MAX) size = stale_end - off;
+    commit_end = 0;
+#endif
+    return SeqWrite();
+}
+
+void CSLClient::postRead(RemoteConData &p, LogSegments *dst, uint64_t local_off, uint64_t remote_off, uint64_t size,
+                         RequestToken *token) {
+    infinity::queues::OperationFlags flags;
+    dst->MarkWritten(local_off, size);
+    while (true) {
+        int ls = segmentOf(local_off), rs = segmentOf(remote_off);
+        uint64_t len = min({size, segmentBegin(ls + 1) - local_off, segmentBegin(rs + 1) - remote_off,
+                            static_cast<uint64_t>(UINT32_MAX)});
+        bool last = len == size;
+        p.qp->read(dst->GetSegment(ls), local_off - segmentBegin(ls), remoteSegment(p, rs),
+                   remote_off - segmentBegin(rs), len, flags, last ? token : nullptr);
+        if (last) break;
+        local_off += len;
+        remote_off += len;
+        size -= len;
+    }
+    dispatcher->Kick();
 }
 
 void CSLClient::SetFileInfo(const char *name, size_t size) {
@@ -645,28 +2109,86 @@ void CSLClient::SetFileInfo(const char *name, size_t size) {
     open_req.type = OPEN_FILE;
     open_req.fi.size = size;
     strcpy(open_req.fi.file_id, file_identifier.c_str());
-    for (auto &c : remote_props) {
-        send(c.second.qp->getRemoteSocket(), &open_req, sizeof(open_req), 0);
+    vector<string> failed;
+    {
+        auto guards = lockChannels();
+        for (auto &c : remote_props) {
+            send(c.second.qp->getRemoteSocket(), &open_req, sizeof(open_req), 0);
+        }
+        for (auto &c : remote_props) {
+            LogRegionTokens tokens;
+            int ret = recv(c.second.qp->getRemoteSocket(), &tokens, sizeof(tokens), MSG_WAITALL);
+            if (ret != sizeof(tokens) || tokens.first_segment.getSizeInBytes() < segmentSize(0)) {
+                LOG(ERROR) << "Peer " << c.first << " failed to open " << file_identifier;
+                failed.push_back(c.first);
+                continue;
+            }
+            c.second.remote_meta = tokens.meta;
+            c.second.remote_segments[0] = tokens.first_segment;
+            c.second.n_segments = 1;
+            c.second.pinned = 0;
+            fill(begin(c.second.pin_refs), end(c.second.pin_refs), 0);
+            c.second.held_pins.clear();
+            c.second.file_handle = tokens.file_handle;
+        }
     }
+    lock_guard<mutex> guard(grow_lock);
+    int n = peerSegmentsFor(segments->GetCapacity());
     for (auto &c : remote_props) {
-        recv(c.second.qp->getRemoteSocket(), c.second.qp->getUserData(), sizeof(RegionToken), 0);
+        if (find(failed.begin(), failed.end(), c.first) == failed.end() && !growPeer(c.second, n)) {
+            failed.push_back(c.first);
+        }
+    }
+    if (!growParity(n)) LOG(ERROR) << "Failed to grow the parity of " << filename;
+    // writes must not go through the tokens of a refused segment
+    for (auto &addr : failed) dropPeer(addr);
+    if (!failed.empty()) {
+        if (zh) updateClientZKNode();
+        LOG(WARNING) << "working under reduced redundancy, peer num: " << remote_props.size()
+                     << ", expected num: " << rep_factor;
     }
 }
 
 void CSLClient::TryRecover() {
     // todo: get file info on creating connection to save 1 rtt
-    string recover_src;
-    size_t recover_size;
-    std::tie(recover_src, recover_size) = getRecoverSrcPeer();
+    stopRecovery();
+    if (ec) {
+        recoverErasureCoded();
+        return;
+    }
+    std::tie(recover_srcs, recover_size) = getRecoverSrcPeers();
+    commit_tail = recover_size;
+    commit_end = recover_size + sizeof(CommitTrailer);  // the servers strip a trailer the last client left there
 
+#if LAZY_RECOVERY
+    if (recover_size > 0) {
+        if (!growTo(recover_size)) {
+            LOG(ERROR) << "Failed to grow log to " << recover_size << "B for recovery";
+            return;
+        }
+        LOG(INFO) << "lazily recover " << recover_size << "B for " << filename << " from " << recover_srcs.size()
+                  << " replicas";
+        size_t n_chunks = (recover_size + RECOVERY_CHUNK_SIZE - 1) / RECOVERY_CHUNK_SIZE;
+        auto r = make_shared<LazyRecovery>();
+        r->size = recover_size;
+        r->chunks.reset(new atomic<uint8_t>[n_chunks]());
+        atomic_store(&lazy, r);
+        file_size = recover_size;
+        recovering.store(true, memory_order_release);
+        prefetch_th = thread(&CSLClient::prefetchFunc, this);
+        return;
+    }
+#else
     if (recover_size > 0) {
-        LOG(INFO) << "recover " << recover_size << "B for " << filename << " from " << recover_src;
-        recoverFromSrc(recover_src, recover_size);
+        LOG(INFO) << "recover " << recover_size << "B for " << filename << " from " << recover_srcs.size()
+                  << " replicas";
+        recoverFromSrcs(recover_srcs, recover_size);
     }
+#endif
 #ifdef LATENCY
     auto before_sync = high_resolution_clock::now();
 #endif
-    syncPeerAfterRecover(recover_src);
+    syncPeerAfterRecover(recover_srcs);
 
 #ifdef LATENCY
     auto after_sync = high_resolution_clock::now();
@@ -674,12 +2196,186 @@ void CSLClient::TryRecover() {
 #endif
 }
 
+bool CSLClient::fetchChunks(size_t begin, size_t end) {
+    auto r = atomic_load(&lazy);
+    if (!r) return true;  // stopped meanwhile
+    end = min(end, r->size);
+    for (size_t c = begin / RECOVERY_CHUNK_SIZE; c * RECOVERY_CHUNK_SIZE < end; c++) {
+        if (!fetchChunk(*r, c)) return false;
+    }
+    return true;
+}
+
+bool CSLClient::fetchChunk(LazyRecovery &r, size_t c) {
+    while (true) {
+        uint8_t expected = CHUNK_MISSING;
+        if (r.chunks[c].compare_exchange_strong(expected, CHUNK_FETCHING)) {
+            RequestToken token(context);
+            string src;
+            RemoteConData p;
+            uint32_t held = 0;
+            if (!postChunkRead(r, c, &token, src, p, held)) {
+                setChunkState(r, c, CHUNK_MISSING);
+                return false;
+            }
+            dispatcher->WaitUntilCompleted(&token);
+            unpinSegments(p, held);
+            if (token.wasSuccessful()) {
+                setChunkState(r, c, CHUNK_PRESENT);
+                return true;
+            }
+            failSource(src);
+            setChunkState(r, c, CHUNK_MISSING);
+        } else if (expected == CHUNK_PRESENT) {
+            return true;
+        } else {
+            // fetched by another thread, which may fail and leave it to us
+            unique_lock<mutex> lk(recovery_lock);
+            recovery_cv.wait(lk, [&]() { return r.chunks[c].load(memory_order_acquire) != CHUNK_FETCHING; });
+        }
+    }
+}
+
+bool CSLClient::postChunkRead(LazyRecovery &r, size_t c, RequestToken *token, string &src, RemoteConData &p,
+                              uint32_t &held) {
+    {
+        // a source may be dropped by the ZooKeeper watcher at any time
+        lock_guard<mutex> lk(recovery_lock);
+        for (size_t i = 0; i < recover_srcs.size() && src.empty(); i++) {
+            const string &s = recover_srcs[(c + i) % recover_srcs.size()];  // striped across replicas
+            auto it = remote_props.find(s);
+            if (it == remote_props.end() || recover_failed.count(s)) continue;
+            src = s;
+            p.qp = it->second.qp;
+            p.remote_meta = it->second.remote_meta;
+            copy(begin(it->second.remote_segments), end(it->second.remote_segments), begin(p.remote_segments));
+            p.n_segments = it->second.n_segments;
+            p.socket = it->second.socket;
+            p.channel = it->second.channel;
+            p.file_handle = it->second.file_handle;
+            // its own pins, the server counts them apart from those of the writers
+        }
+    }
+    if (src.empty()) {
+        LOG(ERROR) << "No replica left to recover chunk " << c << " of " << filename << " from";
+        return false;
+    }
+    size_t off = c * RECOVERY_CHUNK_SIZE;
+    pinSegments(p, off, min(RECOVERY_CHUNK_SIZE, r.size - off), held);
+    postRead(p, off, off, min(RECOVERY_CHUNK_SIZE, r.size - off), token);
+    return true;
+}
+
+void CSLClient::setChunkState(LazyRecovery &r, size_t c, ChunkState state) {
+    {
+        lock_guard<mutex> lk(recovery_lock);
+        r.chunks[c].store(state, memory_order_release);
+    }
+    recovery_cv.notify_all();
+}
+
+void CSLClient::failSource(const string &src) {
+    LOG(WARNING) << "Failed to read from " << src << ", recovery of " << filename << " goes on from other replicas";
+    lock_guard<mutex> lk(recovery_lock);
+    recover_failed.insert(src);
+}
+
+void CSLClient::prefetchFunc() {
+    auto start = high_resolution_clock::now();
+    auto r = atomic_load(&lazy);
+    size_t n_chunks = (r->size + RECOVERY_CHUNK_SIZE - 1) / RECOVERY_CHUNK_SIZE;
+    struct Inflight {
+        size_t chunk;
+        string src;
+        unique_ptr<RequestToken> token;
+        RemoteConData p;  // holds the pins of the read
+        uint32_t held;
+    };
+    vector<deque<Inflight>> inflight(recover_srcs.size());
+    bool lost = false;
+    auto complete = [&](Inflight &f) {
+        dispatcher->WaitUntilCompleted(f.token.get());
+        unpinSegments(f.p, f.held);
+        if (f.token->wasSuccessful()) {
+            setChunkState(*r, f.chunk, CHUNK_PRESENT);
+            return;
+        }
+        failSource(f.src);
+        setChunkState(*r, f.chunk, CHUNK_MISSING);
+        if (!prefetch_stop && !fetchChunk(*r, f.chunk)) lost = true;  // again from another replica
+    };
+    for (size_t c = 0; c < n_chunks && !prefetch_stop && !lost; c++) {
+        uint8_t expected = CHUNK_MISSING;
+        if (!r->chunks[c].compare_exchange_strong(expected, CHUNK_FETCHING)) continue;  // read on demand
+        auto &q = inflight[c % inflight.size()];
+        if (q.size() >= RECOVERY_WINDOW) {
+            complete(q.front());
+            q.pop_front();
+        }
+        Inflight f{c, "", unique_ptr<RequestToken>(new RequestToken(context)), RemoteConData(), 0};
+        if (!postChunkRead(*r, c, f.token.get(), f.src, f.p, f.held)) {
+            setChunkState(*r, c, CHUNK_MISSING);
+            lost = true;
+            break;
+        }
+        q.push_back(move(f));
+    }
+    for (auto &q : inflight) {  // posted reads must complete even if stopped, they write to the log
+        for (auto &f : q) complete(f);
+    }
+    if (prefetch_stop) return;
+    if (lost) {
+        LOG(ERROR) << "Lazy recovery of " << filename << " has no up-to-date replica left, missing chunks fail to read";
+        {
+            lock_guard<mutex> lk(recovery_lock);
+            recover_lost = true;
+        }
+        recovery_cv.notify_all();
+        return;
+    }
+
+    auto after_fetch = high_resolution_clock::now();
+    vector<string> srcs;
+    {
+        lock_guard<mutex> lk(recovery_lock);
+        for (auto &src : recover_srcs) {
+            if (remote_props.count(src) && !recover_failed.count(src)) srcs.push_back(src);
+        }
+    }
+    syncPeerAfterRecover(srcs);
+    {
+        lock_guard<mutex> lk(recovery_lock);
+        recovering.store(false, memory_order_release);
+    }
+    recovery_cv.notify_all();  // writes waiting for the peers to be resynced
+    LOG(INFO) << "recovered " << recover_size << "B for " << filename << " in "
+              << duration_cast<microseconds>(after_fetch - start).count() << "us, sync peers: "
+              << duration_cast<microseconds>(high_resolution_clock::now() - after_fetch).count() << "us";
+}
+
+void CSLClient::stopRecovery() {
+    prefetch_stop = true;
+    if (prefetch_th.joinable()) prefetch_th.join();
+    prefetch_stop = false;
+    recovering.store(false, memory_order_release);
+    atomic_store(&lazy, shared_ptr<LazyRecovery>());  // readers still fetching keep theirs
+    recover_size = 0;
+    {
+        lock_guard<mutex> lk(recovery_lock);
+        recover_failed.clear();
+        recover_lost = false;
+    }
+    recovery_cv.notify_all();
+}
+
 void CSLClient::TryLocalRecover(int fd) {
     struct stat log_stat;
     fstat(fd, &log_stat);
     if (log_stat.st_size > 0) {
         LOG(INFO) << "recover " << log_stat.st_size << "B from local";
-        read(fd, buffer->getData(), log_stat.st_size);
+        if (!growTo(log_stat.st_size)) return;
+        read(fd, segments->GetBase(), log_stat.st_size);
+        segments->MarkWritten(0, log_stat.st_size);
         for (auto &p : peers)
             recoverPeer(p);
     }
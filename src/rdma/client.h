@@ -19,8 +19,12 @@
 #include <infinity/memory/RegionToken.h>
 #include <infinity/queues/QueuePair.h>
 #include <infinity/queues/QueuePairFactory.h>
+#include <sys/uio.h>
 #include <zookeeper/zookeeper.h>
 
+#include <condition_variable>
+#include <deque>
+#include <map>
 #include <memory>
 #include <mutex>
 #include <queue>
@@ -30,6 +34,10 @@
 #include <unordered_map>
 
 #include "../csl_config.h"
+#include "common.h"
+#include "completion_dispatcher.h"
+#include "erasure_code.h"
+#include "log_segments.h"
 #include "mr_pool.h"
 #include "qp_pool.h"
 
@@ -41,49 +49,97 @@ class CSLClient {
     friend void ClientWatcher(zhandle_t *zh, int type, int state, const char *path, void *watcher_ctx);
 
     struct CombinedRequestToken {
-        Context *ctx_;
+        CompletionDispatcher *dispatcher_;
         RequestToken data_token_;
         RequestToken seq_token_;
         atomic<bool> all_prev_completed_;
         const string peer_;
-
-        CombinedRequestToken(Context *ctx, const string &peer)
-            : ctx_(ctx), data_token_(ctx), seq_token_(ctx), all_prev_completed_(false), peer_(peer) {}
+        const uint64_t op_;      // sequence of the replicated write this token belongs to
+        const bool signaled_;  // false if the writes were posted without it, none of its tokens ever completes
+
+        CombinedRequestToken(Context *ctx, CompletionDispatcher *dispatcher, const string &peer, uint64_t op = 0,
+                             bool signaled = true)
+            : dispatcher_(dispatcher),
+              data_token_(ctx),
+              seq_token_(ctx),
+              all_prev_completed_(false),
+              peer_(peer),
+              op_(op),
+              signaled_(signaled) {}
 
         void WaitUntilBothCompleted() {
-            while (!data_token_.completed.load() || !seq_token_.completed.load()) {
-                ctx_->pollTwoSendCompletion();
-            }
+            dispatcher_->WaitFor([this] { return data_token_.completed.load() && seq_token_.completed.load(); });
         }
 
         bool CheckIfBothCompleted() {
             if (data_token_.completed.load() && seq_token_.completed.load()) {
                 return true;
             } else {
-                ctx_->pollTwoSendCompletion();
+                dispatcher_->Poll();
                 return (data_token_.completed.load() && seq_token_.completed.load());
             }
         }
 
+        bool BothSucceeded() { return data_token_.wasSuccessful() && seq_token_.wasSuccessful(); }
+
         bool CheckAllPrevCompleted() { return all_prev_completed_.load(); }
 
         void SetAllPrevCompleted() { all_prev_completed_.store(true); }
     };
     struct RemoteConData {
         shared_ptr<infinity::queues::QueuePair> qp;
-        infinity::memory::RegionToken *remote_buffer_token;
+        infinity::memory::RegionToken remote_meta;
+        infinity::memory::RegionToken remote_segments[MAX_LOG_SEGMENTS];  // valid up to n_segments
+        int n_segments = 1;
         int socket;
-        queue<shared_ptr<CombinedRequestToken> > op_queue;
+        shared_ptr<mutex> channel;  // held while exchanging a request and its reply on socket
+        uint32_t file_handle;       // the file's handle on the peer
+        uint32_t pinned = 0;        // segments pinned with PIN_SEGMENT since their token was fetched, see channel
+        uint16_t pin_refs[MAX_LOG_SEGMENTS] = {};   // batches of accesses in flight holding each pin, see channel
+        deque<pair<uint64_t, uint32_t>> held_pins;  // {op, segments} pinned for writes in flight, see recover_lock
+        deque<shared_ptr<CombinedRequestToken> > op_queue;
+        uint64_t completed_ops = 0;  // op_ of the last token popped from op_queue
+        bool failed = false;         // a write completed with an error, the peer acknowledges no more writes
+    };
+    enum ChunkState : uint8_t { CHUNK_MISSING, CHUNK_FETCHING, CHUNK_PRESENT };
+    struct LazyRecovery {
+        size_t size;
+        unique_ptr<atomic<uint8_t>[]> chunks;  // ChunkState of each RECOVERY_CHUNK_SIZE chunk below size
+    };
+    /**
+     * What postWrite() writes to a peer after the data of a replicated write to commit it
+     */
+    struct SeqWrite {
+        enum Kind {
+            SEQ,             // the sequence number
+            LOG_RECORD,      // LogRecord slot, staged by frameRecord()
+            COMMIT_TRAILER,  // the CommitTrailer staged by foldCommit(), in the same work request as the data
+            PROGRESS,        // WriteProgress staging slot, staged by stageProgress()
+        };
+        Kind kind;
+        int slot;
+
+        SeqWrite(Kind kind = SEQ, int slot = 0) : kind(kind), slot(slot) {}
+    };
+
+    struct GroupCommitEntry {
+        size_t end;
+        bool filled;     // data has been copied to the local MR
+        bool committed;  // data has been replicated to a quorum
+        bool failed;     // the batch couldn't be replicated, or the range not recovered and then left out of batches
     };
 
    protected:
     infinity::core::Context *context;
+    CompletionDispatcher *dispatcher;
     // infinity::queues::QueuePairFactory *qp_factory;
     shared_ptr<NCLQpPool> qp_pool;
     shared_ptr<NCLMrPool> mr_pool;
     unordered_map<string, RemoteConData> remote_props;
     set<string> peers;
-    shared_ptr<infinity::memory::Buffer> buffer;
+    unique_ptr<LogSegments> segments;
+    shared_ptr<infinity::memory::Buffer> meta;  // holds the sequence number
+    mutex grow_lock;                            // serializes adding segments and peers
 #if ASYNC_QUORUM_POLL
     thread cq_poll_th;
     mutex poll_lock;
@@ -101,26 +157,223 @@ class CSLClient {
     mutex recover_lock;
 
     uint64_t *seq_addr;
-    uint64_t seq_offset;
     zhandle_t *zh;
 
+    bool write_back;      // replicate asynchronously, Sync() is the durability barrier
+    uint64_t posted_ops;  // number of replicated writes posted, protected by recover_lock
+    bool unsignaled_tail;  // the last write-back write was posted unsignaled, protected by recover_lock
+
+    /**
+     * Post a signaled write of the sequence number to every peer if the last write-back write was unsignaled, so that
+     * the writes before it get acknowledged. recover_lock held
+     */
+    void signalTail();
+
+    mutex gc_lock;
+    condition_variable gc_cv;
+    multimap<size_t, GroupCommitEntry *> gc_pending;  // ranges reserved by Append and not yet replicated, by offset
+    bool gc_leader_active;
+
+    mutex stdio_lock;
+    int stdio_mode;            // _IOFBF, _IOLBF or _IONBF, see SETVBUF(3)
+    size_t stdio_buf_size;     // replicate once this many bytes are buffered
+    size_t stdio_dirty_begin;  // range written by BufferedAppend but not yet replicated
+    size_t stdio_dirty_end;
+
+    mutex map_lock;
+    int map_count;                    // number of shared mappings of buffer, protected by map_lock
+    atomic<uintptr_t> map_begin;      // write-protected range of buffer, page aligned, empty if nothing is mapped
+    atomic<uintptr_t> map_end;        // writable
+    size_t mapped_end;                // end of the furthest writable shared mapping, as an offset of the log
+    // bitmap of pages in buffer written through a mapping. Allocated by the first writable mapping and kept until the
+    // client is destroyed, the fault handler may still read it while another thread drops the mappings
+    unique_ptr<atomic<uint64_t>[]> dirty_pages;
+
+    /**
+     * Write-protect [begin, end) again and return the dirty runs in [first_page, last_page), clearing their bits
+     */
+    vector<pair<size_t, size_t>> collectDirtyPages(size_t first_page, size_t last_page);
+
+    void dropMappings();
+
+    atomic<bool> recovering;  // lazy recovery in progress, chunks below recover_size may not be present yet
+    vector<string> recover_srcs;  // replicas with the latest state, recovery is striped across them
+    size_t recover_size;
+    shared_ptr<LazyRecovery> lazy;  // swapped with atomic_load/store, a reader keeps its own until it is done
+    set<string> recover_failed;     // sources a chunk read failed on, protected by recovery_lock with remote_props
+    bool recover_lost;              // lazy recovery ran out of sources, the peers are never resynced, recovery_lock
+    mutex recovery_lock;
+    condition_variable recovery_cv;
+    thread prefetch_th;
+    atomic<bool> prefetch_stop;
+
+    bool framing;                   // a LogRecord follows every replicated write
+    atomic<uint64_t> record_id;     // id of the next LogRecord
+    atomic<uint64_t> log_end;       // end of the log recorded in the last LogRecord
+
+    /**
+     * Fill the next LogRecord slot of the local metadata for a write of [off, off + size), with the checksum of the
+     * local data
+     *
+     * @return the postWrite() record writing the slot to the same slot of a peer in place of the sequence number
+     */
+    SeqWrite frameRecord(uint64_t off, uint64_t size);
+
+    bool progress;                  // replicated writes notify the peers of their progress with an immediate
+    atomic<uint64_t> progress_id;   // picks the local staging slot of the next WriteProgress
+
+    /**
+     * Move the end of the log recorded in log_end past a write of [off, off + size)
+     *
+     * @return the new end
+     */
+    uint64_t advanceEnd(uint64_t off, uint64_t size);
+
+    /**
+     * Stage the WriteProgress of a write in the next local slot, with the current sequence number
+     *
+     * @return the postWrite() record writing it to the peers with an immediate
+     */
+    SeqWrite stageProgress(uint64_t end);
+
+    atomic<uint64_t> spill_horizon;  // highest end of the log a peer may have been told of
+
+    void raiseHorizon(uint64_t end) {
+        uint64_t h = spill_horizon.load();
+        while (h < end && !spill_horizon.compare_exchange_weak(h, end))
+            ;
+    }
+
+    /**
+     * Token of segment i on peer p, which pinSegments() must have pinned if it may be spilled
+     */
+    RegionToken *remoteSegment(RemoteConData &p, int i) { return &p.remote_segments[i]; }
+
+    /**
+     * A peer built with SERVER_SPILL may move segments far below the end of the log to SSD and free their memory. So
+     * before accessing [remote_off, remote_off + size) on peer p, the segments of the range more than SPILL_HOT_SIZE
+     * below the horizon are pinned in the peer's memory with PIN_SEGMENT, which also gives their current token.
+     *
+     * @param held segments the caller already holds a pin on, which are skipped, and those pinned now are added
+     */
+    void pinSegments(RemoteConData &p, uint64_t remote_off, uint64_t size, uint32_t &held);
+
+    /**
+     * pinSegments() on every peer, before a write to [remote_off, remote_off + size) takes recover_lock
+     *
+     * @return segments pinned on each peer, empty if the range isn't cold
+     */
+    unordered_map<string, uint32_t> pinPeers(uint64_t remote_off, uint64_t size);
+
+    /**
+     * Drop the pins of held once the accesses through them are complete, a segment no access holds any more is
+     * unpinned with UNPIN_SEGMENT and may be spilled again
+     */
+    void unpinSegments(RemoteConData &p, uint32_t held);
+
+    /**
+     * unpinSegments() the held_pins of the writes every peer has completed, with recover_lock held
+     */
+    void releasePins();
+
+    uint64_t commit_tail;  // end of the log on the peers, protected by recover_lock
+    uint64_t commit_end;   // end of the last CommitTrailer posted, 0 if overwritten, protected by recover_lock
+
+    /**
+     * Decide whether a write of [off, off + size) carries its sequence number in a CommitTrailer right after the data.
+     * Only a write reaching the tail of the log can, otherwise the trailer would overwrite data, and the trailer must
+     * land in the same segment as the data. A tail write that can't fold is widened over the stale trailer of the
+     * previous one, with the local bytes there. A write past the tail leaves the stale trailer in the hole, which
+     * must be posted from the local log ahead of the write either way.
+     *
+     * @param stale set to the start of the stale trailer in the hole
+     * @param stale_len set to its length, 0 if there is none
+     * @return COMMIT_TRAILER if the trailer was staged in the local metadata, SEQ for a separate sequence number write
+     */
+    SeqWrite foldCommit(uint64_t off, uint32_t &size, uint64_t &stale, uint32_t &stale_len);
+
+    bool zero_copy;        // large writes are posted from the caller's buffer
+    size_t zero_copy_min;  // smallest write posted from the caller's buffer
+
+    bool useZeroCopy(int iovcnt, size_t size) {
+        return zero_copy && iovcnt == 1 && size >= zero_copy_min && size <= UINT32_MAX && !ec && !framing &&
+               !write_back;
+    }
+
+    /**
+     * Replicate [off, off + size) from buf through a registration of the caller's buffer. The local image is filled
+     * while the NIC reads buf, and every peer is waited for, not only a quorum, since the caller may reuse buf once
+     * this returns.
+     *
+     * @param failed set with errno if the write was taken but no quorum has it, or the peers aren't in sync
+     * @return true once a quorum has the data, false if buf can't be registered, nothing has been done then, or failed
+     */
+    bool writeZeroCopy(const void *buf, uint64_t off, uint32_t size, bool &failed);
+
+    unique_ptr<ErasureCode> ec;                // null if every peer holds a full copy
+    vector<unique_ptr<LogSegments>> parity;    // local copy of each parity shard
+    vector<string> shard_peers;                // peer holding each shard, data shards first, empty if lost
+    bool shards_assigned;                      // shard ids have been written to the peers of the current file
+    bool shards_lost;                          // fewer than k shards survived, the file can't be written
+
+    struct ChunkDigest {
+        uint64_t version;  // LogSegments version of the chunk when the digest was taken
+        size_t len;
+        uint64_t digest;  // 0 if not computed yet
+    };
+    mutex digest_lock;
+    vector<ChunkDigest> chunk_digests;  // cached digests of the local copy, protected by digest_lock
+
+    /**
+     * @return digest of the first size bytes of chunk c of the local copy, recomputed only if the chunk was written
+     * since it was last taken. Called with digest_lock held
+     */
+    uint64_t localDigest(size_t c, size_t size);
+
+    /**
+     * Ask a peer for the digests of the first size bytes of the log
+     *
+     * @return chunks whose content on the peer differs from the local copy
+     */
+    vector<size_t> staleChunks(const string &peer, size_t size);
+
    public:
     CSLClient() = default;
     CSLClient(shared_ptr<NCLQpPool> qp_pool, shared_ptr<NCLMrPool> mr_pool, set<string> host_addresses, size_t buf_size,
               uint32_t id = 0, const char *filename = "");
     CSLClient(shared_ptr<NCLQpPool> qp_pool, shared_ptr<NCLMrPool> mr_pool, string mgr_hosts, size_t buf_size,
-              uint32_t id = 0, const char *filename = "", int rep_num = DEFAULT_REP_FACTOR, bool try_recover = false);
+              uint32_t id = 0, const char *filename = "", int rep_num = DEFAULT_REP_FACTOR, bool try_recover = false,
+              int ec_parity = 0);
     ~CSLClient();
 
     /**
      * Synchronously write to all replicas
+     *
+     * @return false if fewer than a quorum of them took the write
      */
-    void WriteSync(uint64_t local_off, uint64_t remote_off, uint32_t size);
+    bool WriteSync(uint64_t local_off, uint64_t remote_off, uint32_t size);
     void ReadSync(uint64_t local_off, uint64_t remote_off, uint32_t size);
     /**
      * Write to a quorum of replicas before return
+     *
+     * @return false if too many peers failed to gather a quorum
+     */
+    bool WriteQuorum(uint64_t local_off, uint64_t remote_off, uint32_t size);
+
+    /**
+     * Post a write to all replicas and return without waiting for completion. If more than MAX_INFLIGHT_WRITES writes
+     * are not yet acknowledged by a quorum, block until the window drains. Only every SIGNAL_INTERVAL-th write is
+     * signaled, it acknowledges the ones before it.
+     */
+    void WriteAsync(uint64_t local_off, uint64_t remote_off, uint32_t size);
+
+    /**
+     * Wait until every write posted so far has been acknowledged by a quorum of replicas.
+     * Behavior of this call is expected to be consistent with glibc FSYNC(2)
+     *
+     * @return 0 on success, -1 with errno set to EIO if too many peers failed to gather a quorum
      */
-    void WriteQuorum(uint64_t local_off, uint64_t remote_off, uint32_t size);
+    int Sync();
 
     /**
      * Append to the end of the log.
@@ -131,6 +384,16 @@ class CSLClient {
      */
     ssize_t Append(const void *buf, size_t size);
 
+    /**
+     * Append the buffers described by iov to the end of the log as one replicated write.
+     * Behavior of this call is expected to be consistent with glibc WRITEV(2)
+     *
+     * @param iov buffers to be appended, in order
+     * @param iovcnt number of buffers in iov
+     * @return size of data appended, or -1 with errno set
+     */
+    ssize_t AppendVec(const struct iovec *iov, int iovcnt);
+
     /**
      * Write to specified position in the log.
      * Behavior of this call is expected to be consistent with glibc PWRITE(2)
@@ -141,6 +404,12 @@ class CSLClient {
      */
     ssize_t WritePos(const void *buf, size_t size, off_t pos);
 
+    /**
+     * Write the buffers described by iov to specified position in the log as one replicated write.
+     * Behavior of this call is expected to be consistent with glibc PWRITEV(2)
+     */
+    ssize_t WritePosVec(const struct iovec *iov, int iovcnt, off_t pos);
+
     /**
      * Read from the log.
      * Behavior of this call is expected to be consistent with glibc READ(2)
@@ -151,6 +420,12 @@ class CSLClient {
      */
     ssize_t Read(void *buf, size_t size);
 
+    /**
+     * Read from the log into the buffers described by iov.
+     * Behavior of this call is expected to be consistent with glibc READV(2)
+     */
+    ssize_t ReadVec(const struct iovec *iov, int iovcnt);
+
     /**
      * Read from specified position in the log.
      * Behavior of this call is expected to be consistent with glibc PREAD(2)
@@ -161,6 +436,12 @@ class CSLClient {
      */
     ssize_t ReadPos(void *buf, size_t size, off_t pos);
 
+    /**
+     * Read from specified position in the log into the buffers described by iov.
+     * Behavior of this call is expected to be consistent with glibc PREADV(2)
+     */
+    ssize_t ReadPosVec(const struct iovec *iov, int iovcnt, off_t pos);
+
     /**
      * This function does the same as lseek(). See `man lseek` for detail.
      * Not all whence are supported
@@ -181,9 +462,65 @@ class CSLClient {
      */
     char *GetLine(char *s, int size);
 
+    /**
+     * Append for stdio streams. Data is copied to the MR right away, but only replicated on Flush(), once the stream
+     * buffer size is reached, or at a newline in line buffered mode.
+     * Behavior of this call is expected to be consistent with glibc FWRITE(3)
+     *
+     * @return size of data appended
+     */
+    size_t BufferedAppend(const void *buf, size_t size);
+
+    /**
+     * Replicate data buffered by BufferedAppend.
+     * Behavior of this call is expected to be consistent with glibc FFLUSH(3)
+     */
+    int Flush();
+
+    /**
+     * Set the buffering mode of the stdio stream backed by this log.
+     * Behavior of this call is expected to be consistent with glibc SETVBUF(3)
+     *
+     * @param mode _IOFBF, _IOLBF or _IONBF
+     * @param size buffer size, 0 to keep the current one
+     * @return 0 on success, nonzero if mode is invalid
+     */
+    int SetBuffering(int mode, size_t size);
+
+    /**
+     * Map the MR into the caller's address space. Shared mappings return buffer itself, so stores go to the MR
+     * directly. Written pages are tracked by write-protecting them and catching the first store in a SIGSEGV handler,
+     * they are replicated on MapSync() or Unmap(). Private mappings get a copy of the data.
+     * Behavior of this call is expected to be consistent with glibc MMAP(2), except the mapping can't go beyond the MR
+     *
+     * @return address of the mapping, or MAP_FAILED with errno set
+     */
+    void *Map(size_t len, int prot, int flags, off_t offset);
+
+    /**
+     * Replicate pages in [addr, addr + len) written through a mapping, as a batch of writes to the quorum. Unless
+     * MS_ASYNC is set, wait until they are acknowledged.
+     * Behavior of this call is expected to be consistent with glibc MSYNC(2)
+     */
+    int MapSync(void *addr, size_t len, int flags);
+
+    /**
+     * Sync and release a shared mapping returned by Map()
+     * Behavior of this call is expected to be consistent with glibc MUNMAP(2)
+     */
+    int Unmap(void *addr, size_t len);
+
+    /**
+     * Called from the SIGSEGV handler. If addr is in a write-protected mapping of this client, mark the page dirty and
+     * make it writable.
+     *
+     * @return true if the fault is handled
+     */
+    bool HandleWriteFault(void *addr);
+
     int Eof() { return buf_offset >= file_size ? 1 : 0; }
 
-    void *GetBufData() { return buffer->getData(); }
+    void *GetBufData() { return segments->GetBase(); }
 
     /**
      * Reset the client to unuse state
@@ -201,29 +538,39 @@ class CSLClient {
      * @param type type of finalization
      * close file: server will preserve the QP for future use
      * exit process: server will destroy the QP
+     * @param used bytes of the log that may be non-zero, the server only zeroes those before reusing the memory
      */
-    void SendFinalization(int type = CLOSE_FILE);
+    void SendFinalization(int type = CLOSE_FILE, size_t used = SIZE_MAX);
 
     /**
-     * If buffer of a greater size is needed, recycle the buffer and get a new buffer from MR pool
+     * Make sure at least size bytes are backed by local segments. Segments of the peers are fetched by SetFileInfo
      * @param size size of the new buffer needed
      */
     void ReplaceBuffer(size_t size);
 
     /**
      * Set file info locally, sync file info with each replication server (fileid, size), and
-     * get back MR region token from each replication server. Called at each file openning.
+     * get back MR region token from each replication server. Called at each file openning. A peer that fails to open
+     * the file or to add its segments is dropped.
      *
      * @param name name of the (new) file
-     * @param size max possible size of the (new) file
+     * @param size initial size of the (new) file
      */
     void SetFileInfo(const char *name, size_t size);
 
     /**
-     * Try to recover log content from an available replication peer
+     * Try to recover log content from an available replication peer. With LAZY_RECOVERY the file is usable right away:
+     * chunks are fetched when first accessed and a background thread prefetches the rest in file order, then brings
+     * the other peers up to date.
      */
     void TryRecover();
 
+    /**
+     * Read the first size bytes of the log from replicas into the local MR. Chunk c of chunk_size bytes is read from
+     * srcs[c % srcs.size()], with up to RECOVERY_WINDOW reads in flight per replica.
+     */
+    void RecoverStriped(const vector<string> &srcs, size_t size, size_t chunk_size);
+
     /**
      * Experiment API.
      * Try to recover log content from a local file. 
@@ -233,23 +580,240 @@ class CSLClient {
     const set<string> &GetPeers() { return peers; }
     size_t GetBufSize() { return buf_size; }
     size_t GetFileSize() { return file_size; }
+
+    /**
+     * @return whether [addr, addr + len) overlaps the address space reserved for the log
+     */
+    bool InLog(const void *addr, size_t len) {
+        uintptr_t a = reinterpret_cast<uintptr_t>(addr), base = reinterpret_cast<uintptr_t>(segments->GetBase());
+        return a < base + MAX_LOG_SIZE && a + len > base;
+    }
     size_t GetOffset() { return buf_offset.load(); }
     void SetInUse(bool is_inuse) { in_use = is_inuse; }
+
+    /**
+     * Select between write-through (every write waits for a quorum) and write-back (writes return after the local
+     * copy, durability is reached at Sync()) replication for the current file
+     */
+    void SetWriteBack(bool enable);
+    bool IsWriteBack() { return write_back; }
     uint32_t GetId() { return id; }
 
+    bool IsErasureCoded() { return ec != nullptr; }
+
+    /**
+     * Frame every replicated write with a checksummed LogRecord so servers find the end of the log without scanning
+     * it and detect torn writes. Not used for erasure-coded logs
+     */
+    void SetRecordFraming(bool enable) { framing = enable && !ec; }
+    bool IsRecordFraming() { return framing; }
+
+    /**
+     * Let the peers track the end and sequence number of the log from WRITE_WITH_IMM completions, so they answer
+     * GET_INFO without scanning the log. Framed writes keep their records instead.
+     */
+    void SetProgressNotify(bool enable) { progress = enable && !ec; }
+    bool IsProgressNotify() { return progress; }
+
+    /**
+     * Post writes of at least min_size bytes straight from the caller's buffer instead of copying them to the local MR
+     * first. The buffer is registered on first use and stays registered in the MR pool's UserMrCache. Applies to
+     * single-buffer writes of replicated files without record framing or write-back.
+     */
+    void SetZeroCopy(bool enable, size_t min_size = ZERO_COPY_THRESHOLD) {
+        zero_copy = enable;
+        zero_copy_min = min_size;
+    }
+    bool IsZeroCopy() { return zero_copy; }
+
+    /**
+     * @return GET_INFO reply of every peer
+     */
+    unordered_map<string, ServerResp> GetPeerInfo();
+
+    /**
+     * Lock the control channels of all peers, in address order since other files may share them
+     */
+    vector<unique_lock<mutex>> lockChannels();
+
+    /**
+     * @return bytes of memory registered for the current file on all peers
+     */
+    size_t GetRemoteMemory();
+
    private:
     void init(set<string> host_addresses);
+
+    /**
+     * Make sure [0, end) is backed by segments locally and on every peer, adding segments if needed
+     *
+     * @return false if end is beyond MAX_LOG_SIZE or a segment can't be added
+     */
+    bool growTo(size_t end);
+
+    /**
+     * Get the token of segment i of the current file from a peer, the peer allocates it if needed
+     *
+     * @param pin pin the segment in the peer's memory with PIN_SEGMENT unless it already is, and take a reference on
+     * the pin, see unpinSegments()
+     */
+    bool fetchRemoteSegment(RemoteConData &p, int i, bool pin = false);
+
+    /**
+     * @return number of segments a peer needs when the local log has capacity bytes, fewer than the local count for
+     * an erasure-coded log
+     */
+    int peerSegmentsFor(size_t capacity);
+
+    /**
+     * Add segments to a peer, and to the local parity shards of an erasure-coded log, until it holds n. Called with
+     * grow_lock held
+     */
+    bool growPeer(RemoteConData &p, int n);
+    bool growParity(int n);
+
+    /**
+     * Reserve up to size bytes at the end of the log and grow the log to hold them
+     *
+     * @param off set to the offset of the reserved range
+     * @return number of bytes reserved, which is less than size only at MAX_LOG_SIZE, or -1 with errno set
+     */
+    ssize_t reserveAppend(size_t size, size_t &off);
+
+    /**
+     * Post the writes of [local_off, local_off + size) to a peer, split at segment boundaries, followed by the write of
+     * record. Only the record write is signaled, the data token is completed right away. With COMMIT_TRAILER the data
+     * and the staged trailer go in one work request, with PROGRESS the WriteProgress replaces the sequence number and
+     * carries an immediate.
+     */
+    void postWrite(RemoteConData &p, uint64_t local_off, uint64_t remote_off, uint64_t size,
+                   CombinedRequestToken *token, SeqWrite record = SeqWrite()) {
+        postWrite(p, segments.get(), local_off, remote_off, size, token, record);
+    }
+    void postWrite(RemoteConData &p, LogSegments *src, uint64_t local_off, uint64_t remote_off, uint64_t size,
+                   CombinedRequestToken *token, SeqWrite record = SeqWrite(), Buffer *from = nullptr,
+                   uint64_t from_off = 0);
+
+    /**
+     * Post the data writes of postWrite(), with token on the last one. The data comes from src, or from offset
+     * from_off of from if it is set, e.g. a registered application buffer.
+     */
+    void postData(RemoteConData &p, LogSegments *src, uint64_t local_off, uint64_t remote_off, uint64_t size,
+                  RequestToken *token, Buffer *from = nullptr, uint64_t from_off = 0);
+
+    /**
+     * Post the reads of [remote_off, remote_off + size) from a peer, split at segment boundaries. Only the last read
+     * is signaled.
+     */
+    void postRead(RemoteConData &p, uint64_t local_off, uint64_t remote_off, uint64_t size, RequestToken *token) {
+        postRead(p, segments.get(), local_off, remote_off, size, token);
+    }
+    void postRead(RemoteConData &p, LogSegments *dst, uint64_t local_off, uint64_t remote_off, uint64_t size,
+                  RequestToken *token);
     void createClientZKNode();
     void updateClientZKNode();
 
     bool quorumCompleted(vector<shared_ptr<CombinedRequestToken> > &tokens);
 
+    /**
+     * Pop the head of each peer's op_queue if it has completed. Polls the CQ once per peer. A peer whose write
+     * completed with an error is marked failed and its queue is no longer popped.
+     */
+    void pollOpQueues();
+
+    /**
+     * @return whether enough peers haven't failed a write to acknowledge the next ones by a quorum
+     */
+    bool quorumAlive();
+
+    /**
+     * @return the number of leading writes that have been acknowledged by a quorum of replicas
+     */
+    uint64_t quorumCompletedOps();
+
+    /**
+     * Replicate a local range with either WriteQuorum or WriteAsync according to the mode of the file
+     *
+     * @return false and errno set to EIO if the write can't reach a quorum
+     */
+    bool replicate(uint64_t off, uint32_t size);
+
+    /**
+     * Set up k + m erasure coding over the peers, called before any peer is added
+     */
+    void initErasureCode(int k, int m);
+
+    size_t ecRowSize() { return ec->GetDataShards() * EC_STRIPE_UNIT; }
+
+    /**
+     * @return bytes of each shard holding [0, end) of the log
+     */
+    size_t shardEnd(size_t end) { return (end + ecRowSize() - 1) / ecRowSize() * EC_STRIPE_UNIT; }
+
+    /**
+     * Erasure-coded counterpart of replicate(). Each EC_STRIPE_UNIT piece of the range is written to its data shard,
+     * and the same range of every parity shard is re-encoded from the local log and written to the parity peers.
+     * Waits for every shard.
+     *
+     * @return false without writing anything if fewer than k + 1 shards are reachable, the write wouldn't survive
+     * the loss of another peer
+     */
+    bool replicateErasureCoded(uint64_t off, uint64_t size);
+
+    /**
+     * Give every connected peer a shard and record it in the peer's metadata, so a restarted client knows which
+     * shard each peer holds
+     */
+    void assignShards();
+    void writeShardId(const string &peer, int shard);
+
+    /**
+     * Post the write of file_size to META_EC_END_OFFSET of a shard, recovery can't tell the end of the log from the
+     * content of the shards
+     */
+    void postEcEnd(RemoteConData &p, RequestToken *token);
+    int shardOf(const string &peer);
+
+    /**
+     * Write a whole shard of the current file to a peer, used when a peer replaces a lost one
+     */
+    void pushShard(const string &peer, int shard);
+
+    /**
+     * Read the first rows stripe units of a shard into segments or its parity copy
+     *
+     * @return false if any of the reads failed
+     */
+    bool readShard(int shard, size_t rows);
+
+    /**
+     * Rebuild the log from any k shards after a client restart. A shard whose read fails is rebuilt like a lost one,
+     * from the others.
+     *
+     * @return false if fewer than k shards survive, the peers are left untouched and the file can't be written
+     */
+    bool recoverErasureCoded();
+
+    /**
+     * Append with group commit. Each thread reserves its range and copies its data, then one of the waiting threads
+     * becomes the leader and replicates the longest contiguous run of filled ranges with a single WriteQuorum (one
+     * write per peer and one sequence number update), and wakes up the others once a quorum is reached.
+     */
+    ssize_t appendGroupCommit(const struct iovec *iov, int iovcnt, size_t size);
+
     /**
      * @return number of peers already exists for this client. If this is the first time the client
      * connects to ZK, 0 will be returned
      */
     int getPeersFromZK(set<string> &peer_ips);
     
+    /**
+     * Remove a replication peer from the client, without replacing it
+     *
+     * @return false if the client has no such peer
+     */
+    bool dropPeer(const string &addr);
+
     /**
      * Remove a replication peer from the client and add a new replication peer
      * @param old_addr address of the peer to be removed
@@ -266,30 +830,87 @@ class CSLClient {
     bool recoverPeers(const vector<string> &new_addrs);
 
     /**
-     * Get the ip address of the replication server from which the client recover the lost data.
+     * Get the ip addresses of the replication servers from which the client recover the lost data.
      * Usually called after an client crash.
-     * @return ip address of replication server that serves as recover source and number of bytes to recover
+     * @return ip addresses of replication servers with the same latest state and number of bytes to recover
      */
-    tuple<string, size_t> getRecoverSrcPeer();
+    tuple<vector<string>, size_t> getRecoverSrcPeers();
 
     /**
-     * Get the lost data from a replication server
+     * Get the lost data from replication servers
      *
-     * @param recover_src ip of the replication server to get the data from
-     * @param size size to get from the replication server
+     * @param srcs ips of the replication servers to get the data from
+     * @param size size to get from the replication servers
      */
-    void recoverFromSrc(string &recover_src, size_t size);
+    void recoverFromSrcs(const vector<string> &srcs, size_t size);
+
+    /**
+     * Bring the first size bytes of the log on peers up to date with the local copy. Only the RECOVERY_CHUNK_SIZE
+     * chunks a peer reports a different digest for are written, with up to RECOVERY_WINDOW chunks in flight per peer
+     */
+    void pushChunked(const vector<string> &dsts, size_t size);
 
     /**
      * Sync the state of all replication peers after client is recovered. We need this step because the state of peers
      * may not be the same and we must bring them to the same before continuing.
      *
-     * @param skip_peer The peer to skip, which is the peer we used to recover the client.
+     * @param skip_peers The peers to skip, which are the peers we used to recover the client.
+     */
+    void syncPeerAfterRecover(const vector<string> &skip_peers);
+
+    /**
+     * Wait until the peers that weren't recovery sources have been resynced. Until then they are behind the sources,
+     * a write reaching them would bump their sequence number over the prefix they miss, and a recovery after another
+     * crash could pick one of them as a source.
+     *
+     * @return false if the lazy recovery failed and they never will be
      */
-    void syncPeerAfterRecover(const string &skip_peer);
+    bool waitPeersSynced();
 
     void watchForPeerJoin();
 
+    /**
+     * Block until [off, off + size) is present locally, fetching missing chunks from the recovery sources. No-op when
+     * no lazy recovery is in progress.
+     *
+     * @return false if a chunk can't be fetched, no up-to-date replica is left
+     */
+    bool ensureRecovered(size_t off, size_t size) {
+        return !recovering.load(memory_order_acquire) || fetchChunks(off, off + size);
+    }
+
+    bool fetchChunks(size_t begin, size_t end);
+
+    /**
+     * Post the read of chunk c from the next recovery source that is still a peer and hasn't failed a read
+     *
+     * @param src set to the source read from
+     * @param p set to a copy of the source's connection, which holds the pins of the read
+     * @param held set to the segments pinned for the read, unpinSegments() once it completes
+     * @return false if no source is left
+     */
+    bool postChunkRead(LazyRecovery &r, size_t c, RequestToken *token, string &src, RemoteConData &p, uint32_t &held);
+    void setChunkState(LazyRecovery &r, size_t c, ChunkState state);
+    void failSource(const string &src);
+
+    /**
+     * Fetch chunk c unless another thread already did, or wait for the thread fetching it. A failed read is retried
+     * from another source.
+     *
+     * @return false if no source is left
+     */
+    bool fetchChunk(LazyRecovery &r, size_t c);
+
+    /**
+     * Body of prefetch_th, fetch all chunks in file order then sync the other peers
+     */
+    void prefetchFunc();
+
+    /**
+     * Stop the prefetcher and discard the lazy recovery state
+     */
+    void stopRecovery();
+
     /**
      * A human-readable unique identifier of each file
      */
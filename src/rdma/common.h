@@ -8,6 +8,9 @@
 #pragma once
 
 #include <stddef.h>
+#include <stdint.h>
+
+#include "../csl_config.h"
 
 #define OPEN_FILE   1
 #define CLOSE_FILE  2
@@ -15,6 +18,10 @@
 #define GET_INFO    4
 #define SYNC_PEER   5
 #define SYNC_PEER_DONE  6
+#define ADD_SEGMENT 7
+#define GET_DIGESTS 8
+#define PIN_SEGMENT 9
+#define UNPIN_SEGMENT 10  // no reply
 
 #define MAX_FILE_ID_LENGTH 512
 
@@ -26,10 +33,76 @@ struct FileInfo {
 
 struct ClientReq {
     int type;
-    FileInfo fi;
+    FileInfo fi;  // fi.size is the number of bytes to digest for GET_DIGESTS, or that may be non-zero for CLOSE_FILE
+    int segment;  // index of the segment for ADD_SEGMENT, PIN_SEGMENT and UNPIN_SEGMENT
 }__attribute__((packed));
 
 struct ServerResp {
     size_t size;
     uint64_t seq;
+    uint64_t shard;  // 1 + index of the erasure code shard the server holds, 0 for a full copy
+    uint64_t resident;  // bytes of memory the file takes on the server, less than its MRs once segments are spilled
+    uint64_t log_end;   // end of the whole log of an erasure-coded file, as its client last wrote it
+};
+
+/**
+ * Layout of the per-file metadata region on a server
+ */
+#define META_SEQ_OFFSET     0
+#define META_SHARD_OFFSET   8
+#define META_PROGRESS_OFFSET 16   // WriteProgress of the last write with an immediate
+#define META_EC_END_OFFSET  48    // end of the whole log, written to every shard of an erasure-coded file
+#define META_RECORDS_OFFSET 4096  // journal of LogRecord, the rest of the region
+
+/**
+ * Frame of a replicated write, written to slot id % LOG_RECORD_SLOTS of the journal after the data. The newest valid
+ * record tells a server where the log ends without scanning it.
+ */
+struct LogRecord {
+    uint64_t id;        // increasing, 0 for an empty slot
+    uint64_t seq;
+    uint64_t offset;    // range of the log written
+    uint64_t length;
+    uint64_t end;       // end of the log after the write
+    uint32_t data_crc;  // CRC32C of the range
+    uint32_t crc;       // CRC32C of the fields above
+};
+
+#define LOG_RECORD_SLOTS ((LOG_META_SIZE - META_RECORDS_OFFSET) / sizeof(LogRecord))
+
+/**
+ * Sequence number carried in the same RDMA write as an append, right after its data, so a write to the tail of the log
+ * is a single work request. The last byte of the magic is TAIL_MARKER, which is where a backward scan for the end of
+ * the log stops; the trailer is then stripped and its seq is newer than the one in the metadata region.
+ */
+struct CommitTrailer {
+    uint64_t seq;
+    uint64_t magic;
+};
+
+/**
+ * Bytes of the CommitTrailer at [tail, trailer_end) that a write starting at off leaves in the hole below it. The
+ * peers would find it inside the log, so they must be written over from the local log, which has zeroes there.
+ */
+inline uint64_t staleTrailerBelow(uint64_t tail, uint64_t trailer_end, uint64_t off) {
+    return trailer_end > tail && off > tail ? (trailer_end < off ? trailer_end : off) - tail : 0;
+}
+
+/**
+ * Progress of a replicated write, written to META_PROGRESS_OFFSET with RDMA WRITE_WITH_IMM. The immediate is the
+ * file handle the server gave out with the region tokens, and its receive completion tells the server the progress is
+ * in place, so the server keeps the end of every log up to date without looking at the data.
+ *
+ * A newer write may land while the server copies the slot. The words of one work request are placed in address order,
+ * so the copy is consistent when the version it read last from the first word matches the one it read first from the
+ * last word, like a seqlock.
+ */
+struct WriteProgress {
+    uint64_t version;  // different for every write of a client, never 0
+    uint64_t seq;
+    uint64_t end;          // end of the log after the write
+    uint64_t version_end;  // same as version
 };
+static_assert(META_PROGRESS_OFFSET + sizeof(WriteProgress) <= META_EC_END_OFFSET, "WriteProgress overlaps");
+
+#define COMMIT_MAGIC 0xff54494d4d4f4321ULL  // "!COMMIT" followed by TAIL_MARKER in memory
@@ -0,0 +1,110 @@
+/*
+ * Send completion dispatcher for Compute-side log RDMA client
+ *
+ * Copyright 2022 UIUC
+ * Author: Xuhao Luo
+ */
+
+#include "completion_dispatcher.h"
+
+#include <glog/logging.h>
+#include <pthread.h>
+#include <sched.h>
+
+CompletionDispatcher::CompletionDispatcher(Context *context)
+    : context(context),
+      cq(context->getSendCompletionQueue()),
+      enabled(true),
+      running(false),
+      poller_asleep(false),
+      kicked(false),
+      sleepers(0),
+      dispatched(0),
+      spin_budget(POLLER_MIN_SPIN_POLLS) {}
+
+int CompletionDispatcher::reap() {
+    struct ibv_wc wc[DISPATCH_BATCH];
+    int n = ibv_poll_cq(cq, DISPATCH_BATCH, wc);
+    for (int i = 0; i < n; i++) {
+        if (wc[i].status != IBV_WC_SUCCESS) {
+            LOG(ERROR) << "Send completion error: " << ibv_wc_status_str(wc[i].status);
+        }
+        // the QPs post a signaled work request with its token as wr_id
+        auto token = reinterpret_cast<RequestToken *>(wc[i].wr_id);
+        if (token) token->setCompleted(wc[i].status == IBV_WC_SUCCESS);
+    }
+    return n;
+}
+
+int CompletionDispatcher::Poll() {
+    if (running) return 0;  // the poller thread owns the CQ
+    if (!enabled) return context->pollTwoSendCompletion();
+    unique_lock<mutex> guard(poll_lock, try_to_lock);
+    if (!guard.owns_lock()) return 0;  // the poller will complete our token too
+    return reap();
+}
+
+void CompletionDispatcher::Start(int cpu) {
+    if (running.exchange(true)) return;
+    poller = thread(&CompletionDispatcher::pollerFunc, this, cpu);
+}
+
+void CompletionDispatcher::Stop() {
+    if (!running.exchange(false)) return;
+    {
+        lock_guard<mutex> guard(wait_lock);
+        kick_cv.notify_all();
+        done_cv.notify_all();
+    }
+    poller.join();
+}
+
+void CompletionDispatcher::pollerFunc(int cpu) {
+    if (cpu >= 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        int ret = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+        if (ret) LOG(ERROR) << "Failed to pin the CQ poller to CPU " << cpu << ", errno: " << ret;
+    }
+    LOG(INFO) << "CQ poller running, cpu " << cpu;
+
+    int idle = 0;
+    while (running) {
+        int n;
+        {
+            lock_guard<mutex> guard(poll_lock);
+            n = reap();
+        }
+        if (n > 0) {
+            idle = 0;
+            dispatched += n;
+            if (sleepers.load() > 0) {
+                lock_guard<mutex> guard(wait_lock);
+                done_cv.notify_all();
+            }
+            continue;
+        }
+        if (++idle < spin_budget) continue;
+
+        // the CQ stays empty, sleep until a writer posts or the timeout, in case a kick was missed
+        auto start = chrono::steady_clock::now();
+        bool woken;
+        {
+            unique_lock<mutex> lk(wait_lock);
+            poller_asleep = true;
+            woken = kick_cv.wait_for(lk, chrono::microseconds(POLLER_MAX_SLEEP_US),
+                                     [this] { return kicked || !running; });
+            kicked = false;
+            poller_asleep = false;
+        }
+        auto slept = chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - start).count();
+        if (woken && slept < POLLER_MAX_SLEEP_US / 8) {
+            spin_budget = min(spin_budget * 2, POLLER_MAX_SPIN_POLLS);  // slept too early, spin longer
+        } else if (!woken) {
+            spin_budget = max(spin_budget / 2, POLLER_MIN_SPIN_POLLS);  // idle, give the core back sooner
+        }
+        idle = 0;
+    }
+    LOG(INFO) << "CQ poller stopped";
+}
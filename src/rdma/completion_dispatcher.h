@@ -0,0 +1,123 @@
+/*
+ * Send completion dispatcher for Compute-side log RDMA client
+ *
+ * Copyright 2022 UIUC
+ * Author: Xuhao Luo
+ */
+
+#pragma once
+
+#include <infinity/core/Context.h>
+#include <infinity/requests/RequestToken.h>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+#include "../csl_config.h"
+
+using namespace std;
+using infinity::core::Context;
+using infinity::requests::RequestToken;
+
+/**
+ * Reaps the send CQ of a Context in batches and completes the RequestToken each CQE belongs to, found from its wr_id.
+ * One thread polls the CQ at a time while the others spin on their own tokens, so writers of different files neither
+ * contend on the CQ lock nor take turns reaping each other's completions one or two at a time.
+ *
+ * With Start(), a dedicated poller thread owns the CQ. It busy-polls while completions keep coming and sleeps once
+ * the CQ has been empty for its spin budget, until a writer posts again. The budget adapts: it grows when the poller
+ * is woken up right after falling asleep and shrinks when it sleeps through a whole timeout. Waiters spin on their
+ * tokens for a while, then block until the poller dispatches more completions.
+ */
+class CompletionDispatcher {
+   private:
+    Context *context;
+    ibv_cq *cq;
+    mutex poll_lock;
+    atomic<bool> enabled;
+
+    thread poller;
+    atomic<bool> running;
+    mutex wait_lock;
+    condition_variable kick_cv;   // wakes up the poller
+    condition_variable done_cv;   // wakes up the waiters
+    atomic<bool> poller_asleep;
+    bool kicked;                  // protected by wait_lock
+    atomic<int> sleepers;         // waiters blocked on done_cv
+    atomic<uint64_t> dispatched;  // completions dispatched by the poller
+    int spin_budget;              // empty polls before the poller sleeps, only used by the poller
+
+    /**
+     * @return number of completions reaped from the CQ, poll_lock held
+     */
+    int reap();
+    void pollerFunc(int cpu);
+
+   public:
+    explicit CompletionDispatcher(Context *context);
+    ~CompletionDispatcher() { Stop(); }
+
+    /**
+     * Start the poller thread
+     *
+     * @param cpu CPU the thread is pinned to, -1 to let it float
+     */
+    void Start(int cpu = -1);
+    void Stop();
+    bool IsRunning() { return running; }
+
+    /**
+     * Reap the completions available, unless another thread already is
+     *
+     * @return number of completions dispatched by this call
+     */
+    int Poll();
+
+    /**
+     * Tell a sleeping poller there is work in flight. Called after posting signaled work requests
+     */
+    void Kick() {
+        if (!poller_asleep.load(memory_order_relaxed)) return;
+        lock_guard<mutex> guard(wait_lock);
+        kicked = true;
+        kick_cv.notify_one();
+    }
+
+    /**
+     * Wait until done() returns true, polling the CQ if there is no poller thread
+     */
+    template <class Pred>
+    void WaitFor(Pred done) {
+        if (!running) {
+            while (!done()) Poll();
+            return;
+        }
+        Kick();
+        for (int i = 0; i < WAITER_SPIN_POLLS; i++) {
+            if (done()) return;
+        }
+        sleepers++;
+        while (running) {
+            uint64_t seen = dispatched.load();  // read before done(), a later dispatch ends the wait
+            if (done()) break;
+            unique_lock<mutex> lk(wait_lock);
+            done_cv.wait_for(lk, chrono::microseconds(POLLER_MAX_SLEEP_US),
+                             [&] { return dispatched.load() != seen || !running; });
+        }
+        sleepers--;
+        while (!done()) Poll();  // the poller was stopped
+    }
+
+    void WaitUntilCompleted(RequestToken *token) {
+        WaitFor([token] { return token->completed.load(memory_order_acquire); });
+    }
+
+    /**
+     * When disabled, every waiter polls the Context itself, as before the dispatcher. For comparison
+     */
+    void SetEnabled(bool enable) { enabled = enable; }
+    bool IsEnabled() { return enabled; }
+};
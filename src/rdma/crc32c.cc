@@ -0,0 +1,60 @@
+/*
+ * CRC32C (Castagnoli) checksum for Compute-side log records
+ *
+ * Copyright 2022 UIUC
+ * Author: Xuhao Luo
+ */
+#include "crc32c.h"
+
+#include <string.h>
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+namespace {
+
+struct CrcTable {
+    uint32_t t[256];
+
+    CrcTable() {
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t c = i;
+            for (int b = 0; b < 8; b++) c = (c >> 1) ^ (0x82f63b78 & (0 - (c & 1)));  // reflected 0x1edc6f41
+            t[i] = c;
+        }
+    }
+};
+
+uint32_t crc32cSoftware(const uint8_t *p, size_t size, uint32_t crc) {
+    static const CrcTable table;  // built on first use, records may be checksummed before static initialization
+    for (size_t i = 0; i < size; i++) crc = table.t[(crc ^ p[i]) & 0xff] ^ (crc >> 8);
+    return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2"))) uint32_t crc32cHardware(const uint8_t *p, size_t size, uint32_t crc) {
+    uint64_t c = crc;
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8) {
+        uint64_t v;
+        memcpy(&v, p + i, sizeof(v));
+        c = _mm_crc32_u64(c, v);
+    }
+    crc = c;
+    for (; i < size; i++) crc = _mm_crc32_u8(crc, p[i]);
+    return crc;
+}
+#endif
+
+}  // namespace
+
+uint32_t crc32c(const void *buf, size_t size, uint32_t crc) {
+    const uint8_t *p = static_cast<const uint8_t *>(buf);
+    crc = ~crc;
+#if defined(__x86_64__)
+    static const bool has_sse42 = __builtin_cpu_supports("sse4.2");
+    if (has_sse42) return ~crc32cHardware(p, size, crc);
+#endif
+    return ~crc32cSoftware(p, size, crc);
+}
@@ -0,0 +1,17 @@
+/*
+ * CRC32C (Castagnoli) checksum for Compute-side log records
+ *
+ * Copyright 2022 UIUC
+ * Author: Xuhao Luo
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * CRC32C of size bytes, continuing from crc so a range can be checksummed in pieces. Uses the SSE4.2 crc32
+ * instruction when the CPU has it and a table otherwise.
+ */
+uint32_t crc32c(const void *buf, size_t size, uint32_t crc = 0);
@@ -0,0 +1,223 @@
+/*
+ * Reed-Solomon erasure code over GF(2^8) for Compute-side log
+ *
+ * Copyright 2022 UIUC
+ * Author: Xuhao Luo
+ */
+#include "erasure_code.h"
+
+#include <glog/logging.h>
+#include <string.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+namespace {
+
+const size_t ENCODE_BLOCK_SIZE = 16 * 1024;  // parity of a block is built while the block is still in cache
+
+struct GfTables {
+    uint8_t exp[512];
+    uint8_t log[256];
+
+    GfTables() {
+        int x = 1;
+        for (int i = 0; i < 255; i++) {
+            exp[i] = exp[i + 255] = x;
+            log[x] = i;
+            x <<= 1;
+            if (x & 0x100) x ^= 0x11d;  // x^8 + x^4 + x^3 + x^2 + 1
+        }
+        exp[510] = exp[511] = exp[0];
+        log[0] = 0;
+    }
+};
+
+const GfTables gf;
+
+uint8_t gfMul(uint8_t a, uint8_t b) { return (a && b) ? gf.exp[gf.log[a] + gf.log[b]] : 0; }
+
+uint8_t gfInv(uint8_t a) { return gf.exp[255 - gf.log[a]]; }
+
+/**
+ * Nibble tables of multiplication by c: [0, 16) is c * n, [16, 32) is c * (n << 4)
+ */
+void buildTables(uint8_t c, uint8_t *tables) {
+    for (int n = 0; n < 16; n++) {
+        tables[n] = gfMul(c, n);
+        tables[16 + n] = gfMul(c, n << 4);
+    }
+}
+
+void mulAddScalar(uint8_t *dst, const uint8_t *src, const uint8_t *tables, size_t len) {
+    for (size_t i = 0; i < len; i++) dst[i] ^= tables[src[i] & 0xf] ^ tables[16 + (src[i] >> 4)];
+}
+
+#if defined(__x86_64__)
+__attribute__((target("ssse3"))) void mulAddSsse3(uint8_t *dst, const uint8_t *src, const uint8_t *tables,
+                                                  size_t len) {
+    const __m128i lo = _mm_loadu_si128(reinterpret_cast<const __m128i *>(tables));
+    const __m128i hi = _mm_loadu_si128(reinterpret_cast<const __m128i *>(tables + 16));
+    const __m128i mask = _mm_set1_epi8(0x0f);
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16) {
+        __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + i));
+        __m128i p = _mm_xor_si128(_mm_shuffle_epi8(lo, _mm_and_si128(x, mask)),
+                                  _mm_shuffle_epi8(hi, _mm_and_si128(_mm_srli_epi64(x, 4), mask)));
+        __m128i d = _mm_loadu_si128(reinterpret_cast<const __m128i *>(dst + i));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i), _mm_xor_si128(d, p));
+    }
+    mulAddScalar(dst + i, src + i, tables, len - i);
+}
+
+__attribute__((target("avx2"))) void mulAddAvx2(uint8_t *dst, const uint8_t *src, const uint8_t *tables, size_t len) {
+    // vpshufb looks up within each 128-bit lane, so the tables are duplicated to both lanes
+    const __m256i lo = _mm256_broadcastsi128_si256(_mm_loadu_si128(reinterpret_cast<const __m128i *>(tables)));
+    const __m256i hi = _mm256_broadcastsi128_si256(_mm_loadu_si128(reinterpret_cast<const __m128i *>(tables + 16)));
+    const __m256i mask = _mm256_set1_epi8(0x0f);
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32) {
+        __m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src + i));
+        __m256i p = _mm256_xor_si256(_mm256_shuffle_epi8(lo, _mm256_and_si256(x, mask)),
+                                     _mm256_shuffle_epi8(hi, _mm256_and_si256(_mm256_srli_epi64(x, 4), mask)));
+        __m256i d = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(dst + i));
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + i), _mm256_xor_si256(d, p));
+    }
+    mulAddScalar(dst + i, src + i, tables, len - i);
+}
+#endif
+
+/**
+ * Invert a n x n matrix in place with Gauss-Jordan elimination
+ *
+ * @return false if the matrix is singular
+ */
+bool invertMatrix(vector<uint8_t> &a, int n) {
+    vector<uint8_t> inv(n * n, 0);
+    for (int i = 0; i < n; i++) inv[i * n + i] = 1;
+    for (int col = 0; col < n; col++) {
+        int pivot = col;
+        while (pivot < n && a[pivot * n + col] == 0) pivot++;
+        if (pivot == n) return false;
+        for (int j = 0; j < n; j++) {
+            swap(a[col * n + j], a[pivot * n + j]);
+            swap(inv[col * n + j], inv[pivot * n + j]);
+        }
+        uint8_t s = gfInv(a[col * n + col]);
+        for (int j = 0; j < n; j++) {
+            a[col * n + j] = gfMul(a[col * n + j], s);
+            inv[col * n + j] = gfMul(inv[col * n + j], s);
+        }
+        for (int row = 0; row < n; row++) {
+            uint8_t f = a[row * n + col];
+            if (row == col || f == 0) continue;
+            for (int j = 0; j < n; j++) {
+                a[row * n + j] ^= gfMul(f, a[col * n + j]);
+                inv[row * n + j] ^= gfMul(f, inv[col * n + j]);
+            }
+        }
+    }
+    a.swap(inv);
+    return true;
+}
+
+}  // namespace
+
+ErasureCode::ErasureCode(int k, int m)
+    : k(k), m(m), parity_matrix(m * k), parity_tables(m * k * 32), kernel(BestKernel()) {
+    DLOG_ASSERT(k > 0 && m >= 0 && k + m <= 256) << "Invalid erasure code " << k << "+" << m;
+    for (int q = 0; q < m; q++) {
+        for (int i = 0; i < k; i++) {
+            // Cauchy matrix 1 / (x_q + y_i) with x_q = k + q and y_i = i, every square submatrix is invertible
+            parity_matrix[q * k + i] = gfInv((k + q) ^ i);
+            buildTables(parity_matrix[q * k + i], &parity_tables[(q * k + i) * 32]);
+        }
+    }
+}
+
+ErasureCode::Kernel ErasureCode::BestKernel() {
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("avx2")) return AVX2;
+    if (__builtin_cpu_supports("ssse3")) return SSSE3;
+#endif
+    return SCALAR;
+}
+
+void ErasureCode::mulAdd(uint8_t *dst, const uint8_t *src, const uint8_t *tables, size_t len) {
+    switch (kernel) {
+#if defined(__x86_64__)
+        case AVX2:
+            mulAddAvx2(dst, src, tables, len);
+            break;
+        case SSSE3:
+            mulAddSsse3(dst, src, tables, len);
+            break;
+#endif
+        default:
+            mulAddScalar(dst, src, tables, len);
+            break;
+    }
+}
+
+void ErasureCode::Encode(const uint8_t *const *data, uint8_t *const *parity, size_t len) {
+    for (size_t off = 0; off < len; off += ENCODE_BLOCK_SIZE) {
+        size_t n = min(ENCODE_BLOCK_SIZE, len - off);
+        for (int q = 0; q < m; q++) {
+            memset(parity[q] + off, 0, n);
+            for (int i = 0; i < k; i++) mulAdd(parity[q] + off, data[i] + off, &parity_tables[(q * k + i) * 32], n);
+        }
+    }
+}
+
+bool ErasureCode::Reconstruct(uint8_t *const *shards, const bool *present, size_t len) {
+    vector<int> rows;  // the first k present shards
+    for (int s = 0; s < k + m && static_cast<int>(rows.size()) < k; s++) {
+        if (present[s]) rows.push_back(s);
+    }
+    if (static_cast<int>(rows.size()) < k) return false;
+
+    bool data_missing = false;
+    for (int i = 0; i < k; i++) data_missing |= !present[i];
+    if (data_missing) {
+        // rows of the generator for the chosen shards, inverted, map them back to the data shards
+        vector<uint8_t> decode(k * k, 0);
+        for (int r = 0; r < k; r++) {
+            if (rows[r] < k) {
+                decode[r * k + rows[r]] = 1;
+            } else {
+                memcpy(&decode[r * k], &parity_matrix[(rows[r] - k) * k], k);
+            }
+        }
+        if (!invertMatrix(decode, k)) return false;
+
+        uint8_t tables[32];
+        for (int d = 0; d < k; d++) {
+            if (present[d]) continue;
+            memset(shards[d], 0, len);
+            for (int r = 0; r < k; r++) {
+                if (decode[d * k + r] == 0) continue;
+                buildTables(decode[d * k + r], tables);
+                mulAdd(shards[d], shards[rows[r]], tables, len);
+            }
+        }
+    }
+
+    bool parity_missing = false;
+    for (int q = 0; q < m; q++) parity_missing |= !present[k + q];
+    if (parity_missing) {
+        vector<uint8_t *> parity;
+        vector<uint8_t> scratch;
+        for (int q = 0; q < m; q++) {
+            if (!present[k + q]) {
+                parity.push_back(shards[k + q]);
+            } else {
+                // Encode() writes every parity shard, keep the present ones intact
+                if (scratch.empty()) scratch.resize(len);
+                parity.push_back(scratch.data());
+            }
+        }
+        Encode(shards, parity.data(), len);
+    }
+    return true;
+}
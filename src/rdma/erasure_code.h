@@ -0,0 +1,72 @@
+/*
+ * Reed-Solomon erasure code over GF(2^8) for Compute-side log
+ *
+ * Copyright 2022 UIUC
+ * Author: Xuhao Luo
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <vector>
+
+using namespace std;
+
+/**
+ * Systematic Reed-Solomon code with k data shards and m parity shards. The generator is an identity on top of a
+ * Cauchy matrix, so any k of the k + m shards reconstruct the others. The code is byte-wise: byte i of a parity shard
+ * only depends on byte i of the data shards, so a write to a range of a data shard only changes the same range of the
+ * parity shards.
+ *
+ * Multiplication by a constant is done with two 16-entry tables, one per nibble, which maps to PSHUFB. The AVX2 or
+ * SSSE3 kernel is picked at runtime, with a scalar fallback.
+ */
+class ErasureCode {
+   public:
+    enum Kernel { SCALAR, SSSE3, AVX2 };
+
+   private:
+    int k;
+    int m;
+    vector<uint8_t> parity_matrix;  // m x k, row q holds the coefficients of parity shard q
+    vector<uint8_t> parity_tables;  // 32 bytes of nibble tables per coefficient of parity_matrix
+    Kernel kernel;
+
+    void mulAdd(uint8_t *dst, const uint8_t *src, const uint8_t *tables, size_t len);
+
+   public:
+    ErasureCode(int k, int m);
+
+    int GetDataShards() { return k; }
+    int GetParityShards() { return m; }
+
+    /**
+     * @return the fastest kernel this CPU supports
+     */
+    static Kernel BestKernel();
+
+    /**
+     * Force a kernel, for testing and benchmarking. The kernel must be supported by the CPU
+     */
+    void SetKernel(Kernel kern) { kernel = kern; }
+    Kernel GetKernel() { return kernel; }
+
+    /**
+     * Compute len bytes of each parity shard from len bytes of each data shard
+     *
+     * @param data k pointers to data shards
+     * @param parity m pointers to parity shards, overwritten
+     */
+    void Encode(const uint8_t *const *data, uint8_t *const *parity, size_t len);
+
+    /**
+     * Rebuild the missing shards from any k present ones
+     *
+     * @param shards k + m pointers, data shards first, missing ones are overwritten
+     * @param present k + m flags telling which shards hold valid content
+     * @return false if fewer than k shards are present
+     */
+    bool Reconstruct(uint8_t *const *shards, const bool *present, size_t len);
+};
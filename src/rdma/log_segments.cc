@@ -0,0 +1,87 @@
+/*
+ * Segmented log layout shared by Compute-side log RDMA client and server
+ *
+ * Copyright 2022 UIUC
+ * Author: Xuhao Luo
+ */
+#include "log_segments.h"
+
+#include <errno.h>
+#include <glog/logging.h>
+#include <string.h>
+#include <sys/mman.h>
+
+static const size_t SEGMENT_ALIGN = 2 * 1024 * 1024;  // huge page boundary segments start on with a placement policy
+
+LogSegments::LogSegments(Context *context, MrPlacementPolicy *placement)
+    : context(context), placement(placement), count(0), clock(0), high_water(0) {
+    // only address space is reserved, memory is committed segment by segment
+    size_t align = placement && placement->GetPageSize() >= SEGMENT_ALIGN ? SEGMENT_ALIGN : 0;
+    reserved = MAX_LOG_SIZE + align;
+    char *raw = reinterpret_cast<char *>(
+        mmap(nullptr, reserved, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0));
+    if (raw == MAP_FAILED) {
+        LOG(ERROR) << "Failed to reserve " << reserved << "B of address space for log, errno: " << errno;
+        base = nullptr;
+        slack = 0;
+        return;
+    }
+    // segment i > 0 starts at base + LOG_FIRST_SEGMENT_SIZE * (2^i - 1), aligned once base + LOG_FIRST_SEGMENT_SIZE is
+    slack = align ? (align - (reinterpret_cast<uintptr_t>(raw) + LOG_FIRST_SEGMENT_SIZE) % align) % align : 0;
+    base = raw + slack;
+}
+
+LogSegments::~LogSegments() {
+    Shrink(0);
+    if (base) munmap(base - slack, reserved);
+}
+
+bool LogSegments::AddSegment() {
+    int i = count.load();
+    if (!base || i >= MAX_LOG_SEGMENTS) return false;
+
+    char *addr = base + segmentBegin(i);
+    if (placement) {
+        if (!placement->Map(segmentSize(i), addr)) return false;
+    } else if (mprotect(addr, segmentSize(i), PROT_READ | PROT_WRITE)) {
+        LOG(ERROR) << "Failed to commit segment " << i << ", errno: " << errno;
+        return false;
+    }
+    segments[i].reset(new Buffer(context, addr, segmentSize(i)));
+    versions[i].reset(new atomic<uint64_t>[segmentSize(i) / RECOVERY_CHUNK_SIZE]());
+    count.store(i + 1, memory_order_release);
+    return true;
+}
+
+void LogSegments::Shrink(int n) {
+    for (int i = count.load() - 1; i >= n; i--) {
+        count.store(i, memory_order_release);
+        segments[i].reset();  // deregister before the pages are dropped
+        versions[i].reset();
+        char *addr = base + segmentBegin(i);
+        // mapping the reservation back drops the pages, huge or not
+        mmap(addr, segmentSize(i), PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0);
+    }
+}
+
+void LogSegments::MarkWritten(size_t off, size_t size) {
+    if (size == 0) return;
+    size_t end = high_water.load();
+    while (end < off + size && !high_water.compare_exchange_weak(end, off + size))
+        ;
+    uint64_t v = clock.fetch_add(1) + 1;
+    for (size_t c = off / RECOVERY_CHUNK_SIZE; c <= (off + size - 1) / RECOVERY_CHUNK_SIZE; c++) {
+        int i = segmentOf(c * RECOVERY_CHUNK_SIZE);
+        versions[i][c - segmentBegin(i) / RECOVERY_CHUNK_SIZE].store(v, memory_order_release);
+    }
+}
+
+void LogSegments::Zero(size_t used) {
+    if (base) memset(base, 0, min(max(used, high_water.load()), GetCapacity()));
+    high_water.store(0);
+}
+
+uint64_t LogSegments::GetVersion(size_t c) {
+    int i = segmentOf(c * RECOVERY_CHUNK_SIZE);
+    return versions[i][c - segmentBegin(i) / RECOVERY_CHUNK_SIZE].load(memory_order_acquire);
+}
@@ -0,0 +1,132 @@
+/*
+ * Segmented log layout shared by Compute-side log RDMA client and server
+ *
+ * Copyright 2022 UIUC
+ * Author: Xuhao Luo
+ */
+
+#pragma once
+
+#include <infinity/core/Context.h>
+#include <infinity/memory/Buffer.h>
+#include <infinity/memory/RegionToken.h>
+
+#include <atomic>
+#include <memory>
+
+#include "../csl_config.h"
+#include "mr_placement.h"
+
+using namespace std;
+using infinity::core::Context;
+using infinity::memory::Buffer;
+using infinity::memory::RegionToken;
+
+/**
+ * A log is a chain of segments, segment i holds LOG_FIRST_SEGMENT_SIZE * 2^i bytes starting at file offset
+ * LOG_FIRST_SEGMENT_SIZE * (2^i - 1). The layout is the same on the client and every replica, so a file offset maps
+ * to the same segment on both sides.
+ */
+inline size_t segmentSize(int i) { return LOG_FIRST_SEGMENT_SIZE << i; }
+
+/**
+ * @return file offset of the first byte of segment i, which is also the total size of segments [0, i)
+ */
+inline size_t segmentBegin(int i) { return LOG_FIRST_SEGMENT_SIZE * ((1UL << i) - 1); }
+
+/**
+ * @return index of the segment holding file offset off
+ */
+inline int segmentOf(size_t off) { return 63 - __builtin_clzl(off / LOG_FIRST_SEGMENT_SIZE + 1); }
+
+/**
+ * @return number of segments needed to hold size bytes, at least 1
+ */
+inline int segmentsFor(size_t size) { return size <= LOG_FIRST_SEGMENT_SIZE ? 1 : segmentOf(size - 1) + 1; }
+
+// a chunk of lazy recovery or resync never spans two segments
+static_assert(LOG_FIRST_SEGMENT_SIZE % RECOVERY_CHUNK_SIZE == 0, "chunks must not cross segments");
+
+/**
+ * Region tokens a server replies with on connection and OPEN_FILE
+ */
+struct LogRegionTokens {
+    RegionToken meta;           // region of LOG_META_SIZE bytes holding the sequence number
+    RegionToken first_segment;  // segment 0, tokens of other segments are fetched with ADD_SEGMENT
+    uint32_t file_handle;       // names the file in the immediate of a progress notification, QPs may be shared
+};
+
+/**
+ * Client side segments of a log. The whole MAX_LOG_SIZE range of address space is reserved up front and segments are
+ * committed and registered in it on demand, so the log stays contiguous in memory while each segment is its own MR.
+ *
+ * With a placement policy the reservation is laid out so that every segment but the first starts on a 2MB boundary,
+ * segments are mapped over it with huge pages on the NUMA node of the RNIC.
+ */
+class LogSegments {
+   private:
+    Context *context;
+    MrPlacementPolicy *placement;
+    char *base;
+    size_t reserved;  // bytes of address space reserved at base - slack
+    size_t slack;
+    unique_ptr<Buffer> segments[MAX_LOG_SEGMENTS];
+    unique_ptr<atomic<uint64_t>[]> versions[MAX_LOG_SEGMENTS];  // version of each RECOVERY_CHUNK_SIZE chunk
+    atomic<int> count;  // segments [0, count) are registered
+    atomic<uint64_t> clock;
+    atomic<size_t> high_water;  // end of the furthest range marked written
+
+   public:
+    /**
+     * @param placement policy segments are mapped with, nullptr for small pages wherever the kernel puts them
+     */
+    LogSegments(Context *context, MrPlacementPolicy *placement = nullptr);
+    ~LogSegments();
+
+    /**
+     * @return address of file offset 0
+     */
+    char *GetBase() { return base; }
+
+    int GetCount() { return count.load(memory_order_acquire); }
+
+    /**
+     * @return number of bytes backed by registered segments
+     */
+    size_t GetCapacity() { return segmentBegin(GetCount()); }
+
+    Buffer *GetSegment(int i) { return segments[i].get(); }
+
+    /**
+     * Give every chunk overlapping [off, off + size) a new version, the range must be within capacity
+     */
+    void MarkWritten(size_t off, size_t size);
+
+    /**
+     * @return end of the furthest range marked written since the log was created or zeroed, within capacity
+     */
+    size_t GetHighWater() { return min(high_water.load(memory_order_acquire), GetCapacity()); }
+
+    /**
+     * Zero the part of the log that may have been written, [0, max(used, high water)) within capacity, rather than
+     * the whole capacity
+     */
+    void Zero(size_t used = 0);
+
+    /**
+     * @return version of chunk c, 0 if it hasn't been written since its segment was added
+     */
+    uint64_t GetVersion(size_t c);
+
+    /**
+     * Commit and register the next segment. Not thread-safe with itself or Shrink()
+     *
+     * @return false if the log already has MAX_LOG_SEGMENTS segments or registration failed
+     */
+    bool AddSegment();
+
+    /**
+     * Deregister and release all but the first n segments. Released memory reads as zero when added again.
+     */
+    void Shrink(int n);
+};
@@ -0,0 +1,118 @@
+/*
+ * Page size and NUMA placement of memory backing Compute-side log MRs
+ *
+ * Copyright 2022 UIUC
+ * Author: Xuhao Luo
+ */
+#include "mr_placement.h"
+
+#include <errno.h>
+#include <glog/logging.h>
+#include <linux/mempolicy.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <fstream>
+#include <sstream>
+
+static const size_t SMALL_PAGE_SIZE = 4096;
+static const size_t THP_SIZE = 2 * 1024 * 1024;  // the only size transparent huge pages come in on x86
+
+MrPlacementPolicy::MrPlacementPolicy(Context *context, size_t page_size, int numa_node)
+    : page_size(page_size), node(numa_node) {
+    for (auto &p : placed) p = 0;
+    if (node == NUMA_RNIC_NODE) node = context ? RnicNode(context) : -1;
+    if (node == NUMA_ANY_NODE || node >= 64) node = -1;
+    LOG(INFO) << Report();
+}
+
+int MrPlacementPolicy::RnicNode(Context *context) {
+    ibv_context *ib = context->getInfiniBandContext();
+    if (!ib) return -1;
+    ifstream f(string("/sys/class/infiniband/") + ibv_get_device_name(ib->device) + "/device/numa_node");
+    int n = -1;
+    f >> n;
+    return n;
+}
+
+int MrPlacementPolicy::NodeOf(const void *addr) {
+    int n = -1;
+    if (syscall(SYS_get_mempolicy, &n, nullptr, 0, addr, MPOL_F_NODE | MPOL_F_ADDR)) return -1;
+    return n;
+}
+
+MrPlacementPolicy::Backing MrPlacementPolicy::BackingOf(void *addr, size_t size) {
+    auto fits = [&](size_t ps) { return size % ps == 0 && reinterpret_cast<uintptr_t>(addr) % ps == 0; };
+    if (page_size > SMALL_PAGE_SIZE && fits(page_size)) {
+        ifstream f("/sys/kernel/mm/hugepages/hugepages-" + to_string(page_size / 1024) + "kB/free_hugepages");
+        size_t free_pages = 0;
+        f >> free_pages;
+        return free_pages >= size / page_size ? HUGETLB_PAGES : TRANSPARENT_HUGE_PAGES;
+    }
+    // ranges that don't fit 1GB pages still get 2MB ones
+    if (page_size > THP_SIZE && fits(THP_SIZE)) return TRANSPARENT_HUGE_PAGES;
+    return SMALL_PAGES;
+}
+
+void *MrPlacementPolicy::Map(size_t size, void *fixed) {
+    int flags = MAP_PRIVATE | MAP_ANONYMOUS | (fixed ? MAP_FIXED : 0);
+    Backing b = BackingOf(fixed, size);
+    void *mem = MAP_FAILED;
+    if (b == HUGETLB_PAGES) {
+        int huge = MAP_HUGETLB | (__builtin_ctzl(page_size) << MAP_HUGE_SHIFT);
+        mem = mmap(fixed, size, PROT_READ | PROT_WRITE, flags | huge, -1, 0);
+        if (mem == MAP_FAILED) b = TRANSPARENT_HUGE_PAGES;  // lost the reserved pages to someone else
+    }
+    if (mem == MAP_FAILED && b == TRANSPARENT_HUGE_PAGES && !fixed) {
+        // over-map and trim, so that the range starts on a huge page boundary
+        char *raw = reinterpret_cast<char *>(mmap(nullptr, size + THP_SIZE, PROT_READ | PROT_WRITE, flags, -1, 0));
+        if (raw != MAP_FAILED) {
+            uintptr_t a = (reinterpret_cast<uintptr_t>(raw) + THP_SIZE - 1) & ~(THP_SIZE - 1);
+            char *aligned = reinterpret_cast<char *>(a);
+            if (aligned > raw) munmap(raw, aligned - raw);
+            if (raw + THP_SIZE > aligned) munmap(aligned + size, raw + THP_SIZE - aligned);
+            mem = aligned;
+        }
+    }
+    if (mem == MAP_FAILED) mem = mmap(fixed, size, PROT_READ | PROT_WRITE, flags, -1, 0);
+    if (mem == MAP_FAILED) {
+        LOG(ERROR) << "Failed to map " << size << " bytes for a MR, errno: " << errno;
+        return nullptr;
+    }
+    if (b == TRANSPARENT_HUGE_PAGES && madvise(mem, size, MADV_HUGEPAGE)) b = SMALL_PAGES;
+    bind(mem, size);
+    placed[b] += size;
+    return mem;
+}
+
+void *MrPlacementPolicy::MapShared(int fd, size_t size) {
+    void *mem = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (mem == MAP_FAILED) {
+        LOG(ERROR) << "Failed to map " << size << " bytes of shared memory for a MR, errno: " << errno;
+        return nullptr;
+    }
+    Backing b = BackingOf(mem, size) == SMALL_PAGES ? SMALL_PAGES : TRANSPARENT_HUGE_PAGES;
+    if (b == TRANSPARENT_HUGE_PAGES && madvise(mem, size, MADV_HUGEPAGE)) b = SMALL_PAGES;
+    bind(mem, size);
+    placed[b] += size;
+    return mem;
+}
+
+bool MrPlacementPolicy::bind(void *addr, size_t size) {
+    if (node < 0) return true;
+    unsigned long mask = 1UL << node;
+    if (syscall(SYS_mbind, addr, size, MPOL_PREFERRED, &mask, sizeof(mask) * 8, 0)) {
+        LOG(WARNING) << "Failed to place " << size << " bytes on NUMA node " << node << ", errno: " << errno;
+        return false;
+    }
+    return true;
+}
+
+string MrPlacementPolicy::Report() {
+    stringstream ss;
+    ss << "MR placement: " << page_size / 1024 << "KB pages, NUMA node " << node << ", mapped "
+       << placed[HUGETLB_PAGES].load() / 1048576 << "MB hugetlb, " << placed[TRANSPARENT_HUGE_PAGES].load() / 1048576
+       << "MB THP, " << placed[SMALL_PAGES].load() / 1048576 << "MB small pages";
+    return ss.str();
+}
@@ -0,0 +1,88 @@
+/*
+ * Page size and NUMA placement of memory backing Compute-side log MRs
+ *
+ * Copyright 2022 UIUC
+ * Author: Xuhao Luo
+ */
+
+#pragma once
+
+#include <infinity/core/Context.h>
+#include <stddef.h>
+
+#include <atomic>
+#include <string>
+
+#include "../csl_config.h"
+
+using namespace std;
+using infinity::core::Context;
+
+/**
+ * How the memory of MRs is backed. Large MRs get huge pages, which cuts the address translations the RNIC has to
+ * cache, and all MRs prefer the NUMA node of the RNIC, so DMA doesn't cross the socket interconnect.
+ *
+ * Huge pages come from hugetlbfs when pages of the size are reserved, else from transparent huge pages with
+ * MADV_HUGEPAGE. Only ranges aligned to and a multiple of the page size get huge pages. The node is a preference
+ * rather than a hard binding: when it runs out of memory pages come from another node instead of failing
+ * registration.
+ */
+class MrPlacementPolicy {
+   public:
+    enum Backing { SMALL_PAGES, TRANSPARENT_HUGE_PAGES, HUGETLB_PAGES };
+
+   private:
+    size_t page_size;
+    int node;  // -1 to leave placement to the kernel
+    atomic<size_t> placed[3];  // bytes mapped with each backing
+
+    bool bind(void *addr, size_t size);
+
+   public:
+    /**
+     * @param page_size 4KB, 2MB or 1GB
+     * @param numa_node node to place memory on, NUMA_RNIC_NODE for the node of the RNIC of context or NUMA_ANY_NODE
+     */
+    MrPlacementPolicy(Context *context, size_t page_size = MR_PAGE_SIZE, int numa_node = MR_NUMA_NODE);
+
+    /**
+     * Map size bytes of zeroed memory according to the policy. Pages are faulted in by registration, after the policy
+     * is set.
+     *
+     * @param fixed if not nullptr, replace the mapping at this address rather than picking one
+     * @return nullptr on failure
+     */
+    void *Map(size_t size, void *fixed = nullptr);
+
+    /**
+     * Map size bytes of a shared memory object according to the policy. Its pages outlive the process, the node only
+     * applies to those not allocated yet. Shared memory gets transparent huge pages if the kernel allows them for it.
+     *
+     * @return nullptr on failure
+     */
+    void *MapShared(int fd, size_t size);
+
+    /**
+     * @return how a range of size bytes at addr would be backed
+     */
+    Backing BackingOf(void *addr, size_t size);
+
+    size_t GetPageSize() { return page_size; }
+    int GetNode() { return node; }
+    size_t GetPlacedBytes(Backing b) { return placed[b].load(); }
+
+    /**
+     * @return one line summary of the policy and of the memory mapped so far
+     */
+    string Report();
+
+    /**
+     * @return NUMA node the RNIC of context is attached to, -1 if unknown
+     */
+    static int RnicNode(Context *context);
+
+    /**
+     * @return NUMA node of the page at addr, which is faulted in if it isn't yet, -1 if the kernel doesn't tell
+     */
+    static int NodeOf(const void *addr);
+};
@@ -1,41 +1,246 @@
 #include "mr_pool.h"
 
+#include <errno.h>
+#include <fcntl.h>
+#include <glog/logging.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
 #include <algorithm>
 
 #include "../csl_config.h"
 
-bool mr_cmp(const shared_ptr<Buffer> &b1, const shared_ptr<Buffer> &b2) {
-    if (b1->getSizeInBytes() != b2->getSizeInBytes())
-        return b1->getSizeInBytes() < b2->getSizeInBytes();
-    else
-        return b1 < b2;
+NCLMrPool::NCLMrPool(Context *context, int pre_allocate, int arena_regions, size_t page_size, int numa_node,
+                     const string &shm_name)
+    : context(context),
+      placement(context, page_size, numa_node),
+      stop(false),
+      user_mrs(context),
+      registrations(0),
+      use_arena(arena_regions > 0 || !shm_name.empty()),
+      shm_name(shm_name) {
+    if (!shm_name.empty()) {
+        while (addArenaRegion(false)) {
+        }
+    }
+    for (int i = arena.size(); i < arena_regions; i++) addArenaRegion();
+    for (int i = 0; i < pre_allocate; i++) free_mrs[MR_SIZE].push_back(allocate(MR_SIZE));
+    zeroer = thread(&NCLMrPool::zeroerFunc, this);
 }
 
-NCLMrPool::NCLMrPool(Context *context, int pre_allocate) : context(context), free_mrs(mr_cmp) {
-    for (int i = 0; i < pre_allocate; i++) {
-        auto mr = make_shared<Buffer>(context, MR_SIZE);
-        mr->zero();
-        free_mrs.emplace(mr);
+NCLMrPool::~NCLMrPool() {
+    {
+        lock_guard<mutex> guard(lock);
+        stop = true;
+    }
+    dirty_cv.notify_all();
+    zeroer.join();
+    for (auto &r : arena) {
+        r.memory.reset();  // deregister before unmapping
+        munmap(r.mem, ARENA_REGION_SIZE);
     }
 }
 
-shared_ptr<Buffer> NCLMrPool::GetMRofSize(size_t size) {
+bool NCLMrPool::addArenaRegion(bool create) {
+    void *mem;
+    bool stale = false;
+    if (shm_name.empty()) {
+        mem = placement.Map(ARENA_REGION_SIZE);
+    } else {
+        string name = "/" + shm_name + "." + to_string(arena.size());
+        int fd = shm_open(name.c_str(), O_RDWR | (create ? O_CREAT : 0), 0600);
+        if (fd < 0) {
+            if (create || errno != ENOENT) {
+                LOG(ERROR) << "Failed to open shared memory " << name << ", errno: " << errno;
+            }
+            return false;
+        }
+        struct stat st;
+        if (fstat(fd, &st) == 0 && st.st_size > 0) {
+            stale = true;
+            if (static_cast<size_t>(st.st_size) != ARENA_REGION_SIZE) {
+                LOG(ERROR) << "Shared memory " << name << " has " << st.st_size << " bytes, not a region of "
+                           << ARENA_REGION_SIZE;
+                close(fd);
+                return false;
+            }
+        } else if (ftruncate(fd, ARENA_REGION_SIZE)) {
+            LOG(ERROR) << "Failed to size shared memory " << name << ", errno: " << errno;
+            close(fd);
+            return false;
+        }
+        mem = placement.MapShared(fd, ARENA_REGION_SIZE);
+        close(fd);  // the mapping keeps the object
+    }
+    if (!mem) return false;
+    auto memory = make_unique<RegisteredMemory>(context, mem, ARENA_REGION_SIZE);
+    arena.push_back({mem, move(memory), BuddyAllocator(ARENA_REGION_SIZE, ARENA_MIN_BLOCK), stale});
+    registrations++;
+    LOG(INFO) << "MR arena has " << arena.size() << " regions of " << ARENA_REGION_SIZE / 1048576
+              << "MB, the last one on NUMA node " << MrPlacementPolicy::NodeOf(mem)
+              << (stale ? " and attached to shared memory of a previous pool" : "") << ". " << placement.Report();
+    return true;
+}
+
+shared_ptr<Buffer> NCLMrPool::carve(size_t size, bool &stale) {
+    if (size > ARENA_REGION_SIZE) return nullptr;
+    size_t off;
+    int r = 0;
+    while (r < static_cast<int>(arena.size()) && !arena[r].blocks.Allocate(size, off)) r++;
+    if (r == static_cast<int>(arena.size())) {
+        if (!addArenaRegion() || !arena[r].blocks.Allocate(size, off)) return nullptr;
+    }
+    auto mr = make_shared<Buffer>(context, arena[r].memory.get(), off, size);
+    carved[mr.get()] = {r, off};
+    stale = arena[r].stale;
+    return mr;
+}
+
+shared_ptr<Buffer> NCLMrPool::Adopt(int region, size_t off, size_t size) {
+    lock_guard<mutex> guard(lock);
+    if (region < 0 || region >= static_cast<int>(arena.size()) || !arena[region].blocks.Reserve(off, size)) {
+        return nullptr;
+    }
+    auto mr = make_shared<Buffer>(context, arena[region].memory.get(), off, size);
+    carved[mr.get()] = {region, off};
+    return mr;
+}
+
+bool NCLMrPool::Locate(Buffer *mr, int &region, size_t &off) {
     lock_guard<mutex> guard(lock);
-    if (free_mrs.empty()) {
+    auto c = carved.find(mr);
+    if (c == carved.end()) return false;
+    region = c->second.region;
+    off = c->second.off;
+    return true;
+}
+
+void NCLMrPool::SweepStale() {
+    {
+        lock_guard<mutex> guard(lock);
+        for (int r = 0; r < static_cast<int>(arena.size()); r++) {
+            if (!arena[r].stale) continue;
+            for (auto &b : arena[r].blocks.FreeBlocks()) {
+                // in chunks, so that carving doesn't wait long for the blocks being zeroed
+                for (size_t off = 0; off < b.second; off += ARENA_SWEEP_CHUNK) {
+                    stale_blocks.push_back({r, b.first + off, min(b.second, ARENA_SWEEP_CHUNK)});
+                }
+            }
+            if (arena[r].blocks.GetFree() == 0) arena[r].stale = false;
+        }
+    }
+    dirty_cv.notify_one();
+}
+
+void NCLMrPool::RemoveShared(const string &shm_name) {
+    for (int r = 0; shm_unlink(("/" + shm_name + "." + to_string(r)).c_str()) == 0; r++) {
+    }
+}
+
+shared_ptr<Buffer> NCLMrPool::allocate(size_t size) {
+    registrations++;
+    void *mem = placement.Map(size);
+    if (!mem) {
         auto mr = make_shared<Buffer>(context, size);
         mr->zero();
         return mr;
-    } else {
-        auto it_mr = find_if(free_mrs.begin(), free_mrs.end(),
-                             [size](const shared_ptr<Buffer> &b) -> bool { return b->getSizeInBytes() >= size; });
-        auto mr = *it_mr;
-        free_mrs.erase(it_mr);
-        return mr;
     }
+    // the buffer doesn't own memory it is given, unmap it once deregistered
+    return shared_ptr<Buffer>(new Buffer(context, mem, size), [mem, size](Buffer *mr) {
+        delete mr;
+        munmap(mem, size);
+    });
 }
 
-void NCLMrPool::RecycleMR(shared_ptr<Buffer> mr) {
-    lock_guard<mutex> guard(lock);
-    mr->zero();
-    free_mrs.insert(mr);
+shared_ptr<Buffer> NCLMrPool::GetMRofSize(size_t size) {
+    DirtyMr dirty;
+    bool stale = false;
+    {
+        lock_guard<mutex> guard(lock);
+        auto it = free_mrs.lower_bound(size);
+        if (it != free_mrs.end()) {
+            auto mr = it->second.back();
+            it->second.pop_back();
+            if (it->second.empty()) free_mrs.erase(it);
+            return mr;
+        }
+        if (use_arena) {
+            auto mr = carve(size, stale);
+            if (mr && !stale) return mr;
+            // left by a previous pool, zeroed below up to the end of the block, which is freed whole
+            if (mr) dirty = {mr, arena[carved[mr.get()].region].blocks.BlockSize(size)};
+        }
+        if (!stale) {
+            // rather than growing the pool, zero a recycled MR the background thread hasn't got to yet
+            auto d = find_if(dirty_mrs.begin(), dirty_mrs.end(),
+                             [size](const DirtyMr &m) { return m.mr->getSizeInBytes() >= size; });
+            if (d == dirty_mrs.end()) return allocate(size);
+            dirty = *d;
+            dirty_mrs.erase(d);
+        }
+    }
+    memset(dirty.mr->getData(), 0, stale ? dirty.used : min(dirty.used, dirty.mr->getSizeInBytes()));
+    return dirty.mr;
+}
+
+void NCLMrPool::RecycleMR(shared_ptr<Buffer> mr, size_t used) {
+    {
+        lock_guard<mutex> guard(lock);
+        if (used == 0) {
+            release(mr);
+            return;
+        }
+        dirty_mrs.push_back({mr, used});
+    }
+    dirty_cv.notify_one();
+}
+
+void NCLMrPool::zeroerFunc() {
+    unique_lock<mutex> lk(lock);
+    while (true) {
+        dirty_cv.wait(lk, [this] { return stop || !dirty_mrs.empty() || !stale_blocks.empty(); });
+        if (stop) break;
+        if (dirty_mrs.empty()) {
+            sweepBlock(lk);  // recycled MRs first, GetMRofSize() may be waiting for them
+            continue;
+        }
+        DirtyMr dirty = dirty_mrs.front();
+        dirty_mrs.pop_front();
+        lk.unlock();
+        memset(dirty.mr->getData(), 0, min(dirty.used, dirty.mr->getSizeInBytes()));
+        lk.lock();
+        release(dirty.mr);
+    }
+}
+
+void NCLMrPool::sweepBlock(unique_lock<mutex> &lk) {
+    StaleBlock b = stale_blocks.front();
+    stale_blocks.pop_front();
+    if (arena[b.region].blocks.Reserve(b.off, b.size)) {
+        char *mem = static_cast<char *>(arena[b.region].mem);
+        lk.unlock();
+        memset(mem + b.off, 0, b.size);
+        lk.lock();
+        arena[b.region].blocks.Free(b.off, b.size);  // regions may have been added meanwhile
+    } else if (b.size > ARENA_MIN_BLOCK) {
+        // part of it was carved since, which zeroed that part
+        stale_blocks.push_front({b.region, b.off + b.size / 2, b.size / 2});
+        stale_blocks.push_front({b.region, b.off, b.size / 2});
+    }
+    if (none_of(stale_blocks.begin(), stale_blocks.end(), [&b](const StaleBlock &s) { return s.region == b.region; })) {
+        arena[b.region].stale = false;
+        LOG(INFO) << "Zeroed the free blocks of MR arena region " << b.region;
+    }
+}
+
+void NCLMrPool::release(shared_ptr<Buffer> mr) {
+    auto c = carved.find(mr.get());
+    if (c == carved.end()) {
+        free_mrs[mr->getSizeInBytes()].push_back(mr);
+        return;
+    }
+    arena[c->second.region].blocks.Free(c->second.off, mr->getSizeInBytes());
+    carved.erase(c);
 }
@@ -2,22 +2,113 @@
 
 #include <infinity/core/Context.h>
 #include <infinity/memory/Buffer.h>
+#include <infinity/memory/RegisteredMemory.h>
 
+#include <condition_variable>
+#include <deque>
+#include <map>
 #include <memory>
 #include <mutex>
-#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "buddy_allocator.h"
+#include "mr_placement.h"
+#include "user_mr_cache.h"
 
 using namespace std;
 using infinity::core::Context;
 using infinity::memory::Buffer;
+using infinity::memory::RegisteredMemory;
 
-bool mr_cmp(const shared_ptr<Buffer> &b1, const shared_ptr<Buffer> &b2);  // custom comparitor for MR pointer
-
+/**
+ * Pool of zeroed MRs. Free MRs are kept in size classes, one per MR size, so a lookup is a lower_bound over the
+ * classes. A recycled MR is zeroed by a background thread before it becomes free again, and only up to the number of
+ * bytes its user says it wrote.
+ *
+ * With an arena, MRs are carved out of a few large regions registered up front with a buddy allocator, instead of
+ * being registered one by one. A carved MR shares the lkey and rkey of its region, its region token points into the
+ * region. Carved MRs go back to the buddy allocator once zeroed, so that they merge again.
+ *
+ * Memory of MRs and arena regions is mapped according to a MrPlacementPolicy: huge pages where they fit, on the NUMA
+ * node of the RNIC.
+ *
+ * Arena regions can live in named shared memory instead, which outlives the process. A pool created with the same
+ * name attaches to the regions left by the previous one with their content, and the MRs its user still needs are
+ * taken back with Adopt(). Blocks of those regions that aren't adopted may still hold old data. Once SweepStale() is
+ * called, the background thread zeroes them once, and until it is done blocks carved from those regions are zeroed
+ * when carved.
+ */
 class NCLMrPool {
    protected:
+    struct DirtyMr {
+        shared_ptr<Buffer> mr;
+        size_t used;  // bytes from the start of the MR that may be non-zero
+    };
+    struct ArenaRegion {
+        void *mem;
+        unique_ptr<RegisteredMemory> memory;
+        BuddyAllocator blocks;
+        bool stale;  // attached with the content of a previous pool, free blocks may not be zero
+    };
+    struct Carved {
+        int region;
+        size_t off;
+    };
+    struct StaleBlock {
+        int region;
+        size_t off;
+        size_t size;
+    };
+
     Context *context;
-    set<shared_ptr<Buffer>, decltype(mr_cmp) *> free_mrs;  // sorted by mr size
+    MrPlacementPolicy placement;
+    map<size_t, vector<shared_ptr<Buffer>>> free_mrs;  // zeroed MRs by size
+    deque<DirtyMr> dirty_mrs;                          // recycled MRs waiting to be zeroed
+    deque<StaleBlock> stale_blocks;                    // free blocks of attached regions waiting to be zeroed
     mutex lock;
+    condition_variable dirty_cv;
+    bool stop;
+    thread zeroer;
+    UserMrCache user_mrs;  // registrations of application buffers, for zero-copy writes
+
+    size_t registrations;
+    bool use_arena;
+    vector<ArenaRegion> arena;
+    map<Buffer *, Carved> carved;  // where each MR carved from the arena lives
+    string shm_name;               // arena regions are the shared memory objects <shm_name>.<region> if not empty
+
+    /**
+     * Register one more arena region, lock held
+     *
+     * @param create whether to create the shared memory object of the region if it doesn't exist
+     */
+    bool addArenaRegion(bool create = true);
+
+    /**
+     * Carve a MR out of the arena, adding a region if none has room, lock held
+     *
+     * @param stale set if the MR may not be zero
+     * @return nullptr if size is larger than a region
+     */
+    shared_ptr<Buffer> carve(size_t size, bool &stale);
+
+    /**
+     * Make a zeroed MR available again, lock held
+     */
+    void release(shared_ptr<Buffer> mr);
+
+    /**
+     * Register size bytes of fresh memory mapped by the placement policy, which the kernel hands out zeroed
+     */
+    shared_ptr<Buffer> allocate(size_t size);
+    void zeroerFunc();
+
+    /**
+     * Zero the first of stale_blocks if it is still free, else queue its halves, lock held and released meanwhile
+     */
+    void sweepBlock(unique_lock<mutex> &lk);
 
    public:
     /**
@@ -25,12 +116,20 @@ class NCLMrPool {
      * 
      * @param pre_allocate number of MR to pre-allocate. This will save time in creating MR when client request to
      * replicate a new file
+     * @param arena_regions number of ARENA_REGION_SIZE regions registered up front to carve MRs from, 0 to register
+     * every MR on its own
+     * @param page_size page size of MRs large enough for it, see MrPlacementPolicy
+     * @param numa_node NUMA node of MR memory, NUMA_RNIC_NODE for the node of the RNIC
+     * @param shm_name if not empty, arena regions live in shared memory objects of this name, and the regions a
+     * previous pool left are attached to first
      */
-    NCLMrPool(Context *context, int pre_allocate = 0);
+    NCLMrPool(Context *context, int pre_allocate = 0, int arena_regions = 0, size_t page_size = MR_PAGE_SIZE,
+              int numa_node = MR_NUMA_NODE, const string &shm_name = "");
+    ~NCLMrPool();
 
     /**
-     * Get a MR of particular size. If free mr of satisfied size is available, get the mr.
-     * Else, create a new mr. Called when a new file is opened.
+     * Get a zeroed MR of particular size. If free mr of satisfied size is available, get the mr. Else, take a recycled
+     * one that is still dirty and zero it, or create a new mr. Called when a new file is opened.
      *
      * @param size the lower size limit that the MR needs to satisfy
      * @return pointer to the mr
@@ -38,8 +137,57 @@ class NCLMrPool {
     shared_ptr<Buffer> GetMRofSize(size_t size);
 
     /**
-     * Recycle a mr when no longer needed. Called when a file is closed.
+     * Recycle a mr when no longer needed. Called when a file is closed. Returns right away, the mr is zeroed in the
+     * background.
+     *
      * @param mr MR to be recycled
+     * @param used number of bytes from the start of the mr that may have been written
+     */
+    void RecycleMR(shared_ptr<Buffer> mr, size_t used = SIZE_MAX);
+
+    /**
+     * Take back a MR carved by a previous pool from the shared memory regions, with its content
+     *
+     * @param region, off where the MR lives, as told by Locate()
+     * @return nullptr if the region doesn't exist or the block is in use
+     */
+    shared_ptr<Buffer> Adopt(int region, size_t off, size_t size);
+
+    /**
+     * Zero the free blocks of the regions attached from a previous pool in the background, after the MRs still needed
+     * have been adopted
+     */
+    void SweepStale();
+
+    /**
+     * Find where a MR carved from the arena lives
+     *
+     * @return false if the MR was registered on its own
+     */
+    bool Locate(Buffer *mr, int &region, size_t &off);
+
+    /**
+     * @return whether the arena lives in shared memory, so that MRs carved from it outlive the process
+     */
+    bool IsShared() { return !shm_name.empty(); }
+
+    /**
+     * Remove the shared memory objects of the regions of a pool, their memory is freed once no pool maps them
+     */
+    static void RemoveShared(const string &shm_name);
+
+    UserMrCache *GetUserMrCache() { return &user_mrs; }
+
+    /**
+     * Policy MR memory is mapped with, also used by the client for its log segments
+     */
+    MrPlacementPolicy *GetPlacement() { return &placement; }
+
+    /**
+     * @return number of memory registrations made by the pool, arena regions count as one each
      */
-    void RecycleMR(shared_ptr<Buffer> mr);
+    size_t GetRegistrations() {
+        lock_guard<mutex> guard(lock);
+        return registrations;
+    }
 };
@@ -1,33 +1,98 @@
 #include "qp_pool.h"
+#include <glog/logging.h>
 #include <sys/socket.h>
 #include <string.h>
 
-NCLQpPool::NCLQpPool(Context *context, const uint16_t port) : context(context), port(port) {
+#include <algorithm>
+
+NCLQpPool::NCLQpPool(Context *context, const uint16_t port, int qps_per_peer)
+    : context(context), dispatcher(context), port(port), qps_per_peer(qps_per_peer) {
     qp_factory = make_shared<QueuePairFactory>(context);
 }
 
-shared_ptr<QueuePair> NCLQpPool::GetQpTo(const string &host_addr, struct FileInfo *fi) {
+shared_ptr<QueuePair> NCLQpPool::connect(const string &host_addr, struct FileInfo *fi, LogRegionTokens *tokens) {
+    auto qp = shared_ptr<QueuePair>(qp_factory->connectToRemoteHost(host_addr.c_str(), port, fi, sizeof(*fi)));
+    memcpy(tokens, qp->getUserData(), sizeof(*tokens));
+    channels[qp.get()] = make_shared<mutex>();
+    return qp;
+}
+
+bool NCLQpPool::openOn(const shared_ptr<QueuePair> &qp, struct FileInfo *fi, LogRegionTokens *tokens) {
+    // exchange MR info with server
+    struct ClientReq open_req;
+    open_req.type = OPEN_FILE;
+    open_req.fi.size = fi->size;
+    open_req.fi.epoch = fi->epoch;
+    memcpy(open_req.fi.file_id, fi->file_id, MAX_FILE_ID_LENGTH);
+    lock_guard<mutex> guard(*channels[qp.get()]);
+    if (send(qp->getRemoteSocket(), &open_req, sizeof(open_req), 0) != sizeof(open_req)) {
+        LOG(ERROR) << "Failed to send open request to " << qp->getRemoteAddr() << ", errno: " << errno;
+        return false;
+    }
+    if (recv(qp->getRemoteSocket(), tokens, sizeof(*tokens), MSG_WAITALL) != sizeof(*tokens)) {
+        LOG(ERROR) << "Failed to receive region tokens from " << qp->getRemoteAddr() << ", errno: " << errno;
+        return false;
+    }
+    return true;
+}
+
+shared_ptr<QueuePair> NCLQpPool::GetQpTo(const string &host_addr, struct FileInfo *fi, LogRegionTokens *tokens) {
     lock_guard<mutex> guard(lock);
-    if (idle_qps[host_addr].empty()) {
-        auto qp = shared_ptr<QueuePair>(qp_factory->connectToRemoteHost(host_addr.c_str(), port, fi, sizeof(*fi)));
-        return qp;
-    } else {
-        auto &idle_queue = idle_qps[host_addr];
+    if (qps_per_peer > 0) {
+        auto &qps = shared_qps[host_addr];
+        if (static_cast<int>(qps.size()) < qps_per_peer) {
+            qps.push_back({connect(host_addr, fi, tokens), 1});
+            return qps.back().qp;
+        }
+        auto least = min_element(qps.begin(), qps.end(),
+                                 [](const SharedQp &a, const SharedQp &b) { return a.users < b.users; });
+        if (openOn(least->qp, fi, tokens)) {
+            least->users++;
+            return least->qp;
+        }
+        // the control socket is broken and the QP with it, replace it for every later file
+        channels.erase(least->qp.get());
+        *least = {connect(host_addr, fi, tokens), 1};
+        return least->qp;
+    }
+    auto &idle_queue = idle_qps[host_addr];
+    while (!idle_queue.empty()) {
         auto qp = idle_queue.front();
         idle_queue.pop();
-        // exchange MR info with server
-        struct ClientReq open_req;
-        open_req.type = OPEN_FILE;
-        open_req.fi.size = fi->size;
-        open_req.fi.epoch = fi->epoch;
-        memcpy(open_req.fi.file_id, fi->file_id, MAX_FILE_ID_LENGTH);
-        send(qp->getRemoteSocket(), &open_req, sizeof(open_req), 0);
-        recv(qp->getRemoteSocket(), qp->getUserData(), sizeof(RegionToken), 0);
-        return qp;
+        if (openOn(qp, fi, tokens)) return qp;
+        channels.erase(qp.get());
     }
+    return connect(host_addr, fi, tokens);
 }
 
 void NCLQpPool::RecycleQp(shared_ptr<QueuePair> qp) {
     lock_guard<mutex> guard(lock);
+    if (qps_per_peer > 0) {
+        // stays connected for the other files of the process
+        for (auto &s : shared_qps[qp->getRemoteAddr()]) {
+            if (s.qp == qp) s.users--;
+        }
+        return;
+    }
     idle_qps[qp->getRemoteAddr()].push(qp);
 }
+
+void NCLQpPool::DropPeer(const string &host_addr) {
+    lock_guard<mutex> guard(lock);
+    auto shared = shared_qps.find(host_addr);
+    if (shared != shared_qps.end()) {
+        // a file holding one of them keeps its channel lock
+        for (auto &s : shared->second) channels.erase(s.qp.get());
+        shared_qps.erase(shared);
+    }
+    auto idle = idle_qps.find(host_addr);
+    if (idle != idle_qps.end()) {
+        for (; !idle->second.empty(); idle->second.pop()) channels.erase(idle->second.front().get());
+        idle_qps.erase(idle);
+    }
+}
+
+shared_ptr<mutex> NCLQpPool::GetChannelLock(QueuePair *qp) {
+    lock_guard<mutex> guard(lock);
+    return channels[qp];
+}
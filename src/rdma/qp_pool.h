@@ -10,8 +10,11 @@
 #include <mutex>
 #include <queue>
 #include <string>
+#include <vector>
 
 #include "common.h"
+#include "completion_dispatcher.h"
+#include "log_segments.h"
 
 using namespace std;
 using infinity::core::Context;
@@ -21,15 +24,40 @@ using infinity::queues::QueuePairFactory;
 
 class NCLQpPool {
    protected:
+    /**
+     * A QP shared by the files of the process, along with its control socket
+     */
+    struct SharedQp {
+        shared_ptr<QueuePair> qp;
+        int users;  // files currently open on the QP
+    };
+
     map<string, queue<shared_ptr<QueuePair>>> idle_qps;
+    map<string, vector<SharedQp>> shared_qps;
+    map<QueuePair *, shared_ptr<mutex>> channels;  // serializes request and reply on the control socket of each QP
 
     Context *context;
+    CompletionDispatcher dispatcher;
     shared_ptr<QueuePairFactory> qp_factory;
     const uint16_t port;
+    const int qps_per_peer;  // 0 for a QP per file
     mutex lock;
 
+    shared_ptr<QueuePair> connect(const string &host_addr, struct FileInfo *fi, LogRegionTokens *tokens);
+
+    /**
+     * Open a file on a connected QP, the server replies with the tokens of the file
+     *
+     * @return false if the request or the reply was cut short, tokens is left unusable
+     */
+    bool openOn(const shared_ptr<QueuePair> &qp, struct FileInfo *fi, LogRegionTokens *tokens);
+
    public:
-    NCLQpPool(Context *context, const uint16_t port);
+    /**
+     * @param qps_per_peer if not 0, all the files of the process share this many QPs to each server, and the files on
+     * a QP are told apart by their region tokens, so the QP count scales with servers rather than files
+     */
+    NCLQpPool(Context *context, const uint16_t port, int qps_per_peer = 0);
 
     /**
      * Get a qp to a replication server. If free qp to that server is available, get the free qp.
@@ -37,14 +65,35 @@ class NCLQpPool {
      *
      * @param host_addr address of the replication server
      * @param fi file info of the replicated file
+     * @param tokens set to the region tokens of the file on the server
      * @return pointer to the qp
      */
-    shared_ptr<QueuePair> GetQpTo(const string &host_addr, struct FileInfo *fi);
+    shared_ptr<QueuePair> GetQpTo(const string &host_addr, struct FileInfo *fi, LogRegionTokens *tokens);
 
     /**
      * Recycle a qp when no longer needed. Called when a file is closed.
      * @param qp QP to be recycled
      */
     void RecycleQp(shared_ptr<QueuePair> qp);
+
+    /**
+     * Stop handing out the QPs to a server that failed, the files still holding one keep it until they drop the peer,
+     * and the next GetQpTo() to the server connects again. Called when a write to the server fails or a file drops it.
+     *
+     * @param host_addr address of the replication server
+     */
+    void DropPeer(const string &host_addr);
+
+    /**
+     * @return the lock to hold while exchanging a request and its reply on the control socket of a QP
+     */
+    shared_ptr<mutex> GetChannelLock(QueuePair *qp);
+
+    bool IsShared() { return qps_per_peer > 0; }
     Context *GetContext() { return context; }
+
+    /**
+     * @return the dispatcher of the send completions of every QP in the pool
+     */
+    CompletionDispatcher *GetDispatcher() { return &dispatcher; }
 };
@@ -8,27 +8,120 @@
 #include "server.h"
 
 #include <errno.h>
+#include <fcntl.h>
 #include <glog/logging.h>
-#include <sys/select.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
+#include <iomanip>
+#include <map>
+#include <sstream>
+
+#include "chunk_digest.h"
 #include "common.h"
+#include "crc32c.h"
 
 using infinity::memory::RegionToken;
 using infinity::queues::QueuePair;
 using infinity::queues::QueuePairFactory;
 using namespace std::chrono;
 
-CSLServer::CSLServer(uint16_t port, size_t buf_size, string mgr_hosts) : stop(false) {
+static const size_t PROGRESS_RECV_SIZE = 64;  // WRITE_WITH_IMM writes nothing to a receive buffer
+static const int PROGRESS_IDLE_POLLS = 1024;  // empty polls of the receive CQ before the poller starts to sleep
+static const int EPOLL_BATCH = 64;            // events taken by one epoll_wait() of a worker
+static const int EPOLL_TIMEOUT_MS = 1000;     // bounds how long a thread takes to notice the server stopped
+static const size_t DIRECT_IO_ALIGN = 4096;
+
+static bool pwriteAll(int fd, const char *buf, size_t size, off_t off) {
+    while (size > 0) {
+        ssize_t n = pwrite(fd, buf, size, off);
+        if (n <= 0) return false;
+        buf += n;
+        off += n;
+        size -= n;
+    }
+    return true;
+}
+
+static bool preadAll(int fd, char *buf, size_t size, off_t off) {
+    while (size > 0) {
+        ssize_t n = pread(fd, buf, size, off);
+        if (n <= 0) return false;
+        buf += n;
+        off += n;
+        size -= n;
+    }
+    return true;
+}
+
+/**
+ * @return end of the last non-zero byte of buf past from, or from if they are all zero
+ */
+static size_t nonZeroEnd(const char *buf, size_t from, size_t size) {
+    size_t end = size;
+    for (; end > from && end % sizeof(uint64_t) != 0; end--) {
+        if (buf[end - 1] != 0) return end;
+    }
+    for (; end >= from + sizeof(uint64_t); end -= sizeof(uint64_t)) {
+        uint64_t word;
+        memcpy(&word, buf + end - sizeof(uint64_t), sizeof(word));
+        if (word != 0) break;
+    }
+    for (; end > from; end--) {
+        if (buf[end - 1] != 0) return end;
+    }
+    return from;
+}
+
+CSLServer::CSLServer(uint16_t port, size_t buf_size, string mgr_hosts, int workers)
+    : stop(false), next_worker(0), next_handle(1), spilled_bytes(0), index_fd(-1) {
     context = new infinity::core::Context(infinity::core::Configuration::DEFAULT_IB_DEVICE,
                                           infinity::core::Configuration::DEFAULT_IB_PHY_PORT);
     qp_factory = new QueuePairFactory(context);
+#if defined(SERVER_SHM)
+    mr_pool = make_unique<NCLMrPool>(context, 0, ARENA_REGIONS, MR_PAGE_SIZE, MR_NUMA_NODE, SHM_NAME);
+#elif defined(SERVER_ARENA)
+    mr_pool = make_unique<NCLMrPool>(context, 0, ARENA_REGIONS);
+#else
     mr_pool = make_unique<NCLMrPool>(context);
+#endif
+    recv_memory = make_unique<infinity::memory::RegisteredMemory>(context, PROGRESS_RECV_BUFFERS * PROGRESS_RECV_SIZE);
+    for (int i = 0; i < PROGRESS_RECV_BUFFERS; i++) {
+        recv_buffers.emplace_back(new Buffer(context, recv_memory.get(), i * PROGRESS_RECV_SIZE, PROGRESS_RECV_SIZE));
+        context->postReceiveBuffer(recv_buffers.back().get());
+    }
+    for (int i = 0; i < max(workers, 1); i++) {
+        auto w = make_unique<Worker>();
+        w->epfd = epoll_create1(EPOLL_CLOEXEC);
+        w->event_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+        struct epoll_event ev = {};
+        ev.events = EPOLLIN;
+        ev.data.fd = w->event_fd;
+        if (w->epfd < 0 || w->event_fd < 0 || epoll_ctl(w->epfd, EPOLL_CTL_ADD, w->event_fd, &ev)) {
+            LOG(ERROR) << "Failed to create the epoll instance of worker " << i << ", errno: " << errno;
+        }
+        this->workers.push_back(move(w));
+    }
     int ret;
 
     LOG(INFO) << "Setting up connection (blocking)" << endl;
     qp_factory->bindToPort(port);
     LOG(INFO) << "Bind to port";
 
+#ifdef SERVER_SHM
+    {
+        // the files of the previous server are back before this one is advertised
+        ifstream index(SHM_INDEX_PATH);
+        if (index) Preload(index);
+        compactIndex();
+        mr_pool->SweepStale();  // whatever the files didn't take back
+    }
+#endif
+
     if (mgr_hosts == "") return;  // skip connect to zookeeper
 
     zh = zookeeper_init(mgr_hosts.c_str(), ServerWatcher, 10000, 0, this, 0);
@@ -51,6 +144,17 @@ CSLServer::CSLServer(uint16_t port, size_t buf_size, string mgr_hosts) : stop(fa
         return;
     }
     ret = zoo_create(zh, node_path.c_str(), (const char *)&value, sizeof(value), &aclv, ZOO_EPHEMERAL, nullptr, 0);
+    if (ret == ZNODEEXISTS) {
+        // the node of a previous server of this host lingers until its session expires. It is replaced rather than
+        // waited for, the clients watching it see it deleted and reconnect, so their QPs and tokens are fresh
+        struct Stat stat = {};
+        ret = zoo_exists(zh, node_path.c_str(), 0, &stat);
+        if (ret == ZOK && stat.ephemeralOwner != zoo_client_id(zh)->client_id) {
+            zoo_delete(zh, node_path.c_str(), -1);
+            ret = zoo_create(zh, node_path.c_str(), (const char *)&value, sizeof(value), &aclv, ZOO_EPHEMERAL, nullptr,
+                             0);
+        }
+    }
     if (ret) {
         LOG(ERROR) << "Failed to create zk node: " << node_path << ", errno: " << ret;
         return;
@@ -58,121 +162,212 @@ CSLServer::CSLServer(uint16_t port, size_t buf_size, string mgr_hosts) : stop(fa
 }
 
 void CSLServer::Run() {
-    fd_set fds;
-    struct timeval tv = {
-        .tv_sec = 1,
-        .tv_usec = 0,
-    };
     int listen_fd = qp_factory->getServerSocket();
-    int ret;
-    int max_fd;
-    // set<int> client_socks;
+    int epfd = epoll_create1(EPOLL_CLOEXEC);
+    struct epoll_event ev = {};
+    ev.events = EPOLLIN;
+    ev.data.fd = listen_fd;
+    if (epfd < 0 || epoll_ctl(epfd, EPOLL_CTL_ADD, listen_fd, &ev)) {
+        LOG(ERROR) << "Failed to watch the listening socket, errno: " << errno;
+        if (epfd >= 0) close(epfd);
+        return;
+    }
 
+    progress_th = thread(&CSLServer::progressFunc, this);
+#ifdef SERVER_SPILL
+    spill_th = thread(&CSLServer::spillFunc, this);
+#endif
+    for (auto &w : workers) w->th = thread(&CSLServer::workerFunc, this, w.get());
     while (!stop) {
-        FD_ZERO(&fds);
-        FD_SET(listen_fd, &fds);
-        max_fd = listen_fd;
-        for (auto &qp : existing_qps) {
-            if (qp.first > 0) {
-                max_fd = max(max_fd, qp.first);  // find the max of all active fds
-                FD_SET(qp.first, &fds);
-            }
+        int ret = epoll_wait(epfd, &ev, 1, EPOLL_TIMEOUT_MS);
+        if (ret < 0 && errno != EINTR) {
+            LOG(ERROR) << "Error epoll_wait(), errno: " << errno;
+            break;
+        } else if (ret > 0) {
+            handleIncomingConnection();
         }
+    }
+    stop = true;
+    for (auto &w : workers) w->th.join();
+    progress_th.join();
+    if (spill_th.joinable()) spill_th.join();
+    close(epfd);
+}
 
-        tv.tv_sec = 1;
-        ret = select(max_fd + 1, &fds, nullptr, nullptr, &tv);
-        if (ret < 0) {
-            LOG(ERROR) << "Error select(), errno: " << errno;
-            return;
-        } else if (ret > 0) {
-            // check for incoming connection
-            if (FD_ISSET(listen_fd, &fds)) {
-                FD_CLR(listen_fd, &fds);
-                handleIncomingConnection();
-            }
-            // then check for client requests
-            for (auto qp = existing_qps.begin(); qp != existing_qps.end();) {
-                if (qp->first > 0 && FD_ISSET(qp->first, &fds)) {
-                    FD_CLR(qp->first, &fds);
-                    ret = handleClientRequest(qp->first);
-                    if (ret == 0) {
-                        existing_qps.erase(qp++);  // connection has been terminated, prevent triggerring select again
+void CSLServer::handleIncomingConnection() {
+    PendingConnection pc;
+    pc.accepted = high_resolution_clock::now();
+    pc.recv_buf = nullptr;
+    // only accept here, a client that is slow to send its QP holds up a worker's epoll instead of every new client
+    pc.socket = accept(qp_factory->getServerSocket(), nullptr, nullptr);
+    if (pc.socket < 0) {
+        LOG(ERROR) << "Failed to accept a connection, errno: " << errno;
+        return;
+    }
+
+    Worker *w = workers[next_worker++ % workers.size()].get();
+    {
+        lock_guard<mutex> guard(w->lock);
+        w->pending.push_back(pc);
+    }
+    uint64_t one = 1;
+    if (write(w->event_fd, &one, sizeof(one)) != sizeof(one)) {
+        LOG(ERROR) << "Failed to wake up a worker, errno: " << errno;
+    }
+}
+
+void CSLServer::workerFunc(Worker *w) {
+    struct epoll_event events[EPOLL_BATCH];
+    while (!stop) {
+        int n = epoll_wait(w->epfd, events, EPOLL_BATCH, EPOLL_TIMEOUT_MS);
+        if (n < 0 && errno != EINTR) {
+            LOG(ERROR) << "Error epoll_wait(), errno: " << errno;
+            break;
+        }
+        for (int i = 0; i < n; i++) {
+            int fd = events[i].data.fd;
+            if (fd == w->event_fd) {
+                uint64_t cnt;
+                if (read(w->event_fd, &cnt, sizeof(cnt)) < 0 && errno != EAGAIN) {
+                    LOG(ERROR) << "Failed to read the eventfd of a worker, errno: " << errno;
+                }
+                deque<PendingConnection> pending;
+                {
+                    lock_guard<mutex> guard(w->lock);
+                    pending.swap(w->pending);
+                }
+                for (auto &pc : pending) {
+                    struct epoll_event ev = {};
+                    ev.events = EPOLLIN;
+                    ev.data.fd = pc.socket;
+                    if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, pc.socket, &ev)) {
+                        LOG(ERROR) << "Failed to watch a new connection, errno: " << errno;
+                        close(pc.socket);
                         continue;
                     }
+                    w->handshakes[pc.socket] = pc;
                 }
-                ++qp;
+                continue;
+            }
+            auto hs = w->handshakes.find(fd);
+            if (hs != w->handshakes.end()) {
+                PendingConnection pc = hs->second;
+                w->handshakes.erase(hs);
+                epoll_ctl(w->epfd, EPOLL_CTL_DEL, fd, nullptr);
+                finishHandshake(w, pc);
+                continue;
+            }
+            bool known;
+            {
+                lock_guard<mutex> guard(qps_lock);
+                known = existing_qps.count(fd);
+            }
+            // the QP was replaced by a reconnection, or the connection has been terminated
+            if (!known || handleClientRequest(fd) == 0) {
+                epoll_ctl(w->epfd, EPOLL_CTL_DEL, fd, nullptr);
+                lock_guard<mutex> guard(qps_lock);
+                if (known) existing_qps.erase(fd);
             }
-        } else {
-            continue;
         }
     }
 }
 
-void CSLServer::handleIncomingConnection() {
-    int socket = 0;
-    infinity::queues::serializedQueuePair *recv_buf;
-    struct FileInfo fi;
-    string file_id;
-
+void CSLServer::finishHandshake(Worker *w, PendingConnection &pc) {
+    // the client sends its QP right after connecting, the socket is readable
+    pc.recv_buf = static_cast<infinity::queues::serializedQueuePair *>(calloc(1, sizeof(*pc.recv_buf)));
+    ssize_t ret = recv(pc.socket, pc.recv_buf, sizeof(*pc.recv_buf), MSG_WAITALL);
+    if (ret != sizeof(*pc.recv_buf)) {
+        LOG(ERROR) << "Failed to receive the QP of a new client, " << ret << "B received, errno: " << errno;
+        free(pc.recv_buf);
+        close(pc.socket);
+        return;
+    }
 #ifdef LATENCY
-    auto start = high_resolution_clock::now();
+    printf("accept & recv %ldus\n", duration_cast<microseconds>(high_resolution_clock::now() - pc.accepted).count());
 #endif
+    setupConnection(w, pc);
+}
 
-    LOG(INFO) << "Waiting for connection from new client...";
-    socket = qp_factory->waitIncomingConnection(&recv_buf);
-    DLOG_ASSERT(recv_buf->userDataSize == sizeof(FileInfo))
+void CSLServer::setupConnection(Worker *w, PendingConnection &pc) {
+    DLOG_ASSERT(pc.recv_buf->userDataSize == sizeof(FileInfo))
         << "Incorrect user data size, "
-        << "expect " << sizeof(FileInfo) << " receive " << recv_buf->userDataSize;
+        << "expect " << sizeof(FileInfo) << " receive " << pc.recv_buf->userDataSize;
     // Get file information from client
-    fi = *(reinterpret_cast<FileInfo *>(recv_buf->userData));
-    file_id = fi.file_id;
+    struct FileInfo fi = *(reinterpret_cast<FileInfo *>(pc.recv_buf->userData));
+    string file_id = fi.file_id;
     LOG(INFO) << "Get incoming connection: " << file_id << ":" << fi.size / 1024.0 / 1024.0 << "MB";
 
 #ifdef LATENCY
-    auto after_recv = high_resolution_clock::now();
+    auto start = high_resolution_clock::now();
 #endif
 
-    // Find if MR and QP have been created for this file
-    auto it = local_cons.find(file_id);
-    if (it == local_cons.end()) {
-        LOG(INFO) << "Create new MR and qp";
-        LocalConData con;
-        con.socket = socket;
-        con.buffer = mr_pool->GetMRofSize(fi.size);
-        memset(con.buffer->getData(), 0, con.buffer->getSizeInBytes());
-        con.buffer_token = shared_ptr<RegionToken>(con.buffer->createRegionToken());
-
-        con.qp = shared_ptr<QueuePair>(
-            qp_factory->replyIncomingConnection(socket, recv_buf, con.buffer_token.get(), sizeof(*(con.buffer_token))));
-        con.epoch = fi.epoch;
-        existing_qps.insert(make_pair(con.qp->getRemoteSocket(), con.qp));
-        local_cons.insert(make_pair(file_id, con));
-        // conn_cnt++;
-    } else {
-        /*
-         * MR and QP has already been created and not freed/recycled
-         * Client may disconnect abnormally
-         */
-        LOG(INFO) << "Reuse exist MR and recreate qp";
-        LocalConData &con = it->second;
-        con.socket = socket;
-        // delete old QP as it has been disconnected
-        existing_qps.erase(con.qp->getRemoteSocket());  // ? how to reuse a qp if it's disconnected?
-        con.qp = shared_ptr<QueuePair>(
-            qp_factory->replyIncomingConnection(socket, recv_buf, con.buffer_token.get(), sizeof(*(con.buffer_token))));
-        existing_qps.insert(make_pair(con.qp->getRemoteSocket(), con.qp));
+    ConShard &shard = shardOf(file_id);
+    LogRegionTokens tokens;
+    {
+        lock_guard<mutex> guard(shard.lock);
+        // Find if MR and QP have been created for this file
+        auto it = shard.cons.find(file_id);
+        if (it == shard.cons.end()) {
+            LOG(INFO) << "Create new MR and qp";
+            LocalConData con;
+            con.socket = pc.socket;
+            con.epoch = fi.epoch;
+            initConData(con, fi.size);
+            indexFile(file_id, con);
+            it = shard.cons.insert(make_pair(file_id, con)).first;
+            // conn_cnt++;
+        } else {
+            /*
+             * MR and QP has already been created and not freed/recycled
+             * Client may disconnect abnormally
+             */
+            LOG(INFO) << "Reuse exist MR and recreate qp";
+        }
+        tokens = getRegionTokens(it->second);
+    }
+
+    // the reply and the QP creation don't hold up the other files of the shard
+    auto qp = shared_ptr<QueuePair>(
+        qp_factory->replyIncomingConnection(pc.socket, pc.recv_buf, &tokens, sizeof(tokens)));
+    shared_ptr<QueuePair> old_qp;
+    {
+        lock_guard<mutex> guard(shard.lock);
+        auto it = shard.cons.find(file_id);
+        if (it == shard.cons.end()) {
+            LOG(WARNING) << "File " << file_id << " was closed while connecting";
+            return;
+        }
+        old_qp = it->second.qp;  // a file preloaded after a restart has none
+        it->second.qp = qp;
+        it->second.socket = pc.socket;
+    }
+    if (old_qp) {
+        // delete old QP as it has been disconnected, its worker stops watching the socket
+        lock_guard<mutex> guard(qps_lock);
+        existing_qps.erase(old_qp->getRemoteSocket());  // ? how to reuse a qp if it's disconnected?
+    }
+    int fd = qp->getRemoteSocket();
+    {
+        lock_guard<mutex> guard(qps_lock);
+        existing_qps[fd] = qp;
+    }
+    struct epoll_event ev = {};
+    ev.events = EPOLLIN;
+    ev.data.fd = fd;
+    if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, fd, &ev)) {
+        LOG(ERROR) << "Failed to watch the socket of file " << file_id << ", errno: " << errno;
     }
     LOG(INFO) << "Connection accepted, total: " << GetConnectionCount();
 #ifdef LATENCY
     auto after_reply = high_resolution_clock::now();
-    printf("accept & recv %ldus\nreply %ldus\n", duration_cast<microseconds>(after_recv - start).count(),
-           duration_cast<microseconds>(after_reply - after_recv).count());
+    printf("queued %ldus\nreply %ldus\n", duration_cast<microseconds>(start - pc.accepted).count(),
+           duration_cast<microseconds>(after_reply - start).count());
 #endif
 }
 
 int CSLServer::handleClientRequest(int socket) {
     ClientReq req;
-    ServerResp resp;
+    ServerResp resp = {};
     int ret;
 
     ret = recv(socket, &req, sizeof(req), 0);
@@ -181,45 +376,107 @@ int CSLServer::handleClientRequest(int socket) {
                                     << "expect " << sizeof(req) << " receive " << ret;
 
     string file_id(req.fi.file_id);
-    auto it = local_cons.find(file_id);
-    auto it_qp = existing_qps.find(socket);
+    shared_ptr<QueuePair> qp;
+    {
+        lock_guard<mutex> guard(qps_lock);
+        auto it_qp = existing_qps.find(socket);
+        if (it_qp != existing_qps.end()) qp = it_qp->second;
+    }
+    // requests of files in the same shard are serialized, whichever workers watch their QPs
+    ConShard &shard = shardOf(file_id);
+    unique_lock<mutex> lk(shard.lock);
+    auto &cons = shard.cons;
+    auto it = cons.find(file_id);
     LocalConData new_con;
+    LogRegionTokens tokens;
     switch (req.type) {
         case OPEN_FILE:
-            if (it != local_cons.end()) {
-                DLOG_ASSERT(socket == it->second.qp->getRemoteSocket()) << "socket unmatch";
-                send(it->second.qp->getRemoteSocket(), it->second.buffer_token.get(), sizeof(RegionToken), 0);
-            } else if (it_qp == existing_qps.end()) {
+            if (it != cons.end()) {
+                if (qp && socket != it->second.socket) {
+                    // reopened on another QP, e.g. one shared by the files of a restarted client
+                    it->second.qp = qp;
+                    it->second.socket = socket;
+                }
+                fill(begin(it->second.pinned), end(it->second.pinned), 0);  // the client starts over with its pins
+                tokens = getRegionTokens(it->second);
+                send(socket, &tokens, sizeof(tokens), 0);
+            } else if (!qp) {
                 LOG(ERROR) << "[OPEN FILE] Can't find the existing qp with the client";
                 break;
             } else {
-                DLOG_ASSERT(socket == it_qp->second->getRemoteSocket()) << "socket unmatch";
-                new_con.qp = it_qp->second;
-                new_con.buffer = mr_pool->GetMRofSize(req.fi.size);
-                new_con.buffer_token = shared_ptr<RegionToken>(new_con.buffer->createRegionToken());
+                DLOG_ASSERT(socket == qp->getRemoteSocket()) << "socket unmatch";
+                new_con.qp = qp;
+                initConData(new_con, req.fi.size);
                 new_con.socket = socket;
-                local_cons.insert(make_pair(file_id, new_con));
-                send(socket, new_con.buffer_token.get(), sizeof(RegionToken), 0);
+                indexFile(file_id, new_con);
+                cons.insert(make_pair(file_id, new_con));
+                tokens = getRegionTokens(new_con);
+                send(socket, &tokens, sizeof(tokens), 0);
             }
 
+            break;
+        case ADD_SEGMENT:
+            // idempotent, a reconnecting client asks again for segments that already exist
+            if (it == cons.end() || req.segment < 0 || req.segment >= MAX_LOG_SEGMENTS) {
+                LOG(ERROR) << "[ADD SEGMENT] can't add segment " << req.segment << " to file id: " << file_id;
+                RegionToken empty;  // size 0 tells the client the request failed
+                send(socket, &empty, sizeof(empty), 0);
+                break;
+            }
+            while (it->second.segments.size() <= static_cast<size_t>(req.segment)) addSegment(it->second);
+            if (it->second.segment_states[req.segment] >= SEGMENT_SPILLED) {
+                if (!restoreSegment(shard, lk, file_id, req.segment)) {
+                    RegionToken empty;
+                    send(socket, &empty, sizeof(empty), 0);
+                    break;
+                }
+                it = cons.find(file_id);  // the shard was unlocked
+            }
+            indexFile(file_id, it->second);
+            send(socket, it->second.segment_tokens[req.segment].get(), sizeof(RegionToken), 0);
+            break;
+        case PIN_SEGMENT:
+            // the client is about to access a cold segment, which stays in memory from now on
+            if (it == cons.end() || req.segment < 0 || req.segment >= static_cast<int>(it->second.segments.size()) ||
+                (it->second.segment_states[req.segment] >= SEGMENT_SPILLED &&
+                 !restoreSegment(shard, lk, file_id, req.segment))) {
+                LOG(ERROR) << "[PIN SEGMENT] can't pin segment " << req.segment << " of file id: " << file_id;
+                RegionToken empty;
+                send(socket, &empty, sizeof(empty), 0);
+                break;
+            }
+            it = cons.find(file_id);  // the shard may have been unlocked
+            it->second.pinned[req.segment]++;
+            indexFile(file_id, it->second);  // the segment may have been restored
+            send(socket, it->second.segment_tokens[req.segment].get(), sizeof(RegionToken), 0);
+            break;
+        case UNPIN_SEGMENT:
+            if (it == cons.end() || req.segment < 0 || req.segment >= MAX_LOG_SEGMENTS ||
+                it->second.pinned[req.segment] == 0) {
+                LOG(ERROR) << "[UNPIN SEGMENT] segment " << req.segment << " of file id: " << file_id
+                           << " isn't pinned";
+                break;
+            }
+            it->second.pinned[req.segment]--;  // spilled again once cold
             break;
         case CLOSE_FILE:
-            if (it == local_cons.end()) {
+            if (it == cons.end()) {
                 LOG(ERROR) << "[CLOSE FILE] can't find file id: " << file_id;
                 break;
             }
-            finalizeConData(it->second);
-            local_cons.erase(it);
+            unindexFile(file_id);
+            finalizeConData(it->second, req.fi.size);
+            cons.erase(it);
             LOG(INFO) << "[CLOSE FILE] File: " << file_id << " finalized, return v " << ret;
             break;
         case EXIT_PROC:
-            if (it == local_cons.end()) {
+            if (it == cons.end()) {
                 LOG(ERROR) << "[EXIT PROC] can't find file id: " << file_id;
             } else {
                 // finalizeConData(it->second);
                 // local_cons.erase(it);
             }
-            if (it_qp == existing_qps.end()) {
+            if (!qp) {
                 LOG(ERROR) << "[EXIT PROC] can't find QP with socket: " << socket;
                 break;
             }
@@ -227,35 +484,40 @@ int CSLServer::handleClientRequest(int socket) {
             LOG(INFO) << "[EXIT PROC] File: " << file_id << " finalized with QP (socket=" << socket << ") destroyed";
             break;
         case GET_INFO:
-            if (it != local_cons.end()) {
-                resp.size = findSize(file_id);
-                resp.seq = ReadSeqNum(file_id);
+            if (it != cons.end() && !progressOf(it->second, resp.size, resp.seq)) {
+                uint64_t meta_seq = metaSeqNum(it->second);
+                if (!findEndFromRecords(shard, lk, file_id, resp.size, resp.seq)) {
+                    // the client neither notifies nor frames its writes
+                    resp.seq = meta_seq;
+                    if (!findSize(shard, lk, file_id, resp.size) ||
+                        !stripCommitTrailer(shard, lk, file_id, resp.size, resp.seq)) {
+                        // answer as if the file wasn't here, so the client doesn't recover from this server
+                        LOG(ERROR) << "[GET INFO] can't find the end of file id: " << file_id;
+                        resp = {};
+                        send(socket, &resp, sizeof(resp), 0);
+                        break;
+                    }
+                }
+                it = cons.find(file_id);  // the shard may have been unlocked
+            }
+            if (it != cons.end()) {
+                resp.shard = *reinterpret_cast<uint64_t *>(
+                    reinterpret_cast<char *>(it->second.meta->getData()) + META_SHARD_OFFSET);
+                resp.resident = residentSize(it->second);
+                resp.log_end = *reinterpret_cast<uint64_t *>(
+                    reinterpret_cast<char *>(it->second.meta->getData()) + META_EC_END_OFFSET);
             } else {
                 LOG(ERROR) << "[GET INFO] can't find file id: " << file_id;
             }
-            send(it->second.qp->getRemoteSocket(), &resp, sizeof(resp), 0);
+            send(socket, &resp, sizeof(resp), 0);
             break;
-        case SYNC_PEER:
-            if (it == local_cons.end()) {
-                LOG(ERROR) << "[SYNC PEER] can't find file id: " << file_id;
-                break;
-            }
-            if (req.fi.size != it->second.buffer->getSizeInBytes()) {
-                LOG(WARNING) << "[SYNC PEER] req size not consistent with buf size, req: " << req.fi.size
-                             << ", buf: " << it->second.buffer->getSizeInBytes();
-            }
-            it->second.tmp_buffer = mr_pool->GetMRofSize(it->second.buffer->getSizeInBytes());
-            it->second.tmp_buffer_token.reset(it->second.tmp_buffer->createRegionToken());
-            send(it->second.socket, it->second.tmp_buffer_token.get(), sizeof(RegionToken), 0);
+        case GET_DIGESTS:
+            sendDigests(socket, shard, lk, file_id, req.fi.size);
             break;
+        case SYNC_PEER:
         case SYNC_PEER_DONE:
-            if (it == local_cons.end()) {
-                LOG(ERROR) << "[SYNC PEER DONE] can't find file id: " << file_id;
-                break;
-            }
-            it->second.buffer.swap(it->second.tmp_buffer);
-            it->second.buffer_token.swap(it->second.tmp_buffer_token);
-            mr_pool->RecycleMR(it->second.tmp_buffer);
+            // the tmp MR swap isn't used by the client and can't swap a chain of segments atomically
+            LOG(ERROR) << "[SYNC PEER] not supported for segmented logs, file id: " << file_id;
             break;
         default:
             LOG(ERROR) << "Unknown request type" << req.type;
@@ -265,44 +527,589 @@ int CSLServer::handleClientRequest(int socket) {
     return ret;
 }
 
-void CSLServer::finalizeConData(struct LocalConData &con) {
+void CSLServer::initConData(struct LocalConData &con, size_t size) {
+    con.meta = mr_pool->GetMRofSize(LOG_META_SIZE);
+    con.meta_token = shared_ptr<RegionToken>(con.meta->createRegionToken());
+    for (int i = segmentsFor(size); i > 0; i--) addSegment(con);
+    addProgress(con);
+}
+
+void CSLServer::addProgress(struct LocalConData &con) {
+    con.handle = next_handle.fetch_add(1);
+    lock_guard<mutex> guard(progress_lock);
+    progress[con.handle] = {reinterpret_cast<WriteProgress *>(reinterpret_cast<char *>(con.meta->getData()) +
+                                                              META_PROGRESS_OFFSET),
+                            0, 0, 0};
+}
+
+void CSLServer::addSegment(struct LocalConData &con) {
+    auto seg = mr_pool->GetMRofSize(segmentSize(con.segments.size()));
+    con.segment_tokens.emplace_back(seg->createRegionToken());
+    con.segments.push_back(seg);
+    con.segment_states.push_back(SEGMENT_IN_MEMORY);
+}
+
+string CSLServer::spillPath(uint32_t handle) {
+    return SPILL_DIR + "/" + to_string(getpid()) + "_" + to_string(handle) + ".spill";
+}
+
+void CSLServer::spillFunc() {
+    if (mkdir(SPILL_DIR.c_str(), 0755) && errno != EEXIST) {
+        LOG(ERROR) << "Failed to create spill directory " << SPILL_DIR << ", errno: " << errno;
+        return;
+    }
+    struct ColdSegment {
+        string file_id;
+        uint32_t handle;
+        int segment;
+        int fd;  // dup of the spill file of the file, which may be closed meanwhile
+        shared_ptr<Buffer> mr;
+    };
+    while (!stop) {
+        this_thread::sleep_for(milliseconds(SPILL_INTERVAL_MS));
+        vector<ColdSegment> cold;
+        for (auto &shard : local_cons) {
+            vector<string> file_ids;
+            {
+                lock_guard<mutex> guard(shard.lock);
+                for (auto &c : shard.cons) file_ids.push_back(c.first);
+            }
+            for (auto &file_id : file_ids) {
+                unique_lock<mutex> lk(shard.lock);
+                auto it = shard.cons.find(file_id);
+                size_t end;
+                uint64_t seq;
+                if (it == shard.cons.end()) continue;
+                if (!progressOf(it->second, end, seq) && !findEndFromRecords(shard, lk, file_id, end, seq)) continue;
+                it = shard.cons.find(file_id);  // the shard may have been unlocked
+                if (it == shard.cons.end()) continue;
+                LocalConData &con = it->second;
+                // the first segment holds the token sent on connection, it stays
+                for (size_t i = 1; i < con.segments.size() && segmentBegin(i + 1) + 2 * SPILL_HOT_SIZE <= end; i++) {
+                    if (con.segment_states[i] != SEGMENT_IN_MEMORY || con.pinned[i] > 0) continue;
+                    if (con.spill_fd < 0) {
+                        // a file preloaded after a restart keeps its spill file
+                        if (con.spill_path.empty()) con.spill_path = spillPath(con.handle);
+                        const char *path = con.spill_path.c_str();
+                        con.spill_fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_DIRECT, 0644);
+                        // e.g. tmpfs doesn't support direct I/O
+                        if (con.spill_fd < 0) con.spill_fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+                        if (con.spill_fd < 0) {
+                            LOG(ERROR) << "Failed to create spill file " << path << ", errno: " << errno;
+                            break;
+                        }
+                    }
+                    con.segment_states[i] = SEGMENT_SPILLING;
+                    cold.push_back({file_id, con.handle, static_cast<int>(i), dup(con.spill_fd), con.segments[i]});
+                }
+            }
+        }
+
+        for (auto &cs : cold) {
+            // the segment stays registered while it is written out, the client may pin it meanwhile
+            size_t size = segmentSize(cs.segment);
+            bool ok = cs.fd >= 0 && pwriteAll(cs.fd, reinterpret_cast<char *>(cs.mr->getData()), size,
+                                              segmentBegin(cs.segment)) &&
+                      fdatasync(cs.fd) == 0;
+            if (!ok) {
+                LOG(ERROR) << "Failed to spill segment " << cs.segment << " of " << cs.file_id << ", errno: " << errno;
+            }
+            if (cs.fd >= 0) close(cs.fd);
+
+            ConShard &shard = shardOf(cs.file_id);
+            lock_guard<mutex> guard(shard.lock);
+            auto it = shard.cons.find(cs.file_id);
+            if (it == shard.cons.end() || it->second.handle != cs.handle) continue;  // closed meanwhile
+            LocalConData &con = it->second;
+            if (!ok || con.pinned[cs.segment] > 0) {
+                con.segment_states[cs.segment] = SEGMENT_IN_MEMORY;
+                continue;
+            }
+            con.segments[cs.segment].reset();
+            con.segment_states[cs.segment] = SEGMENT_SPILLED;
+            indexFile(cs.file_id, con);  // before the memory can be carved again
+            mr_pool->RecycleMR(cs.mr, size);
+            spilled_bytes += size;
+        }
+        if (!cold.empty()) LOG(INFO) << "Spilled " << spilled_bytes.load() / 1048576 << "MB of cold segments";
+    }
+}
+
+bool CSLServer::restoreSegment(ConShard &shard, unique_lock<mutex> &lk, const string &file_id, int i) {
+    auto it = shard.cons.find(file_id);
+    while (it != shard.cons.end() && it->second.segment_states[i] == SEGMENT_RESTORING) {
+        shard.restored.wait(lk);  // by another worker
+        it = shard.cons.find(file_id);
+    }
+    if (it == shard.cons.end()) return false;
+    if (it->second.segment_states[i] == SEGMENT_IN_MEMORY) return true;
+
+    // read without the shard lock through a dup of the spill file, which a close of the file doesn't invalidate
+    LocalConData &con = it->second;
+    uint32_t handle = con.handle;
+    int fd = con.spill_fd >= 0 ? dup(con.spill_fd) : -1;
+    con.segment_states[i] = SEGMENT_RESTORING;
+    lk.unlock();
+    auto mr = mr_pool->GetMRofSize(segmentSize(i));
+    bool ok = fd >= 0 && preadAll(fd, reinterpret_cast<char *>(mr->getData()), segmentSize(i), segmentBegin(i));
+    if (!ok) LOG(ERROR) << "Failed to read spilled segment " << i << " of " << file_id << ", errno: " << errno;
+    if (fd >= 0) close(fd);
+    lk.lock();
+
+    it = shard.cons.find(file_id);
+    bool open = it != shard.cons.end() && it->second.handle == handle;
+    if (open && ok) {
+        it->second.segments[i] = mr;
+        it->second.segment_tokens[i].reset(mr->createRegionToken());
+        it->second.segment_states[i] = SEGMENT_IN_MEMORY;
+        spilled_bytes -= segmentSize(i);
+    } else {
+        if (open) it->second.segment_states[i] = SEGMENT_SPILLED;
+        mr_pool->RecycleMR(mr, segmentSize(i));
+    }
+    shard.restored.notify_all();
+    return open && ok;
+}
+
+template <typename Visit>
+bool CSLServer::readRange(ConShard &shard, unique_lock<mutex> &lk, const string &file_id, size_t off, size_t len,
+                          bool backward, vector<char> &staging, Visit visit) {
+    auto it = shard.cons.find(file_id);
+    if (it == shard.cons.end()) return false;
+    uint32_t handle = it->second.handle;
+    for (size_t done = 0; done < len;) {
+        // a piece never crosses a chunk, nor a segment then
+        size_t pos, n;
+        if (backward) {
+            size_t last = off + len - done;
+            pos = max(off, (last - 1) / RECOVERY_CHUNK_SIZE * RECOVERY_CHUNK_SIZE);
+            n = last - pos;
+        } else {
+            pos = off + done;
+            n = min(RECOVERY_CHUNK_SIZE - pos % RECOVERY_CHUNK_SIZE, len - done);
+        }
+        int i = segmentOf(pos);
+        if (i >= static_cast<int>(it->second.segments.size())) return false;
+        const char *data;
+        if (it->second.segments[i]) {
+            data = reinterpret_cast<const char *>(it->second.segments[i]->getData()) + pos - segmentBegin(i);
+        } else {
+            // same as restoreSegment(), the spill file is read through a dup without the shard lock
+            size_t chunk = pos / RECOVERY_CHUNK_SIZE * RECOVERY_CHUNK_SIZE;
+            staging.resize(RECOVERY_CHUNK_SIZE + DIRECT_IO_ALIGN);
+            char *buf = reinterpret_cast<char *>((reinterpret_cast<uintptr_t>(staging.data()) + DIRECT_IO_ALIGN - 1) &
+                                                 ~(DIRECT_IO_ALIGN - 1));
+            int fd = it->second.spill_fd >= 0 ? dup(it->second.spill_fd) : -1;
+            lk.unlock();
+            bool ok = fd >= 0 && preadAll(fd, buf, RECOVERY_CHUNK_SIZE, chunk);
+            if (!ok) {
+                LOG(ERROR) << "Failed to read spilled chunk at " << chunk << " of " << file_id << ", errno: " << errno;
+            }
+            if (fd >= 0) close(fd);
+            lk.lock();
+            it = shard.cons.find(file_id);
+            if (!ok || it == shard.cons.end() || it->second.handle != handle) return false;
+            data = buf + pos - chunk;
+        }
+        if (!visit(data, pos, n)) break;
+        done += n;
+    }
+    return true;
+}
+
+size_t CSLServer::residentSize(struct LocalConData &con) {
+    size_t size = con.meta->getSizeInBytes();
+    for (auto &seg : con.segments) {
+        if (seg) size += seg->getSizeInBytes();
+    }
+    return size;
+}
+
+void CSLServer::sendDigests(int socket, ConShard &shard, unique_lock<mutex> &lk, const string &file_id, size_t size) {
+    // the reply always has one entry per chunk, 0 for chunks this server doesn't have or can't read, which the client
+    // sends again
+    vector<uint64_t> digests((size + RECOVERY_CHUNK_SIZE - 1) / RECOVERY_CHUNK_SIZE, 0);
+    vector<char> staging;
+    for (size_t c = 0; c < digests.size(); c++) {
+        size_t off = c * RECOVERY_CHUNK_SIZE;
+        readRange(shard, lk, file_id, off, min(RECOVERY_CHUNK_SIZE, size - off), false, staging,
+                  [&](const char *data, size_t, size_t len) {
+                      digests[c] = chunkDigest(data, len);
+                      return true;
+                  });
+    }
+    send(socket, digests.data(), digests.size() * sizeof(uint64_t), 0);
+}
+
+LogRegionTokens CSLServer::getRegionTokens(struct LocalConData &con) {
+    return {*con.meta_token, *con.segment_tokens[0], con.handle};
+}
+
+void CSLServer::finalizeConData(struct LocalConData &con, size_t used) {
     // * qp are never freed for now
     // delete con.qp;
-    mr_pool->RecycleMR(con.buffer);
+    {
+        lock_guard<mutex> guard(progress_lock);
+        progress.erase(con.handle);
+    }
+    mr_pool->RecycleMR(con.meta);
+    for (size_t i = 0; i < con.segments.size(); i++) {
+        size_t begin = segmentBegin(i);
+        if (con.segments[i]) {
+            // the client only knows what it wrote itself, an earlier client of the file, the recovery this server
+            // took part in or a stale trailer may have left data past used, so the rest is scanned
+            size_t size = con.segments[i]->getSizeInBytes();
+            size_t dirty = min(used > begin ? used - begin : 0, size);
+            if (dirty < size) dirty = nonZeroEnd(static_cast<const char *>(con.segments[i]->getData()), dirty, size);
+            mr_pool->RecycleMR(con.segments[i], dirty);
+        } else {
+            spilled_bytes -= segmentSize(i);
+        }
+    }
+    if (con.spill_fd >= 0) {
+        close(con.spill_fd);
+        unlink(con.spill_path.c_str());
+    }
 }
 
 vector<string> CSLServer::GetAllFileId() {
     vector<string> all_file_id;
-    for (auto &c : local_cons) {
-        all_file_id.emplace_back(c.first);
+    for (auto &shard : local_cons) {
+        lock_guard<mutex> guard(shard.lock);
+        for (auto &c : shard.cons) {
+            all_file_id.emplace_back(c.first);
+        }
     }
     return all_file_id;
 }
 
+int CSLServer::GetConnectionCount() {
+    int n = 0;
+    for (auto &shard : local_cons) {
+        lock_guard<mutex> guard(shard.lock);
+        n += shard.cons.size();
+    }
+    return n;
+}
+
+const void *CSLServer::GetBufData(const string &fileid) {
+    ConShard &shard = shardOf(fileid);
+    lock_guard<mutex> guard(shard.lock);
+    auto it = shard.cons.find(fileid);
+    return it == shard.cons.end() ? nullptr : it->second.segments[0]->getData();
+}
+
 uint64_t CSLServer::ReadSeqNum(const string &fileid) {
-    auto buf = local_cons[fileid].buffer;
-    return *reinterpret_cast<uint64_t *>(buf->getAddress() + buf->getSizeInBytes() - sizeof(uint64_t));
+    ConShard &shard = shardOf(fileid);
+    unique_lock<mutex> lk(shard.lock);
+    auto it = shard.cons.find(fileid);
+    if (it == shard.cons.end()) return 0;
+    auto &con = it->second;
+    size_t end;
+    uint64_t seq;
+    if (progressOf(con, end, seq)) return seq;
+    seq = metaSeqNum(con);
+    if (findSize(shard, lk, fileid, end)) stripCommitTrailer(shard, lk, fileid, end, seq);
+    return seq;
+}
+
+uint64_t CSLServer::metaSeqNum(struct LocalConData &con) {
+    auto meta = reinterpret_cast<char *>(con.meta->getData());
+    return max(*reinterpret_cast<uint64_t *>(meta + META_SEQ_OFFSET),
+               reinterpret_cast<WriteProgress *>(meta + META_PROGRESS_OFFSET)->seq);
+}
+
+bool CSLServer::GetProgress(const string &file_id, size_t &end, uint64_t &seq) {
+    ConShard &shard = shardOf(file_id);
+    lock_guard<mutex> guard(shard.lock);
+    auto con = shard.cons.find(file_id);
+    if (con == shard.cons.end()) return false;
+    return progressOf(con->second, end, seq);
+}
+
+bool CSLServer::progressOf(struct LocalConData &con, size_t &end, uint64_t &seq) {
+    lock_guard<mutex> guard(progress_lock);
+    auto it = progress.find(con.handle);
+    if (it == progress.end() || it->second.writes == 0) return false;
+    end = it->second.end;
+    seq = it->second.seq;
+    return true;
+}
+
+void CSLServer::progressFunc() {
+    infinity::core::receive_element_t recv;
+    int idle = 0;
+    while (!stop) {
+        if (!context->receive(&recv)) {
+            if (++idle >= PROGRESS_IDLE_POLLS) this_thread::sleep_for(microseconds(50));
+            continue;
+        }
+        idle = 0;
+        context->postReceiveBuffer(recv.buffer);
+        if (!recv.immediateValueValid) continue;
+
+        lock_guard<mutex> guard(progress_lock);
+        auto it = progress.find(recv.immediateValue);
+        if (it == progress.end()) continue;  // the file was closed
+        FileProgress &fp = it->second;
+        WriteProgress wp = readProgress(fp.remote);  // in place once the completion is received, or a newer one
+        fp.end = wp.end;
+        fp.seq = wp.seq;
+        fp.writes++;
+    }
+}
+
+WriteProgress CSLServer::readProgress(const WriteProgress *remote) {
+    auto slot = reinterpret_cast<const volatile WriteProgress *>(remote);
+    WriteProgress wp;
+    do {
+        // read in the opposite order of the placement, a write in between changes version
+        wp.version_end = slot->version_end;
+        atomic_thread_fence(memory_order_acquire);
+        wp.end = slot->end;
+        wp.seq = slot->seq;
+        atomic_thread_fence(memory_order_acquire);
+        wp.version = slot->version;
+    } while (wp.version != wp.version_end);
+    return wp;
 }
 
 void CSLServer::Preload(ifstream &file) {
+    if (!mr_pool->IsShared()) {
+        LOG(ERROR) << "Preloading files needs their MRs in shared memory, build with SERVER_SHM";
+        return;
+    }
+    auto start = high_resolution_clock::now();
+    struct Indexed {
+        uint64_t epoch;
+        string spill_path;
+        vector<IndexExtent> extents;
+    };
+    map<string, Indexed> files;  // the last record of a file wins
+    string tag, file_id;
+    while (file >> tag) {
+        if (tag == "session") {
+            string ignored;  // written by older servers, which resumed the ZooKeeper session of the previous one
+            getline(file, ignored);
+        } else if (tag == "drop") {
+            if (file >> quoted(file_id)) files.erase(file_id);
+        } else if (tag == "file") {
+            Indexed f;
+            size_t n = 0;
+            file >> quoted(file_id) >> f.epoch >> quoted(f.spill_path) >> n;
+            if (n > MAX_LOG_SEGMENTS + 1) break;
+            f.extents.resize(n);
+            for (auto &e : f.extents) file >> e.region >> e.off >> e.size;
+            if (file) files[file_id] = move(f);
+        } else {
+            break;
+        }
+        if (!file) break;  // the last record is torn if the previous server crashed while appending it
+    }
+
+    size_t restored = 0, bytes = 0;
+    for (auto &f : files) {
+        ConShard &shard = shardOf(f.first);
+        lock_guard<mutex> guard(shard.lock);
+        if (shard.cons.count(f.first)) continue;
+        LocalConData con;
+        con.socket = -1;  // until the client reconnects
+        con.epoch = f.second.epoch;
+        con.spill_path = f.second.spill_path;
+        if (!adoptConData(con, f.second.extents)) {
+            LOG(ERROR) << "Failed to preload file " << f.first << ", its MRs aren't where the index says";
+            continue;
+        }
+        addProgress(con);
+        indexFile(f.first, con);
+        bytes += residentSize(con);
+        restored++;
+        shard.cons.insert(make_pair(f.first, con));
+    }
+    LOG(INFO) << "Preloaded " << restored << " of " << files.size() << " files, " << bytes / 1048576 << "MB in "
+              << duration_cast<microseconds>(high_resolution_clock::now() - start).count() / 1000.0 << "ms";
+}
+
+bool CSLServer::adoptConData(struct LocalConData &con, const vector<IndexExtent> &extents) {
+    size_t i = 0;
+    for (; i < extents.size(); i++) {
+        const IndexExtent &e = extents[i];
+        if (e.size != (i == 0 ? LOG_META_SIZE : segmentSize(i - 1))) break;
+        shared_ptr<Buffer> mr;
+        if (e.region >= 0) {
+            mr = mr_pool->Adopt(e.region, e.off, e.size);
+            if (!mr) break;
+        } else if (i == 0 || con.spill_path.empty()) {
+            break;  // only segments are spilled
+        }
+        if (i == 0) {
+            con.meta = mr;
+            con.meta_token = shared_ptr<RegionToken>(mr->createRegionToken());
+            continue;
+        }
+        con.segments.push_back(mr);
+        con.segment_tokens.emplace_back(mr ? mr->createRegionToken() : nullptr);
+        con.segment_states.push_back(mr ? SEGMENT_IN_MEMORY : SEGMENT_SPILLED);
+    }
+    bool ok = i == extents.size() && !con.segments.empty() && con.segments[0];
+    size_t spilled = 0;
+    for (size_t s = 0; ok && s < con.segments.size(); s++) {
+        if (con.segments[s]) continue;
+        spilled += segmentSize(s);
+        if (con.spill_fd >= 0) continue;
+        con.spill_fd = open(con.spill_path.c_str(), O_RDWR | O_DIRECT);
+        if (con.spill_fd < 0) con.spill_fd = open(con.spill_path.c_str(), O_RDWR);
+        if (con.spill_fd < 0) {
+            LOG(ERROR) << "Failed to open spill file " << con.spill_path << ", errno: " << errno;
+            ok = false;
+        }
+    }
+    if (ok) {
+        spilled_bytes += spilled;
+        return true;
+    }
+    if (con.meta) mr_pool->RecycleMR(con.meta);
+    for (auto &seg : con.segments) {
+        if (seg) mr_pool->RecycleMR(seg);
+    }
+    if (con.spill_fd >= 0) close(con.spill_fd);
+    return false;
+}
+
+void CSLServer::indexFile(const string &file_id, struct LocalConData &con) {
+    if (index_fd < 0) return;
+    stringstream record;
+    record << "file " << quoted(file_id) << " " << con.epoch << " " << quoted(con.spill_path) << " "
+           << con.segments.size() + 1;
+    for (size_t i = 0; i <= con.segments.size(); i++) {
+        Buffer *mr = i == 0 ? con.meta.get() : con.segments[i - 1].get();
+        int region = -1;
+        size_t off = 0;
+        if (mr && !mr_pool->Locate(mr, region, off)) {
+            LOG(WARNING) << "A MR of file " << file_id << " isn't in shared memory, the file won't survive a restart";
+            unindexFile(file_id);
+            return;
+        }
+        record << " " << region << " " << off << " " << (i == 0 ? LOG_META_SIZE : segmentSize(i - 1));
+    }
+    record << "\n";
+    appendIndex(record.str());
+}
 
+void CSLServer::unindexFile(const string &file_id) {
+    if (index_fd < 0) return;
+    stringstream record;
+    record << "drop " << quoted(file_id) << "\n";
+    appendIndex(record.str());
 }
 
-size_t CSLServer::findSize(const string &file_id) {
-    if (local_cons.find(file_id) == local_cons.end()) return 0;
+void CSLServer::appendIndex(const string &record) {
+    lock_guard<mutex> guard(index_lock);
+    if (write(index_fd, record.data(), record.size()) != static_cast<ssize_t>(record.size())) {
+        LOG(ERROR) << "Failed to append to index " << SHM_INDEX_PATH << ", errno: " << errno;
+    }
+}
 
-    auto &mr = local_cons[file_id].buffer;
-    char *mr_begin = reinterpret_cast<char *>(mr->getData());
-    char *buf = mr_begin + mr->getSizeInBytes() - sizeof(uint64_t) - 1;  // points to the end of the MR, ignore sequence number
-    while (buf >= mr_begin) {
-        if (*buf != 0) break;  // todo
-        buf--;
+void CSLServer::compactIndex() {
+    string tmp = SHM_INDEX_PATH + ".tmp";
+    index_fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0600);
+    if (index_fd < 0) {
+        LOG(ERROR) << "Failed to create index " << tmp << ", errno: " << errno;
+        return;
+    }
+    for (auto &shard : local_cons) {
+        lock_guard<mutex> guard(shard.lock);
+        for (auto &c : shard.cons) indexFile(c.first, c.second);
+    }
+    if (rename(tmp.c_str(), SHM_INDEX_PATH.c_str())) {
+        LOG(ERROR) << "Failed to replace index " << SHM_INDEX_PATH << ", errno: " << errno;
+        close(index_fd);
+        index_fd = -1;
     }
-    return buf - mr_begin + 1;
+}
+
+bool CSLServer::findEndFromRecords(ConShard &shard, unique_lock<mutex> &lk, const string &file_id, size_t &end,
+                                   uint64_t &seq) {
+    auto it = shard.cons.find(file_id);
+    if (it == shard.cons.end()) return false;
+    LocalConData &con = it->second;
+    auto records = reinterpret_cast<LogRecord *>(reinterpret_cast<char *>(con.meta->getData()) + META_RECORDS_OFFSET);
+    LogRecord *newest = nullptr, *prev = nullptr;
+    for (size_t i = 0; i < LOG_RECORD_SLOTS; i++) {
+        LogRecord &r = records[i];
+        if (r.id == 0 || crc32c(&r, offsetof(LogRecord, crc)) != r.crc) continue;  // empty or torn record
+        if (!newest || r.id > newest->id) {
+            prev = newest;
+            newest = &r;
+        } else if (!prev || r.id > prev->id) {
+            prev = &r;
+        }
+    }
+    if (!newest) return false;
+    // copied, the journal may be gone once the shard is unlocked
+    LogRecord last = *newest, before = prev ? *prev : LogRecord{};
+
+    // the data of the newest write must be intact, otherwise the log ends where it did before that write
+    bool intact = last.offset + last.length <= segmentBegin(con.segments.size());
+    uint32_t data_crc = 0;
+    vector<char> staging;
+    if (intact && !readRange(shard, lk, file_id, last.offset, last.length, false, staging,
+                             [&](const char *data, size_t, size_t len) {
+                                 data_crc = crc32c(data, len, data_crc);
+                                 return true;
+                             })) {
+        return false;  // not torn, only unreadable
+    }
+    if (intact && data_crc == last.data_crc) {
+        end = last.end;
+        seq = last.seq;
+        return true;
+    }
+    LOG(WARNING) << "Torn write of " << last.length << "B at " << last.offset << " (record " << last.id
+                 << ") is discarded";
+    end = before.end;
+    seq = before.seq;
+    return true;
+}
+
+bool CSLServer::stripCommitTrailer(ConShard &shard, unique_lock<mutex> &lk, const string &file_id, size_t &end,
+                                   uint64_t &seq) {
+    if (end < sizeof(CommitTrailer)) return true;
+    size_t off = end - sizeof(CommitTrailer);
+    if (segmentOf(end - 1) != segmentOf(off)) return true;  // the client never splits a trailer
+    CommitTrailer trailer;
+    vector<char> staging;
+    auto copy = [&](const char *data, size_t pos, size_t len) {
+        memcpy(reinterpret_cast<char *>(&trailer) + pos - off, data, len);
+        return true;
+    };
+    if (!readRange(shard, lk, file_id, off, sizeof(trailer), false, staging, copy)) return false;
+    if (trailer.magic != COMMIT_MAGIC) return true;
+    end = off;
+    seq = max(seq, trailer.seq);  // a later write below the tail still updates the metadata
+    return true;
+}
+
+bool CSLServer::findSize(ConShard &shard, unique_lock<mutex> &lk, const string &file_id, size_t &size) {
+    auto it = shard.cons.find(file_id);
+    if (it == shard.cons.end()) return false;
+    size_t capacity = segmentBegin(it->second.segments.size());
+    vector<char> staging;
+    size = 0;
+    return readRange(shard, lk, file_id, 0, capacity, true, staging, [&](const char *data, size_t pos, size_t len) {
+        size_t n = nonZeroEnd(data, 0, len);
+        if (n > 0) size = pos + n;
+        return n == 0;  // stop at the last non-zero byte
+    });
 }
 
 CSLServer::~CSLServer() {
     if (zh) zookeeper_close(zh);
+    if (index_fd >= 0) close(index_fd);
+    for (auto &w : workers) {
+        if (w->epfd >= 0) close(w->epfd);
+        if (w->event_fd >= 0) close(w->event_fd);
+    }
     // for (auto &c : local_cons) {
     //     if (c.second.buffer) delete c.second.buffer;
     //     if (c.second.qp) delete c.second.qp;
@@ -15,14 +15,24 @@
 #include <infinity/core/Context.h>
 #include <infinity/memory/Buffer.h>
 #include <infinity/memory/RegionToken.h>
+#include <infinity/memory/RegisteredMemory.h>
 #include <infinity/queues/QueuePair.h>
 #include <infinity/queues/QueuePairFactory.h>
 #include <zookeeper/zookeeper.h>
 
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
 #include <fstream>
+#include <mutex>
+#include <thread>
 #include <unordered_map>
+#include <vector>
 
 #include "../csl_config.h"
+#include "common.h"
+#include "log_segments.h"
 #include "mr_pool.h"
 
 using namespace std;
@@ -33,38 +43,118 @@ using infinity::queues::QueuePairFactory;
 
 class CSLServer {
     friend void ServerWatcher(zhandle_t *zh, int type, int state, const char *path, void *watcher_ctx);
+    enum SegmentState : uint8_t { SEGMENT_IN_MEMORY, SEGMENT_SPILLING, SEGMENT_SPILLED, SEGMENT_RESTORING };
     struct LocalConData {
         shared_ptr<QueuePair> qp;
-        shared_ptr<Buffer> buffer;
-        shared_ptr<RegionToken> buffer_token;
-        shared_ptr<Buffer> tmp_buffer;
-        shared_ptr<RegionToken> tmp_buffer_token;
-        uint64_t epoch;
+        shared_ptr<Buffer> meta;  // holds the sequence number
+        shared_ptr<RegionToken> meta_token;
+        vector<shared_ptr<Buffer>> segments;  // see log_segments.h for the layout
+        vector<shared_ptr<RegionToken>> segment_tokens;
+        uint64_t epoch = 0;
         int socket;
+        uint32_t handle;  // names the file in progress notifications, the QP may be shared with other files
+        vector<SegmentState> segment_states;
+        uint16_t pinned[MAX_LOG_SEGMENTS] = {};  // PIN_SEGMENT not yet released with UNPIN_SEGMENT, never spilled
+        int spill_fd = -1;  // file cold segments are spilled to, opened on the first spill
+        string spill_path;
     };
 
+    /**
+     * Where a MR of a file lives in the shared memory arena, as recorded in the index. Region -1 for a spilled segment.
+     */
+    struct IndexExtent {
+        int region;
+        size_t off;
+        size_t size;
+    };
+
+    /**
+     * Entry of the progress table, kept up to date from the WRITE_WITH_IMM completions of a file
+     */
+    struct FileProgress {
+        const WriteProgress *remote;  // where the client writes its progress, in the metadata region
+        size_t end;
+        uint64_t seq;
+        uint64_t writes;  // notifications received, 0 if the client doesn't send them
+    };
+
+    /**
+     * Partition of the open files, locked while a request of one of them is handled
+     */
+    struct ConShard {
+        mutex lock;
+        unordered_map<string, LocalConData> cons;
+        condition_variable restored;  // a segment of one of the files left SEGMENT_RESTORING
+    };
+
+    /**
+     * Connection accepted by the main thread, waiting for a worker to receive the client's QP and set up its own
+     */
+    struct PendingConnection {
+        int socket;
+        infinity::queues::serializedQueuePair *recv_buf;
+        chrono::high_resolution_clock::time_point accepted;
+    };
+
+    /**
+     * Worker thread of the control plane. It sets up the QPs of the connections handed to it and handles the requests
+     * that arrive on them, waiting on its own epoll instance.
+     */
+    struct Worker {
+        int epfd;
+        int event_fd;  // wakes the worker when a connection is handed to it
+        mutex lock;
+        deque<PendingConnection> pending;
+        unordered_map<int, PendingConnection> handshakes;  // by socket, until the client's QP arrives, worker only
+        thread th;
+    };
+
+    static const int CON_SHARDS = 64;
+
    private:
     infinity::core::Context *context;
     QueuePairFactory *qp_factory;
     unordered_map<int, shared_ptr<QueuePair> > existing_qps;  // prevent QPs from being automatically freed
+    mutex qps_lock;                                            // protects existing_qps
     unique_ptr<NCLMrPool> mr_pool;
-    unordered_map<string, LocalConData> local_cons;
+    ConShard local_cons[CON_SHARDS];  // by hash of the file id
     zhandle_t *zh;
 
     // size_t buf_size;
     // int conn_cnt;
-    bool stop;
+    atomic<bool> stop;
+
+    vector<unique_ptr<Worker>> workers;
+    size_t next_worker;
+    atomic<uint32_t> next_handle;
+    unordered_map<uint32_t, FileProgress> progress;  // by file handle, protected by progress_lock
+    mutex progress_lock;
+    thread progress_th;
+    unique_ptr<infinity::memory::RegisteredMemory> recv_memory;
+    vector<unique_ptr<Buffer>> recv_buffers;  // posted to the shared receive queue, consumed by WRITE_WITH_IMM
+
+    thread spill_th;
+    atomic<size_t> spilled_bytes;  // bytes of segments currently on SSD instead of memory
+
+    int index_fd;      // journal of the files whose MRs live in shared memory, with SERVER_SHM
+    mutex index_lock;  // keeps the records of the journal whole
 
    public:
-    CSLServer(uint16_t port, size_t buf_size, string mgr_hosts = "");
+    /**
+     * @param workers number of threads setting up connections and handling requests
+     */
+    CSLServer(uint16_t port, size_t buf_size, string mgr_hosts = "", int workers = SERVER_WORKERS);
     ~CSLServer();
 
+    /**
+     * Accept connections and hand them to the workers round-robin, until the server stops
+     */
     void Run();
 
     /**
      * Get the total number of RDMA connections to this server
      */
-    int GetConnectionCount() { return local_cons.size(); }
+    int GetConnectionCount();
 
     /**
      * Get the file ids of all the files this server is currently backing up
@@ -72,30 +162,206 @@ class CSLServer {
     vector<string> GetAllFileId();
 
     /**
-     * Get the pointer to the MR for the specified file
+     * Get the pointer to the first segment of the specified file, nullptr if the file isn't open
      */
-    const void *GetBufData(const string &fileid) { return local_cons[fileid].buffer->getData(); }
+    const void *GetBufData(const string &fileid);
 
     /**
-     * Get the current sequence number for the specified file
+     * Get the current sequence number for the specified file, from the metadata or the CommitTrailer at the end of the
+     * log
      */
     uint64_t ReadSeqNum(const string &fileid);
+
+    /**
+     * Get the end and the sequence number of a file from the progress table, in constant time
+     *
+     * @return false if the client of the file doesn't send progress notifications
+     */
+    bool GetProgress(const string &file_id, size_t &end, uint64_t &seq);
+
+    /**
+     * @return bytes of log segments spilled to SSD with SERVER_SPILL
+     */
+    size_t GetSpilledBytes() { return spilled_bytes.load(); }
     void Stop() { stop = true; }
-    // Not used currently
+
+    /**
+     * Take back the files listed in an index written by a previous server, whose MRs are still in shared memory.
+     * Their clients get them back as they were when they reconnect. A server built with SERVER_SHM preloads the index
+     * at SHM_INDEX_PATH before it advertises itself.
+     */
     void Preload(ifstream &file);
 
    private:
+    ConShard &shardOf(const string &file_id) { return local_cons[hash<string>()(file_id) % CON_SHARDS]; }
+
+    /**
+     * Get the current memory usage (the byte in use, not total size of the MR) in Byte of a file. Spilled data is read
+     * with readRange().
+     *
+     * @param lk lock of the shard of the file, held on entry and on return
+     * @return false if a spilled segment can't be read or the file was closed meanwhile
+     */
+    bool findSize(ConShard &shard, unique_lock<mutex> &lk, const string &file_id, size_t &size);
+
+    /**
+     * GetProgress() of a file whose shard is locked
+     */
+    bool progressOf(struct LocalConData &con, size_t &end, uint64_t &seq);
+
+    /**
+     * If the log found ending at end finishes with a CommitTrailer, move end before it and take its sequence number if
+     * newer than seq
+     *
+     * @param lk lock of the shard of the file, held on entry and on return
+     * @return false if the end of the log can't be read
+     */
+    bool stripCommitTrailer(ConShard &shard, unique_lock<mutex> &lk, const string &file_id, size_t &end, uint64_t &seq);
+
+    /**
+     * @return the newest sequence number written to the metadata region, as a plain word or with a progress
+     */
+    uint64_t metaSeqNum(struct LocalConData &con);
+
+    /**
+     * Poll the receive CQ for WRITE_WITH_IMM completions and update the progress table, until the server stops
+     */
+    void progressFunc();
+
     /**
-     * Get the current memory usage (the byte in use, not total size of the MR) in Byte of the specified file
+     * Copy the progress a client wrote, retried while a newer write is being placed
+     */
+    static WriteProgress readProgress(const WriteProgress *remote);
+
+    /**
+     * Find the end of the log and the sequence number from the newest valid record of the journal. A write whose data
+     * doesn't match its record is discarded.
+     *
+     * @param lk lock of the shard of the file, held on entry and on return
+     * @return false if the journal has no valid record, the client doesn't frame its writes, or the data of the
+     * newest record can't be read
+     */
+    bool findEndFromRecords(ConShard &shard, unique_lock<mutex> &lk, const string &file_id, size_t &end, uint64_t &seq);
+
+    /**
+     * Allocate MRs for the metadata and the segments covering size bytes of a new file, and give it a handle in the
+     * progress table
+     */
+    void initConData(struct LocalConData &con, size_t size);
+
+    /**
+     * Allocate MRs for the next segment of a file
+     */
+    void addSegment(struct LocalConData &con);
+
+    /**
+     * Give a file a handle in the progress table
+     */
+    void addProgress(struct LocalConData &con);
+
+    /**
+     * Take back the MRs of a file listed in the index from the shared memory arena, and reopen its spill file
+     *
+     * @param extents the metadata region, then the segments
+     * @return false if any of them can't be taken back, those that were are recycled
+     */
+    bool adoptConData(struct LocalConData &con, const vector<IndexExtent> &extents);
+
+    /**
+     * Record where the MRs of a file live in the index, once they change. A record is appended to the journal, the
+     * last one of a file wins. Nothing is recorded without SERVER_SHM.
+     */
+    void indexFile(const string &file_id, struct LocalConData &con);
+
+    /**
+     * Remove a file from the index, before its MRs are recycled
+     */
+    void unindexFile(const string &file_id);
+    void appendIndex(const string &record);
+
+    /**
+     * Start a new journal with a record for each open file, and append to it from now on
+     */
+    void compactIndex();
+
+    /**
+     * Spill segments of open files that are fully acknowledged and far enough below the end of their log to SSD, then
+     * free their memory, until the server stops. Only files with progress notifications or framed writes are
+     * spilled, the end of other logs is only known by scanning them.
+     *
+     * The client may still access a spilled segment with the token it had. It doesn't: a segment more than
+     * SPILL_HOT_SIZE below the end of the log is pinned with PIN_SEGMENT before the client touches it and unpinned with
+     * UNPIN_SEGMENT once the access completes, and a server only spills segments 2 * SPILL_HOT_SIZE below the end it
+     * knows of.
+     */
+    void spillFunc();
+    string spillPath(uint32_t handle);
+
+    /**
+     * Bring a spilled segment of a file back into a new MR, which the client is given the token of. The shard lock is
+     * released while the segment is read, the segment is SEGMENT_RESTORING meanwhile and other requests for it wait.
+     *
+     * @param lk lock of the shard of the file, held on entry and on return
+     * @return false if the segment can't be read back or the file was closed meanwhile
+     */
+    bool restoreSegment(ConShard &shard, unique_lock<mutex> &lk, const string &file_id, int i);
+
+    /**
+     * Call visit(data, pos, n) on [off, off + len) of a file, a piece of at most RECOVERY_CHUNK_SIZE bytes at a time,
+     * from the end if backward, until it returns false. A spilled piece is read with its whole chunk into staging, with
+     * the shard lock released like in restoreSegment().
+     *
+     * @param lk lock of the shard of the file, held on entry, on return and during visit
+     * @return false if a piece is past the segments, can't be read, or the file was closed meanwhile
+     */
+    template <typename Visit>
+    bool readRange(ConShard &shard, unique_lock<mutex> &lk, const string &file_id, size_t off, size_t len,
+                   bool backward, vector<char> &staging, Visit visit);
+
+    /**
+     * @return bytes of memory the MRs of a file take
+     */
+    size_t residentSize(struct LocalConData &con);
+
+    /**
+     * @return tokens of the metadata region and the first segment, which are sent to the client on connection
+     */
+    LogRegionTokens getRegionTokens(struct LocalConData &con);
+
+    /**
+     * Reply to GET_DIGESTS with the digest of every RECOVERY_CHUNK_SIZE chunk of the first size bytes of a file, which
+     * the client compares with its own copy to find the chunks this server is missing
+     */
+    void sendDigests(int socket, ConShard &shard, unique_lock<mutex> &lk, const string &file_id, size_t size);
+
+    /**
+     * Accept a connection and hand it to the next worker, which waits for the client's QP on it
      */
-    size_t findSize(const string &file_id);
     void handleIncomingConnection();
+
+    /**
+     * Receive the QP of a client that connected to worker w and set up the connection
+     */
+    void finishHandshake(Worker *w, PendingConnection &pc);
+
+    /**
+     * Set up the MRs and the QP of a connection handed to worker w, and watch its socket for requests
+     */
+    void setupConnection(Worker *w, PendingConnection &pc);
     int handleClientRequest(int socket);
 
+    /**
+     * Wait for events of the connections of w, until the server stops
+     */
+    void workerFunc(Worker *w);
+
     /**
      * Called when client closed a file and close the RDMA connection
+     *
+     * @param used bytes of the log the client may have written. Only the non-zero part of the rest of each resident
+     * segment is zeroed as well, a write the client doesn't know of may be there.
      */
-    void finalizeConData(struct LocalConData &con);
+    void finalizeConData(struct LocalConData &con, size_t used = SIZE_MAX);
 };
 
 void ServerWatcher(zhandle_t *zh, int type, int state, const char *path, void *watcher_ctx);
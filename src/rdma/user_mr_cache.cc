@@ -0,0 +1,158 @@
+/*
+ * Registration cache of application buffers for Compute-side log RDMA client
+ *
+ * Copyright 2022 UIUC
+ * Author: Xuhao Luo
+ */
+
+#include "user_mr_cache.h"
+
+#include <glog/logging.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <vector>
+
+#ifndef MADV_POPULATE_WRITE
+#define MADV_POPULATE_WRITE 23  // Linux 5.14
+#endif
+
+atomic<size_t> UserMrCache::total_pinned(0);
+
+namespace {
+
+/**
+ * Set while a thread works on a cache. Registering and deregistering may allocate or free memory, and the interposed
+ * free() must not try to take the lock the thread already holds
+ */
+thread_local bool in_cache = false;
+
+struct InCache {
+    InCache() { in_cache = true; }
+    ~InCache() { in_cache = false; }
+};
+
+/**
+ * Stack of the thread and the caches holding registrations in it. glibc unmaps or hands out the stack of an exited
+ * thread with its internal munmap, which the interposed one doesn't see, so they are dropped when the thread exits.
+ */
+struct ThreadStack {
+    uintptr_t lo = 0, hi = 0;
+    vector<UserMrCache *> caches;
+
+    ThreadStack() {
+        pthread_attr_t attr;
+        void *addr;
+        size_t size;
+        if (pthread_getattr_np(pthread_self(), &attr) != 0) return;
+        if (pthread_attr_getstack(&attr, &addr, &size) == 0) {
+            lo = reinterpret_cast<uintptr_t>(addr);
+            hi = lo + size;
+        }
+        pthread_attr_destroy(&attr);
+    }
+    ~ThreadStack() {
+        for (auto c : caches) c->Invalidate(reinterpret_cast<void *>(lo), hi - lo);
+    }
+};
+
+}  // namespace
+
+UserMrCache::UserMrCache(Context *context, size_t capacity)
+    : context(context), capacity(capacity), pinned(0), lo(UINTPTR_MAX), hi(0), hits(0), misses(0) {}
+
+UserMrCache::~UserMrCache() {
+    lock_guard<mutex> guard(lock);
+    InCache busy;
+    for (auto it = entries.begin(); it != entries.end();) it = erase(it);
+}
+
+map<uintptr_t, UserMrCache::Entry>::iterator UserMrCache::erase(map<uintptr_t, Entry>::iterator it) {
+    size_t len = it->second.end - it->first;
+    pinned -= len;
+    total_pinned -= len;
+    lru.erase(it->second.lru);
+    if (entries.size() == 1) {
+        lo = UINTPTR_MAX;
+        hi = 0;
+    }
+    return entries.erase(it);
+}
+
+bool UserMrCache::registrable(uintptr_t begin, size_t len) {
+    // faults the pages in for writing without pinning them, which fails on read-only or unmapped pages like the
+    // registration would, and leaves it less to do
+    if (madvise(reinterpret_cast<void *>(begin), len, MADV_POPULATE_WRITE) == 0) return true;
+    if (errno != EINVAL) return false;
+    // an older kernel or an I/O mapping, only a registration tells
+    ibv_mr *mr = ibv_reg_mr(context->getProtectionDomain(), reinterpret_cast<void *>(begin), len,
+                            IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE | IBV_ACCESS_REMOTE_READ);
+    if (mr == nullptr) return false;
+    ibv_dereg_mr(mr);
+    return true;
+}
+
+shared_ptr<Buffer> UserMrCache::Get(const void *addr, size_t len, uint64_t &offset) {
+    uintptr_t begin = reinterpret_cast<uintptr_t>(addr), end = begin + len;
+    lock_guard<mutex> guard(lock);
+    InCache busy;
+
+    auto it = entries.upper_bound(begin);
+    if (it != entries.begin() && prev(it)->second.end >= end) {
+        --it;
+        lru.splice(lru.begin(), lru, it->second.lru);
+        hits++;
+        offset = begin - it->first;
+        return it->second.mr;
+    }
+    misses++;
+
+    // whole pages, merged with the entries it overlaps
+    const uintptr_t page = sysconf(_SC_PAGESIZE);
+    uintptr_t rb = begin & ~(page - 1), re = (end + page - 1) & ~(page - 1);
+    if (re - rb > capacity) return nullptr;
+    it = entries.upper_bound(rb);
+    if (it != entries.begin() && prev(it)->second.end > rb) --it;
+    while (it != entries.end() && it->first < re) {
+        rb = min(rb, it->first);
+        re = max(re, it->second.end);
+        it = erase(it);
+    }
+    if (!registrable(rb, re - rb)) {
+        LOG(ERROR) << "Failed to register user buffer " << reinterpret_cast<void *>(rb) << ", length " << re - rb
+                   << ", errno: " << errno;
+        return nullptr;
+    }
+    while (pinned + (re - rb) > capacity && !lru.empty()) erase(entries.find(lru.back()));
+
+    auto mr = make_shared<Buffer>(context, reinterpret_cast<void *>(rb), re - rb);
+    watchStack(rb, re);
+    lru.push_front(rb);
+    entries[rb] = {re, mr, lru.begin()};
+    pinned += re - rb;
+    total_pinned += re - rb;
+    lo = min(lo.load(), rb);
+    hi = max(hi.load(), re);
+    offset = begin - rb;
+    return mr;
+}
+
+void UserMrCache::watchStack(uintptr_t begin, uintptr_t end) {
+    static thread_local ThreadStack stack;
+    if (end <= stack.lo || begin >= stack.hi) return;
+    if (find(stack.caches.begin(), stack.caches.end(), this) == stack.caches.end()) stack.caches.push_back(this);
+}
+
+void UserMrCache::Invalidate(const void *addr, size_t len) {
+    if (in_cache) return;  // memory of the cache itself, never registered
+    uintptr_t begin = reinterpret_cast<uintptr_t>(addr), end = begin + len;
+    if (end <= lo.load(memory_order_relaxed) || begin >= hi.load(memory_order_relaxed)) return;
+
+    lock_guard<mutex> guard(lock);
+    InCache busy;
+    auto it = entries.upper_bound(begin);
+    if (it != entries.begin() && prev(it)->second.end > begin) --it;
+    while (it != entries.end() && it->first < end) it = erase(it);
+}
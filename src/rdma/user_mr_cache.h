@@ -0,0 +1,96 @@
+/*
+ * Registration cache of application buffers for Compute-side log RDMA client
+ *
+ * Copyright 2022 UIUC
+ * Author: Xuhao Luo
+ */
+
+#pragma once
+
+#include <infinity/core/Context.h>
+#include <infinity/memory/Buffer.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+
+#include "../csl_config.h"
+
+using namespace std;
+using infinity::core::Context;
+using infinity::memory::Buffer;
+
+/**
+ * LRU cache of memory registrations of application buffers, so that large writes are posted straight from the
+ * caller's buffer. Registrations cover whole pages and never overlap: a new one absorbs the entries it overlaps. At
+ * most `capacity` bytes stay pinned, the least recently used entries are deregistered first.
+ *
+ * A registration pins the physical pages, so it must be dropped before its virtual range is unmapped or reused.
+ * Invalidate() is called from the interposed munmap(), mremap(), free() and realloc(), and for the stack of a thread
+ * when it exits. An entry a write still uses is only deregistered once the write drops its reference.
+ */
+class UserMrCache {
+   private:
+    struct Entry {
+        uintptr_t end;
+        shared_ptr<Buffer> mr;
+        list<uintptr_t>::iterator lru;
+    };
+
+    Context *context;
+    size_t capacity;
+    map<uintptr_t, Entry> entries;  // by page-aligned start
+    list<uintptr_t> lru;            // starts of the entries, most recently used first
+    size_t pinned;                  // bytes registered by this cache
+    atomic<uintptr_t> lo, hi;       // bounds of all the entries, lets Invalidate() skip unrelated ranges
+    mutex lock;
+    atomic<uint64_t> hits, misses;
+
+    static atomic<size_t> total_pinned;  // bytes registered by all the caches of the process
+
+    map<uintptr_t, Entry>::iterator erase(map<uintptr_t, Entry>::iterator it);
+
+    /**
+     * @return whether [begin, begin + len) can be registered. infinity aborts the process when a registration fails,
+     * which it does for read-only or unmapped pages
+     */
+    bool registrable(uintptr_t begin, size_t len);
+
+    /**
+     * Drop the registrations of the calling thread's stack when it exits if [begin, end) is part of it
+     */
+    void watchStack(uintptr_t begin, uintptr_t end);
+
+   public:
+    explicit UserMrCache(Context *context, size_t capacity = USER_MR_CACHE_SIZE);
+    ~UserMrCache();
+
+    /**
+     * Get a registration covering [addr, addr + len), registering the range if it isn't cached
+     *
+     * @param offset set to the offset of addr in the returned buffer
+     * @return nullptr if the range can't be registered or is larger than the cache
+     */
+    shared_ptr<Buffer> Get(const void *addr, size_t len, uint64_t &offset);
+
+    /**
+     * Drop every registration overlapping [addr, addr + len)
+     */
+    void Invalidate(const void *addr, size_t len);
+
+    size_t GetPinned() {
+        lock_guard<mutex> guard(lock);
+        return pinned;
+    }
+    uint64_t GetHits() { return hits; }
+    uint64_t GetMisses() { return misses; }
+
+    /**
+     * @return whether any cache of the process holds a registration. Safe to call at any time, even before the caches
+     * are constructed or after they are destroyed
+     */
+    static bool AnyPinned() { return total_pinned.load(memory_order_relaxed) > 0; }
+};
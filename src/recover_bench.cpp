@@ -0,0 +1,66 @@
+#include "rdma/client.h"
+
+#include <infinity/core/Context.h>
+#include <string.h>
+
+#include <chrono>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "csl_config.h"
+
+size_t TOTAL_SIZE = 1024;
+int REP_NUM = 3;
+std::string filename = "recover_bench";
+
+/**
+ * Recovery read throughput. TOTAL_SIZE MB is appended to a file replicated on REP_NUM servers, then read back into
+ * the local log with RecoverStriped() for every chunk size and number of source replicas.
+ *
+ * Usage:
+ * ./recover_bench [total_size_mb] [rep_num] [filename]
+ */
+int main(int argc, const char *argv[]) {
+    if (argc > 1) TOTAL_SIZE = std::stoul(argv[1]);
+    if (argc > 2) REP_NUM = std::stoi(argv[2]);
+    if (argc > 3) filename = argv[3];
+    TOTAL_SIZE *= 1048576;
+
+    infinity::core::Context *context = new infinity::core::Context(infinity::core::Configuration::DEFAULT_IB_DEVICE,
+                                                                   infinity::core::Configuration::DEFAULT_IB_PHY_PORT);
+    auto qp_pool = std::make_shared<NCLQpPool>(context, PORT);
+    auto mr_pool = std::make_shared<NCLMrPool>(context);
+    {
+        CSLClient client(qp_pool, mr_pool, ZK_DEFAULT_HOST, MR_SIZE, 1, filename.c_str(), REP_NUM);
+        client.SetInUse(true);
+
+        std::vector<char> buf(MAX_GROUP_COMMIT_SIZE, 42);
+        for (size_t done = 0; done < TOTAL_SIZE;) {
+            size_t n = std::min(buf.size(), TOTAL_SIZE - done);
+            if (client.Append(buf.data(), n) != static_cast<ssize_t>(n)) {
+                std::cerr << "append error" << std::endl;
+                return 1;
+            }
+            done += n;
+        }
+
+        std::vector<std::string> peers(client.GetPeers().begin(), client.GetPeers().end());
+        std::cout << "total size: " << TOTAL_SIZE << "B\nreplicas: " << peers.size() << std::endl;
+        std::cout << "chunk size\treplicas\tthroughput(GB/s)" << std::endl;
+        for (size_t chunk = 64 * 1024; chunk <= 16 * 1024 * 1024; chunk *= 4) {
+            for (size_t r = 1; r <= peers.size(); r++) {
+                std::vector<std::string> srcs(peers.begin(), peers.begin() + r);
+                auto start = std::chrono::high_resolution_clock::now();
+                client.RecoverStriped(srcs, TOTAL_SIZE, chunk);
+                auto end = std::chrono::high_resolution_clock::now();
+                auto elapse = std::chrono::duration_cast<std::chrono::microseconds>(end - start).count();
+                std::cout << chunk << "\t" << r << "\t" << static_cast<double>(TOTAL_SIZE) / elapse / 1000 << std::endl;
+            }
+        }
+        client.SendFinalization();
+    }
+
+    delete context;
+    return 0;
+}
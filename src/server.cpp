@@ -27,11 +27,13 @@ int main(int argc, char *argv[]) {
 
     while (!stop) {
         sleep(1);
-        cout << "total client: " << server.GetConnectionCount() << endl;
+        cout << "total client: " << server.GetConnectionCount() << ", spilled: " << server.GetSpilledBytes() / 1048576
+             << "MB" << endl;
         vector<string> all_files = server.GetAllFileId();
         for (auto &f : all_files) {
             cout << "file " << f << ", sequence: " << server.ReadSeqNum(f) << endl;
             const char *buf = (const char *)server.GetBufData(f);
+            if (!buf) continue;  // closed meanwhile
             for (int j = 0; j < 128; j++) cout << buf[j];
             cout << endl;
         }
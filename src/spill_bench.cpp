@@ -0,0 +1,80 @@
+#include "rdma/client.h"
+
+#include <infinity/core/Context.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "csl_config.h"
+
+size_t TOTAL_SIZE = 1024;
+int WAIT_SEC = 10;
+std::string filename = "spill_bench";
+
+/**
+ * Peer memory footprint and recovery time with cold segments spilled to SSD. TOTAL_SIZE MB is appended to a file with
+ * progress notifications, so the peers know the end of the log, then the memory the file takes on each peer is
+ * sampled every second for WAIT_SEC seconds. The file is then read back from all peers twice: the first read brings
+ * spilled segments back from SSD, the second finds them in memory. Run it against servers built with and without
+ * SERVER_SPILL.
+ *
+ * Usage:
+ * ./spill_bench [total_size_mb] [wait_sec] [filename]
+ */
+int main(int argc, char *argv[]) {
+    if (argc > 1) TOTAL_SIZE = std::stoul(argv[1]);
+    if (argc > 2) WAIT_SEC = std::stoi(argv[2]);
+    if (argc > 3) filename = argv[3];
+    TOTAL_SIZE *= 1048576;
+
+    infinity::core::Context *context = new infinity::core::Context(infinity::core::Configuration::DEFAULT_IB_DEVICE,
+                                                                   infinity::core::Configuration::DEFAULT_IB_PHY_PORT);
+    auto qp_pool = std::make_shared<NCLQpPool>(context, PORT);
+    auto mr_pool = std::make_shared<NCLMrPool>(context);
+    {
+        CSLClient client(qp_pool, mr_pool, ZK_DEFAULT_HOST, MR_SIZE, 1, filename.c_str());
+        client.SetInUse(true);
+        client.SetProgressNotify(true);
+
+        std::vector<char> buf(MAX_GROUP_COMMIT_SIZE, 42);
+        for (size_t done = 0; done < TOTAL_SIZE;) {
+            size_t n = std::min(buf.size(), TOTAL_SIZE - done);
+            if (client.Append(buf.data(), n) != static_cast<ssize_t>(n)) {
+                std::cerr << "append error" << std::endl;
+                return 1;
+            }
+            done += n;
+        }
+
+        auto resident = [&]() {
+            size_t max_resident = 0;
+            for (auto &r : client.GetPeerInfo()) max_resident = std::max<size_t>(max_resident, r.second.resident);
+            return max_resident / 1048576.0;
+        };
+        std::cout << "log size(MB)\t" << TOTAL_SIZE / 1048576 << std::endl;
+        std::cout << "time(s)\tpeer memory(MB)" << std::endl;
+        for (int t = 0; t <= WAIT_SEC; t++) {
+            if (t > 0) sleep(1);
+            std::cout << t << "\t" << resident() << std::endl;
+        }
+
+        std::vector<std::string> peers(client.GetPeers().begin(), client.GetPeers().end());
+        std::cout << "read\trecovery time(ms)\tthroughput(GB/s)\tpeer memory after(MB)" << std::endl;
+        for (const char *round : {"cold", "warm"}) {
+            auto start = std::chrono::high_resolution_clock::now();
+            client.RecoverStriped(peers, TOTAL_SIZE, RECOVERY_CHUNK_SIZE);
+            auto end = std::chrono::high_resolution_clock::now();
+            auto elapse = std::chrono::duration_cast<std::chrono::microseconds>(end - start).count();
+            std::cout << round << "\t" << elapse / 1000.0 << "\t" << static_cast<double>(TOTAL_SIZE) / elapse / 1000
+                      << "\t" << resident() << std::endl;
+        }
+        client.SendFinalization();
+    }
+
+    delete context;
+    return 0;
+}
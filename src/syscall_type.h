@@ -1,5 +1,7 @@
 #pragma once
 
+#include <stdarg.h>
+#include <stdio.h>
 #include <sys/types.h>
 
 using original_open_t = int (*)(const char *, int, ...);
@@ -8,14 +10,35 @@ using original_openat_t = int (*)(int, const char *, int, ...);
 using original_write_t = ssize_t (*)(int, const void *, size_t);
 using original_pwrite_t = ssize_t (*)(int, const void *, size_t, off_t);
 using original_pwritev_t = ssize_t (*)(int, const struct iovec *, int, off_t);
+using original_pwritev2_t = ssize_t (*)(int, const struct iovec *, int, off_t, int);
+using original_writev_t = ssize_t (*)(int, const struct iovec *, int);
 using original_close_t = int (*)(int);
 using original_read_t = ssize_t (*)(int, void *, size_t);
 using original_pread_t = ssize_t (*)(int, void *, size_t, off_t);
+using original_readv_t = ssize_t (*)(int, const struct iovec *, int);
+using original_preadv_t = ssize_t (*)(int, const struct iovec *, int, off_t);
+using original_preadv2_t = ssize_t (*)(int, const struct iovec *, int, off_t, int);
 using original_unlink_t = int (*)(const char *);
 using original_lseek_t = off_t (*)(int, off_t, int);
 using original_ftruncate_t = int (*)(int, off_t);
 using original_fsync_t = int (*)(int);
 using original_fread_t = size_t (*)(void *, size_t, size_t, FILE *);
+using original_fwrite_t = size_t (*)(const void *, size_t, size_t, FILE *);
+using original_fputs_t = int (*)(const char *, FILE *);
+using original_fputc_t = int (*)(int, FILE *);
+using original_vfprintf_t = int (*)(FILE *, const char *, va_list);
+using original_vfprintf_chk_t = int (*)(FILE *, int, const char *, va_list);
+using original_fflush_t = int (*)(FILE *);
+using original_setvbuf_t = int (*)(FILE *, char *, int, size_t);
+using original_setbuf_t = void (*)(FILE *, char *);
+using original_setbuffer_t = void (*)(FILE *, char *, size_t);
+using original_setlinebuf_t = void (*)(FILE *);
+using original_mmap_t = void *(*)(void *, size_t, int, int, int, off_t);
+using original_msync_t = int (*)(void *, size_t, int);
+using original_munmap_t = int (*)(void *, size_t);
+using original_mremap_t = void *(*)(void *, size_t, size_t, int, ...);
+using original_free_t = void (*)(void *);
+using original_realloc_t = void *(*)(void *, size_t);
 using original_feof_t = int (*)(FILE *);
 using original_fopen_t = FILE* (*)(const char *, const char *);
 using original_fclose_t = int (*)(FILE *);
@@ -0,0 +1,69 @@
+#include "rdma/client.h"
+
+#include <infinity/core/Context.h>
+
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "csl_config.h"
+
+size_t MIN_SIZE = 4096;
+size_t MAX_SIZE = 4 * 1024 * 1024;
+size_t TOTAL_SIZE = 256;
+std::string filename = "zerocopy_bench";
+
+/**
+ * Append latency and throughput of copying writes into the local MR and of posting them from the caller's buffer,
+ * for write sizes from MIN_SIZE to MAX_SIZE. TOTAL_SIZE MB is appended per size and mode, from a buffer that stays
+ * registered after the first write, as a buffer reused by a compaction or a doublewrite batch would.
+ *
+ * Usage:
+ * ./zerocopy_bench [min_size] [max_size] [total_size_mb] [filename]
+ */
+int main(int argc, char *argv[]) {
+    if (argc > 1) MIN_SIZE = std::stoul(argv[1]);
+    if (argc > 2) MAX_SIZE = std::stoul(argv[2]);
+    if (argc > 3) TOTAL_SIZE = std::stoul(argv[3]);
+    if (argc > 4) filename = argv[4];
+    TOTAL_SIZE *= 1048576;
+
+    infinity::core::Context *context = new infinity::core::Context(infinity::core::Configuration::DEFAULT_IB_DEVICE,
+                                                                   infinity::core::Configuration::DEFAULT_IB_PHY_PORT);
+    auto qp_pool = std::make_shared<NCLQpPool>(context, PORT);
+    auto mr_pool = std::make_shared<NCLMrPool>(context);
+    std::vector<char> buf(MAX_SIZE, 42);
+
+    std::cout << "mode\tsize\tappends\tavg latency(us)\tthroughput(MB/s)" << std::endl;
+    for (size_t size = MIN_SIZE; size <= MAX_SIZE; size *= 2) {
+        for (bool zero_copy : {false, true}) {
+            std::string name = filename + "_" + std::to_string(size) + (zero_copy ? "_zc" : "_copy");
+            CSLClient client(qp_pool, mr_pool, ZK_DEFAULT_HOST, MR_SIZE, zero_copy ? 2 : 1, name.c_str());
+            client.SetInUse(true);
+            client.SetZeroCopy(zero_copy, 0);  // every size, to find where it starts paying off
+
+            size_t ops = std::max<size_t>(1, TOTAL_SIZE / size);
+            auto start = std::chrono::high_resolution_clock::now();
+            for (size_t i = 0; i < ops; i++) {
+                if (client.Append(buf.data(), size) != static_cast<ssize_t>(size)) {
+                    std::cerr << "append error" << std::endl;
+                    return 1;
+                }
+            }
+            auto end = std::chrono::high_resolution_clock::now();
+            auto elapse = std::chrono::duration_cast<std::chrono::microseconds>(end - start).count();
+            std::cout << (zero_copy ? "zero-copy" : "copy") << "\t" << size << "\t" << ops << "\t"
+                      << static_cast<double>(elapse) / ops << "\t"
+                      << static_cast<double>(ops * size) / 1048576 / (elapse / 1e6) << std::endl;
+            client.SendFinalization();
+        }
+    }
+    auto cache = mr_pool->GetUserMrCache();
+    std::cout << "registration cache hits " << cache->GetHits() << ", misses " << cache->GetMisses() << ", pinned "
+              << cache->GetPinned() << " bytes" << std::endl;
+
+    delete context;
+    return 0;
+}
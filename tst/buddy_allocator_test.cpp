@@ -0,0 +1,65 @@
+#include "../src/rdma/buddy_allocator.h"
+
+#include <gtest/gtest.h>
+
+#include <vector>
+
+TEST(BuddyAllocatorTest, TestAllocate) {
+    BuddyAllocator buddy(1024, 64);
+    size_t a, b, c;
+    ASSERT_TRUE(buddy.Allocate(100, a));  // rounded up to 128
+    ASSERT_EQ(a, 0);
+    ASSERT_EQ(buddy.BlockSize(100), 128);
+    ASSERT_TRUE(buddy.Allocate(64, b));
+    ASSERT_EQ(b, 128);
+    ASSERT_TRUE(buddy.Allocate(512, c));
+    ASSERT_EQ(c, 512);
+    ASSERT_EQ(buddy.GetFree(), 1024 - 128 - 64 - 512);
+    ASSERT_FALSE(buddy.Allocate(512, c));
+    ASSERT_FALSE(buddy.Allocate(2048, c));
+}
+
+TEST(BuddyAllocatorTest, TestMerge) {
+    BuddyAllocator buddy(1024, 64);
+    std::vector<size_t> offs(16);
+    for (auto &off : offs) ASSERT_TRUE(buddy.Allocate(64, off));
+    size_t off;
+    ASSERT_FALSE(buddy.Allocate(64, off));
+    for (size_t i = 0; i < offs.size(); i += 2) buddy.Free(offs[i], 64);
+    ASSERT_EQ(buddy.GetFree(), 512);
+    ASSERT_FALSE(buddy.Allocate(128, off));  // free space is fragmented
+    for (size_t i = 1; i < offs.size(); i += 2) buddy.Free(offs[i], 64);
+    ASSERT_TRUE(buddy.Allocate(1024, off));  // and merged back into one block
+    ASSERT_EQ(off, 0);
+}
+
+TEST(BuddyAllocatorTest, TestReserve) {
+    BuddyAllocator buddy(1024, 64);
+    ASSERT_TRUE(buddy.Reserve(320, 64));
+    ASSERT_TRUE(buddy.Reserve(512, 256));
+    ASSERT_FALSE(buddy.Reserve(320, 64));   // taken
+    ASSERT_FALSE(buddy.Reserve(256, 128));  // holds a taken block
+    ASSERT_FALSE(buddy.Reserve(64, 128));   // misaligned
+    ASSERT_EQ(buddy.GetFree(), 1024 - 64 - 256);
+    size_t off;
+    ASSERT_TRUE(buddy.Allocate(256, off));  // what is left of the lower half is split around the reserved block
+    ASSERT_EQ(off, 0);
+    ASSERT_TRUE(buddy.Allocate(64, off));
+    ASSERT_EQ(off, 256);
+    buddy.Free(320, 64);
+    buddy.Free(512, 256);
+    buddy.Free(0, 256);
+    buddy.Free(256, 64);
+    ASSERT_TRUE(buddy.Allocate(1024, off));
+}
+
+TEST(BuddyAllocatorTest, TestFreeBlocks) {
+    BuddyAllocator buddy(1024, 64);
+    ASSERT_TRUE(buddy.Reserve(320, 64));
+    auto blocks = buddy.FreeBlocks();
+    std::vector<std::pair<size_t, size_t>> expected = {{256, 64}, {384, 128}, {0, 256}, {512, 512}};
+    ASSERT_EQ(blocks, expected);
+    buddy.Free(320, 64);
+    expected = {{0, 1024}};
+    ASSERT_EQ(buddy.FreeBlocks(), expected);
+}
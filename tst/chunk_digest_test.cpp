@@ -0,0 +1,19 @@
+#include "../src/rdma/chunk_digest.h"
+
+#include <gtest/gtest.h>
+
+#include <vector>
+
+TEST(ChunkDigestTest, TestDigest) {
+    std::vector<char> a(4096 + 13, 42), b(a);
+    ASSERT_EQ(chunkDigest(a.data(), a.size()), chunkDigest(b.data(), b.size()));
+    ASSERT_NE(chunkDigest(a.data(), a.size()), chunkDigest(b.data(), b.size() - 1));
+    for (size_t i : {0UL, 31UL, 32UL, 4095UL, a.size() - 1}) {
+        b[i] ^= 1;  // a single bit flip anywhere changes the digest
+        ASSERT_NE(chunkDigest(a.data(), a.size()), chunkDigest(b.data(), b.size()));
+        b[i] ^= 1;
+    }
+    std::vector<char> zero(4096, 0);
+    ASSERT_NE(chunkDigest(zero.data(), 0), 0);
+    ASSERT_NE(chunkDigest(zero.data(), zero.size()), 0);
+}
@@ -0,0 +1,49 @@
+#include "../src/rdma/common.h"
+
+#include <gtest/gtest.h>
+
+#include <string.h>
+
+#include <vector>
+
+/**
+ * The peers' copy of a log written the way foldCommit() does: a tail write carries its CommitTrailer right after the
+ * data, and the stale trailer a write leaves in the hole below it is written over from the local log
+ */
+struct PeerLog {
+    std::vector<char> local = std::vector<char>(4096, 0), remote = std::vector<char>(4096, 0);
+    uint64_t tail = 0, trailer_end = 0;
+
+    void write(uint64_t off, const char *data, uint64_t size, uint64_t seq) {
+        memcpy(local.data() + off, data, size);
+        uint64_t stale = staleTrailerBelow(tail, trailer_end, off);
+        memcpy(remote.data() + tail, local.data() + tail, stale);
+        memcpy(remote.data() + off, data, size);
+        CommitTrailer trailer = {seq, COMMIT_MAGIC};
+        memcpy(remote.data() + off + size, &trailer, sizeof(trailer));
+        tail = off + size;
+        trailer_end = tail + sizeof(trailer);
+    }
+};
+
+TEST(CommitTrailerTest, TestStaleTrailerBelow) {
+    ASSERT_EQ(staleTrailerBelow(100, 116, 100), 0);  // the write covers it
+    ASSERT_EQ(staleTrailerBelow(100, 116, 50), 0);   // below the tail
+    ASSERT_EQ(staleTrailerBelow(100, 0, 200), 0);    // already overwritten
+    ASSERT_EQ(staleTrailerBelow(100, 116, 108), 8);  // half of it is covered
+    ASSERT_EQ(staleTrailerBelow(100, 116, 200), sizeof(CommitTrailer));
+}
+
+TEST(CommitTrailerTest, TestWritePastEnd) {
+    PeerLog log;
+    std::vector<char> data(100, 'a');
+    log.write(0, data.data(), data.size(), 1);
+    log.write(1000, data.data(), data.size(), 2);
+
+    std::vector<char> zero(1000 - data.size(), 0);
+    ASSERT_EQ(memcmp(log.remote.data() + data.size(), zero.data(), zero.size()), 0);  // the hole reads back zeroes
+    ASSERT_EQ(memcmp(log.remote.data(), log.local.data(), 1100), 0);
+
+    log.write(1100 + 8, data.data(), data.size(), 3);  // starts inside the last trailer
+    ASSERT_EQ(memcmp(log.remote.data(), log.local.data(), 1208), 0);
+}
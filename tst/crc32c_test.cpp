@@ -0,0 +1,18 @@
+#include "../src/rdma/crc32c.h"
+
+#include <gtest/gtest.h>
+
+#include <string.h>
+
+TEST(Crc32cTest, TestCrc32c) {
+    const char *check = "123456789";
+    ASSERT_EQ(crc32c(check, strlen(check)), 0xe3069283);  // standard check value of CRC-32C
+    ASSERT_EQ(crc32c(check, 0), 0);
+
+    char buf[1000];
+    for (size_t i = 0; i < sizeof(buf); i++) buf[i] = i * 7;
+    uint32_t whole = crc32c(buf, sizeof(buf));
+    for (size_t cut : {1UL, 7UL, 8UL, 333UL, 999UL}) {  // checksumming in pieces gives the same result
+        ASSERT_EQ(crc32c(buf + cut, sizeof(buf) - cut, crc32c(buf, cut)), whole);
+    }
+}
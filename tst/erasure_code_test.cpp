@@ -0,0 +1,51 @@
+#include "../src/rdma/erasure_code.h"
+
+#include <gtest/gtest.h>
+
+#include <string.h>
+
+#include <random>
+
+class ErasureCodeTest : public ::testing::Test {
+   protected:
+    static const int K = 4, M = 2;
+    static const size_t LEN = 4096 + 7;  // not a multiple of the vector width
+    ErasureCode ec{K, M};
+    std::vector<std::vector<uint8_t>> shards;
+    std::vector<uint8_t *> ptrs;
+
+    void SetUp() override {
+        std::mt19937 rng(42);
+        shards.assign(K + M, std::vector<uint8_t>(LEN));
+        for (int i = 0; i < K; i++) {
+            for (auto &b : shards[i]) b = rng();
+        }
+        for (auto &s : shards) ptrs.push_back(s.data());
+        ec.Encode(ptrs.data(), ptrs.data() + K, LEN);
+    }
+};
+
+TEST_F(ErasureCodeTest, TestKernelsAgree) {
+    std::vector<uint8_t> parity(LEN * M);
+    uint8_t *p[M] = {parity.data(), parity.data() + LEN};
+    ec.SetKernel(ErasureCode::SCALAR);
+    ec.Encode(ptrs.data(), p, LEN);
+    for (int q = 0; q < M; q++) ASSERT_EQ(0, memcmp(p[q], shards[K + q].data(), LEN));
+}
+
+TEST_F(ErasureCodeTest, TestReconstruct) {
+    auto orig = shards;
+    for (int a = 0; a < K + M; a++) {
+        for (int b = a + 1; b < K + M; b++) {  // every combination of M lost shards
+            bool present[K + M];
+            std::fill(present, present + K + M, true);
+            present[a] = present[b] = false;
+            std::fill(shards[a].begin(), shards[a].end(), 0);
+            std::fill(shards[b].begin(), shards[b].end(), 0);
+            ASSERT_TRUE(ec.Reconstruct(ptrs.data(), present, LEN));
+            ASSERT_EQ(orig, shards) << "lost " << a << " and " << b;
+        }
+    }
+    bool present[K + M] = {true, false, false, false, true, true};
+    ASSERT_FALSE(ec.Reconstruct(ptrs.data(), present, LEN));
+}
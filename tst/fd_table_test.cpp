@@ -0,0 +1,98 @@
+#include "../src/fd_table.h"
+
+#include <gtest/gtest.h>
+
+#include <thread>
+#include <vector>
+
+struct Counted {
+    static atomic<int> alive;
+    int v;
+    Counted(int v) : v(v) { alive++; }
+    ~Counted() { alive--; }
+};
+
+atomic<int> Counted::alive(0);
+
+TEST(FdTableTest, TestInsertGetErase) {
+    FdTable<Counted> table(64);
+    ASSERT_EQ(table.Capacity(), 64);
+    ASSERT_FALSE(table.Contains(3));
+    ASSERT_TRUE(table.Insert(3, make_shared<Counted>(42)));
+    ASSERT_TRUE(table.Contains(3));
+    {
+        FdTable<Counted>::ReadGuard guard;
+        ASSERT_EQ(table.Get(3)->v, 42);
+        ASSERT_EQ(table.Get(4), nullptr);
+    }
+    auto erased = table.Erase(3);
+    ASSERT_EQ(erased->v, 42);
+    ASSERT_FALSE(table.Contains(3));
+    ASSERT_EQ(table.Erase(3), nullptr);
+}
+
+TEST(FdTableTest, TestOutOfRange) {
+    FdTable<Counted> table(16);
+    ASSERT_FALSE(table.Insert(-1, make_shared<Counted>(0)));
+    ASSERT_FALSE(table.Insert(16, make_shared<Counted>(0)));
+    ASSERT_FALSE(table.Contains(-1));
+    ASSERT_FALSE(table.Contains(100));
+    ASSERT_EQ(table.GetShared(100), nullptr);
+}
+
+TEST(FdTableTest, TestDefaultCapacity) {
+    FdTable<Counted> table;
+    ASSERT_GE(table.Capacity(), FD_TABLE_MIN_SIZE);
+    ASSERT_LE(table.Capacity(), FD_TABLE_MAX_SIZE);
+}
+
+TEST(FdTableTest, TestReclaimDeferredByReader) {
+    FdTable<Counted> table(16);
+    table.Insert(5, make_shared<Counted>(7));
+    int alive_before = Counted::alive.load();
+
+    FdTable<Counted>::ReadGuard *guard = new FdTable<Counted>::ReadGuard();
+    Counted *c = table.Get(5);
+    thread closer([&]() { table.Erase(5); });  // the erased shared_ptr returned is dropped immediately
+    closer.join();
+    // the reader still inside its guard keeps the object alive
+    ASSERT_EQ(c->v, 7);
+    ASSERT_EQ(Counted::alive.load(), alive_before);
+    delete guard;
+
+    // the next retire reclaims the entry once no reader is left
+    table.Insert(6, make_shared<Counted>(8));
+    table.Erase(6);
+    ASSERT_EQ(Counted::alive.load(), alive_before - 1);
+}
+
+TEST(FdTableTest, TestConcurrentLookupAndErase) {
+    const int n_fds = 32, n_readers = 8, rounds = 200;
+    FdTable<Counted> table(n_fds);
+    atomic<bool> stop(false);
+
+    vector<thread> readers;
+    for (int t = 0; t < n_readers; t++) {
+        readers.emplace_back([&]() {
+            while (!stop.load()) {
+                for (int fd = 0; fd < n_fds; fd++) {
+                    if (!table.Contains(fd)) continue;
+                    FdTable<Counted>::ReadGuard guard;
+                    Counted *c = table.Get(fd);
+                    if (c) {
+                        EXPECT_EQ(c->v, fd);
+                    }
+                }
+            }
+        });
+    }
+
+    for (int r = 0; r < rounds; r++) {
+        for (int fd = 0; fd < n_fds; fd++) table.Insert(fd, make_shared<Counted>(fd));
+        for (int fd = 0; fd < n_fds; fd++) table.Erase(fd);
+    }
+    stop.store(true);
+    for (auto &th : readers) th.join();
+
+    for (int fd = 0; fd < n_fds; fd++) ASSERT_FALSE(table.Contains(fd));
+}
@@ -0,0 +1,119 @@
+#include "../src/iov_util.h"
+
+#include <gtest/gtest.h>
+
+#include <string>
+
+TEST(IovTest, TestTotalLen) {
+    char a[3], b[5];
+    struct iovec iov[3] = {{a, sizeof(a)}, {nullptr, 0}, {b, sizeof(b)}};
+    ASSERT_EQ(iovTotalLen(iov, 3), 8);
+    ASSERT_EQ(iovTotalLen(iov, 0), 0);
+}
+
+TEST(IovTest, TestInvalidCount) {
+    struct iovec iov[1] = {{nullptr, 0}};
+    errno = 0;
+    ASSERT_EQ(iovTotalLen(iov, -1), -1);
+    ASSERT_EQ(errno, EINVAL);
+    errno = 0;
+    ASSERT_EQ(iovTotalLen(iov, IOV_MAX + 1), -1);
+    ASSERT_EQ(errno, EINVAL);
+}
+
+TEST(IovTest, TestLenOverflow) {
+    struct iovec iov[2] = {{nullptr, SSIZE_MAX}, {nullptr, 1}};
+    errno = 0;
+    ASSERT_EQ(iovTotalLen(iov, 1), SSIZE_MAX);
+    ASSERT_EQ(iovTotalLen(iov, 2), -1);
+    ASSERT_EQ(errno, EINVAL);
+}
+
+TEST(IovTest, TestGather) {
+    char a[] = "abc", b[] = "defgh";
+    struct iovec iov[3] = {{a, 3}, {nullptr, 0}, {b, 5}};
+    char dst[16] = {0};
+    ASSERT_EQ(iovGather(dst, iov, 3, sizeof(dst)), 8);
+    ASSERT_EQ(std::string(dst), "abcdefgh");
+}
+
+TEST(IovTest, TestGatherShort) {
+    char a[] = "abc", b[] = "defgh";
+    struct iovec iov[2] = {{a, 3}, {b, 5}};
+    char dst[16] = {0};
+    ASSERT_EQ(iovGather(dst, iov, 2, 5), 5);
+    ASSERT_EQ(std::string(dst), "abcde");
+}
+
+TEST(IovTest, TestScatter) {
+    const char src[] = "abcdefgh";
+    char a[4] = {0}, b[8] = {0};
+    struct iovec iov[2] = {{a, 3}, {b, 7}};
+    ASSERT_EQ(iovScatter(iov, 2, src, 8), 8);
+    ASSERT_EQ(std::string(a), "abc");
+    ASSERT_EQ(std::string(b), "defgh");
+}
+
+TEST(IovTest, TestScatterShort) {
+    const char src[] = "ab";
+    char a[4] = {0}, b[4] = {0};
+    struct iovec iov[2] = {{a, 3}, {b, 3}};
+    ASSERT_EQ(iovScatter(iov, 2, src, 2), 2);
+    ASSERT_EQ(std::string(a), "ab");
+    ASSERT_EQ(std::string(b), "");
+}
+
+TEST(IovTest, TestWritableLen) {
+    ASSERT_EQ(writableLen(100, 0, 1024), 100);
+    ASSERT_EQ(writableLen(100, 1000, 1024), 24);  // short write at the size limit
+    errno = 0;
+    ASSERT_EQ(writableLen(100, 1024, 1024), -1);
+    ASSERT_EQ(errno, EFBIG);
+    errno = 0;
+    ASSERT_EQ(writableLen(1, 4096, 1024), -1);
+    ASSERT_EQ(errno, EFBIG);
+    errno = 0;
+    ASSERT_EQ(writableLen(1, -1, 1024), -1);
+    ASSERT_EQ(errno, EINVAL);
+    ASSERT_EQ(writableLen(0, 1023, 1024), 0);
+}
+
+TEST(IovTest, TestReadableLen) {
+    ASSERT_EQ(readableLen(10, 0, 100), 10);
+    ASSERT_EQ(readableLen(10, 95, 100), 5);  // short read at the end of file
+    ASSERT_EQ(readableLen(10, 100, 100), 0);
+    ASSERT_EQ(readableLen(10, 200, 100), 0);
+    ASSERT_EQ(readableLen(10, 0, 0), 0);
+}
+
+TEST(IovTest, TestShortReadv) {
+    const char file[] = "abcdef";
+    char a[4] = {0}, b[8] = {0};
+    struct iovec iov[2] = {{a, 3}, {b, 7}};
+    size_t n = readableLen(iovTotalLen(iov, 2), 2, 6);
+    ASSERT_EQ(n, 4);
+    ASSERT_EQ(iovScatter(iov, 2, file + 2, n), 4);
+    ASSERT_EQ(std::string(a), "cde");
+    ASSERT_EQ(std::string(b), "f");
+}
+
+TEST(IovTest, TestShortWritev) {
+    char a[] = "abc", b[] = "defgh";
+    struct iovec iov[2] = {{a, 3}, {b, 5}};
+    char file[8] = {0};
+    ssize_t n = writableLen(iovTotalLen(iov, 2), 3, 7);
+    ASSERT_EQ(n, 4);
+    ASSERT_EQ(iovGather(file + 3, iov, 2, n), 4);
+    ASSERT_EQ(std::string(file + 3), "abcd");
+}
+
+TEST(IovTest, TestRwfFlags) {
+    ASSERT_TRUE(rwfFlagsSupported(0, NCL_RWF_WRITE_FLAGS));
+    ASSERT_TRUE(rwfFlagsSupported(RWF_APPEND | RWF_DSYNC, NCL_RWF_WRITE_FLAGS));
+    errno = 0;
+    ASSERT_FALSE(rwfFlagsSupported(RWF_APPEND, NCL_RWF_READ_FLAGS));
+    ASSERT_EQ(errno, EOPNOTSUPP);
+    errno = 0;
+    ASSERT_FALSE(rwfFlagsSupported(0x40000000, NCL_RWF_WRITE_FLAGS));
+    ASSERT_EQ(errno, EOPNOTSUPP);
+}
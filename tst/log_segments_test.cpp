@@ -0,0 +1,31 @@
+#include "../src/rdma/log_segments.h"
+
+#include <gtest/gtest.h>
+
+TEST(LogSegmentsTest, TestLayout) {
+    ASSERT_EQ(segmentBegin(0), 0);
+    ASSERT_EQ(segmentSize(0), LOG_FIRST_SEGMENT_SIZE);
+    for (int i = 0; i < MAX_LOG_SEGMENTS - 1; i++) {
+        ASSERT_EQ(segmentBegin(i + 1), segmentBegin(i) + segmentSize(i));
+        ASSERT_EQ(segmentSize(i + 1), 2 * segmentSize(i));
+    }
+    ASSERT_EQ(segmentBegin(MAX_LOG_SEGMENTS), MAX_LOG_SIZE);
+}
+
+TEST(LogSegmentsTest, TestSegmentOf) {
+    for (int i = 0; i < MAX_LOG_SEGMENTS; i++) {
+        ASSERT_EQ(segmentOf(segmentBegin(i)), i);
+        ASSERT_EQ(segmentOf(segmentBegin(i) + segmentSize(i) / 2), i);
+        ASSERT_EQ(segmentOf(segmentBegin(i + 1) - 1), i);
+    }
+}
+
+TEST(LogSegmentsTest, TestSegmentsFor) {
+    ASSERT_EQ(segmentsFor(0), 1);
+    ASSERT_EQ(segmentsFor(1), 1);
+    ASSERT_EQ(segmentsFor(LOG_FIRST_SEGMENT_SIZE), 1);
+    ASSERT_EQ(segmentsFor(LOG_FIRST_SEGMENT_SIZE + 1), 2);
+    ASSERT_EQ(segmentsFor(segmentBegin(3)), 3);
+    ASSERT_EQ(segmentsFor(segmentBegin(3) + 1), 4);
+    ASSERT_EQ(segmentsFor(MAX_LOG_SIZE), MAX_LOG_SEGMENTS);
+}